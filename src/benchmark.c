@@ -35,18 +35,212 @@
 #include <string.h>
 #include <time.h>
 #include <ctype.h>
+#include <math.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/param.h>
 #include "error.h"
+#include "misc.h"
+#include "connection.h"
+#include "ratelimit.h"
+#include "benchmark.h"
+#include "vxi11.h"
 #include <lxi.h>
 
 #define ID_LENGTH_MAX 65536
+#define CALIBRATION_COUNT 10
+#define ADDRESS_LENGTH_MAX 256
 
-int benchmark(const char *ip, int port, int timeout, lxi_protocol_t protocol, int count, bool no_gui, double *result, void (*progress)(unsigned int count))
+static double time_now(void)
 {
-    struct timespec start, stop;
-    double elapsed_time;
-    int device, i, bytes_received;
-    char id[ID_LENGTH_MAX];
+    struct timespec time_spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &time_spec);
+
+    return time_spec.tv_sec + time_spec.tv_nsec * 0.000000001;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+// Percentile of sorted data (linear interpolation)
+static double percentile(double *sorted, int count, double p)
+{
+    double rank = p * (count - 1);
+    int index = (int) rank;
+
+    if (index + 1 >= count)
+        return sorted[count - 1];
+
+    return sorted[index] + (rank - index) * (sorted[index + 1] - sorted[index]);
+}
+
+static double median(double *data, int count)
+{
+    double sorted[BENCHMARK_REPETITIONS_MAX];
+
+    memcpy(sorted, data, sizeof(double) * count);
+    qsort(sorted, count, sizeof(double), compare_double);
+
+    return percentile(sorted, count, 0.5);
+}
+
+// Distribution free 95% confidence interval of median of sorted data (order statistics)
+static void median_ci(double *sorted, int count, double *low, double *high)
+{
+    int rank_low = (int) floor(count / 2.0 - 1.96 * sqrt(count) / 2);
+    int rank_high = (int) ceil(count / 2.0 + 1.96 * sqrt(count) / 2);
+
+    if (rank_low < 0)
+        rank_low = 0;
+    if (rank_high > count - 1)
+        rank_high = count - 1;
+
+    *low = sorted[rank_low];
+    *high = sorted[rank_high];
+}
+
+int benchmark_stats_compute(struct benchmark_stats_t *stats,
+                            double *throughput, int repetitions,
+                            double *latency, int count)
+{
+    double deviation[BENCHMARK_REPETITIONS_MAX];
+    double sorted_throughput[BENCHMARK_REPETITIONS_MAX];
+    double mad;
+    double *sorted;
+    int i;
+
+    memset(stats, 0, sizeof(struct benchmark_stats_t));
+
+    if ((repetitions < 1) || (repetitions > BENCHMARK_REPETITIONS_MAX) || (count < 1))
+        return 1;
+
+    sorted = malloc(sizeof(double) * count);
+    if (sorted == NULL)
+    {
+        error_printf("Failure allocating memory for latency statistics\n");
+        return 1;
+    }
+
+    stats->repetitions = repetitions;
+    stats->count = count;
+    memcpy(stats->throughput, throughput, sizeof(double) * repetitions);
+
+    // Median of per repetition throughputs is robust against a single bad run
+    memcpy(sorted_throughput, throughput, sizeof(double) * repetitions);
+    qsort(sorted_throughput, repetitions, sizeof(double), compare_double);
+    stats->throughput_median = percentile(sorted_throughput, repetitions, 0.5);
+    median_ci(sorted_throughput, repetitions, &stats->throughput_ci_low, &stats->throughput_ci_high);
+
+    // Flag outliers using median absolute deviation (scaled to sigma)
+    for (i=0; i<repetitions; i++)
+        deviation[i] = fabs(throughput[i] - stats->throughput_median);
+    mad = 1.4826 * median(deviation, repetitions);
+    for (i=0; i<repetitions; i++)
+    {
+        stats->outlier[i] = (mad > 0) && (deviation[i] > 3 * mad);
+        if (stats->outlier[i])
+            stats->outliers++;
+    }
+
+    // Latency percentiles
+    memcpy(sorted, latency, sizeof(double) * count);
+    qsort(sorted, count, sizeof(double), compare_double);
+    stats->latency_min = sorted[0];
+    stats->latency_max = sorted[count - 1];
+    stats->latency_median = percentile(sorted, count, 0.5);
+    stats->latency_p90 = percentile(sorted, count, 0.9);
+    stats->latency_p99 = percentile(sorted, count, 0.99);
+    median_ci(sorted, count, &stats->latency_ci_low, &stats->latency_ci_high);
+
+    free(sorted);
+
+    return 0;
+}
+
+void benchmark_stats_print(struct benchmark_stats_t *stats, const char *unit)
+{
+    int i;
+
+    if (stats->repetitions > 1)
+    {
+        for (i=0; i<stats->repetitions; i++)
+            printf("Repetition %d: %.1f %s/second%s\n", i+1, stats->throughput[i], unit,
+                   stats->outlier[i] ? " (outlier)" : "");
+    }
+
+    printf("Result: %.1f %s/second", stats->throughput_median, unit);
+    if (stats->repetitions > 1)
+        printf(" (median, 95%% CI: %.1f - %.1f)", stats->throughput_ci_low, stats->throughput_ci_high);
+    printf("\n");
+
+    printf("Latency: median %.3f ms (95%% CI: %.3f - %.3f), p90 %.3f ms, p99 %.3f ms, min %.3f ms, max %.3f ms\n",
+           stats->latency_median * 1000, stats->latency_ci_low * 1000, stats->latency_ci_high * 1000,
+           stats->latency_p90 * 1000, stats->latency_p99 * 1000,
+           stats->latency_min * 1000, stats->latency_max * 1000);
+
+    if (stats->outliers > 0)
+        printf("Warning: %d of %d repetitions flagged as outliers\n", stats->outliers, stats->repetitions);
+}
+
+static int request_id(const char *ip, int port, lxi_protocol_t protocol, int device, bool native,
+                      const char *command, int timeout, char *id)
+{
+    struct ratelimit_t limit;
+    int status = 1;
+
+    if (ratelimit_acquire(ip, port, protocol, timeout, NULL, &limit) != 0)
+        return 1;
+
+    if (native)
+    {
+        if (vxi11_request(device, command, strlen(command), id, ID_LENGTH_MAX, timeout) < 0)
+        {
+            error_printf("Failed to request instrument ID\n");
+            goto out;
+        }
+        status = 0;
+        goto out;
+    }
+
+    if (lxi_send(device, command, strlen(command), timeout) < 0)
+    {
+        error_printf("Failed to send instrument ID request\n");
+        goto out;
+    }
+
+    if (lxi_receive(device, id, ID_LENGTH_MAX, timeout) < 0)
+    {
+        error_printf("Failed to receive instrument ID\n");
+        goto out;
+    }
+
+    status = 0;
+
+out:
+    ratelimit_release(&limit);
+    return status;
+}
+
+int benchmark(const char *ip, int port, int timeout, lxi_protocol_t protocol, bool native,
+              int count, int warmup, int repetitions, double duration, bool no_gui,
+              double *result, struct benchmark_stats_t *stats,
+              void (*progress)(unsigned int count))
+{
+    struct benchmark_stats_t local_stats;
+    struct vxi11_stats_t rpc_stats;
+    double throughput[BENCHMARK_REPETITIONS_MAX];
+    double *latency = NULL;
+    double time_start, time_request, time_repetition, latency_mean;
+    int device, i, j, index = 0;
+    char *id = NULL;
     char *command = "*IDN?";
+    int status = 1;
 
     // Check for required options
     if (strlen(ip) == 0)
@@ -55,67 +249,440 @@ int benchmark(const char *ip, int port, int timeout, lxi_protocol_t protocol, in
         exit(EXIT_FAILURE);
     }
 
+    if ((count < 1) || (repetitions < 1) || (repetitions > BENCHMARK_REPETITIONS_MAX))
+    {
+        error_printf("Invalid number of requests or repetitions\n");
+        return 1;
+    }
+
+    if (stats == NULL)
+        stats = &local_stats;
+
     if (protocol == RAW)
         command = "*IDN?\n";
 
+    id = malloc(ID_LENGTH_MAX);
+    if (id == NULL)
+    {
+        error_printf("Failure allocating memory for ID\n");
+        return 1;
+    }
+
+    // Use native VXI-11 client only for VXI-11
+    native = native && (protocol == VXI11);
+
     // Connect
-    device = lxi_connect(ip, port, NULL, timeout, protocol);
-    if (device != LXI_OK)
+    if (native)
+        device = vxi11_connect(ip, NULL, timeout);
+    else
+        device = connection_open(ip, port, NULL, timeout, protocol);
+    if (device == LXI_ERROR)
     {
         error_printf("Unable to connect to LXI device\n");
-        return 1;
+        goto error_connect;
     }
 
-    if (no_gui)
-        printf("Benchmarking by sending %d ID requests. Please wait...\n", count);
+    // Warm up connection and instrument (not measured)
+    time_start = time_now();
+    for (i=0; i<warmup; i++)
+    {
+        if (request_id(ip, port, protocol, device, native, command, timeout, id) != 0)
+            goto error_request;
+    }
 
-    // Start time
-    if ( clock_gettime(CLOCK_MONOTONIC, &start) == -1 )
+    // Minimum runtime mode - adapt request count to measured latency
+    if (duration > 0)
     {
-        error_printf("Failed to get start time\n");
-        return 1;
+        if (warmup < CALIBRATION_COUNT)
+        {
+            time_start = time_now();
+            for (i=0; i<CALIBRATION_COUNT; i++)
+            {
+                if (request_id(ip, port, protocol, device, native, command, timeout, id) != 0)
+                    goto error_request;
+            }
+            latency_mean = (time_now() - time_start) / CALIBRATION_COUNT;
+        }
+        else
+            latency_mean = (time_now() - time_start) / warmup;
+
+        if ((latency_mean > 0) && (duration / latency_mean > count))
+            count = (int) ceil(duration / latency_mean);
+    }
+
+    // Count is the total number of measured requests, split evenly into repetitions
+    count = MAX(count / repetitions, 1);
+
+    latency = malloc(sizeof(double) * count * repetitions);
+    if (latency == NULL)
+    {
+        error_printf("Failure allocating memory for latency samples\n");
+        goto error_request;
     }
 
+    if (no_gui)
+        printf("Benchmarking by sending %d ID requests (%d warm-up, %d repetition%s). Please wait...\n",
+               count * repetitions, warmup, repetitions, repetitions > 1 ? "s" : "");
+
     // Run benchmark
-    for (i=0; i<count; i++)
+    for (j=0; j<repetitions; j++)
     {
-        // Get instrument ID
-        lxi_send(device, command, strlen(command), timeout);
-        bytes_received = lxi_receive(device, id, ID_LENGTH_MAX, timeout);
-        if (bytes_received < 0)
+        time_repetition = time_now();
+
+        for (i=0; i<count; i++)
         {
-            error_printf("Failed to receive instrument ID\n");
-            return 1;
+            // Get instrument ID
+            time_request = time_now();
+            if (request_id(ip, port, protocol, device, native, command, timeout, id) != 0)
+                goto error_request;
+            latency[index] = time_now() - time_request;
+
+            if (no_gui)
+            {
+                // Print progress
+                printf("\r%d", index+1);
+                fflush(stdout);
+            } else if (progress != NULL)
+                progress(index);
+
+            index++;
         }
 
-        if (no_gui)
+        throughput[j] = count / (time_now() - time_repetition);
+    }
+
+    if (no_gui)
+        printf("\r");
+
+    if (benchmark_stats_compute(stats, throughput, repetitions, latency, index) != 0)
+        goto error_request;
+    *result = stats->throughput_median;
+
+    if (no_gui)
+    {
+        benchmark_stats_print(stats, "requests");
+
+        if (native && (vxi11_stats(device, &rpc_stats) == 0) && (rpc_stats.rpcs > 0))
+            printf("RPC: %lu calls, mean %.3f ms, min %.3f ms, max %.3f ms, %.1f syscalls/request\n",
+                   rpc_stats.rpcs, rpc_stats.rpc_total / rpc_stats.rpcs * 1000,
+                   rpc_stats.rpc_min * 1000, rpc_stats.rpc_max * 1000,
+                   (double) rpc_stats.syscalls / (warmup + index));
+    }
+
+    status = 0;
+
+error_request:
+    // Disconnect
+    if (native)
+        vxi11_disconnect(device);
+    else
+        connection_close(device);
+error_connect:
+    free(latency);
+    free(id);
+
+    return status;
+}
+
+struct benchmark_instrument_t
+{
+    char address[ADDRESS_LENGTH_MAX];
+    char id[ADDRESS_LENGTH_MAX];
+    bool started;
+    bool running;
+    int status;
+    double result;
+    struct benchmark_stats_t stats;
+};
+
+struct benchmark_survey_t
+{
+    struct benchmark_instrument_t *instrument;
+    int instrument_count;
+    int done;
+    pthread_mutex_t mutex;
+    pthread_cond_t idle;
+    int port;
+    int timeout;
+    lxi_protocol_t protocol;
+    bool native;
+    int count;
+    int warmup;
+    int repetitions;
+    double duration;
+};
+
+static struct benchmark_instrument_t survey_instrument[BENCHMARK_INSTRUMENTS_MAX];
+static int survey_instrument_count = 0;
+
+static void survey_broadcast(const char *address, const char *interface)
+{
+    UNUSED(address);
+    UNUSED(interface);
+}
+
+static void survey_device(const char *address, const char *id)
+{
+    int i;
+
+    // Skip repeated replies (eg. same instrument answering on several interfaces)
+    for (i=0; i<survey_instrument_count; i++)
+    {
+        if ((strcmp(survey_instrument[i].address, address) == 0) &&
+            (strcmp(survey_instrument[i].id, id) == 0))
+            return;
+    }
+
+    if (survey_instrument_count >= BENCHMARK_INSTRUMENTS_MAX)
+        return;
+
+    strncpy(survey_instrument[i].address, address, ADDRESS_LENGTH_MAX - 1);
+    strncpy(survey_instrument[i].id, id, ADDRESS_LENGTH_MAX - 1);
+    survey_instrument_count++;
+}
+
+// Next instrument not yet started whose address (gateway) is not being benchmarked
+static struct benchmark_instrument_t *survey_next(struct benchmark_survey_t *survey, bool *pending)
+{
+    int i, j;
+
+    *pending = false;
+
+    for (i=0; i<survey->instrument_count; i++)
+    {
+        if (survey->instrument[i].started)
+            continue;
+
+        *pending = true;
+
+        for (j=0; j<survey->instrument_count; j++)
         {
-            // Print progress
-            printf("\r%d", i+1);
-            fflush(stdout);
-        } else if (progress != NULL)
-            progress(i);
+            if (survey->instrument[j].running &&
+                (strcmp(survey->instrument[j].address, survey->instrument[i].address) == 0))
+                break;
+        }
+
+        if (j == survey->instrument_count)
+            return &survey->instrument[i];
     }
 
-    // Stop time
-    if( clock_gettime(CLOCK_MONOTONIC, &stop) == -1 )
+    return NULL;
+}
+
+static void *survey_worker(void *data)
+{
+    struct benchmark_survey_t *survey = data;
+    struct benchmark_instrument_t *instrument;
+    bool pending;
+
+    for (;;)
     {
-        error_printf("Failed to get stop time\n");
+        // Instruments behind one gateway share its address, benchmark them one at a time
+        pthread_mutex_lock(&survey->mutex);
+        while (((instrument = survey_next(survey, &pending)) == NULL) && pending)
+            pthread_cond_wait(&survey->idle, &survey->mutex);
+        if (instrument == NULL)
+        {
+            pthread_mutex_unlock(&survey->mutex);
+            break;
+        }
+        instrument->started = true;
+        instrument->running = true;
+        pthread_mutex_unlock(&survey->mutex);
+
+        instrument->status = benchmark(instrument->address, survey->port, survey->timeout,
+                                       survey->protocol, survey->native, survey->count,
+                                       survey->warmup, survey->repetitions, survey->duration,
+                                       false, &instrument->result, &instrument->stats, NULL);
+
+        pthread_mutex_lock(&survey->mutex);
+        instrument->running = false;
+        pthread_cond_broadcast(&survey->idle);
+        survey->done++;
+        printf("\rBenchmarked %d of %d instruments", survey->done, survey->instrument_count);
+        fflush(stdout);
+        pthread_mutex_unlock(&survey->mutex);
+    }
+
+    return NULL;
+}
+
+static enum benchmark_sort_t
+{
+    SORT_THROUGHPUT,
+    SORT_LATENCY,
+    SORT_ADDRESS
+} survey_sort;
+
+static int compare_instrument(const void *a, const void *b)
+{
+    const struct benchmark_instrument_t *x = a;
+    const struct benchmark_instrument_t *y = b;
+
+    // Failed instruments last
+    if ((x->status != 0) || (y->status != 0))
+        return (x->status != 0) - (y->status != 0);
+
+    switch (survey_sort)
+    {
+        case SORT_LATENCY:
+            return (x->stats.latency_median > y->stats.latency_median) -
+                   (x->stats.latency_median < y->stats.latency_median);
+        case SORT_ADDRESS:
+            return strcmp(x->address, y->address);
+        default:
+            return (x->stats.throughput_median < y->stats.throughput_median) -
+                   (x->stats.throughput_median > y->stats.throughput_median);
+    }
+}
+
+static void survey_print_json(FILE *f, struct benchmark_instrument_t *instrument, int count,
+                              const char *protocol)
+{
+    struct benchmark_stats_t *stats;
+    int i;
+
+    fprintf(f, "[\n");
+    for (i=0; i<count; i++)
+    {
+        stats = &instrument[i].stats;
+        fprintf(f, "  {\"address\": ");
+        json_string(f, instrument[i].address, strlen(instrument[i].address));
+        fprintf(f, ", \"id\": ");
+        json_string(f, instrument[i].id, strlen(instrument[i].id));
+        fprintf(f, ", \"protocol\": \"%s\"", protocol);
+        if (instrument[i].status != 0)
+            fprintf(f, ", \"status\": \"failed\"}");
+        else
+            fprintf(f, ", \"status\": \"ok\", \"requests_per_second\": %.3f"
+                       ", \"requests_per_second_ci\": [%.3f, %.3f]"
+                       ", \"latency_ms\": {\"median\": %.3f, \"p90\": %.3f, \"p99\": %.3f"
+                       ", \"min\": %.3f, \"max\": %.3f}}",
+                    stats->throughput_median, stats->throughput_ci_low, stats->throughput_ci_high,
+                    stats->latency_median * 1000, stats->latency_p90 * 1000,
+                    stats->latency_p99 * 1000, stats->latency_min * 1000,
+                    stats->latency_max * 1000);
+        fprintf(f, "%s\n", i < count - 1 ? "," : "");
+    }
+    fprintf(f, "]\n");
+}
+
+int benchmark_discover(int port, int timeout, lxi_protocol_t protocol, bool native,
+                       int count, int warmup, int repetitions, double duration,
+                       int jobs, const char *sort, const char *json_filename)
+{
+    pthread_t thread[BENCHMARK_JOBS_MAX];
+    struct benchmark_survey_t survey;
+    struct benchmark_stats_t *stats;
+    struct benchmark_instrument_t *instrument;
+    const char *protocol_name;
+    double time_start;
+    lxi_info_t info;
+    int i, threads;
+    FILE *f;
+
+    if ((sort == NULL) || (strcmp(sort, "throughput") == 0))
+        survey_sort = SORT_THROUGHPUT;
+    else if (strcmp(sort, "latency") == 0)
+        survey_sort = SORT_LATENCY;
+    else if (strcmp(sort, "address") == 0)
+        survey_sort = SORT_ADDRESS;
+    else
+    {
+        error_printf("Unknown sort field %s\n", sort);
+        return 1;
+    }
+
+    if ((jobs < 1) || (jobs > BENCHMARK_JOBS_MAX))
+    {
+        error_printf("Number of jobs must be 1 - %d\n", BENCHMARK_JOBS_MAX);
         return 1;
     }
 
-    // Calculate elapsed time in seconds
-    elapsed_time =
-        (double)(stop.tv_sec - start.tv_sec) +
-        (double)(stop.tv_nsec - start.tv_nsec)*1.0e-9;
+    native = native && (protocol == VXI11);
+    protocol_name = (protocol == RAW) ? "RAW" : native ? "VXI11-NATIVE" : "VXI11";
 
-    *result = count / elapsed_time;
+    printf("Searching for LXI devices - please wait...\n");
 
-    if (no_gui)
-        printf("\rResult: %.1f requests/second\n", *result);
+    info.broadcast = &survey_broadcast;
+    info.device = &survey_device;
+    info.service = NULL;
+    lxi_discover(&info, timeout, DISCOVER_VXI11);
 
-    // Disconnect
-    lxi_disconnect(device);
+    if (survey_instrument_count == 0)
+    {
+        printf("No devices found\n");
+        return 1;
+    }
+
+    printf("Benchmarking %d instrument%s (%d in parallel). Please wait...\n", survey_instrument_count,
+           survey_instrument_count > 1 ? "s" : "", MIN(jobs, survey_instrument_count));
+
+    memset(&survey, 0, sizeof(survey));
+    survey.instrument = survey_instrument;
+    survey.instrument_count = survey_instrument_count;
+    survey.port = port;
+    survey.timeout = timeout;
+    survey.protocol = protocol;
+    survey.native = native;
+    survey.count = count;
+    survey.warmup = warmup;
+    survey.repetitions = repetitions;
+    survey.duration = duration;
+    pthread_mutex_init(&survey.mutex, NULL);
+    pthread_cond_init(&survey.idle, NULL);
+
+    // Bounded number of concurrent benchmarks, each gateway by one worker at a time
+    time_start = time_now();
+    threads = MIN(jobs, survey_instrument_count);
+    for (i=0; i<threads; i++)
+    {
+        if (pthread_create(&thread[i], NULL, survey_worker, &survey) != 0)
+            break;
+    }
+    threads = i;
+    if (threads == 0)
+        survey_worker(&survey);
+    for (i=0; i<threads; i++)
+        pthread_join(thread[i], NULL);
+
+    pthread_cond_destroy(&survey.idle);
+    pthread_mutex_destroy(&survey.mutex);
+
+    printf("\rBenchmarked %d instrument%s in %.1f seconds\n\n", survey_instrument_count,
+           survey_instrument_count > 1 ? "s" : "", time_now() - time_start);
+
+    qsort(survey_instrument, survey_instrument_count, sizeof(struct benchmark_instrument_t),
+          compare_instrument);
+
+    // Table
+    printf("%-16s %-12s %10s %10s %10s %10s  %s\n",
+           "Address", "Protocol", "Req/s", "p50 (ms)", "p90 (ms)", "p99 (ms)", "ID");
+    for (i=0; i<survey_instrument_count; i++)
+    {
+        instrument = &survey_instrument[i];
+        stats = &instrument->stats;
+        if (instrument->status != 0)
+            printf("%-16s %-12s %10s %10s %10s %10s  %s\n", instrument->address, protocol_name,
+                   "failed", "-", "-", "-", instrument->id);
+        else
+            printf("%-16s %-12s %10.1f %10.3f %10.3f %10.3f  %s\n", instrument->address, protocol_name,
+                   stats->throughput_median, stats->latency_median * 1000,
+                   stats->latency_p90 * 1000, stats->latency_p99 * 1000, instrument->id);
+    }
+
+    if (json_filename != NULL)
+    {
+        f = fopen(json_filename, "w");
+        if (f == NULL)
+        {
+            error_printf("Could not write %s (%s)\n", json_filename, strerror(errno));
+            return 1;
+        }
+        survey_print_json(f, survey_instrument, survey_instrument_count, protocol_name);
+        fclose(f);
+        printf("\nSaved results to %s\n", json_filename);
+    }
 
     return 0;
 }
@@ -44,7 +44,40 @@ extern "C" {
 #include "error.h"
 #include <lxi.h>
 
-int benchmark(const char *ip, int port, int timeout, lxi_protocol_t protocol, int count, bool no_gui, double *result, void (*progress)(unsigned int count));
+#define BENCHMARK_REPETITIONS_MAX 100
+#define BENCHMARK_INSTRUMENTS_MAX 256
+#define BENCHMARK_JOBS_MAX 64
+
+struct benchmark_stats_t
+{
+    int repetitions;
+    int count;
+    double throughput[BENCHMARK_REPETITIONS_MAX];
+    bool outlier[BENCHMARK_REPETITIONS_MAX];
+    int outliers;
+    double throughput_median;
+    double throughput_ci_low;
+    double throughput_ci_high;
+    double latency_min;
+    double latency_max;
+    double latency_median;
+    double latency_ci_low;
+    double latency_ci_high;
+    double latency_p90;
+    double latency_p99;
+};
+
+int benchmark(const char *ip, int port, int timeout, lxi_protocol_t protocol, bool native,
+              int count, int warmup, int repetitions, double duration, bool no_gui,
+              double *result, struct benchmark_stats_t *stats,
+              void (*progress)(unsigned int count));
+int benchmark_discover(int port, int timeout, lxi_protocol_t protocol, bool native,
+                       int count, int warmup, int repetitions, double duration,
+                       int jobs, const char *sort, const char *json_filename);
+int benchmark_stats_compute(struct benchmark_stats_t *stats,
+                            double *throughput, int repetitions,
+                            double *latency, int count);
+void benchmark_stats_print(struct benchmark_stats_t *stats, const char *unit);
 
 #ifdef __cplusplus
 }
@@ -28,16 +28,53 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <math.h>
 #include "gtkchart.h"
+#include "trace.h"
 
 #define UNUSED(expr) do { (void)(expr); } while (0)
 
+// Resolution of density chart accumulation buffer
+#define DENSITY_COLUMNS 1000
+#define DENSITY_ROWS 500
+
 struct chart_point_t
 {
   double x;
   double y;
 };
 
+// Everything needed to draw a chart, independent of widget
+struct chart_state_t
+{
+  int type;
+  char *title;
+  char *label;
+  char *x_label;
+  char *y_label;
+  double x_max;
+  double y_max;
+  double value;
+  double value_min;
+  double value_max;
+  const struct chart_point_t *points;
+  guint points_count;
+  cairo_surface_t *density_image;
+};
+
+// Offscreen PNG rendering job handed to worker thread
+struct chart_png_job_t
+{
+  struct chart_state_t state;
+  struct chart_point_t *points;
+  char *filename;
+  int width;
+  int height;
+  GtkChartSaveCallback callback;
+  gpointer user_data;
+  char *error;
+};
+
 struct _GtkChart
 {
   GtkWidget parent_instance;
@@ -53,10 +90,25 @@ struct _GtkChart
   double value_max;
   int width;
   void *user_data;
-  GSList *point_list;
+  GArray *point_array;
   GtkSnapshot *snapshot;
+
+  // Density chart (stored column-major so waveform spans are contiguous)
+  GMutex density_mutex;
+  float *density;
+  int *density_rows;
+  int density_rows_size;
+  double decay;
+  bool density_dirty;
+  gint density_redraw_pending;
+  cairo_surface_t *density_image;
+  guint32 density_palette[256];
 };
 
+// Single worker serializes PNG rendering so the image surface can be reused
+static GThreadPool *png_pool = NULL;
+static cairo_surface_t *png_surface = NULL;
+
 struct _GtkChartClass
 {
   GtkWidgetClass parent_class;
@@ -79,6 +131,15 @@ gtk_chart_init (GtkChart *self)
   self->value_max = 100;
   self->width = 500;
   self->snapshot = NULL;
+  self->point_array = g_array_new(FALSE, FALSE, sizeof(struct chart_point_t));
+  self->density = NULL;
+  self->density_rows = NULL;
+  self->density_rows_size = 0;
+  self->decay = 0;
+  self->density_dirty = false;
+  self->density_redraw_pending = 0;
+  self->density_image = NULL;
+  g_mutex_init(&self->density_mutex);
 
   //gtk_widget_init_template (GTK_WIDGET (self));
 }
@@ -88,6 +149,8 @@ gtk_chart_finalize (GObject *object)
 {
   GtkChart *self = GTK_CHART (object);
 
+  g_mutex_clear(&self->density_mutex);
+
   G_OBJECT_CLASS (
     gtk_chart_parent_class)->
       finalize (G_OBJECT (self));
@@ -110,15 +173,22 @@ gtk_chart_dispose (GObject *object)
 
   gdk_display_sync(gdk_display_get_default());
 
-  g_slist_free_full(g_steal_pointer(&self->point_list), g_free);
-  g_slist_free(self->point_list);
+  if (self->point_array != NULL)
+    g_array_unref(g_steal_pointer(&self->point_array));
+
+  g_mutex_lock(&self->density_mutex);
+  g_free(g_steal_pointer(&self->density));
+  g_free(g_steal_pointer(&self->density_rows));
+  if (self->density_image != NULL)
+    cairo_surface_destroy(g_steal_pointer(&self->density_image));
+  g_mutex_unlock(&self->density_mutex);
 
   G_OBJECT_CLASS (gtk_chart_parent_class)->dispose (object);
 }
 
 static void
-chart_draw_line_or_scatter(GtkChart *self,
-                           GtkSnapshot *snapshot,
+chart_draw_line_or_scatter(const struct chart_state_t *state,
+                           cairo_t *cr,
                            float h,
                            float w)
 {
@@ -135,14 +205,12 @@ chart_draw_line_or_scatter(GtkChart *self,
   gdk_rgba_parse (&grid, "rgba(255,255,255,0.1)");
 
   // Set background color
-  gtk_snapshot_append_color (snapshot,
-                             &bg_color,
-                             &GRAPHENE_RECT_INIT(0, 0, w, h));
+  gdk_cairo_set_source_rgba (cr, &bg_color);
+  cairo_paint (cr);
 
   // Assume aspect ratio w:h = 2:1
 
-  // Set up Cairo region
-  cairo_t * cr = gtk_snapshot_append_cairo (snapshot, &GRAPHENE_RECT_INIT(0, 0, w, h));
+  // Set up Cairo drawing
   cairo_set_antialias (cr, CAIRO_ANTIALIAS_FAST);
   cairo_set_tolerance (cr, 1.5);
   gdk_cairo_set_source_rgba (cr, &white);
@@ -156,29 +224,29 @@ chart_draw_line_or_scatter(GtkChart *self,
 
   // Draw title
   cairo_set_font_size (cr, 15.0 * (w/650));
-  cairo_text_extents(cr, self->title, &extents);
+  cairo_text_extents(cr, state->title, &extents);
   cairo_move_to (cr, 0.5 * w - extents.width/2, 0.9 * h - extents.height/2);
   cairo_save(cr);
   cairo_scale(cr, 1, -1);
-  cairo_show_text (cr, self->title);
+  cairo_show_text (cr, state->title);
   cairo_restore(cr);
 
   // Draw x-axis label
   cairo_set_font_size (cr, 11.0 * (w/650));
-  cairo_text_extents(cr, self->x_label, &extents);
+  cairo_text_extents(cr, state->x_label, &extents);
   cairo_move_to (cr, 0.5 * w - extents.width/2, 0.075 * h);
   cairo_save(cr);
   cairo_scale(cr, 1, -1);
-  cairo_show_text (cr, self->x_label);
+  cairo_show_text (cr, state->x_label);
   cairo_restore(cr);
 
   // Draw y-axis label
-  cairo_text_extents(cr, self->y_label, &extents);
+  cairo_text_extents(cr, state->y_label, &extents);
   cairo_move_to (cr, 0.035 * w, 0.5 * h - extents.width/2);
   cairo_save(cr);
   cairo_rotate(cr, M_PI/2);
   cairo_scale(cr, 1, -1);
-  cairo_show_text (cr, self->y_label);
+  cairo_show_text (cr, state->y_label);
   cairo_restore(cr);
 
   // Draw x-axis
@@ -194,7 +262,7 @@ chart_draw_line_or_scatter(GtkChart *self,
   cairo_stroke (cr);
 
   // Draw x-axis value at 100% mark
-  g_snprintf(value, sizeof(value), "%.1f", self->x_max);
+  g_snprintf(value, sizeof(value), "%.1f", state->x_max);
   cairo_set_font_size (cr, 8.0 * (w/650));
   cairo_text_extents(cr, value, &extents);
   cairo_move_to (cr, 0.9 * w - extents.width/2, 0.16 * h);
@@ -204,7 +272,7 @@ chart_draw_line_or_scatter(GtkChart *self,
   cairo_restore(cr);
 
   // Draw x-axis value at 75% mark
-  g_snprintf(value, sizeof(value), "%.1f", (self->x_max/4) * 3);
+  g_snprintf(value, sizeof(value), "%.1f", (state->x_max/4) * 3);
   cairo_set_font_size (cr, 8.0 * (w/650));
   cairo_text_extents(cr, value, &extents);
   cairo_move_to (cr, 0.7 * w - extents.width/2, 0.16 * h);
@@ -214,7 +282,7 @@ chart_draw_line_or_scatter(GtkChart *self,
   cairo_restore(cr);
 
   // Draw x-axis value at 50% mark
-  g_snprintf(value, sizeof(value), "%.1f", self->x_max/2);
+  g_snprintf(value, sizeof(value), "%.1f", state->x_max/2);
   cairo_set_font_size (cr, 8.0 * (w/650));
   cairo_text_extents(cr, value, &extents);
   cairo_move_to (cr, 0.5 * w - extents.width/2, 0.16 * h);
@@ -224,7 +292,7 @@ chart_draw_line_or_scatter(GtkChart *self,
   cairo_restore(cr);
 
   // Draw x-axis value at 25% mark
-  g_snprintf(value, sizeof(value), "%.1f", self->x_max/4);
+  g_snprintf(value, sizeof(value), "%.1f", state->x_max/4);
   cairo_set_font_size (cr, 8.0 * (w/650));
   cairo_text_extents(cr, value, &extents);
   cairo_move_to (cr, 0.3 * w - extents.width/2, 0.16 * h);
@@ -252,7 +320,7 @@ chart_draw_line_or_scatter(GtkChart *self,
   cairo_restore(cr);
 
   // Draw y-axis value at 25% mark
-  g_snprintf(value, sizeof(value), "%.1f", self->y_max/4);
+  g_snprintf(value, sizeof(value), "%.1f", state->y_max/4);
   cairo_set_font_size (cr, 8.0 * (w/650));
   cairo_text_extents(cr, value, &extents);
   cairo_move_to (cr, 0.091 * w - extents.width, 0.34 * h);
@@ -262,7 +330,7 @@ chart_draw_line_or_scatter(GtkChart *self,
   cairo_restore(cr);
 
   // Draw y-axis value at 50% mark
-  g_snprintf(value, sizeof(value), "%.1f", self->y_max/2);
+  g_snprintf(value, sizeof(value), "%.1f", state->y_max/2);
   cairo_set_font_size (cr, 8.0 * (w/650));
   cairo_text_extents(cr, value, &extents);
   cairo_move_to (cr, 0.091 * w - extents.width, 0.49 * h);
@@ -272,7 +340,7 @@ chart_draw_line_or_scatter(GtkChart *self,
   cairo_restore(cr);
 
   // Draw y-axis value at 75% mark
-  g_snprintf(value, sizeof(value), "%.1f", (self->y_max/4) * 3);
+  g_snprintf(value, sizeof(value), "%.1f", (state->y_max/4) * 3);
   cairo_set_font_size (cr, 8.0 * (w/650));
   cairo_text_extents(cr, value, &extents);
   cairo_move_to (cr, 0.091 * w - extents.width, 0.64 * h);
@@ -282,7 +350,7 @@ chart_draw_line_or_scatter(GtkChart *self,
   cairo_restore(cr);
 
   // Draw y-axis value at 100% mark
-  g_snprintf(value, sizeof(value), "%.1f", self->y_max);
+  g_snprintf(value, sizeof(value), "%.1f", state->y_max);
   cairo_set_font_size (cr, 8.0 * (w/650));
   cairo_text_extents(cr, value, &extents);
   cairo_move_to (cr, 0.091 * w - extents.width, 0.79 * h);
@@ -348,19 +416,18 @@ chart_draw_line_or_scatter(GtkChart *self,
   cairo_set_line_width (cr, 2.0);
 
   // Calc scales
-  float x_scale = (w - 2 * 0.1 * w) / self->x_max;
-  float y_scale = (h - 2 * 0.2 * h) / self->y_max;
+  float x_scale = (w - 2 * 0.1 * w) / state->x_max;
+  float y_scale = (h - 2 * 0.2 * h) / state->y_max;
 
-  // Draw data points from list
-  GSList *l;
-  for (l = self->point_list; l != NULL; l = l->next)
+  // Draw data points
+  for (guint i = 0; i < state->points_count; i++)
   {
-    struct chart_point_t *point = l->data;
+    const struct chart_point_t *point = &state->points[i];
 
-    switch (self->type)
+    switch (state->type)
     {
       case GTK_CHART_TYPE_LINE:
-        if (l == self->point_list)
+        if (i == 0)
         {
           // Move to first point
           cairo_move_to(cr, point->x * x_scale, point->y * y_scale);
@@ -389,13 +456,11 @@ chart_draw_line_or_scatter(GtkChart *self,
         break;
     }
   }
-
-  cairo_destroy (cr);
 }
 
 static void
-chart_draw_number(GtkChart *self,
-                  GtkSnapshot *snapshot,
+chart_draw_number(const struct chart_state_t *state,
+                  cairo_t *cr,
                   float h,
                   float w)
 {
@@ -411,14 +476,12 @@ chart_draw_number(GtkChart *self,
   gdk_rgba_parse (&grid, "rgba(255,255,255,0.1)");
 
   // Set background color
-  gtk_snapshot_append_color (snapshot,
-                             &bg_color,
-                             &GRAPHENE_RECT_INIT(0, 0, w, h));
+  gdk_cairo_set_source_rgba (cr, &bg_color);
+  cairo_paint (cr);
 
   // Assume aspect ratio w:h = 1:1
 
-  // Set up Cairo region
-  cairo_t * cr = gtk_snapshot_append_cairo (snapshot, &GRAPHENE_RECT_INIT(0, 0, w, h));
+  // Set up Cairo drawing
   cairo_set_antialias (cr, CAIRO_ANTIALIAS_FAST);
   cairo_set_tolerance (cr, 1.5);
   gdk_cairo_set_source_rgba (cr, &white);
@@ -432,24 +495,24 @@ chart_draw_number(GtkChart *self,
 
   // Draw title
   cairo_set_font_size (cr, 15.0 * (w/650));
-  cairo_text_extents(cr, self->title, &extents);
+  cairo_text_extents(cr, state->title, &extents);
   cairo_move_to (cr, 0.5 * w - extents.width/2, 0.9 * h - extents.height/2);
   cairo_save(cr);
   cairo_scale(cr, 1, -1);
-  cairo_show_text (cr, self->title);
+  cairo_show_text (cr, state->title);
   cairo_restore(cr);
 
   // Draw label
   cairo_set_font_size (cr, 25.0 * (w/650));
-  cairo_text_extents(cr, self->label, &extents);
+  cairo_text_extents(cr, state->label, &extents);
   cairo_move_to(cr, 0.5 * w - extents.width/2, 0.2 * h - extents.height/2);
   cairo_save(cr);
   cairo_scale(cr, 1, -1);
-  cairo_show_text(cr, self->label);
+  cairo_show_text(cr, state->label);
   cairo_restore(cr);
 
   // Draw number
-  g_snprintf(value, sizeof(value), "%.1f", self->value);
+  g_snprintf(value, sizeof(value), "%.1f", state->value);
   cairo_set_font_size (cr, 140.0 * (w/650));
   cairo_text_extents(cr, value, &extents);
   cairo_move_to(cr, 0.5 * w - extents.width/2, 0.5 * h - extents.height/2);
@@ -457,13 +520,11 @@ chart_draw_number(GtkChart *self,
   cairo_scale(cr, 1, -1);
   cairo_show_text(cr, value);
   cairo_restore(cr);
-
-  cairo_destroy (cr);
 }
 
 static void
-chart_draw_gauge_linear(GtkChart *self,
-                        GtkSnapshot *snapshot,
+chart_draw_gauge_linear(const struct chart_state_t *state,
+                        cairo_t *cr,
                         float h,
                         float w)
 {
@@ -479,14 +540,12 @@ chart_draw_gauge_linear(GtkChart *self,
   gdk_rgba_parse (&grid, "rgba(255,255,255,0.1)");
 
   // Set background color
-  gtk_snapshot_append_color (snapshot,
-                             &bg_color,
-                             &GRAPHENE_RECT_INIT(0, 0, w, h));
+  gdk_cairo_set_source_rgba (cr, &bg_color);
+  cairo_paint (cr);
 
   // Assume aspect ratio w:h = 1:2
 
-  // Set up Cairo region
-  cairo_t * cr = gtk_snapshot_append_cairo (snapshot, &GRAPHENE_RECT_INIT(0, 0, w, h));
+  // Set up Cairo drawing
   cairo_set_antialias (cr, CAIRO_ANTIALIAS_FAST);
   cairo_set_tolerance (cr, 1.5);
   gdk_cairo_set_source_rgba (cr, &white);
@@ -500,24 +559,24 @@ chart_draw_gauge_linear(GtkChart *self,
 
   // Draw title
   cairo_set_font_size (cr, 15.0 * (2*w/650));
-  cairo_text_extents(cr, self->title, &extents);
+  cairo_text_extents(cr, state->title, &extents);
   cairo_move_to (cr, 0.5 * w - extents.width/2, 0.95 * h - extents.height/2);
   cairo_save(cr);
   cairo_scale(cr, 1, -1);
-  cairo_show_text (cr, self->title);
+  cairo_show_text (cr, state->title);
   cairo_restore(cr);
 
   // Draw label
   cairo_set_font_size (cr, 25.0 * (w/650));
-  cairo_text_extents(cr, self->label, &extents);
+  cairo_text_extents(cr, state->label, &extents);
   cairo_move_to(cr, 0.5 * w - extents.width/2, 0.05 * h - extents.height/2);
   cairo_save(cr);
   cairo_scale(cr, 1, -1);
-  cairo_show_text(cr, self->label);
+  cairo_show_text(cr, state->label);
   cairo_restore(cr);
 
   // Draw minimum value
-  g_snprintf(value, sizeof(value), "%.0f", self->value_min);
+  g_snprintf(value, sizeof(value), "%.0f", state->value_min);
   cairo_set_font_size (cr, 25.0 * (w/650));
   cairo_text_extents(cr, value, &extents);
   cairo_move_to(cr, 0.7 * w, 0.1 * h - extents.height/2);
@@ -527,7 +586,7 @@ chart_draw_gauge_linear(GtkChart *self,
   cairo_restore(cr);
 
   // Draw maximum value
-  g_snprintf(value, sizeof(value), "%.0f", self->value_max);
+  g_snprintf(value, sizeof(value), "%.0f", state->value_max);
   cairo_set_font_size (cr, 25.0 * (w/650));
   cairo_text_extents(cr, value, &extents);
   cairo_move_to(cr, 0.7 * w, 0.9 * h - extents.height/2);
@@ -555,17 +614,15 @@ chart_draw_gauge_linear(GtkChart *self,
   // Draw gauge line
   gdk_cairo_set_source_rgba (cr, &line);
   cairo_move_to(cr, 0, 0);
-  float y_scale = (h - 2 * 0.1 * h) / self->value_max;
+  float y_scale = (h - 2 * 0.1 * h) / state->value_max;
   cairo_set_line_width (cr, 0.2 * w);
-  cairo_line_to(cr, 0, self->value * y_scale);
+  cairo_line_to(cr, 0, state->value * y_scale);
   cairo_stroke (cr);
-
-  cairo_destroy (cr);
 }
 
 static void
-chart_draw_gauge_angular(GtkChart *self,
-                        GtkSnapshot *snapshot,
+chart_draw_gauge_angular(const struct chart_state_t *state,
+                        cairo_t *cr,
                         float h,
                         float w)
 {
@@ -581,14 +638,12 @@ chart_draw_gauge_angular(GtkChart *self,
   gdk_rgba_parse (&grid, "rgba(255,255,255,0.1)");
 
   // Set background color
-  gtk_snapshot_append_color (snapshot,
-                             &bg_color,
-                             &GRAPHENE_RECT_INIT(0, 0, w, h));
+  gdk_cairo_set_source_rgba (cr, &bg_color);
+  cairo_paint (cr);
 
   // Assume aspect ratio w:h = 1:1
 
-  // Set up Cairo region
-  cairo_t * cr = gtk_snapshot_append_cairo (snapshot, &GRAPHENE_RECT_INIT(0, 0, w, h));
+  // Set up Cairo drawing
   cairo_set_antialias (cr, CAIRO_ANTIALIAS_FAST);
 //  cairo_set_tolerance (cr, 1.5);
   gdk_cairo_set_source_rgba (cr, &white);
@@ -602,24 +657,24 @@ chart_draw_gauge_angular(GtkChart *self,
 
   // Draw title
   cairo_set_font_size (cr, 15.0 * (2*w/650));
-  cairo_text_extents(cr, self->title, &extents);
+  cairo_text_extents(cr, state->title, &extents);
   cairo_move_to (cr, 0.5 * w - extents.width/2, 0.9 * h - extents.height/2);
   cairo_save(cr);
   cairo_scale(cr, 1, -1);
-  cairo_show_text (cr, self->title);
+  cairo_show_text (cr, state->title);
   cairo_restore(cr);
 
   // Draw label
   cairo_set_font_size (cr, 25.0 * (w/650));
-  cairo_text_extents(cr, self->label, &extents);
+  cairo_text_extents(cr, state->label, &extents);
   cairo_move_to(cr, 0.5 * w - extents.width/2, 0.1 * h - extents.height/2);
   cairo_save(cr);
   cairo_scale(cr, 1, -1);
-  cairo_show_text(cr, self->label);
+  cairo_show_text(cr, state->label);
   cairo_restore(cr);
 
   // Draw minimum value
-  g_snprintf(value, sizeof(value), "%.0f", self->value_min);
+  g_snprintf(value, sizeof(value), "%.0f", state->value_min);
   cairo_set_font_size (cr, 25.0 * (w/650));
   cairo_text_extents(cr, value, &extents);
   cairo_move_to(cr, 0.225 * w, 0.25 * h - extents.height/2);
@@ -629,7 +684,7 @@ chart_draw_gauge_angular(GtkChart *self,
   cairo_restore(cr);
 
   // Draw maximum value
-  g_snprintf(value, sizeof(value), "%.0f", self->value_max);
+  g_snprintf(value, sizeof(value), "%.0f", state->value_max);
   cairo_set_font_size (cr, 25.0 * (w/650));
   cairo_text_extents(cr, value, &extents);
   cairo_move_to(cr, 0.77 * w - extents.width, 0.25 * h - extents.height/2);
@@ -660,22 +715,20 @@ chart_draw_gauge_angular(GtkChart *self,
   double yc = -0.25 * h;
   double radius = 0.35 * w;
   double angle1 = 180 * (M_PI/180.0);
-  double angle = self->value * (180 / (self->value_max));
+  double angle = state->value * (180 / (state->value_max));
   double angle2 = 180 * (M_PI/180.0) + angle * (M_PI/180.0);
   cairo_set_line_width (cr, 0.1 * w);
   cairo_arc (cr, xc, yc, radius, angle1, angle2);
   cairo_stroke (cr);
-
-  cairo_destroy (cr);
 }
 
 static void
-chart_draw_unknown_type(GtkChart *self,
-                        GtkSnapshot *snapshot,
+chart_draw_unknown_type(const struct chart_state_t *state,
+                        cairo_t *cr,
                         float h,
                         float w)
 {
-  UNUSED(self);
+  UNUSED(state);
 
   GdkRGBA bg_color, white;
   cairo_text_extents_t extents;
@@ -685,12 +738,10 @@ chart_draw_unknown_type(GtkChart *self,
   gdk_rgba_parse (&white, "rgba(255,255,255,0.75)");
 
   // Set background color
-  gtk_snapshot_append_color (snapshot,
-                             &bg_color,
-                             &GRAPHENE_RECT_INIT(0, 0, w, h));
+  gdk_cairo_set_source_rgba (cr, &bg_color);
+  cairo_paint (cr);
 
-  // Set up Cairo region
-  cairo_t * cr = gtk_snapshot_append_cairo (snapshot, &GRAPHENE_RECT_INIT(0, 0, w, h));
+  // Set up Cairo drawing
   gdk_cairo_set_source_rgba (cr, &white);
   cairo_select_font_face (cr, "Ubuntu", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
 
@@ -708,46 +759,162 @@ chart_draw_unknown_type(GtkChart *self,
   cairo_scale(cr, 1, -1);
   cairo_show_text (cr, warning);
   cairo_restore(cr);
-
-  cairo_destroy (cr);
 }
 
 
 static void
-gtk_chart_snapshot (GtkWidget   *widget,
-                    GtkSnapshot *snapshot)
+chart_draw_density(const struct chart_state_t *state,
+                   cairo_t *cr,
+                   float h,
+                   float w)
 {
-  GtkChart *self = GTK_CHART(widget);
+  // Draw background, labels, axes and grid like line chart (no points)
+  cairo_save(cr);
+  chart_draw_line_or_scatter(state, cr, h, w);
+  cairo_restore(cr);
 
-  float width = gtk_widget_get_width (widget);
-  float height = gtk_widget_get_height (widget);
+  if (state->density_image == NULL)
+    return;
+
+  // Scale accumulated image into plot area
+  cairo_save(cr);
+  cairo_translate(cr, 0.1 * w, 0.2 * h);
+  cairo_scale(cr, (0.8 * w) / DENSITY_COLUMNS, (0.6 * h) / DENSITY_ROWS);
+  cairo_set_source_surface(cr, state->density_image, 0, 0);
+  cairo_paint(cr);
+  cairo_restore(cr);
+}
 
+static void
+chart_draw(const struct chart_state_t *state,
+           cairo_t *cr,
+           float h,
+           float w)
+{
   // Draw various chart types
-  switch (self->type)
+  switch (state->type)
   {
     case GTK_CHART_TYPE_LINE:
     case GTK_CHART_TYPE_SCATTER:
-      chart_draw_line_or_scatter(self, snapshot, height, width);
+      chart_draw_line_or_scatter(state, cr, h, w);
       break;
 
     case GTK_CHART_TYPE_NUMBER:
-      chart_draw_number(self, snapshot, height, width);
+      chart_draw_number(state, cr, h, w);
       break;
 
     case GTK_CHART_TYPE_GAUGE_LINEAR:
-      chart_draw_gauge_linear(self, snapshot, height, width);
+      chart_draw_gauge_linear(state, cr, h, w);
       break;
 
     case GTK_CHART_TYPE_GAUGE_ANGULAR:
-      chart_draw_gauge_angular(self, snapshot, height, width);
+      chart_draw_gauge_angular(state, cr, h, w);
+      break;
+
+    case GTK_CHART_TYPE_DENSITY:
+      chart_draw_density(state, cr, h, w);
       break;
 
     default:
-      chart_draw_unknown_type(self, snapshot, height, width);
+      chart_draw_unknown_type(state, cr, h, w);
       break;
   }
+}
+
+// Convert accumulated density to image (call with density mutex held)
+static void
+chart_density_image_update(GtkChart *self)
+{
+  const float *density = self->density;
+  float max = 0, scale;
+  unsigned char *data;
+  int stride, row, column, i;
+
+  if ((self->density == NULL) || (self->density_dirty == false))
+    return;
+
+  if (self->density_image == NULL)
+  {
+    self->density_image = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, DENSITY_COLUMNS, DENSITY_ROWS);
+
+    // Palette from chart line color over cyan to white, transparent if empty
+    self->density_palette[0] = 0;
+    for (i = 1; i < 256; i++)
+    {
+      double t = i / 255.0;
+      guint32 r = 0x32 + (0xff - 0x32) * t * t;
+      guint32 g = 0x5a + (0xff - 0x5a) * t;
+      guint32 b = 0xad + (0xff - 0xad) * sqrt(t);
+      self->density_palette[i] = 0xff000000 | (r << 16) | (g << 8) | b;
+    }
+  }
+
+  for (i = 0; i < DENSITY_COLUMNS * DENSITY_ROWS; i++)
+    max = density[i] > max ? density[i] : max;
+
+  // Square root intensity mapping so rare excursions remain visible
+  scale = max > 0 ? 255.0f / sqrtf(max) : 0;
+
+  cairo_surface_flush(self->density_image);
+  data = cairo_image_surface_get_data(self->density_image);
+  stride = cairo_image_surface_get_stride(self->density_image);
+
+  for (row = 0; row < DENSITY_ROWS; row++)
+  {
+    guint32 *pixel = (guint32 *) (data + row * stride);
+
+    for (column = 0; column < DENSITY_COLUMNS; column++)
+      pixel[column] = self->density_palette[(int) (sqrtf(density[column * DENSITY_ROWS + row]) * scale)];
+  }
+
+  cairo_surface_mark_dirty(self->density_image);
+  self->density_dirty = false;
+}
+
+static void
+chart_state_get(GtkChart *self, struct chart_state_t *state)
+{
+  state->type = self->type;
+  state->title = self->title;
+  state->label = self->label;
+  state->x_label = self->x_label;
+  state->y_label = self->y_label;
+  state->x_max = self->x_max;
+  state->y_max = self->y_max;
+  state->value = self->value;
+  state->value_min = self->value_min;
+  state->value_max = self->value_max;
+  state->points = (const struct chart_point_t *) self->point_array->data;
+  state->points_count = self->point_array->len;
+  state->density_image = self->density_image;
+}
+
+static void
+gtk_chart_snapshot (GtkWidget   *widget,
+                    GtkSnapshot *snapshot)
+{
+  GtkChart *self = GTK_CHART(widget);
+  struct chart_state_t state;
+  uint64_t trace_start = trace_begin();
+
+  float width = gtk_widget_get_width (widget);
+  float height = gtk_widget_get_height (widget);
+
+  g_mutex_lock(&self->density_mutex);
+
+  // Only render accumulated density image when new waveforms arrived
+  chart_density_image_update(self);
+  chart_state_get(self, &state);
+
+  cairo_t *cr = gtk_snapshot_append_cairo (snapshot, &GRAPHENE_RECT_INIT(0, 0, width, height));
+  chart_draw(&state, cr, height, width);
+  cairo_destroy (cr);
+
+  g_mutex_unlock(&self->density_mutex);
 
   self->snapshot = snapshot;
+
+  trace_end("redraw", "gui", trace_start, self->title);
 }
 
 static void gtk_chart_class_init (GtkChartClass *class)
@@ -777,6 +944,28 @@ void * gtk_chart_get_user_data(GtkChart *chart)
   return chart->user_data;
 }
 
+// Number of plotted points
+guint gtk_chart_get_point_count(GtkChart *chart)
+{
+  return chart->point_array->len;
+}
+
+// Memory held by plotted data and density buffers
+gsize gtk_chart_get_memory_size(GtkChart *chart)
+{
+  gsize size = chart->point_array->len * sizeof(struct chart_point_t);
+
+  g_mutex_lock(&chart->density_mutex);
+  if (chart->density != NULL)
+    size += DENSITY_COLUMNS * DENSITY_ROWS * sizeof(float);
+  size += chart->density_rows_size * sizeof(int);
+  if (chart->density_image != NULL)
+    size += DENSITY_COLUMNS * DENSITY_ROWS * 4;
+  g_mutex_unlock(&chart->density_mutex);
+
+  return size;
+}
+
 void gtk_chart_set_type(GtkChart *chart, GtkChartType type)
 {
   chart->type = type;
@@ -819,13 +1008,10 @@ void gtk_chart_set_width(GtkChart *chart, int width)
 
 void gtk_chart_plot_point(GtkChart *chart, double x, double y)
 {
-  // Allocate memory for new point
-  struct chart_point_t *point = g_new0(struct chart_point_t, 1);
-  point->x = x;
-  point->y = y;
+  struct chart_point_t point = { .x = x, .y = y };
 
-  // Add point to list to be drawn
-  chart->point_list = g_slist_append(chart->point_list, point);
+  // Add point to array to be drawn
+  g_array_append_val(chart->point_array, point);
 
   // Queue draw of widget
   if (GTK_IS_WIDGET(chart))
@@ -855,10 +1041,116 @@ void gtk_chart_set_value_max(GtkChart *chart, double value)
   chart->value_max = value;
 }
 
+void gtk_chart_set_decay(GtkChart *chart, double decay)
+{
+  chart->decay = decay;
+}
+
+static gboolean
+chart_density_redraw(gpointer user_data)
+{
+  GtkChart *chart = user_data;
+
+  g_atomic_int_set(&chart->density_redraw_pending, 0);
+  gtk_widget_queue_draw(GTK_WIDGET(chart));
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+chart_density_span(float *restrict column, int row_a, int row_b)
+{
+  int row_min = row_a < row_b ? row_a : row_b;
+  int row_max = row_a < row_b ? row_b : row_a;
+
+  for (int row = row_min; row <= row_max; row++)
+    column[row] += 1.0f;
+}
+
+// Accumulate waveform into density buffer. May be called from any thread.
+void gtk_chart_plot_waveform(GtkChart *chart, const double *samples, int count)
+{
+  float *restrict density;
+  int *restrict rows;
+  float retain, row_scale;
+  int i, column, column_prev, row, row_prev;
+
+  if ((count <= 0) || (chart->y_max <= 0))
+    return;
+
+  g_mutex_lock(&chart->density_mutex);
+
+  if (chart->density == NULL)
+    chart->density = g_new0(float, DENSITY_COLUMNS * DENSITY_ROWS);
+
+  if (chart->density_rows_size < count)
+  {
+    g_free(chart->density_rows);
+    chart->density_rows = g_new(int, count);
+    chart->density_rows_size = count;
+  }
+
+  density = chart->density;
+  rows = chart->density_rows;
+
+  // Fade previous captures
+  if (chart->decay > 0)
+  {
+    retain = 1.0f - chart->decay;
+    for (i = 0; i < DENSITY_COLUMNS * DENSITY_ROWS; i++)
+      density[i] *= retain;
+  }
+
+  // Map sample values to rows (row 0 is top of plot area)
+  row_scale = (DENSITY_ROWS - 1) / chart->y_max;
+  for (i = 0; i < count; i++)
+  {
+    float y = (DENSITY_ROWS - 1) - samples[i] * row_scale;
+    y = y < 0 ? 0 : y;
+    y = y > (DENSITY_ROWS - 1) ? (DENSITY_ROWS - 1) : y;
+    rows[i] = (int) (y + 0.5f);
+  }
+
+  // Rasterize waveform as connected vertical spans, one pass per capture
+  column_prev = 0;
+  row_prev = rows[0];
+  density[rows[0]] += 1.0f;
+  for (i = 1; i < count; i++)
+  {
+    column = (int) ((long) i * (DENSITY_COLUMNS - 1) / (count - 1));
+    row = rows[i];
+
+    if (column == column_prev)
+      chart_density_span(&density[column * DENSITY_ROWS], row_prev, row);
+    else
+    {
+      // Interpolate across columns when there are fewer samples than columns
+      int row_last = row_prev;
+      for (int c = column_prev + 1; c <= column; c++)
+      {
+        int r = row_prev + (row - row_prev) * (c - column_prev) / (column - column_prev);
+        chart_density_span(&density[c * DENSITY_ROWS], row_last, r);
+        row_last = r;
+      }
+    }
+
+    column_prev = column;
+    row_prev = row;
+  }
+
+  chart->density_dirty = true;
+
+  g_mutex_unlock(&chart->density_mutex);
+
+  // Coalesce redraws so rendering happens at most once per frame
+  if (g_atomic_int_compare_and_exchange(&chart->density_redraw_pending, 0, 1))
+    g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, chart_density_redraw, g_object_ref(chart), g_object_unref);
+}
+
 bool gtk_chart_save_csv(GtkChart *chart, const char *filename)
 {
   struct chart_point_t *point;
-  GSList *l;
+  guint i;
 
   // Open file
   FILE *file = fopen(filename, "w"); // write only
@@ -870,9 +1162,9 @@ bool gtk_chart_save_csv(GtkChart *chart, const char *filename)
   }
 
   // Write CSV data
-  for (l = chart->point_list; l != NULL; l = l->next)
+  for (i = 0; i < chart->point_array->len; i++)
   {
-    point = l->data;
+    point = &g_array_index(chart->point_array, struct chart_point_t, i);
     fprintf(file, "%f,%f\n", point->x, point->y);
   }
 
@@ -882,27 +1174,145 @@ bool gtk_chart_save_csv(GtkChart *chart, const char *filename)
   return true;
 }
 
-bool gtk_chart_save_png(GtkChart *chart, const char *filename)
+static void
+chart_png_job_free(struct chart_png_job_t *job)
+{
+  g_free(job->state.title);
+  g_free(job->state.label);
+  g_free(job->state.x_label);
+  g_free(job->state.y_label);
+  g_free(job->points);
+  g_free(job->filename);
+  g_free(job->error);
+  if (job->state.density_image != NULL)
+    cairo_surface_destroy(job->state.density_image);
+  g_free(job);
+}
+
+// Report result of PNG export in main context
+static gboolean
+chart_png_job_done(gpointer data)
+{
+  struct chart_png_job_t *job = data;
+
+  job->callback(job->filename, job->error, job->user_data);
+  chart_png_job_free(job);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+chart_png_worker_function(gpointer data, gpointer user_data)
 {
+  struct chart_png_job_t *job = data;
+  cairo_status_t status;
+  cairo_t *cr;
+  uint64_t trace_start = trace_begin();
+
+  UNUSED(user_data);
+
+  // Reuse image surface unless chart size changed
+  if ((png_surface == NULL) ||
+      (cairo_image_surface_get_width(png_surface) != job->width) ||
+      (cairo_image_surface_get_height(png_surface) != job->height))
+  {
+    if (png_surface != NULL)
+      cairo_surface_destroy(png_surface);
+    png_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, job->width, job->height);
+  }
+
+  // Render chart offscreen
+  cr = cairo_create(png_surface);
+  chart_draw(&job->state, cr, job->height, job->width);
+  cairo_destroy(cr);
+  cairo_surface_flush(png_surface);
+
+  // Encode PNG file
+  status = cairo_surface_write_to_png(png_surface, job->filename);
+  if (status != CAIRO_STATUS_SUCCESS)
+    job->error = g_strdup_printf("Could not save %s (%s)", job->filename, cairo_status_to_string(status));
+
+  trace_end("save-png", "gui", trace_start, job->filename);
+
+  if (job->callback != NULL)
+    g_idle_add(chart_png_job_done, job);
+  else
+  {
+    if (job->error != NULL)
+      g_print("Error: %s\n", job->error);
+    chart_png_job_free(job);
+  }
+}
+
+// Render and write PNG in background. Unless queuing fails (returns false)
+// callback is called in main context once file is written or failed.
+bool gtk_chart_save_png(GtkChart *chart, const char *filename,
+                        GtkChartSaveCallback callback, gpointer user_data)
+{
+  struct chart_png_job_t *job;
   int width = gtk_widget_get_width (GTK_WIDGET(chart));
   int height = gtk_widget_get_height (GTK_WIDGET(chart));
 
-  // Get to the PNG image file from paintable
-  GdkPaintable *paintable = gtk_widget_paintable_new (GTK_WIDGET(chart));
-  GtkSnapshot *snapshot = gtk_snapshot_new ();
-  gdk_paintable_snapshot (paintable, snapshot, width, height);
-  GskRenderNode *node = gtk_snapshot_free_to_node (snapshot);
-  GskRenderer *renderer = gsk_cairo_renderer_new ();
-  gsk_renderer_realize (renderer, NULL, NULL);
-  GdkTexture *texture = gsk_renderer_render_texture (renderer, node, NULL);
-  gdk_texture_save_to_png (texture, filename);
+  if ((width <= 0) || (height <= 0))
+    return false;
 
-  // Cleanup
-  g_object_unref(texture);
-  gsk_renderer_unrealize(renderer);
-  g_object_unref(renderer);
-  gsk_render_node_unref(node);
-  g_object_unref(paintable);
+  if (png_pool == NULL)
+  {
+    png_pool = g_thread_pool_new(chart_png_worker_function, NULL, 1, FALSE, NULL);
+    if (png_pool == NULL)
+      return false;
+  }
+
+  // Take copy of chart state so rendering does not race with plotting
+  job = g_new0(struct chart_png_job_t, 1);
+  g_mutex_lock(&chart->density_mutex);
+  chart_density_image_update(chart);
+  chart_state_get(chart, &job->state);
+  if (chart->density_image != NULL)
+  {
+    cairo_surface_t *image = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, DENSITY_COLUMNS, DENSITY_ROWS);
+    cairo_t *cr = cairo_create(image);
+    cairo_set_source_surface(cr, chart->density_image, 0, 0);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    job->state.density_image = image;
+  }
+  g_mutex_unlock(&chart->density_mutex);
+  job->state.title = g_strdup(chart->title);
+  job->state.label = g_strdup(chart->label);
+  job->state.x_label = g_strdup(chart->x_label);
+  job->state.y_label = g_strdup(chart->y_label);
+  job->points = g_memdup2(chart->point_array->data,
+                          chart->point_array->len * sizeof(struct chart_point_t));
+  job->state.points = job->points;
+  job->filename = g_strdup(filename);
+  job->width = width;
+  job->height = height;
+  job->callback = callback;
+  job->user_data = user_data;
+
+  // Render and encode in background
+  if (!g_thread_pool_push(png_pool, job, NULL))
+  {
+    chart_png_job_free(job);
+    return false;
+  }
 
   return true;
 }
+
+// Wait for queued PNG exports to be written, called on shutdown
+void gtk_chart_save_png_drain(void)
+{
+  if (png_pool == NULL)
+    return;
+
+  g_thread_pool_free(png_pool, FALSE, TRUE);
+  png_pool = NULL;
+
+  if (png_surface != NULL)
+  {
+    cairo_surface_destroy(png_surface);
+    png_surface = NULL;
+  }
+}
@@ -44,9 +44,13 @@ typedef enum
   GTK_CHART_TYPE_SCATTER,
   GTK_CHART_TYPE_GAUGE_ANGULAR,
   GTK_CHART_TYPE_GAUGE_LINEAR,
-  GTK_CHART_TYPE_NUMBER
+  GTK_CHART_TYPE_NUMBER,
+  GTK_CHART_TYPE_DENSITY
 } GtkChartType;
 
+// Called with error set to NULL if file was written
+typedef void (*GtkChartSaveCallback) (const char *filename, const char *error, gpointer user_data);
+
 GtkWidget * gtk_chart_new (void);
 
 void gtk_chart_set_type(GtkChart *chart, GtkChartType type);
@@ -61,9 +65,15 @@ void gtk_chart_plot_point(GtkChart *chart, double x, double y);
 void gtk_chart_set_value(GtkChart *chart, double value);
 void gtk_chart_set_value_min(GtkChart *chart, double value);
 void gtk_chart_set_value_max(GtkChart *chart, double value);
+void gtk_chart_set_decay(GtkChart *chart, double decay);
+void gtk_chart_plot_waveform(GtkChart *chart, const double *samples, int count);
 bool gtk_chart_save_csv(GtkChart *chart, const char *filename);
-bool gtk_chart_save_png(GtkChart *chart, const char *filename);
+bool gtk_chart_save_png(GtkChart *chart, const char *filename,
+                        GtkChartSaveCallback callback, gpointer user_data);
+void gtk_chart_save_png_drain(void);
 void gtk_chart_set_user_data(GtkChart *chart, void *user_data);
 void * gtk_chart_get_user_data(GtkChart *chart);
+guint gtk_chart_get_point_count(GtkChart *chart);
+gsize gtk_chart_get_memory_size(GtkChart *chart);
 
 G_END_DECLS
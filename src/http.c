@@ -0,0 +1,511 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Minimal HTTP/1.1 client
+ *
+ * Only what is needed to fetch display images from instrument web servers is
+ * supported: GET requests, Content-Length, chunked and close delimited
+ * bodies. Connections are persistent so repeated captures reuse one TCP
+ * connection instead of paying for a new handshake (and, on small embedded
+ * web servers, a new worker) each time. A request on a reused connection
+ * which the server has meanwhile closed is retried once on a new connection.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "error.h"
+#include "misc.h"
+#include "http.h"
+
+#define HOST_LENGTH_MAX 256
+#define PATH_LENGTH_MAX 1024
+#define LINE_LENGTH_MAX 1024
+#define RX_BUFFER_SIZE 0x10000
+
+struct http_connection_t
+{
+    bool used;
+    bool busy;
+    char host[HOST_LENGTH_MAX];
+    int port;
+    int socket;
+    char *rx;
+    size_t rx_start;
+    size_t rx_end;
+};
+
+static struct http_connection_t connection[HTTP_CONNECTIONS_MAX];
+static pthread_mutex_t connection_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int url_parse(const char *url, char *host, int *port, char *path)
+{
+    const char *start, *end, *colon, *host_end;
+    size_t length;
+
+    if (strncasecmp(url, "http://", 7) != 0)
+    {
+        error_printf("Unsupported URL %s\n", url);
+        return -1;
+    }
+
+    start = url + 7;
+    end = strchr(start, '/');
+    if (end == NULL)
+        end = start + strlen(start);
+
+    // IPv6 literal host is enclosed in brackets, eg. http://[fe80::1]:8080/
+    if (*start == '[')
+    {
+        host_end = memchr(start, ']', end - start);
+        if ((host_end == NULL) || ((host_end + 1 != end) && (host_end[1] != ':')))
+        {
+            error_printf("Invalid URL host in %s\n", url);
+            return -1;
+        }
+        colon = (host_end + 1 != end) ? host_end + 1 : NULL;
+        start++;
+    }
+    else
+    {
+        colon = memchr(start, ':', end - start);
+        host_end = colon != NULL ? colon : end;
+    }
+
+    length = host_end - start;
+    if ((length == 0) || (length >= HOST_LENGTH_MAX))
+    {
+        error_printf("Invalid URL host in %s\n", url);
+        return -1;
+    }
+    memcpy(host, start, length);
+    host[length] = 0;
+
+    *port = 80;
+    if (colon != NULL)
+    {
+        *port = atoi(colon + 1);
+        if ((*port <= 0) || (*port > 65535))
+        {
+            error_printf("Invalid URL port in %s\n", url);
+            return -1;
+        }
+    }
+
+    if (*end == 0)
+        end = "/";
+    if (strlen(end) >= PATH_LENGTH_MAX)
+    {
+        error_printf("URL path too long\n");
+        return -1;
+    }
+    strcpy(path, end);
+
+    return 0;
+}
+
+static void connection_close(struct http_connection_t *c)
+{
+    if (c->socket >= 0)
+        close(c->socket);
+    c->socket = -1;
+    c->rx_start = c->rx_end = 0;
+}
+
+// Get idle connection to host, preferring one which is already open
+static struct http_connection_t *connection_acquire(const char *host, int port)
+{
+    struct http_connection_t *c = NULL;
+    int i;
+
+    pthread_mutex_lock(&connection_mutex);
+
+    for (i = 0; i < HTTP_CONNECTIONS_MAX; i++)
+    {
+        if (connection[i].used && !connection[i].busy && (connection[i].port == port) &&
+            (strcmp(connection[i].host, host) == 0))
+        {
+            c = &connection[i];
+            goto out;
+        }
+    }
+
+    // New slot, or else evict an idle connection to another host
+    for (i = 0; i < HTTP_CONNECTIONS_MAX; i++)
+    {
+        if (!connection[i].used)
+        {
+            c = &connection[i];
+            break;
+        }
+        if ((c == NULL) && !connection[i].busy)
+            c = &connection[i];
+    }
+    if (c == NULL)
+        goto out;
+
+    if (c->used)
+        connection_close(c);
+    else
+    {
+        c->rx = malloc(RX_BUFFER_SIZE);
+        if (c->rx == NULL)
+        {
+            c = NULL;
+            goto out;
+        }
+        c->socket = -1;
+        c->rx_start = c->rx_end = 0;
+        c->used = true;
+    }
+    strcpy(c->host, host);
+    c->port = port;
+
+out:
+    if (c != NULL)
+        c->busy = true;
+    pthread_mutex_unlock(&connection_mutex);
+
+    return c;
+}
+
+static void connection_release(struct http_connection_t *c, bool keep_alive)
+{
+    if (!keep_alive)
+        connection_close(c);
+
+    pthread_mutex_lock(&connection_mutex);
+    c->busy = false;
+    pthread_mutex_unlock(&connection_mutex);
+}
+
+// Receive more data into buffer, returns 0 on end of stream
+static int connection_fill(struct http_connection_t *c, int timeout)
+{
+    struct pollfd pfd;
+    ssize_t n;
+    int status;
+
+    if (c->rx_start == c->rx_end)
+        c->rx_start = c->rx_end = 0;
+    else if (c->rx_end == RX_BUFFER_SIZE)
+    {
+        memmove(c->rx, c->rx + c->rx_start, c->rx_end - c->rx_start);
+        c->rx_end -= c->rx_start;
+        c->rx_start = 0;
+    }
+
+    pfd.fd = c->socket;
+    pfd.events = POLLIN;
+    do
+    {
+        status = poll(&pfd, 1, timeout);
+    } while ((status < 0) && (errno == EINTR));
+    if (status <= 0)
+        return -1;
+
+    do
+    {
+        n = recv(c->socket, c->rx + c->rx_end, RX_BUFFER_SIZE - c->rx_end, 0);
+    } while ((n < 0) && (errno == EINTR));
+    if (n < 0)
+        return -1;
+
+    c->rx_end += n;
+
+    return n;
+}
+
+// Read line without CRLF
+static int connection_read_line(struct http_connection_t *c, char *line, int timeout)
+{
+    char *newline;
+    size_t length;
+
+    for (;;)
+    {
+        newline = memchr(c->rx + c->rx_start, '\n', c->rx_end - c->rx_start);
+        if (newline != NULL)
+            break;
+        if ((c->rx_start == 0) && (c->rx_end == RX_BUFFER_SIZE))
+            return -1;
+        if (connection_fill(c, timeout) <= 0)
+            return -1;
+    }
+
+    length = newline - (c->rx + c->rx_start);
+    if ((length > 0) && (newline[-1] == '\r'))
+        length--;
+    if (length >= LINE_LENGTH_MAX)
+        length = LINE_LENGTH_MAX - 1;
+    memcpy(line, c->rx + c->rx_start, length);
+    line[length] = 0;
+    c->rx_start = newline - c->rx + 1;
+
+    return 0;
+}
+
+// Read exactly length bytes, or until end of stream if until_close is set
+static int connection_read(struct http_connection_t *c, char *data, size_t length,
+                           bool until_close, int timeout)
+{
+    size_t count = 0, available;
+    int n;
+
+    for (;;)
+    {
+        available = c->rx_end - c->rx_start;
+        if (available > length - count)
+            available = length - count;
+        memcpy(data + count, c->rx + c->rx_start, available);
+        c->rx_start += available;
+        count += available;
+
+        if (count == length)
+        {
+            // Body must not be larger than buffer
+            if (until_close && ((c->rx_end > c->rx_start) || (connection_fill(c, timeout) != 0)))
+                return -1;
+            break;
+        }
+
+        n = connection_fill(c, timeout);
+        if ((n == 0) && until_close)
+            break;
+        if (n <= 0)
+            return -1;
+    }
+
+    return count;
+}
+
+static int connection_send(struct http_connection_t *c, const char *data, size_t length)
+{
+    ssize_t n;
+
+    while (length > 0)
+    {
+        n = send(c->socket, data, length, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+static int read_chunked(struct http_connection_t *c, char *data, int length, int timeout)
+{
+    char line[LINE_LENGTH_MAX];
+    long chunk_size;
+    int count = 0;
+
+    for (;;)
+    {
+        if (connection_read_line(c, line, timeout) != 0)
+            return -1;
+        chunk_size = strtol(line, NULL, 16);
+        if (chunk_size < 0)
+            return -1;
+        if (chunk_size == 0)
+            break;
+        if (chunk_size > length - count)
+        {
+            error_printf("HTTP response too large\n");
+            return -1;
+        }
+        if (connection_read(c, data + count, chunk_size, false, timeout) < 0)
+            return -1;
+        count += chunk_size;
+
+        // Chunk data is terminated by CRLF
+        if (connection_read_line(c, line, timeout) != 0)
+            return -1;
+    }
+
+    // Skip trailer
+    do
+    {
+        if (connection_read_line(c, line, timeout) != 0)
+            return -1;
+    } while (line[0] != 0);
+
+    return count;
+}
+
+int http_get(const char *url, char *data, int length, int timeout)
+{
+    char host[HOST_LENGTH_MAX], path[PATH_LENGTH_MAX], line[LINE_LENGTH_MAX];
+    char request[PATH_LENGTH_MAX + HOST_LENGTH_MAX + 128];
+    struct http_connection_t *c;
+    long content_length = -1;
+    bool chunked = false, keep_alive = false, reused;
+    int port, request_length, status = 0, minor = 0, count = -1, attempt, i;
+
+    if (url_parse(url, host, &port, path) != 0)
+        return -1;
+
+    c = connection_acquire(host, port);
+    if (c == NULL)
+    {
+        error_printf("Too many HTTP connections\n");
+        return -1;
+    }
+
+    // IPv6 literal host is enclosed in brackets in Host header too
+    request_length = snprintf(request, sizeof(request),
+                              "GET %s HTTP/1.1\r\n"
+                              "Host: %s%s%s\r\n"
+                              "User-Agent: lxi-tools\r\n"
+                              "Connection: keep-alive\r\n"
+                              "\r\n", path,
+                              strchr(host, ':') != NULL ? "[" : "", host,
+                              strchr(host, ':') != NULL ? "]" : "");
+
+    for (attempt = 0; attempt < 2; attempt++)
+    {
+        reused = (c->socket >= 0);
+        if (!reused)
+        {
+            c->socket = socket_connect(host, port, timeout);
+            if (c->socket < 0)
+            {
+                error_printf("Failed to connect to %s:%d\n", host, port);
+                goto error;
+            }
+        }
+
+        if ((connection_send(c, request, request_length) == 0) &&
+            (connection_read_line(c, line, timeout) == 0))
+            break;
+
+        // Server may have closed an idle connection, retry on a fresh one
+        connection_close(c);
+        if (!reused)
+            break;
+    }
+    if (c->socket < 0)
+    {
+        error_printf("Failed to send HTTP request\n");
+        goto error;
+    }
+
+    for (;;)
+    {
+        if (sscanf(line, "HTTP/1.%d %d", &minor, &status) != 2)
+        {
+            error_printf("Invalid HTTP response\n");
+            goto error;
+        }
+        keep_alive = (minor >= 1);
+
+        // Headers
+        for (;;)
+        {
+            if (connection_read_line(c, line, timeout) != 0)
+                goto error;
+            if (line[0] == 0)
+                break;
+            for (i = 0; line[i] != 0; i++)
+                line[i] = tolower((unsigned char) line[i]);
+
+            if (strncmp(line, "content-length:", 15) == 0)
+                content_length = strtol(line + 15, NULL, 10);
+            else if ((strncmp(line, "transfer-encoding:", 18) == 0) && (strstr(line, "chunked") != NULL))
+                chunked = true;
+            else if (strncmp(line, "connection:", 11) == 0)
+            {
+                if (strstr(line, "close") != NULL)
+                    keep_alive = false;
+                else if (strstr(line, "keep-alive") != NULL)
+                    keep_alive = true;
+            }
+        }
+
+        // Skip interim responses (100 Continue)
+        if ((status / 100) != 1)
+            break;
+        if (connection_read_line(c, line, timeout) != 0)
+            goto error;
+    }
+
+    if (status != 200)
+    {
+        error_printf("HTTP request for %s failed with status %d\n", url, status);
+        keep_alive = false;
+        goto error;
+    }
+
+    if (chunked)
+        count = read_chunked(c, data, length, timeout);
+    else if (content_length >= 0)
+    {
+        if (content_length > length)
+        {
+            error_printf("HTTP response too large\n");
+            goto error;
+        }
+        count = connection_read(c, data, content_length, false, timeout);
+    }
+    else
+    {
+        // Body delimited by end of connection
+        keep_alive = false;
+        count = connection_read(c, data, length, true, timeout);
+    }
+
+    if (count < 0)
+    {
+        error_printf("Failed to receive HTTP response\n");
+        keep_alive = false;
+    }
+
+    connection_release(c, keep_alive);
+
+    return count;
+
+error:
+    connection_release(c, false);
+    return -1;
+}
@@ -32,6 +32,7 @@
 
 #include "config.h"
 #include "lxi_gui-application.h"
+#include "trace.h"
 
 int
 main (int   argc,
@@ -45,6 +46,9 @@ main (int   argc,
 	bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
 	textdomain (GETTEXT_PACKAGE);
 
+	/* Enable event tracing if requested via LXI_TRACE */
+	trace_init ();
+
 	/*
 	 * Create a new GtkApplication. The application manages our main loop,
 	 * application windows, integration with the window manager/compositor, and
@@ -52,6 +52,8 @@ struct _LxiGuiPrefs
   GtkSwitch *switch_scpi_show_message_timestamp;
   GtkSwitch *switch_scpi_show_message_ip;
   GtkSwitch *switch_scpi_show_message_type;
+  GtkWidget *spin_button_script_output_scrollback;
+  GtkWidget *entry_script_output_file;
 };
 
 G_DEFINE_TYPE (LxiGuiPrefs, lxi_gui_prefs, ADW_TYPE_PREFERENCES_WINDOW)
@@ -112,6 +114,12 @@ lxi_gui_prefs_init (LxiGuiPrefs *prefs)
   g_settings_bind (prefs->settings, "scpi-show-message-type",
                    prefs->switch_scpi_show_message_type, "active",
                    G_SETTINGS_BIND_DEFAULT);
+  g_settings_bind (prefs->settings, "script-output-scrollback",
+                   prefs->spin_button_script_output_scrollback, "value",
+                   G_SETTINGS_BIND_DEFAULT);
+  g_settings_bind (prefs->settings, "script-output-file",
+                   prefs->entry_script_output_file, "text",
+                   G_SETTINGS_BIND_DEFAULT);
 }
 
 static void
@@ -147,6 +155,8 @@ lxi_gui_prefs_class_init (LxiGuiPrefsClass *class)
   gtk_widget_class_bind_template_child (widget_class, LxiGuiPrefs, switch_scpi_show_message_timestamp);
   gtk_widget_class_bind_template_child (widget_class, LxiGuiPrefs, switch_scpi_show_message_ip);
   gtk_widget_class_bind_template_child (widget_class, LxiGuiPrefs, switch_scpi_show_message_type);
+  gtk_widget_class_bind_template_child (widget_class, LxiGuiPrefs, spin_button_script_output_scrollback);
+  gtk_widget_class_bind_template_child (widget_class, LxiGuiPrefs, entry_script_output_file);
 
   // Bind signals
   gtk_widget_class_bind_template_callback (widget_class, switch_activate_prefer_dark_theme);
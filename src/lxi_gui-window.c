@@ -34,8 +34,13 @@
 #include "lxi_gui-window.h"
 #include "screenshot.h"
 #include "benchmark.h"
+#include "connection.h"
 #include "misc.h"
 #include "lxilua.h"
+#include "ratelimit.h"
+#include "resolve.h"
+#include "trace.h"
+#include "waveform.h"
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
@@ -47,6 +52,25 @@
 
 static lxi_info_t info;
 
+#define GUI_SESSIONS_MAX 8
+#define GUI_SESSION_IDLE_TIMEOUT 30 // seconds
+#define GUI_SESSION_IDLE_CHECK 5 // seconds
+
+// Instrument session shared by all pages, used by one page at a time
+struct gui_session_t
+{
+  GMutex          mutex;
+  bool            used;
+  int             users;
+  char            *ip;
+  lxi_protocol_t  protocol;
+  int             port;
+  int             device;
+  gint64          last_used;
+  unsigned long   requests;
+  gint64          latency; // us, last SCPI page request
+};
+
 struct _LxiGuiWindow
 {
   GtkApplicationWindow  parent_instance;
@@ -61,6 +85,7 @@ struct _LxiGuiWindow
   GtkEntry            *entry_scpi;
   GtkTextView         *text_view_scpi;
   GtkToggleButton     *toggle_button_scpi_send;
+  GtkToggleButton     *toggle_button_scpi_lock;
   GtkPicture          *picture_screenshot;
   GtkToggleButton     *toggle_button_screenshot_grab;
   GtkButton           *button_screenshot_save;
@@ -68,6 +93,7 @@ struct _LxiGuiWindow
   GThread             *screenshot_grab_worker_thread;
   GThread             *search_worker_thread;
   GThread             *send_worker_thread;
+  GThread             *lock_worker_thread;
   GtkProgressBar      *progress_bar_benchmark;
   GThread             *benchmark_worker_thread;
   GtkToggleButton     *toggle_button_benchmark_start;
@@ -85,6 +111,7 @@ struct _LxiGuiWindow
   GtkToggleButton     *toggle_button_script_run;
   AdwFlap             *flap;
   AdwStatusPage       *status_page_instruments;
+  GtkLabel            *label_diagnostics;
   unsigned int        benchmark_requests_count;
   const char          *id;
   const char          *ip;
@@ -103,16 +130,337 @@ struct _LxiGuiWindow
   GMutex              mutex_gui_chart;
   GMutex              mutex_discover;
   GMutex              mutex_save_png;
+  bool                save_png_status;
   GMutex              mutex_save_csv;
   bool                no_instruments;
+  struct gui_session_t sessions[GUI_SESSIONS_MAX];
+  guint               session_idle_source;
+  guint               diagnostics_source;
+  GMutex              mutex_sessions;
+  struct ratelimit_lock_t scpi_lock;
+  char                *scpi_lock_ip;
 };
 
 G_DEFINE_TYPE (LxiGuiWindow, lxi_gui_window, GTK_TYPE_APPLICATION_WINDOW)
 
 static LxiGuiWindow *self_global;
 
+struct trace_idle_t
+{
+  GSourceFunc function;
+  const char *name;
+  gpointer data;
+  uint64_t queued;
+};
+
+static gboolean
+trace_idle_dispatch(gpointer user_data)
+{
+  struct trace_idle_t *idle = user_data;
+  uint64_t start = trace_begin();
+  gboolean status;
+
+  // Time spent waiting in main loop before callback ran
+  if (idle->queued != 0)
+  {
+    trace_end("idle-wait", "gui", idle->queued, idle->name);
+    idle->queued = 0;
+  }
+
+  status = idle->function(idle->data);
+  trace_end("idle", "gui", start, idle->name);
+
+  return status;
+}
+
+// Idle callbacks queued and not yet finished, shown on diagnostics page
+static gint gui_idle_pending = 0;
+
+static void
+trace_idle_done(gpointer user_data)
+{
+  g_free(user_data);
+  g_atomic_int_add(&gui_idle_pending, -1);
+}
+
+static void
+gui_idle_done(gpointer user_data)
+{
+  UNUSED(user_data);
+  g_atomic_int_add(&gui_idle_pending, -1);
+}
+
+static guint
+trace_idle_add(GSourceFunc function, const char *name, gpointer data)
+{
+  struct trace_idle_t *idle;
+
+  g_atomic_int_inc(&gui_idle_pending);
+
+  if (!trace_enabled)
+    return g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, function, data, gui_idle_done);
+
+  idle = g_new(struct trace_idle_t, 1);
+  idle->function = function;
+  idle->name = name;
+  idle->data = data;
+  idle->queued = trace_time();
+
+  return g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, trace_idle_dispatch, idle, trace_idle_done);
+}
+
+// Session borrowed by page running in current thread
+static GPrivate session_current;
+
+static void
+gui_session_disconnect(struct gui_session_t *s)
+{
+  if (s->device >= 0)
+    lxi_disconnect(s->device);
+  s->device = -1;
+}
+
+// Page action working on instrument selected when action was started
+struct gui_action_t
+{
+  LxiGuiWindow *self;
+  char *ip;
+};
+
+static struct gui_action_t *
+gui_action_new(LxiGuiWindow *self)
+{
+  struct gui_action_t *action = g_new0(struct gui_action_t, 1);
+
+  action->self = self;
+  action->ip = g_strdup(self->ip);
+
+  return action;
+}
+
+static void
+gui_action_free(struct gui_action_t *action)
+{
+  g_free(action->ip);
+  g_free(action);
+}
+
+// Borrow session to instrument, waits while another page uses it
+static struct gui_session_t *
+gui_session_begin(LxiGuiWindow *self, const char *ip, lxi_protocol_t protocol, int port)
+{
+  struct gui_session_t *s = NULL, *free_session = NULL;
+  int i;
+
+  if (ip == NULL)
+    return NULL;
+
+  if (protocol == VXI11)
+    port = 0;
+
+  g_mutex_lock(&self->mutex_sessions);
+  for (i = 0; i < GUI_SESSIONS_MAX; i++)
+  {
+    struct gui_session_t *candidate = &self->sessions[i];
+
+    if (candidate->used && (candidate->protocol == protocol) && (candidate->port == port) &&
+        (strcmp(candidate->ip, ip) == 0))
+    {
+      s = candidate;
+      break;
+    }
+    if ((free_session == NULL) && (!candidate->used || (candidate->users == 0)))
+      free_session = candidate;
+  }
+
+  if ((s == NULL) && (free_session != NULL))
+  {
+    // Reuse free slot or evict session nobody is using
+    s = free_session;
+    if (s->used)
+    {
+      gui_session_disconnect(s);
+      g_free(s->ip);
+    }
+    s->used = true;
+    s->ip = g_strdup(ip);
+    s->protocol = protocol;
+    s->port = port;
+    s->device = -1;
+    s->requests = 0;
+    s->latency = 0;
+  }
+
+  if (s != NULL)
+    s->users++;
+  g_mutex_unlock(&self->mutex_sessions);
+
+  if (s == NULL)
+    return NULL;
+
+  g_mutex_lock(&s->mutex);
+  g_private_set(&session_current, s);
+
+  return s;
+}
+
+// Return session, dropping connection if page ran into an error
+static void
+gui_session_end(LxiGuiWindow *self, struct gui_session_t *s, bool ok)
+{
+  if (s == NULL)
+    return;
+
+  g_private_set(&session_current, NULL);
+  if (!ok)
+    gui_session_disconnect(s);
+  s->last_used = g_get_monotonic_time();
+  g_mutex_unlock(&s->mutex);
+
+  g_mutex_lock(&self->mutex_sessions);
+  s->users--;
+  g_mutex_unlock(&self->mutex_sessions);
+}
+
+// Connection provider for screenshot plugins and benchmark
+static int
+gui_session_open(const char *address, int port, const char *name, int timeout, lxi_protocol_t protocol)
+{
+  struct gui_session_t *s = g_private_get(&session_current);
+
+  if ((s != NULL) && (name == NULL) && (protocol == s->protocol) &&
+      ((protocol == VXI11) || (port == s->port)) && (strcmp(address, s->ip) == 0))
+  {
+    if (s->device < 0)
+      s->device = resolve_connect(address, port, NULL, timeout, protocol);
+    return s->device;
+  }
+
+  return resolve_connect(address, port, name, timeout, protocol);
+}
+
+static int
+gui_session_close(int device)
+{
+  struct gui_session_t *s = g_private_get(&session_current);
+
+  // Borrowed session stays open
+  if ((s != NULL) && (device == s->device))
+    return LXI_OK;
+
+  return lxi_disconnect(device);
+}
+
+static const struct connection_provider_t gui_session_provider =
+{
+  .open = gui_session_open,
+  .close = gui_session_close,
+};
+
+// Disconnect detached sessions off the main thread
+static gpointer
+gui_session_close_worker(gpointer data)
+{
+  GArray *devices = data;
+  guint i;
+
+  for (i = 0; i < devices->len; i++)
+    lxi_disconnect(g_array_index(devices, int, i));
+  g_array_free(devices, true);
+
+  return NULL;
+}
+
+// Close sessions which are idle or no longer for the selected instrument
+static gboolean
+gui_session_idle_check(gpointer user_data)
+{
+  LxiGuiWindow *self = user_data;
+  gint64 now = g_get_monotonic_time();
+  GArray *devices = g_array_new(false, false, sizeof(int));
+  struct gui_session_t *s;
+  int i;
+
+  // Only detach under lock, disconnecting may block on unresponsive instrument
+  g_mutex_lock(&self->mutex_sessions);
+  for (i = 0; i < GUI_SESSIONS_MAX; i++)
+  {
+    s = &self->sessions[i];
+    if (!s->used || (s->users > 0))
+      continue;
+
+    if ((now - s->last_used > GUI_SESSION_IDLE_TIMEOUT * G_USEC_PER_SEC) ||
+        (self->ip == NULL) || (strcmp(self->ip, s->ip) != 0))
+    {
+      if (s->device >= 0)
+        g_array_append_val(devices, s->device);
+      s->device = -1;
+      g_free(s->ip);
+      s->ip = NULL;
+      s->used = false;
+    }
+  }
+  g_mutex_unlock(&self->mutex_sessions);
+
+  if (devices->len > 0)
+    g_thread_unref(g_thread_new("session_close_worker", gui_session_close_worker, devices));
+  else
+    g_array_free(devices, true);
+
+  return G_SOURCE_CONTINUE;
+}
+
+// Close all sessions, waiting for pages still using them
+static void
+gui_sessions_close(LxiGuiWindow *self)
+{
+  struct gui_session_t *s;
+  int i;
+
+  if (self->session_idle_source != 0)
+  {
+    g_source_remove(self->session_idle_source);
+    self->session_idle_source = 0;
+  }
+
+  for (i = 0; i < GUI_SESSIONS_MAX; i++)
+  {
+    s = &self->sessions[i];
+
+    g_mutex_lock(&s->mutex);
+    g_mutex_lock(&self->mutex_sessions);
+    if (s->used)
+    {
+      gui_session_disconnect(s);
+      g_free(s->ip);
+      s->ip = NULL;
+      s->used = false;
+    }
+    g_mutex_unlock(&self->mutex_sessions);
+    g_mutex_unlock(&s->mutex);
+  }
+}
+
+// Release instrument lock taken via SCPI page
+static void
+scpi_unlock(LxiGuiWindow *self)
+{
+  ratelimit_unlock(&self->scpi_lock);
+  g_free(self->scpi_lock_ip);
+  self->scpi_lock_ip = NULL;
+}
+
 #define CHARTS_MAX 1024
 
+// Queue idle callback, traced by name when tracing is enabled
+#define gui_idle_add(function, data) trace_idle_add(function, #function, data)
+
+#if LUA_VERSION_NUM < 502
+#define lua_rawlen lua_objlen
+#endif
+#define BENCHMARK_WARMUP 10
+#define BENCHMARK_REPETITIONS 5
+
 struct chart_t
 {
   bool allocated;
@@ -129,6 +477,7 @@ struct chart_t
   double value;
   double value_min;
   double value_max;
+  double decay;
   int width;
   bool autoscale;
   bool no_csv;
@@ -167,7 +516,7 @@ show_error(LxiGuiWindow *self, const char *buffer)
   struct show_data_t *data = g_new0(struct show_data_t, 1);
   data->self = self;
   data->buffer = g_strdup(buffer);
-  g_idle_add(show_error_thread, data);
+  gui_idle_add(show_error_thread, data);
 }
 
 static gboolean
@@ -191,7 +540,7 @@ show_info(LxiGuiWindow *self, const char *buffer)
   struct show_data_t *data = g_new0(struct show_data_t, 1);
   data->self = self;
   data->buffer = g_strdup(buffer);
-  g_idle_add(show_info_thread, data);
+  gui_idle_add(show_info_thread, data);
 }
 
 static void
@@ -259,6 +608,13 @@ pressed_cb (GtkGestureClick *gesture,
     {
       // Save IP selected via GUI
       self->ip = gtk_label_get_text(GTK_LABEL(child));
+
+      // Lock only applies to instrument it was taken for
+      if ((self->scpi_lock.entry >= 0) && (strcmp(self->ip, self->scpi_lock_ip) != 0))
+      {
+        scpi_unlock(self);
+        gtk_toggle_button_set_active(self->toggle_button_scpi_lock, false);
+      }
     }
 
     child = find_child_by_name(GTK_WIDGET(row), "list-subtitle");
@@ -374,7 +730,7 @@ list_add_instrument (LxiGuiWindow *self, const char *ip, const char *id)
   gtk_box_append(GTK_BOX(list_box), list_text_box);
 
   // Add list box to instrument list
-  g_idle_add(gui_update_search_add_instrument_thread, list_box);
+  gui_idle_add(gui_update_search_add_instrument_thread, list_box);
 
   // Mark instrument list populated
   self->no_instruments = false;
@@ -481,6 +837,8 @@ search_worker_thread(gpointer data)
   unsigned int timeout = g_settings_get_uint(self->settings, "timeout-discover");
   bool use_mdns_discovery = g_settings_get_boolean(self->settings, "use-mdns-discovery");
 
+  trace_thread_name("search_worker");
+
   // Reset selected IP and ID
   self->ip = NULL;
   self->id = NULL;
@@ -491,7 +849,7 @@ search_worker_thread(gpointer data)
   else
     lxi_discover(&info, timeout, DISCOVER_VXI11);
 
-  g_idle_add(gui_update_search_finished_thread, self);
+  gui_idle_add(gui_update_search_finished_thread, self);
 
   return NULL;
 }
@@ -531,7 +889,7 @@ button_clicked_search(LxiGuiWindow *self, GtkToggleButton *button)
 {
   UNUSED(button);
 
-  g_idle_add(gui_update_search_start_thread, self);
+  gui_idle_add(gui_update_search_start_thread, self);
 }
 
 struct dispatch_data_t
@@ -570,7 +928,7 @@ text_view_add_buffer(GtkTextView *view, const char *buffer)
   struct dispatch_data_t *data = g_new0(struct dispatch_data_t, 1);
   data->text_view = view;
   data->buffer = g_strdup(buffer);
-  g_idle_add(text_view_add_buffer_thread, data);
+  gui_idle_add(text_view_add_buffer_thread, data);
 }
 
 static gboolean
@@ -602,7 +960,7 @@ text_view_add_buffer_in_dimgray(GtkTextView *view, const char *buffer)
   struct dispatch_data_t *data = g_new0(struct dispatch_data_t, 1);
   data->text_view = view;
   data->buffer = g_strdup_printf("<span foreground=\"dimgray\">%s</span>", buffer);
-  g_idle_add(text_view_add_markup_buffer_thread, data);
+  gui_idle_add(text_view_add_markup_buffer_thread, data);
 }
 
 static gboolean
@@ -621,7 +979,7 @@ text_view_clear_buffer_thread(gpointer data)
 static void
 text_view_clear_buffer(GtkTextView *view)
 {
-  g_idle_add(text_view_clear_buffer_thread, view);
+  gui_idle_add(text_view_clear_buffer_thread, view);
 }
 
 static void save_text_buffer_to_file(GFile *file, GtkTextBuffer *text_buffer)
@@ -788,18 +1146,27 @@ static void scpi_print(LxiGuiWindow *self,
 static gpointer
 send_worker_thread(gpointer data)
 {
-  LxiGuiWindow *self = data;
+  struct gui_action_t *action = data;
+  LxiGuiWindow *self = action->self;
+  const char *ip = action->ip;
+  struct ratelimit_t limit = { -1, -1 };
+  struct ratelimit_lock_t lock;
+  struct gui_session_t *session;
+  bool ok = false;
   int device = 0;
   const char *input_buffer;
   GString *tx_buffer;
   char rx_buffer[65536];
   int rx_bytes;
+  gint64 request_start, request_latency;
   unsigned int timeout = g_settings_get_uint(self->settings, "timeout-scpi");
   bool show_sent_scpi = g_settings_get_boolean(self->settings, "show-sent-scpi");
   unsigned int com_protocol = g_settings_get_uint(self->settings, "com-protocol");
   unsigned int raw_port = g_settings_get_uint(self->settings, "raw-port");
 
-  if (self->ip == NULL)
+  trace_thread_name("send_worker");
+
+  if (ip == NULL)
   {
     show_error(self, "No instrument selected");
     goto error_no_instrument;
@@ -815,14 +1182,16 @@ send_worker_thread(gpointer data)
   tx_buffer = g_string_new_len(input_buffer, strlen(input_buffer));
   strip_trailing_space(tx_buffer->str);
 
+  session = gui_session_begin(self, ip, com_protocol, raw_port);
+
   if (com_protocol == VXI11)
   {
-    device = lxi_connect(self->ip, 0, NULL, timeout, VXI11);
+    device = connection_open(ip, 0, NULL, timeout, VXI11);
   }
   if (com_protocol == RAW)
   {
     tx_buffer = g_string_append(tx_buffer, "\n");
-    device = lxi_connect(self->ip, raw_port, NULL, timeout, RAW);
+    device = connection_open(ip, raw_port, NULL, timeout, RAW);
   }
   if (device == LXI_ERROR)
   {
@@ -830,11 +1199,21 @@ send_worker_thread(gpointer data)
     goto error_connect;
   }
 
+  // Requests pass instrument lock taken via SCPI page
+  lock = self->scpi_lock;
+  if (ratelimit_acquire(ip, com_protocol == RAW ? raw_port : 0, com_protocol, timeout, &lock, &limit) != 0)
+  {
+    show_error(self, "Timeout waiting for instrument rate limit");
+    goto error_send;
+  }
+
+  request_start = g_get_monotonic_time();
   if (lxi_send(device, tx_buffer->str, tx_buffer->len, timeout) == LXI_ERROR)
   {
     show_error(self, "Error sending");
     goto error_send;
   }
+  request_latency = g_get_monotonic_time() - request_start;
 
   if (show_sent_scpi)
   {
@@ -852,7 +1231,7 @@ send_worker_thread(gpointer data)
       // Remove newline
       g_string_erase(tx_buffer, tx_buffer->len - 1, 1);
     }
-    scpi_print(self, tx_buffer->str, true, self->ip, timestamp);
+    scpi_print(self, tx_buffer->str, true, ip, timestamp);
 
     g_free(timestamp);
   }
@@ -866,6 +1245,8 @@ send_worker_thread(gpointer data)
       goto error_receive;
     }
 
+    request_latency = g_get_monotonic_time() - request_start;
+
     // Terminate received string/data
     rx_buffer[rx_bytes] = 0;
 
@@ -878,23 +1259,35 @@ send_worker_thread(gpointer data)
     g_date_time_unref(date_time);
 
     // Print received response to text view
-    scpi_print(self, rx_buffer, false, self->ip, timestamp);
+    scpi_print(self, rx_buffer, false, ip, timestamp);
     g_free(timestamp);
   }
 
   // Clear text in text input entry
   gtk_entry_buffer_delete_text(entry_buffer, 0, -1);
 
+  if (session != NULL)
+  {
+    session->latency = request_latency;
+    session->requests++;
+  }
+
+  ok = true;
+
 error_send:
 error_receive:
-  lxi_disconnect(device);
+  ratelimit_release(&limit);
+  connection_close(device);
 error_connect:
+  gui_session_end(self, session, ok);
   g_string_free(tx_buffer, true);
 error_no_instrument:
 error_no_input:
   // Restore send button state
   // Defer!
-  g_idle_add(gui_update_send_worker_finished_thread, self);
+  gui_idle_add(gui_update_send_worker_finished_thread, self);
+
+  gui_action_free(action);
 
   return NULL;
 }
@@ -920,7 +1313,7 @@ button_clicked_scpi_send(LxiGuiWindow *self, GtkButton *button)
   gtk_widget_set_sensitive(GTK_WIDGET(self->toggle_button_scpi_send), false);
 
   // Start thread which sends the SCPI message
-  self->send_worker_thread = g_thread_new("send_worker", send_worker_thread, (gpointer)self);
+  self->send_worker_thread = g_thread_new("send_worker", send_worker_thread, gui_action_new(self));
 }
 
 static void
@@ -929,13 +1322,66 @@ entry_scpi_enter_pressed (LxiGuiWindow *self, GtkEntry *entry)
   UNUSED(entry);
 
   // Start thread which sends the SCPI message
-  self->send_worker_thread = g_thread_new("send_worker", send_worker_thread, (gpointer)self);
+  self->send_worker_thread = g_thread_new("send_worker", send_worker_thread, gui_action_new(self));
 
   // Update send button state
   gtk_widget_set_sensitive(GTK_WIDGET(self->toggle_button_scpi_send), false);
   gtk_toggle_button_set_active(self->toggle_button_scpi_send, true);
 }
 
+static gboolean
+gui_update_lock_worker_finished_thread(gpointer data)
+{
+  LxiGuiWindow *self = data;
+
+  // Reflect whether lock was granted
+  if (self->scpi_lock.entry < 0)
+    scpi_unlock(self);
+  gtk_toggle_button_set_active(self->toggle_button_scpi_lock, self->scpi_lock.entry >= 0);
+  gtk_widget_set_sensitive(GTK_WIDGET(self->toggle_button_scpi_lock), true);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gpointer
+lock_worker_thread(gpointer data)
+{
+  LxiGuiWindow *self = data;
+  unsigned int timeout = g_settings_get_uint(self->settings, "timeout-scpi");
+
+  trace_thread_name("lock_worker");
+
+  // Wait in line behind other clients of instrument
+  if (ratelimit_lock(self->scpi_lock_ip, timeout, &self->scpi_lock) != 0)
+    show_error(self, "Timeout waiting for instrument lock");
+
+  gui_idle_add(gui_update_lock_worker_finished_thread, self);
+
+  return NULL;
+}
+
+static void
+toggle_button_clicked_scpi_lock(LxiGuiWindow *self, GtkToggleButton *button)
+{
+  if (!gtk_toggle_button_get_active(button))
+  {
+    scpi_unlock(self);
+    return;
+  }
+
+  if (self->ip == NULL)
+  {
+    show_error(self, "No instrument selected");
+    gtk_toggle_button_set_active(button, false);
+    return;
+  }
+
+  // Lock selected instrument for exclusive use until toggled off
+  self->scpi_lock_ip = g_strdup(self->ip);
+  gtk_widget_set_sensitive(GTK_WIDGET(button), false);
+  self->lock_worker_thread = g_thread_new("lock_worker", lock_worker_thread, (gpointer)self);
+}
+
 static void
 button_clicked_scpi(LxiGuiWindow *self, GtkButton *button)
 {
@@ -953,15 +1399,16 @@ button_clicked_scpi(LxiGuiWindow *self, GtkButton *button)
 }
 
 static bool
-grab_screenshot(LxiGuiWindow *self)
+grab_screenshot(LxiGuiWindow *self, const char *ip)
 {
   char *plugin_name = (char *) "";
   char *filename = (char *) "";
   unsigned int timeout = g_settings_get_uint(self->settings, "timeout-screenshot");
+  struct gui_session_t *session;
   int status;
 
   // Check for instrument
-  if (self->ip == NULL)
+  if (ip == NULL)
   {
     show_error(self, "No instrument selected");
     return 1;
@@ -975,8 +1422,10 @@ grab_screenshot(LxiGuiWindow *self)
     return 1;
   }
 
-  // Capture screenshot
-  status = screenshot((char *)self->ip, plugin_name, filename, timeout, false, self->image_buffer, &(self->image_size), self->image_format, self->image_filename);
+  // Capture screenshot (plugins borrow VXI-11 session)
+  session = gui_session_begin(self, ip, VXI11, 0);
+  status = screenshot((char *)ip, plugin_name, filename, timeout, false, self->image_buffer, &(self->image_size), self->image_format, self->image_filename);
+  gui_session_end(self, session, status == 0);
   if (status != 0)
   {
     show_error(self, "Failed to grab screenshot");
@@ -1036,9 +1485,12 @@ gui_update_grab_screenshot_finished_thread(gpointer user_data)
 static gpointer
 screenshot_grab_worker_thread(gpointer data)
 {
-  LxiGuiWindow *self = data;
+  struct gui_action_t *action = data;
+  LxiGuiWindow *self = action->self;
 
-  if (grab_screenshot(self) == 0)
+  trace_thread_name("screenshot_grab_worker");
+
+  if (grab_screenshot(self, action->ip) == 0)
   {
     self->screenshot_ready = true;
   }
@@ -1047,7 +1499,9 @@ screenshot_grab_worker_thread(gpointer data)
     self->screenshot_ready = false;
   }
 
-  g_idle_add(gui_update_grab_screenshot_finished_thread, self);
+  gui_idle_add(gui_update_grab_screenshot_finished_thread, self);
+
+  gui_action_free(action);
 
   return NULL;
 }
@@ -1068,7 +1522,7 @@ button_clicked_screenshot_grab(LxiGuiWindow *self, GtkButton *button)
   gtk_widget_set_sensitive(GTK_WIDGET(self->toggle_button_screenshot_grab), false);
 
   // Start worker thread that will perform the grab screenshot work
-  self->screenshot_grab_worker_thread = g_thread_new("screenshot_grab_worker", screenshot_grab_worker_thread, (gpointer) self);
+  self->screenshot_grab_worker_thread = g_thread_new("screenshot_grab_worker", screenshot_grab_worker_thread, gui_action_new(self));
 }
 
 static void
@@ -1155,7 +1609,7 @@ benchmark_progress_cb(unsigned int count)
   if ((++count % (unsigned int) fraction_count) == 0)
   {
     self_global->progress_bar_fraction = count / fraction_count / 20;
-    g_idle_add(gui_update_progress_bar_fraction_thread, self_global);
+    gui_idle_add(gui_update_progress_bar_fraction_thread, self_global);
   }
 }
 
@@ -1176,23 +1630,38 @@ gui_update_benchmark_finished_thread(gpointer user_data)
 static gpointer
 benchmark_worker_function(gpointer data)
 {
-  double result;
-  LxiGuiWindow *self = data;
+  double result = 0;
+  struct benchmark_stats_t stats;
+  struct gui_action_t *action = data;
+  LxiGuiWindow *self = action->self;
   unsigned int com_protocol = g_settings_get_uint(self->settings, "com-protocol");
   unsigned int raw_port = g_settings_get_uint(self->settings, "raw-port");
+  struct gui_session_t *session;
+  int status = 1;
 
+  trace_thread_name("benchmark_worker");
+
+  memset(&stats, 0, sizeof(stats));
+
+  session = gui_session_begin(self, action->ip, com_protocol, raw_port);
   if (com_protocol == VXI11)
   {
-    benchmark(self->ip, 0, 1000, VXI11, self->benchmark_requests_count, false, &result, benchmark_progress_cb);
+    status = benchmark(action->ip, 0, 1000, VXI11, false, self->benchmark_requests_count,
+                       BENCHMARK_WARMUP, BENCHMARK_REPETITIONS, 0, false, &result, &stats, benchmark_progress_cb);
   }
   if (com_protocol == RAW)
   {
-    benchmark(self->ip, raw_port, 1000, RAW, self->benchmark_requests_count, false, &result, benchmark_progress_cb);
+    status = benchmark(action->ip, raw_port, 1000, RAW, false, self->benchmark_requests_count,
+                       BENCHMARK_WARMUP, BENCHMARK_REPETITIONS, 0, false, &result, &stats, benchmark_progress_cb);
   }
+  gui_session_end(self, session, status == 0);
 
   // Show benchmark result
-  self->benchmark_result_text = g_strdup_printf("%.1f requests/s", result);
-  g_idle_add(gui_update_benchmark_finished_thread, self);
+  self->benchmark_result_text = g_strdup_printf("%.1f requests/s (95%% CI: %.1f - %.1f)",
+                                                result, stats.throughput_ci_low, stats.throughput_ci_high);
+  gui_idle_add(gui_update_benchmark_finished_thread, self);
+
+  gui_action_free(action);
 
   return NULL;
 }
@@ -1215,7 +1684,7 @@ button_clicked_benchmark_start (LxiGuiWindow *self, GtkToggleButton *button)
   UNUSED(button);
 
   // Reset
-  g_idle_add(gui_update_progress_bar_reset_thread, self);
+  gui_idle_add(gui_update_progress_bar_reset_thread, self);
   self->benchmark_requests_count = gtk_spin_button_get_value(self->spin_button_benchmark_requests);
 
   if (self->ip == NULL)
@@ -1226,7 +1695,7 @@ button_clicked_benchmark_start (LxiGuiWindow *self, GtkToggleButton *button)
   }
 
   gtk_widget_set_sensitive(GTK_WIDGET(button), false);
-  self->benchmark_worker_thread = g_thread_new("benchmark_worker", benchmark_worker_function, (gpointer) self);
+  self->benchmark_worker_thread = g_thread_new("benchmark_worker", benchmark_worker_function, gui_action_new(self));
 }
 
 static void
@@ -1509,16 +1978,150 @@ void initialize_script_engine(LxiGuiWindow *self)
   self->lua_stop_requested = false;
 }
 
+// Script output ring, filled by script worker and drained into view once per frame
+struct script_output_t
+{
+  GMutex    mutex;
+  gchar     **line;
+  guint     capacity;
+  guint     head;
+  guint     count;
+  guint64   dropped;
+  FILE      *tee;
+};
+
+static struct script_output_t script_output;
+
+static void
+script_output_clear(void)
+{
+  while (script_output.count > 0)
+  {
+    g_free(script_output.line[script_output.head]);
+    script_output.head = (script_output.head + 1) % script_output.capacity;
+    script_output.count--;
+  }
+  script_output.head = 0;
+  script_output.dropped = 0;
+}
+
+// Reset output of previous run, called from main thread before script starts
+static void
+script_output_begin(LxiGuiWindow *self)
+{
+  guint capacity = g_settings_get_uint(self->settings, "script-output-scrollback");
+  GtkTextBuffer *text_buffer = gtk_text_view_get_buffer(self->text_view_script_status);
+  GtkTextIter start, end;
+
+  g_mutex_lock(&script_output.mutex);
+  script_output_clear();
+  if (capacity != script_output.capacity)
+  {
+    g_free(script_output.line);
+    script_output.line = g_new0(gchar *, capacity);
+    script_output.capacity = capacity;
+  }
+  g_mutex_unlock(&script_output.mutex);
+
+  gtk_text_buffer_get_bounds(text_buffer, &start, &end);
+  gtk_text_buffer_delete(text_buffer, &start, &end);
+}
+
+static void
+script_output_append(const char *string)
+{
+  gchar *line = g_strconcat(string, "\n", NULL);
+
+  if (script_output.tee != NULL)
+    fputs(line, script_output.tee);
+
+  // Overwrite oldest line when view has not caught up
+  g_mutex_lock(&script_output.mutex);
+  if (script_output.count == script_output.capacity)
+  {
+    g_free(script_output.line[script_output.head]);
+    script_output.line[script_output.head] = line;
+    script_output.head = (script_output.head + 1) % script_output.capacity;
+    script_output.dropped++;
+  }
+  else
+  {
+    script_output.line[(script_output.head + script_output.count) % script_output.capacity] = line;
+    script_output.count++;
+  }
+  g_mutex_unlock(&script_output.mutex);
+}
+
+// Frame clock tick, append all buffered output with one insertion
+static gboolean
+script_output_flush(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer user_data)
+{
+  GtkTextView *view = GTK_TEXT_VIEW(widget);
+  GtkTextBuffer *text_buffer;
+  GtkTextIter iter, start;
+  GtkTextMark *end_mark;
+  GString *text;
+  guint capacity;
+  int lines;
+
+  UNUSED(frame_clock);
+  UNUSED(user_data);
+
+  g_mutex_lock(&script_output.mutex);
+  if ((script_output.count == 0) && (script_output.dropped == 0))
+  {
+    g_mutex_unlock(&script_output.mutex);
+    return G_SOURCE_CONTINUE;
+  }
+
+  text = g_string_new(NULL);
+  if (script_output.dropped > 0)
+    g_string_append_printf(text, "[%" G_GUINT64_FORMAT " lines not shown]\n", script_output.dropped);
+  while (script_output.count > 0)
+  {
+    g_string_append(text, script_output.line[script_output.head]);
+    g_free(script_output.line[script_output.head]);
+    script_output.head = (script_output.head + 1) % script_output.capacity;
+    script_output.count--;
+  }
+  script_output.dropped = 0;
+  capacity = script_output.capacity;
+  g_mutex_unlock(&script_output.mutex);
+
+  text_buffer = gtk_text_view_get_buffer(view);
+  gtk_text_buffer_get_end_iter(text_buffer, &iter);
+  gtk_text_buffer_insert(text_buffer, &iter, text->str, text->len);
+  g_string_free(text, true);
+
+  // Cap scrollback
+  lines = gtk_text_buffer_get_line_count(text_buffer);
+  if (lines > (int) capacity + 1)
+  {
+    gtk_text_buffer_get_start_iter(text_buffer, &start);
+    gtk_text_buffer_get_iter_at_line(text_buffer, &iter, lines - capacity - 1);
+    gtk_text_buffer_delete(text_buffer, &start, &iter);
+  }
+
+  // Scroll down
+  gtk_text_buffer_get_end_iter(text_buffer, &iter);
+  gtk_text_iter_backward_line(&iter);
+  end_mark = gtk_text_buffer_create_mark(text_buffer, NULL, &iter, FALSE);
+  gtk_text_view_scroll_mark_onscreen(view, end_mark);
+  gtk_text_buffer_delete_mark(text_buffer, end_mark);
+
+  return G_SOURCE_CONTINUE;
+}
+
 static void lua_print_error(LxiGuiWindow *self, const char *string)
 {
-  text_view_add_buffer(self->text_view_script_status, string);
-  text_view_add_buffer(self->text_view_script_status, "\n");
+  UNUSED(self);
+
+  script_output_append(string);
 }
 
 static void lua_print_string(const char *string)
 {
-  text_view_add_buffer(self_global->text_view_script_status, string);
-  text_view_add_buffer(self_global->text_view_script_status, "\n");
+  script_output_append(string);
 }
 
 static void
@@ -1534,30 +2137,36 @@ chart_destroyed_cb (GtkWidget *widget,
     if (gui_chart[handle].widget == widget)
     {
       gui_chart[handle].allocated = false;
+      gui_chart[handle].widget = NULL;
       break;
     }
   }
 }
 
+static void
+chart_save_image_done (const char *filename, const char *error, gpointer user_data)
+{
+  UNUSED(filename);
+  UNUSED(user_data);
+
+  if (error != NULL)
+    show_error(self_global, error);
+}
+
 static void
 on_chart_save_image_response (GtkDialog      *dialog,
                               int            response,
                               struct chart_t *chart)
 {
-  GError *error = NULL;
-  gboolean status = true;
-
   if (response == GTK_RESPONSE_ACCEPT)
   {
     GtkFileChooser *chooser = GTK_FILE_CHOOSER (dialog);
 
     g_autoptr(GFile) file = gtk_file_chooser_get_file (chooser);
+    g_autofree char *path = g_file_get_path(file);
 
-    status = gtk_chart_save_png(GTK_CHART(chart->widget), g_file_get_path(file));
-    if (status == false)
-    {
-      g_error ("Error: %s\n", error->message);
-    }
+    if (!gtk_chart_save_png(GTK_CHART(chart->widget), path, chart_save_image_done, NULL))
+      show_error(self_global, "Could not save chart image");
   }
 
   gtk_window_destroy (GTK_WINDOW (dialog));
@@ -1715,7 +2324,7 @@ lua_gui_chart_save_csv(lua_State* L)
     char *text = g_strdup_printf ("Saving %s\n", filename);
     text_view_add_buffer(self_global->text_view_script_status, text);
     g_free(text);
-    g_idle_add(gui_chart_save_csv_thread, &gui_chart[handle]);
+    gui_idle_add(gui_chart_save_csv_thread, &gui_chart[handle]);
 
     // Wait for save csv operation finished
     g_mutex_lock(&self_global->mutex_save_csv);
@@ -1724,26 +2333,43 @@ lua_gui_chart_save_csv(lua_State* L)
   return 0;
 }
 
+static void
+gui_chart_save_png_done(const char *filename, const char *error, gpointer user_data)
+{
+  UNUSED(filename);
+  UNUSED(user_data);
+
+  if (error != NULL)
+  {
+    char *text = g_strdup_printf ("Error: %s\n", error);
+    text_view_add_buffer(self_global->text_view_script_status, text);
+    g_free(text);
+  }
+  self_global->save_png_status = (error == NULL);
+
+  // Signal we are finished saving png file
+  g_mutex_unlock(&self_global->mutex_save_png);
+}
+
 static gboolean
 gui_chart_save_png_thread(gpointer user_data)
 {
   struct chart_t *chart = user_data;
 
-  gtk_chart_save_png(GTK_CHART(chart->widget), chart->filename_png);
+  if (!gtk_chart_save_png(GTK_CHART(chart->widget), chart->filename_png, gui_chart_save_png_done, NULL))
+    gui_chart_save_png_done(chart->filename_png, "Could not save chart image", NULL);
   g_free(chart->filename_png);
 
-  // Signal we are finished saving png file
-  g_mutex_unlock(&self_global->mutex_save_png);
-
   return G_SOURCE_REMOVE;
 }
 
-// lua: chart_save_png(handle)
+// lua: status = chart_save_png(handle, filename)
 static int
 lua_gui_chart_save_png(lua_State* L)
 {
   int handle = lua_tointeger(L, 1);
   const char *filename = lua_tostring(L, 2);
+  bool status = false;
 
   if (gui_chart[handle].allocated == true)
   {
@@ -1751,13 +2377,16 @@ lua_gui_chart_save_png(lua_State* L)
     char *text = g_strdup_printf ("Saving %s\n", filename);
     text_view_add_buffer(self_global->text_view_script_status, text);
     g_free(text);
-    g_idle_add(gui_chart_save_png_thread, &gui_chart[handle]);
+    gui_idle_add(gui_chart_save_png_thread, &gui_chart[handle]);
 
-    // Wait for save png operation finished
+    // Wait until png file is written
     g_mutex_lock(&self_global->mutex_save_png);
+    status = self_global->save_png_status;
   }
 
-  return 0;
+  lua_pushboolean(L, status);
+
+  return 1;
 }
 
 static gboolean
@@ -1778,7 +2407,7 @@ lua_gui_chart_close(lua_State* L)
 
   if (gui_chart[handle].allocated == true)
   {
-    g_idle_add(gui_chart_close_thread, gui_chart[handle].window);
+    gui_idle_add(gui_chart_close_thread, gui_chart[handle].window);
   }
 
   return 0;
@@ -1807,9 +2436,83 @@ lua_gui_chart_plot(lua_State* L)
 
   if (gui_chart[handle].allocated == true)
   {
-    g_idle_add(gui_chart_plot_thread, &gui_chart[handle]);
+    gui_idle_add(gui_chart_plot_thread, &gui_chart[handle]);
+  }
+
+  return 0;
+}
+
+struct chart_waveform_t
+{
+  int handle;
+  GtkWidget *widget;
+  double *samples;
+  int count;
+};
+
+static gboolean
+gui_chart_plot_waveform_thread(gpointer user_data)
+{
+  struct chart_waveform_t *waveform = user_data;
+  struct chart_t *chart = &gui_chart[waveform->handle];
+
+  // Chart may have been closed or reused while queued
+  if ((chart->allocated == true) && (chart->widget != NULL) && (chart->widget == waveform->widget))
+    gtk_chart_plot_waveform(GTK_CHART(chart->widget), waveform->samples, waveform->count);
+
+  g_free(waveform->samples);
+  g_free(waveform);
+
+  return G_SOURCE_REMOVE;
+}
+
+// lua: chart_plot_waveform(handle, samples)
+static int
+lua_gui_chart_plot_waveform(lua_State* L)
+{
+  int handle = lua_tointeger(L, 1);
+  double *samples = NULL;
+  int count = 0;
+
+  if ((handle < 0) || (handle >= CHARTS_MAX) || (gui_chart[handle].allocated == false))
+    return 0;
+
+  if (lua_istable(L, 2))
+  {
+    // Array of sample values
+    count = lua_rawlen(L, 2);
+    samples = g_new(double, count > 0 ? count : 1);
+    for (int i = 0; i < count; i++)
+    {
+      lua_rawgeti(L, 2, i + 1);
+      samples[i] = lua_tonumber(L, -1);
+      lua_pop(L, 1);
+    }
+  }
+  else if (lua_isstring(L, 2))
+  {
+    // IEEE 488.2 definite length block or ASCII sample values
+    size_t length;
+    const char *data = lua_tolstring(L, 2, &length);
+
+    // GLib allocator is the system allocator, so g_free() below applies
+    samples = waveform_parse(data, length, &count);
+  }
+
+  if (count <= 0)
+  {
+    g_free(samples);
+    return 0;
   }
 
+  // Hand samples over to main thread, widget may be destroyed at any time
+  struct chart_waveform_t *waveform = g_new0(struct chart_waveform_t, 1);
+  waveform->handle = handle;
+  waveform->widget = gui_chart[handle].widget;
+  waveform->samples = samples;
+  waveform->count = count;
+  gui_idle_add(gui_chart_plot_waveform_thread, waveform);
+
   return 0;
 }
 
@@ -1834,7 +2537,7 @@ lua_gui_chart_set_value(lua_State* L)
 
   if (gui_chart[handle].allocated == true)
   {
-    g_idle_add(gui_chart_set_value_thread, &gui_chart[handle]);
+    gui_idle_add(gui_chart_set_value_thread, &gui_chart[handle]);
   }
 
   return 0;
@@ -1902,6 +2605,11 @@ gui_chart_new_thread(gpointer data)
       gtk_window_set_default_size(window, chart->width, chart->width);
       break;
 
+    case GTK_CHART_TYPE_DENSITY:
+      gtk_window_set_title(window, "Density Chart");
+      gtk_window_set_default_size(window, chart->width, chart->width/2);
+      break;
+
     default: // Do nothing
       break;
   }
@@ -1938,6 +2646,16 @@ gui_chart_new_thread(gpointer data)
       gtk_chart_set_value_max(GTK_CHART(widget), chart->value_max);
       break;
 
+    case GTK_CHART_TYPE_DENSITY:
+      gtk_chart_set_x_label(GTK_CHART(widget), chart->x_label);
+      g_free(chart->x_label);
+      gtk_chart_set_y_label(GTK_CHART(widget), chart->y_label);
+      g_free(chart->y_label);
+      gtk_chart_set_x_max(GTK_CHART(widget), chart->x_max);
+      gtk_chart_set_y_max(GTK_CHART(widget), chart->y_max);
+      gtk_chart_set_decay(GTK_CHART(widget), chart->decay);
+      break;
+
     default: // Do nothing
       break;
   }
@@ -2006,6 +2724,10 @@ lua_gui_chart_new(lua_State* L)
   {
     chart->type = GTK_CHART_TYPE_GAUGE_ANGULAR;
   }
+  else if (strcmp(type, "density") == 0)
+  {
+    chart->type = GTK_CHART_TYPE_DENSITY;
+  }
   else
   {
     chart->type = GTK_CHART_TYPE_UNKNOWN;
@@ -2045,12 +2767,23 @@ lua_gui_chart_new(lua_State* L)
       chart->no_csv = true;
       break;
 
+    case GTK_CHART_TYPE_DENSITY:
+      chart->title = g_strdup(lua_tostring(L, 2));
+      chart->x_label = g_strdup(lua_tostring(L, 3));
+      chart->y_label = g_strdup(lua_tostring(L, 4));
+      chart->x_max = lua_tonumber(L, 5);
+      chart->y_max = lua_tonumber(L, 6);
+      chart->width = lua_tointeger(L, 7);
+      chart->decay = lua_tonumber(L, 8);
+      chart->no_csv = true;
+      break;
+
     default:
       break;
   }
 
   // Create new chart window
-  g_idle_add(gui_chart_new_thread, chart);
+  gui_idle_add(gui_chart_new_thread, chart);
 
   // Wait for chart ready (sleeps here until unlocked)
   g_mutex_lock(&self_global->mutex_gui_chart);
@@ -2116,6 +2849,7 @@ static const struct luaL_Reg gui_lib [] =
 {
   {"chart_new", lua_gui_chart_new},
   {"chart_plot", lua_gui_chart_plot},
+  {"chart_plot_waveform", lua_gui_chart_plot_waveform},
   {"chart_set_value", lua_gui_chart_set_value},
   {"chart_close", lua_gui_chart_close},
   {"chart_save_csv", lua_gui_chart_save_csv},
@@ -2136,6 +2870,11 @@ static void lua_line_hook(lua_State *L, lua_Debug *ar)
       luaL_error(L, "Stopped by user");
     }
   }
+  else
+  {
+    // Call and return events are only enabled when tracing
+    lua_trace_hook(L, ar);
+  }
 }
 
 extern int lua_register_gui(lua_State *L)
@@ -2146,7 +2885,7 @@ extern int lua_register_gui(lua_State *L)
   lua_pop(L, 1);
 
   // Install line hook to manage run/stop execution
-  lua_sethook(L, &lua_line_hook, LUA_MASKLINE, 0);
+  lua_sethook(L, &lua_line_hook, LUA_MASKLINE | (trace_enabled ? LUA_MASKCALL | LUA_MASKRET : 0), 0);
 
   return 0;
 }
@@ -2185,9 +2924,21 @@ script_run_worker_function(gpointer data)
   char *chunkname = NULL;
   char *filename;
 
+  trace_thread_name("script_worker");
+
   // Reset lua control state
   self->lua_stop_requested = false;
 
+  // Optionally tee script output to file
+  gchar *output_file = g_settings_get_string(self->settings, "script-output-file");
+  if (strlen(output_file) > 0)
+  {
+    script_output.tee = fopen(output_file, "a");
+    if (script_output.tee == NULL)
+      show_error(self, "Failed to open script output file");
+  }
+  g_free(output_file);
+
   // Initialize new Lua session
   lua_State *L = luaL_newstate();
 
@@ -2215,6 +2966,14 @@ script_run_worker_function(gpointer data)
   {
     filename = g_file_get_path(self->script_file);
     chunkname = g_path_get_basename(filename);
+
+    // Allow require() of native C modules located next to script file
+    char *dirname = g_path_get_dirname(filename);
+    char *module_path = g_build_filename(dirname, "?.so", NULL);
+    lua_add_module_path(L, module_path);
+    g_free(module_path);
+    g_free(dirname);
+
     g_free(filename);
   }
   else
@@ -2223,20 +2982,29 @@ script_run_worker_function(gpointer data)
   }
 
   // Let lua load buffer and do error checking before running
+  uint64_t trace_start = trace_begin();
   error = luaL_loadbuffer(L, code_buffer, strlen(code_buffer), chunkname) ||
     lua_pcall(L, 0, 0, 0);
+  trace_end("script", "lua", trace_start, chunkname);
   if (error)
   {
     lua_print_error(self, lua_tostring(L, -1));
     lua_pop(L, 1);  /* pop error message from the stack */
   }
 
-  // Cleanup
+  // Cleanup, closing state also releases instrument links, locks and results
+  // databases left by script
   g_free(chunkname);
   lua_close(L);
 
+  if (script_output.tee != NULL)
+  {
+    fclose(script_output.tee);
+    script_output.tee = NULL;
+  }
+
   // Restore script run button
-  g_idle_add(gui_update_script_run_worker_function_finished_thread, self);
+  gui_idle_add(gui_update_script_run_worker_function_finished_thread, self);
 
   return NULL;
 }
@@ -2249,7 +3017,7 @@ toggle_button_clicked_script_run (LxiGuiWindow *self, GtkButton *button)
   // Only allow to run once until execution is done
   gtk_widget_set_sensitive(GTK_WIDGET(self->toggle_button_script_run), false);
 
-  text_view_clear_buffer(self->text_view_script_status);
+  script_output_begin(self);
 
   // Start thread which starts interpreting the Lua script
   self->script_run_worker_thread = g_thread_new("script_worker", script_run_worker_function, (gpointer) self);
@@ -2275,6 +3043,114 @@ info_bar_clicked (LxiGuiWindow *self, GtkInfoBar *infobar)
   gtk_widget_hide(GTK_WIDGET(self_global->info_bar));
 }
 
+static void
+diagnostics_text_view(GString *text, const char *name, GtkTextView *view)
+{
+  GtkTextBuffer *buffer = gtk_text_view_get_buffer(view);
+
+  g_string_append_printf(text, "  %-20s %d lines, %d characters\n", name,
+                         gtk_text_buffer_get_line_count(buffer),
+                         gtk_text_buffer_get_char_count(buffer));
+}
+
+static void
+diagnostics_lua_session(const struct lua_session_info_t *info, void *data)
+{
+  GString *text = data;
+
+  g_string_append_printf(text, "  %-20s %-10s %d links, %lu requests, latency %.3f ms (avg %.3f ms)\n",
+                         info->address, info->name, info->links, info->requests,
+                         info->latency_last * 1000, info->latency_avg * 1000);
+}
+
+// Refresh diagnostics page, only while it is shown
+static gboolean
+gui_diagnostics_update(gpointer user_data)
+{
+  LxiGuiWindow *self = user_data;
+  gint64 now = g_get_monotonic_time();
+  char *status = NULL;
+  char **lines;
+  GString *text;
+  int i, count = 0;
+  gsize memory = 0, size;
+
+  if (!gtk_widget_get_mapped(GTK_WIDGET(self->label_diagnostics)))
+    return G_SOURCE_CONTINUE;
+
+  text = g_string_new("Process\n");
+
+  // Resident memory and thread count of process
+  if (g_file_get_contents("/proc/self/status", &status, NULL, NULL))
+  {
+    lines = g_strsplit(status, "\n", -1);
+    for (i = 0; lines[i] != NULL; i++)
+    {
+      if (g_str_has_prefix(lines[i], "VmRSS:"))
+        g_string_append_printf(text, "  %-20s %s\n", "Resident memory", g_strstrip(lines[i] + 6));
+      if (g_str_has_prefix(lines[i], "Threads:"))
+        g_string_append_printf(text, "  %-20s %s\n", "Threads", g_strstrip(lines[i] + 8));
+    }
+    g_strfreev(lines);
+    g_free(status);
+  }
+  g_string_append_printf(text, "  %-20s %d\n", "Pending idle sources", g_atomic_int_get(&gui_idle_pending));
+
+  g_string_append(text, "\nBuffers\n");
+  diagnostics_text_view(text, "SCPI scrollback", self->text_view_scpi);
+  diagnostics_text_view(text, "Script output", self->text_view_script_status);
+  if (self->pixbuf_screenshot != NULL)
+    g_string_append_printf(text, "  %-20s %dx%d, %zu bytes\n", "Screenshot",
+                           gdk_pixbuf_get_width(self->pixbuf_screenshot),
+                           gdk_pixbuf_get_height(self->pixbuf_screenshot),
+                           gdk_pixbuf_get_byte_length(self->pixbuf_screenshot));
+
+  g_string_append(text, "\nCharts\n");
+  for (i = 0; i < CHARTS_MAX; i++)
+  {
+    struct chart_t *chart = &gui_chart[i];
+    GtkChart *widget;
+
+    if (!chart->allocated || (chart->widget == NULL))
+      continue;
+
+    widget = GTK_CHART(chart->widget);
+    size = gtk_chart_get_memory_size(widget);
+    memory += size;
+    count++;
+    g_string_append_printf(text, "  %-20.20s %u points, %zu bytes\n",
+                           chart->title ? chart->title : "",
+                           gtk_chart_get_point_count(widget), size);
+  }
+  g_string_append_printf(text, "  %-20s %d charts, %zu bytes\n", "Total", count, memory);
+
+  g_string_append(text, "\nInstrument sessions\n");
+  g_mutex_lock(&self->mutex_sessions);
+  for (i = 0; i < GUI_SESSIONS_MAX; i++)
+  {
+    struct gui_session_t *s = &self->sessions[i];
+
+    if (!s->used)
+      continue;
+
+    g_string_append_printf(text, "  %-20s %-5s %s, %s, idle %" G_GINT64_FORMAT " s, %lu requests, latency %.3f ms\n",
+                           s->ip, (s->protocol == RAW) ? "RAW" : "VXI11",
+                           (s->device >= 0) ? "connected" : "disconnected",
+                           (s->users > 0) ? "in use" : "free",
+                           (s->users > 0) ? 0 : (now - s->last_used) / G_USEC_PER_SEC,
+                           s->requests, s->latency / 1000.0);
+  }
+  g_mutex_unlock(&self->mutex_sessions);
+
+  g_string_append(text, "\nScript sessions\n");
+  lua_sessions_foreach(diagnostics_lua_session, text);
+
+  gtk_label_set_text(self->label_diagnostics, text->str);
+  g_string_free(text, true);
+
+  return G_SOURCE_CONTINUE;
+}
+
 static void
 lxi_gui_window_dispose (GObject *object)
 {
@@ -2282,6 +3158,17 @@ lxi_gui_window_dispose (GObject *object)
 
   g_object_unref (window->settings);
 
+  if (window->diagnostics_source != 0)
+  {
+    g_source_remove(window->diagnostics_source);
+    window->diagnostics_source = 0;
+  }
+
+  // Finish writing queued chart images
+  gtk_chart_save_png_drain();
+
+  gui_sessions_close(window);
+
   // Remove list view port as parent to list popover menu
   gtk_widget_unparent(GTK_WIDGET(window->list_widget_popover_menu));
 
@@ -2337,6 +3224,7 @@ lxi_gui_window_class_init (LxiGuiWindowClass *class)
   gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, entry_scpi);
   gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, text_view_scpi);
   gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, toggle_button_scpi_send);
+  gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, toggle_button_scpi_lock);
   gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, picture_screenshot);
   gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, toggle_button_screenshot_grab);
   gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, button_screenshot_save);
@@ -2354,6 +3242,7 @@ lxi_gui_window_class_init (LxiGuiWindowClass *class)
   gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, toggle_button_script_run);
   gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, flap);
   gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, status_page_instruments);
+  gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, label_diagnostics);
 
   // Bind signal callbacks
   gtk_widget_class_bind_template_callback (widget_class, button_clicked_search);
@@ -2362,6 +3251,7 @@ lxi_gui_window_class_init (LxiGuiWindowClass *class)
   gtk_widget_class_bind_template_callback (widget_class, button_clicked_scpi);
   gtk_widget_class_bind_template_callback (widget_class, button_clicked_scpi_clear);
   gtk_widget_class_bind_template_callback (widget_class, button_clicked_scpi_send);
+  gtk_widget_class_bind_template_callback (widget_class, toggle_button_clicked_scpi_lock);
   gtk_widget_class_bind_template_callback (widget_class, button_clicked_screenshot_grab);
   gtk_widget_class_bind_template_callback (widget_class, button_clicked_screenshot_save);
   gtk_widget_class_bind_template_callback (widget_class, button_clicked_benchmark_start);
@@ -2501,6 +3391,21 @@ lxi_gui_window_init (LxiGuiWindow *self)
 
   self->ip = NULL;
   self->id = NULL;
+  self->scpi_lock.entry = -1;
+
+  // Share instrument sessions between pages
+  g_mutex_init(&self->mutex_sessions);
+  for (int i = 0; i < GUI_SESSIONS_MAX; i++)
+    g_mutex_init(&self->sessions[i].mutex);
+  connection_set_provider(&gui_session_provider);
+  self->session_idle_source = g_timeout_add_seconds(GUI_SESSION_IDLE_CHECK, gui_session_idle_check, self);
+
+  // Refresh diagnostics page once per second while shown
+  self->diagnostics_source = g_timeout_add_seconds(1, gui_diagnostics_update, self);
+
+  // Drain script output into its view once per frame
+  g_mutex_init(&script_output.mutex);
+  gtk_widget_add_tick_callback(GTK_WIDGET(self->text_view_script_status), script_output_flush, self, NULL);
 
   // Register LXI screenshot plugins
   screenshot_register_plugins();
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Native C modules for lxi-tools Lua scripts
+ *
+ * A module is a shared library loaded with require() which exports the usual
+ * luaopen_<name>() entry point. From there it fetches the lxi-tools module API
+ * and operates on the device handles returned by the connect() Lua function:
+ *
+ *   int luaopen_fastloop(lua_State *L)
+ *   {
+ *       api = lxi_module_api(L);
+ *       if (api == NULL)
+ *           return luaL_error(L, "Incompatible lxi-tools module API");
+ *       ...
+ *   }
+ *
+ * Requests made through the API share link, gateway scheduling and latency
+ * statistics with the scpi() Lua function.
+ *
+ * Unlike scpi(), data is sent as is. Commands for RAW sessions must include
+ * the terminating newline (eg. "MEAS:VOLT?\n").
+ *
+ * Compatibility: Functions are only ever appended to struct lxi_module_api_t.
+ * A module built against an older version of this header keeps working as
+ * long as LXI_MODULE_ABI_VERSION is unchanged.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <lua.h>
+
+#define LXI_MODULE_ABI_VERSION 1
+#define LXI_MODULE_API_KEY "lxi-tools.module_api"
+
+struct lxi_module_session_t
+{
+    const char *address;
+    const char *name;
+    int port;
+    int timeout;
+    int protocol;
+};
+
+struct lxi_module_api_t
+{
+    int abi_version;
+    int size;
+
+    // Look up session information of device handle, returns 0 on success
+    int (*session)(int device, struct lxi_module_session_t *info);
+
+    // Send data to device, returns number of bytes sent or < 0 on error
+    int (*send)(int device, const char *data, int length, int timeout);
+
+    // Receive data from device, returns number of bytes received or < 0 on error
+    //
+    // send() and receive() each take their own gateway turn, so other threads
+    // may talk to the gateway in between. Use request() for queries.
+    int (*receive)(int device, char *buffer, int length, int timeout);
+
+    // Send command and, if response is not NULL, receive response in one
+    // gateway transaction. Returns response length or < 0 on error.
+    int (*request)(int device, const char *command, int command_length,
+                   char *response, int response_length, int timeout);
+
+    // Get response buffer owned by session, valid until device is disconnected
+    char *(*buffer)(int device, int *size);
+};
+
+// A timeout of 0 means the timeout of the session is used
+
+static inline const struct lxi_module_api_t *lxi_module_api(lua_State *L)
+{
+    const struct lxi_module_api_t *api;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LXI_MODULE_API_KEY);
+    api = (const struct lxi_module_api_t *) lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if ((api == NULL) || (api->abi_version != LXI_MODULE_ABI_VERSION) ||
+        (api->size < (int) sizeof(struct lxi_module_api_t)))
+        return NULL;
+
+    return api;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -28,6 +28,7 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdio.h>
 #include <unistd.h>
 #include <lua.h>
 #include <lauxlib.h>
@@ -35,22 +36,106 @@
 #include <string.h>
 #include <stdbool.h>
 #include <time.h>
+#include <math.h>
 #include <lxi.h>
 #include "error.h"
 #include "misc.h"
+#include "results.h"
+#include "lxi_module.h"
+#include "vxi11.h"
+#include "ratelimit.h"
+#include "resolve.h"
+#include "sweep.h"
+#include "waveform.h"
+#include "lxilua.h"
+#include "trace.h"
+#include "setcache.h"
+#include "config.h"
 #include <stdlib.h>
+#include <pthread.h>
+#include <ctype.h>
 
 #define RESPONSE_LENGTH_MAX 0x400000
 #define SESSIONS_MAX 1024
+#define GATEWAYS_MAX 256
+#define ADDRESS_LENGTH_MAX 256
+#define NAME_LENGTH_MAX 256
 #define CLOCKS_MAX 1024
+#define TRACE_LUA_DEPTH_MAX 256
+#define PREPARED_LENGTH_MAX 1024
+#define PREPARED_ARGUMENTS_MAX 32
+#define PREPARED_METATABLE "lxi.prepared"
+#define RESOLVE_HOSTS_MAX 256
+#define OWNER_KEY "lxi-tools.owner"
+
+// Lua 5.2 and older have no integer subtype, store integral numbers as integers
+#if LUA_VERSION_NUM < 503
+#define lua_isinteger(L, index) (lua_tonumber(L, index) == (lua_Number) lua_tointeger(L, index))
+#endif
+
+struct gateway_t
+{
+    bool allocated;
+    char address[ADDRESS_LENGTH_MAX];
+    int port;
+    int users;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned long ticket_next;
+    unsigned long ticket_serving;
+};
+
+static struct gateway_t gateway[GATEWAYS_MAX];
+static void (*request_callback)(const char *command, int length, double latency) = NULL;
+
+// Links and results databases held by one Lua state, released when the state is closed
+struct owner_t
+{
+    int links[SESSIONS_MAX];
+    bool results[RESULTS_HANDLES_MAX];
+};
+
+enum session_state_t
+{
+    SESSION_FREE,
+    SESSION_CONNECTING,
+    SESSION_READY,
+    SESSION_CLOSING
+};
 
 struct session_t
 {
+    enum session_state_t state;
+    unsigned long generation;
+    int users;
+    int device;
+    int links;
+    char address[ADDRESS_LENGTH_MAX];
+    char name[NAME_LENGTH_MAX];
+    int port;
     int timeout;
     int protocol;
+    bool native;
+    int gateway;
+    unsigned long requests;
+    double latency_last;
+    double latency_min;
+    double latency_max;
+    double latency_total;
+    unsigned long errors;
+    unsigned long long bytes_sent;
+    unsigned long long bytes_received;
+    unsigned long latency_histogram[LUA_LATENCY_BUCKETS];
+    char *buffer;
+    struct setcache_t *cache;
+    const struct owner_t *lock_owner;
+    struct ratelimit_lock_t lock;
 };
 
 static struct session_t session[SESSIONS_MAX];
+static pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t session_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long session_generation = 0;
 
 struct lua_clock_t
 {
@@ -60,10 +145,287 @@ struct lua_clock_t
 
 static struct lua_clock_t lua_clock[CLOCKS_MAX];
 
-// lua: device = lxi_connect(address, port, name, timeout, protocol)
+static struct lua_iteration_info_t iterations;
+static pthread_mutex_t iterations_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static double time_now(void)
+{
+    struct timespec time_spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &time_spec);
+
+    return time_spec.tv_sec + time_spec.tv_nsec * 0.000000001;
+}
+
+static int gateway_get(const char *address, int port)
+{
+    int i, free_index = -1;
+
+    // Sessions to the same address and port share gateway (eg. LAN/GPIB logical devices)
+    for (i=0; i<GATEWAYS_MAX; i++)
+    {
+        if (gateway[i].allocated)
+        {
+            if ((strcmp(gateway[i].address, address) == 0) && (gateway[i].port == port))
+            {
+                gateway[i].users++;
+                return i;
+            }
+        }
+        else if (free_index < 0)
+            free_index = i;
+    }
+
+    if (free_index < 0)
+        return -1;
+
+    gateway[free_index].allocated = true;
+    gateway[free_index].users = 1;
+    gateway[free_index].ticket_next = 0;
+    gateway[free_index].ticket_serving = 0;
+    strncpy(gateway[free_index].address, address, ADDRESS_LENGTH_MAX - 1);
+    gateway[free_index].port = port;
+    pthread_mutex_init(&gateway[free_index].mutex, NULL);
+    pthread_cond_init(&gateway[free_index].cond, NULL);
+
+    return free_index;
+}
+
+static void gateway_put(int index)
+{
+    if (--gateway[index].users == 0)
+    {
+        pthread_cond_destroy(&gateway[index].cond);
+        pthread_mutex_destroy(&gateway[index].mutex);
+        gateway[index].allocated = false;
+    }
+}
+
+// Serve requests to devices behind same gateway in order of arrival
+static void gateway_acquire(int index)
+{
+    struct gateway_t *g = &gateway[index];
+    unsigned long ticket;
+
+    pthread_mutex_lock(&g->mutex);
+    ticket = g->ticket_next++;
+    while (ticket != g->ticket_serving)
+        pthread_cond_wait(&g->cond, &g->mutex);
+    pthread_mutex_unlock(&g->mutex);
+}
+
+static void gateway_release(int index)
+{
+    struct gateway_t *g = &gateway[index];
+
+    pthread_mutex_lock(&g->mutex);
+    g->ticket_serving++;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->mutex);
+}
+
+// Get connected session, which is not closed until put back with session_put()
+static struct session_t *session_get(int handle)
+{
+    struct session_t *s = NULL;
+
+    pthread_mutex_lock(&session_mutex);
+    if ((handle >= 0) && (handle < SESSIONS_MAX) && (session[handle].state == SESSION_READY))
+    {
+        s = &session[handle];
+        s->users++;
+    }
+    pthread_mutex_unlock(&session_mutex);
+
+    if (s == NULL)
+        error_printf("Invalid device handle\n");
+
+    return s;
+}
+
+static void session_put(struct session_t *s)
+{
+    if (s == NULL)
+        return;
+
+    pthread_mutex_lock(&session_mutex);
+    if (--s->users == 0)
+        pthread_cond_broadcast(&session_cond);
+    pthread_mutex_unlock(&session_mutex);
+}
+
+static struct owner_t *owner_get(lua_State *L)
+{
+    struct owner_t *owner;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, OWNER_KEY);
+    owner = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    return owner;
+}
+
+static int latency_bucket(double latency)
+{
+    double us = latency * 1000000;
+    int bucket;
+
+    if (us <= 1)
+        return 0;
+
+    bucket = (int) (log2(us) * 4);
+    if (bucket >= LUA_LATENCY_BUCKETS)
+        bucket = LUA_LATENCY_BUCKETS - 1;
+
+    return bucket;
+}
+
+// Upper bound in seconds of latency below which percentile of requests fall
+double lua_latency_percentile(const unsigned long *histogram, double percentile)
+{
+    unsigned long total = 0, count = 0;
+    int i;
+
+    for (i = 0; i < LUA_LATENCY_BUCKETS; i++)
+        total += histogram[i];
+    if (total == 0)
+        return 0;
+
+    for (i = 0; i < LUA_LATENCY_BUCKETS; i++)
+    {
+        count += histogram[i];
+        if (count >= percentile / 100 * total)
+            break;
+    }
+    if (i == LUA_LATENCY_BUCKETS)
+        i--;
+
+    return pow(2, (i + 1) / 4.0) / 1000000;
+}
+
+// Send command and receive response (if question) as one gateway transaction
+static int session_request(struct session_t *s, const struct owner_t *owner,
+                           const char *command, int command_length,
+                           bool response_expected, char *response, int response_length,
+                           int timeout)
+{
+    struct ratelimit_lock_t lock = { -1, 0 };
+    struct ratelimit_t limit;
+    double time_start, latency;
+    uint64_t trace_start;
+    int length = -1;
+
+    // Only requests of the script holding the instrument lock pass it
+    pthread_mutex_lock(&session_mutex);
+    if ((owner != NULL) && (s->lock_owner == owner))
+        lock = s->lock;
+    pthread_mutex_unlock(&session_mutex);
+
+    // Wait for lock of other client before taking gateway the holder may need
+    trace_start = trace_begin();
+    if (ratelimit_lock_wait(s->address, s->port, s->protocol, timeout, &lock) != 0)
+        return -1;
+    gateway_acquire(s->gateway);
+
+    // Skip set command which would not change instrument state
+    if ((s->cache != NULL) && !response_expected &&
+        setcache_redundant(s->cache, command, command_length))
+    {
+        gateway_release(s->gateway);
+        return 0;
+    }
+
+    if (ratelimit_acquire(s->address, s->port, s->protocol, timeout, &lock, &limit) != 0)
+        goto out;
+    trace_end("gateway", "io", trace_start, s->address);
+    time_start = time_now();
+
+    if (s->native)
+    {
+        // Pipelined write and read in one transaction
+        trace_start = trace_begin();
+        length = vxi11_request(s->device, command, command_length,
+                               response_expected ? response : NULL, response_length, timeout);
+        trace_end_length("request", "io", trace_start, command, command_length);
+        if (length < 0)
+        {
+            error_printf("Failed to %s message\n", response_expected ? "request" : "send");
+            goto out;
+        }
+        if (!response_expected)
+            length = 0;
+        goto done;
+    }
+
+    trace_start = trace_begin();
+    length = lxi_send(s->device, command, command_length, timeout);
+    trace_end_length("send", "io", trace_start, command, command_length);
+    if (length < 0)
+    {
+        error_printf("Failed to send message\n");
+        goto out;
+    }
+
+    if (response_expected)
+    {
+        trace_start = trace_begin();
+        length = lxi_receive(s->device, response, response_length, timeout);
+        trace_end_length("receive", "io", trace_start, command, command_length);
+        if (length < 0)
+        {
+            error_printf("Failed to receive message\n");
+            goto out;
+        }
+    }
+    else
+        length = 0;
+
+done:
+    if (s->cache != NULL)
+        setcache_update(s->cache, command, command_length);
+
+    // Update latency statistics, read by other threads
+    latency = time_now() - time_start;
+    pthread_mutex_lock(&session_mutex);
+    s->latency_histogram[latency_bucket(latency)]++;
+    s->bytes_sent += command_length;
+    s->bytes_received += length;
+    if ((s->requests == 0) || (latency < s->latency_min))
+        s->latency_min = latency;
+    if (latency > s->latency_max)
+        s->latency_max = latency;
+    s->latency_last = latency;
+    s->latency_total += latency;
+    s->requests++;
+    pthread_mutex_unlock(&session_mutex);
+
+    if (request_callback != NULL)
+        request_callback(command, command_length, latency);
+
+out:
+    if (length < 0)
+    {
+        pthread_mutex_lock(&session_mutex);
+        s->errors++;
+        pthread_mutex_unlock(&session_mutex);
+
+        // Instrument state is unknown after failed request
+        if (s->cache != NULL)
+            setcache_flush(s->cache);
+    }
+
+    ratelimit_release(&limit);
+    gateway_release(s->gateway);
+    return length;
+}
+
+// lua: device = connect(address, port, name, timeout, protocol)
 static int connect(lua_State *L)
 {
-    int device;
+    struct owner_t *owner;
+    struct session_t *s;
+    char host[RESOLVE_ADDRESS_LENGTH_MAX];
+    int device, handle, free_handle;
     const char *address = lua_tostring(L, 1);
     int port = lua_tointeger(L, 2);
     const char *name = lua_tostring(L, 3);
@@ -75,6 +437,14 @@ static int connect(lua_State *L)
     const char *arg_name = "inst0";
     int arg_timeout = 2000;
     int arg_protocol = VXI11;
+    bool arg_native = false;
+
+    if (address == NULL)
+    {
+        error_printf("Missing address\n");
+        lua_pushinteger(L, LXI_ERROR);
+        return 1;
+    }
 
     // Handle port
     if (port != 0)
@@ -89,36 +459,303 @@ static int connect(lua_State *L)
        arg_timeout = timeout;
 
     // Handle protocol
-    if (strcmp(protocol, "VXI11") == 0)
+    if ((protocol != NULL) && (strcmp(protocol, "VXI11") == 0))
         arg_protocol = VXI11;
-    if (strcmp(protocol, "RAW") == 0)
+    if ((protocol != NULL) && (strcmp(protocol, "RAW") == 0))
         arg_protocol = RAW;
+    if ((protocol != NULL) && (strcmp(protocol, "VXI11-NATIVE") == 0))
+    {
+        arg_protocol = VXI11;
+        arg_native = true;
+    }
+
+    owner = owner_get(L);
+    if (owner == NULL)
+    {
+        lua_pushinteger(L, LXI_ERROR);
+        return 1;
+    }
 
-    // Connect to LXI instrument using VXI11
-    device = lxi_connect(address, arg_port, arg_name, arg_timeout, arg_protocol);
-    if (device == LXI_ERROR)
-        error_printf("Failed to connect\n");
+    pthread_mutex_lock(&session_mutex);
 
-    // Save session data for later reuse
-    session[device].timeout = arg_timeout;
-    session[device].protocol = arg_protocol;
+    // Reuse link if already connected to same (logical) device
+    for (;;)
+    {
+        s = NULL;
+        free_handle = -1;
+        for (handle=0; handle<SESSIONS_MAX; handle++)
+        {
+            struct session_t *c = &session[handle];
 
-    // Return status
-    lua_pushinteger(L, device);
+            if (c->state == SESSION_FREE)
+            {
+                if (free_handle < 0)
+                    free_handle = handle;
+            }
+            else if (((c->state == SESSION_CONNECTING) || (c->state == SESSION_READY)) &&
+                     (strcmp(c->address, address) == 0) &&
+                     (strcmp(c->name, arg_name) == 0) &&
+                     (c->port == arg_port) &&
+                     (c->protocol == arg_protocol) &&
+                     (c->native == arg_native))
+            {
+                s = c;
+                break;
+            }
+        }
+
+        // Wait for other thread connecting same device, then look again
+        if ((s == NULL) || (s->state == SESSION_READY))
+            break;
+        pthread_cond_wait(&session_cond, &session_mutex);
+    }
+
+    if (s != NULL)
+    {
+        s->links++;
+        owner->links[handle]++;
+        pthread_mutex_unlock(&session_mutex);
+        lua_pushinteger(L, handle);
+        return 1;
+    }
+
+    if (free_handle < 0)
+    {
+        pthread_mutex_unlock(&session_mutex);
+        error_printf("Too many connections\n");
+        lua_pushinteger(L, LXI_ERROR);
+        return 1;
+    }
+
+    // Reserve session, connecting is done without holding session lock
+    s = &session[free_handle];
+    memset(s, 0, sizeof(struct session_t));
+    s->state = SESSION_CONNECTING;
+    s->generation = ++session_generation;
+    strncpy(s->address, address, ADDRESS_LENGTH_MAX - 1);
+    strncpy(s->name, arg_name, NAME_LENGTH_MAX - 1);
+    s->port = arg_port;
+    s->timeout = arg_timeout;
+    s->protocol = arg_protocol;
+    s->native = arg_native;
+
+    pthread_mutex_unlock(&session_mutex);
+
+    // Devices behind the same host share gateway whatever name is used for it
+    if (resolve(address, host, sizeof(host), arg_timeout) != 0)
+        snprintf(host, sizeof(host), "%s", address);
+
+    // Connect to LXI instrument
+    uint64_t trace_start = trace_begin();
+    if (arg_native)
+        device = vxi11_connect(address, arg_name, arg_timeout);
+    else
+        device = resolve_connect(address, arg_port, arg_name, arg_timeout, arg_protocol);
+    trace_end("connect", "io", trace_start, address);
+
+    pthread_mutex_lock(&session_mutex);
+
+    // VXI-11 logical devices share core channel of host, RAW sockets are per port
+    if (device != LXI_ERROR)
+        s->gateway = gateway_get(host, arg_protocol == RAW ? arg_port : 0);
+
+    if ((device == LXI_ERROR) || (s->gateway < 0))
+    {
+        s->state = SESSION_FREE;
+        pthread_cond_broadcast(&session_cond);
+        pthread_mutex_unlock(&session_mutex);
+
+        if (device == LXI_ERROR)
+            error_printf("Failed to connect\n");
+        else
+        {
+            if (arg_native)
+                vxi11_disconnect(device);
+            else
+                lxi_disconnect(device);
+            error_printf("Too many gateways\n");
+        }
+        lua_pushinteger(L, LXI_ERROR);
+        return 1;
+    }
+
+    // Publish session
+    s->device = device;
+    s->links = 1;
+    s->state = SESSION_READY;
+    owner->links[free_handle]++;
+    pthread_cond_broadcast(&session_cond);
+    pthread_mutex_unlock(&session_mutex);
+
+    // Return device handle
+    lua_pushinteger(L, free_handle);
     return 1;
 }
 
-// lua: lxi_disconnect(device)
-static int disconnect(lua_State *L)
+// Release instrument lock if held by owner (or by anyone if owner is NULL)
+static int session_unlock(struct session_t *s, const struct owner_t *owner)
 {
+    struct ratelimit_lock_t lock;
     int status = 0;
-    int device = lua_tointeger(L, 1);
 
-    // Disconnect
-    status = lxi_disconnect(device);
+    pthread_mutex_lock(&session_mutex);
+    if ((s->lock_owner == NULL) || ((owner != NULL) && (s->lock_owner != owner)))
+    {
+        pthread_mutex_unlock(&session_mutex);
+        return 0;
+    }
+    lock = s->lock;
+    s->lock_owner = NULL;
+    pthread_mutex_unlock(&session_mutex);
+
+    if (s->native)
+    {
+        gateway_acquire(s->gateway);
+        status = vxi11_unlock(s->device);
+        gateway_release(s->gateway);
+    }
+
+    // Next client waiting in line gets lock
+    ratelimit_unlock(&lock);
+
+    return status;
+}
+
+// Drop links to session, instrument is disconnected when last link is dropped
+static int session_release(int handle, int links)
+{
+    struct session_t *s = &session[handle];
+    int status = 0;
+
+    pthread_mutex_lock(&session_mutex);
+    s->links -= links;
+    if (s->links > 0)
+    {
+        pthread_mutex_unlock(&session_mutex);
+        return 0;
+    }
+
+    // Stop new users and wait for requests in progress
+    s->state = SESSION_CLOSING;
+    while (s->users > 0)
+        pthread_cond_wait(&session_cond, &session_mutex);
+    pthread_mutex_unlock(&session_mutex);
+
+    session_unlock(s, NULL);
+    if (s->native)
+        status = vxi11_disconnect(s->device);
+    else
+        status = lxi_disconnect(s->device);
+    free(s->buffer);
+    s->buffer = NULL;
+    free(s->cache);
+    s->cache = NULL;
+
+    pthread_mutex_lock(&session_mutex);
+    gateway_put(s->gateway);
+    s->state = SESSION_FREE;
+    pthread_cond_broadcast(&session_cond);
+    pthread_mutex_unlock(&session_mutex);
+
+    return status;
+}
+
+// Release locks, links and results databases a script left behind when its Lua state is closed
+static int owner_gc(lua_State *L)
+{
+    struct owner_t *owner = lua_touserdata(L, 1);
+    struct session_t *s;
+    bool held;
+    int handle;
+
+    for (handle = 0; handle < SESSIONS_MAX; handle++)
+    {
+        s = &session[handle];
+
+        pthread_mutex_lock(&session_mutex);
+        held = (s->state == SESSION_READY) && (s->lock_owner == owner);
+        if (held)
+            s->users++;
+        pthread_mutex_unlock(&session_mutex);
+
+        if (held)
+        {
+            session_unlock(s, owner);
+            session_put(s);
+        }
+    }
+
+    for (handle = 0; handle < SESSIONS_MAX; handle++)
+    {
+        if (owner->links[handle] > 0)
+        {
+            session_release(handle, owner->links[handle]);
+            owner->links[handle] = 0;
+        }
+    }
+
+    // Flush results rows still queued
+    for (handle = 0; handle < RESULTS_HANDLES_MAX; handle++)
+    {
+        if (owner->results[handle])
+        {
+            results_close(handle);
+            owner->results[handle] = false;
+        }
+    }
+
+    return 0;
+}
+
+// lua: address, ... = resolve(host, ...)
+static int lua_resolve(lua_State *L)
+{
+    const char *hosts[RESOLVE_HOSTS_MAX];
+    char address[RESOLVE_ADDRESS_LENGTH_MAX];
+    int count = lua_gettop(L);
+    int i;
+
+    if (count > RESOLVE_HOSTS_MAX)
+        count = RESOLVE_HOSTS_MAX;
+    luaL_checkstack(L, count, NULL);
+
+    for (i = 0; i < count; i++)
+        hosts[i] = lua_tostring(L, i + 1);
+
+    // Look up all names in parallel, then collect results
+    resolve_prefetch(hosts, count);
+
+    for (i = 0; i < count; i++)
+    {
+        if ((hosts[i] != NULL) && (resolve(hosts[i], address, sizeof(address), 2000) == 0))
+            lua_pushstring(L, address);
+        else
+            lua_pushnil(L);
+    }
+
+    return count;
+}
+
+// lua: disconnect(device)
+static int disconnect(lua_State *L)
+{
+    int handle = lua_tointeger(L, 1);
+    struct owner_t *owner = owner_get(L);
+
+    // Only links of this script can be disconnected
+    if ((owner == NULL) || (handle < 0) || (handle >= SESSIONS_MAX) || (owner->links[handle] == 0))
+    {
+        error_printf("Invalid device handle\n");
+        lua_pushnumber(L, LXI_ERROR);
+        return 1;
+    }
+
+    // Lock of script goes with its last link to device
+    if (--owner->links[handle] == 0)
+        session_unlock(&session[handle], owner);
 
     // Return status
-    lua_pushnumber(L, status);
+    lua_pushnumber(L, session_release(handle, 1));
     return 1;
 }
 
@@ -131,14 +768,22 @@ static int scpi(lua_State *L)
     const char *command = lua_tostring(L, 2);
     int timeout = lua_tointeger(L, 3);
     char command_buffer[1000];
+    struct session_t *s = session_get(device);
+
+    if ((s == NULL) || (command == NULL))
+    {
+        session_put(s);
+        status = LXI_ERROR;
+        goto error;
+    }
 
     // Use session timeout if no timeout provided
     if (timeout == 0)
-        timeout = session[device].timeout;
+        timeout = s->timeout;
 
     strip_trailing_space((char *) command);
 
-    if (session[device].protocol == RAW)
+    if (s->protocol == RAW)
     {
         // Add newline to command string
         strcpy(command_buffer, command);
@@ -147,27 +792,16 @@ static int scpi(lua_State *L)
         command = command_buffer;
     }
 
-    // Send SCPI command
-    length = lxi_send(device, command, strlen(command), timeout);
+    // Send SCPI command and only expect response in case we are firing a question command
+    length = session_request(s, owner_get(L), command, strlen(command), question(command),
+                             response, RESPONSE_LENGTH_MAX, timeout);
+    session_put(s);
     if (length < 0)
     {
-        error_printf("Failed to send message\n");
         status = length;
         goto error;
     }
 
-    // Only expect response in case we are firing a question command
-    if (question(command))
-    {
-        length = lxi_receive(device, response, RESPONSE_LENGTH_MAX, timeout);
-        if (length < 0)
-        {
-            error_printf("Failed to receive message\n");
-            status = length;
-            goto error;
-        }
-    }
-
     if (length > 0)
     {
         // Strip newline
@@ -198,32 +832,29 @@ static int scpi_raw(lua_State *L)
     int device = lua_tointeger(L, 1);
     const char *command = lua_tostring(L, 2);
     int timeout = lua_tointeger(L, 3);
+    struct session_t *s = session_get(device);
+
+    if ((s == NULL) || (command == NULL))
+    {
+        session_put(s);
+        status = LXI_ERROR;
+        goto error;
+    }
 
     // Use session timeout if no timeout provided
     if (timeout == 0)
-        timeout = session[device].timeout;
+        timeout = s->timeout;
 
-    // Send SCPI command
-    length = lxi_send(device, command, strlen(command), timeout);
+    // Send SCPI command and only expect response in case we are firing a question command
+    length = session_request(s, owner_get(L), command, strlen(command), question(command),
+                             response, RESPONSE_LENGTH_MAX, timeout);
+    session_put(s);
     if (length < 0)
     {
-        error_printf("Failed to send message\n");
         status = length;
         goto error;
     }
 
-    // Only expect response in case we are firing a question command
-    if (question(command))
-    {
-        length = lxi_receive(device, response, RESPONSE_LENGTH_MAX, timeout);
-        if (length < 0)
-        {
-            error_printf("Failed to receive message\n");
-            status = length;
-            goto error;
-        }
-    }
-
     lua_pushlstring(L, response, length);
     free(response);
     return 1;
@@ -235,22 +866,512 @@ error:
     return 1;
 }
 
-
-// lua: sleep(seconds)
-static int sleep_(lua_State *L)
+// Format integer without going through printf
+static int format_integer(char *buffer, int size, long long value)
 {
-    long seconds = lua_tointeger(L, 1);
+    char digits[24];
+    unsigned long long magnitude = (value < 0) ? -(unsigned long long) value : (unsigned long long) value;
+    int count = 0, length = 0;
 
-    sleep(seconds);
+    do
+    {
+        digits[count++] = '0' + (magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
 
-    return 0;
+    if (count + (value < 0) > size)
+        return -1;
+
+    if (value < 0)
+        buffer[length++] = '-';
+    while (count > 0)
+        buffer[length++] = digits[--count];
+
+    return length;
 }
 
-// lua: msleep(miliseconds)
-static int msleep(lua_State *L)
+// Format number in shortest form (up to 17 digits) which reads back to same value
+static int format_number(char *buffer, int size, double value)
 {
-    long mseconds = lua_tointeger(L, 1);
-    long useconds = mseconds * 1000;
+    char number[32];
+    int precision, length;
+
+    // Most set points are integral
+    if (isfinite(value) && (fabs(value) < 1e15) && (value == (double) (long long) value))
+        return format_integer(buffer, size, (long long) value);
+
+    for (precision = 15; precision <= 17; precision++)
+    {
+        length = snprintf(number, sizeof(number), "%.*g", precision, value);
+        if ((precision == 17) || (strtod(number, NULL) == value))
+            break;
+    }
+
+    if (length > size)
+        return -1;
+    memcpy(buffer, number, length);
+
+    return length;
+}
+
+// Prepared command, template is split into literals around %g/%d/%s arguments
+struct prepared_t
+{
+    int device;
+    unsigned long generation;
+    int timeout;
+    bool response_expected;
+    int arguments;
+    char type[PREPARED_ARGUMENTS_MAX];
+    int literal_offset[PREPARED_ARGUMENTS_MAX + 1];
+    int literal_length[PREPARED_ARGUMENTS_MAX + 1];
+    char literals[PREPARED_LENGTH_MAX];
+    char command[PREPARED_LENGTH_MAX];
+    char *response;
+};
+
+// lua: prepared = scpi_prepare(device, template, timeout)
+static int scpi_prepare(lua_State *L)
+{
+    int device = lua_tointeger(L, 1);
+    const char *template = lua_tostring(L, 2);
+    int timeout = lua_tointeger(L, 3);
+    struct session_t *s = session_get(device);
+    struct prepared_t *p;
+    int i, length = 0, start = 0, protocol;
+    unsigned long generation;
+
+    if ((s == NULL) || (template == NULL))
+    {
+        session_put(s);
+        lua_pushnil(L);
+        return 1;
+    }
+    protocol = s->protocol;
+    generation = s->generation;
+    session_put(s);
+
+    p = lua_newuserdata(L, sizeof(struct prepared_t));
+    memset(p, 0, sizeof(struct prepared_t));
+    p->device = device;
+    p->generation = generation;
+    p->timeout = timeout;
+    p->response_expected = question(template);
+
+    for (i = 0; template[i] != 0; i++)
+    {
+        if (length >= PREPARED_LENGTH_MAX - 2)
+            goto error_length;
+
+        if (template[i] != '%')
+        {
+            p->literals[length++] = template[i];
+            continue;
+        }
+
+        i++;
+        if (template[i] == '%')
+        {
+            p->literals[length++] = '%';
+            continue;
+        }
+
+        if ((template[i] != 'g') && (template[i] != 'd') && (template[i] != 's'))
+        {
+            error_printf("Invalid template argument (use %%g, %%d or %%s)\n");
+            lua_pushnil(L);
+            return 1;
+        }
+
+        if (p->arguments == PREPARED_ARGUMENTS_MAX)
+            goto error_length;
+
+        // Close literal preceding argument
+        p->literal_offset[p->arguments] = start;
+        p->literal_length[p->arguments] = length - start;
+        p->type[p->arguments++] = template[i];
+        start = length;
+    }
+
+    // Terminate RAW commands once here instead of on each call
+    while ((length > start) && isspace((unsigned char) p->literals[length-1]))
+        length--;
+    if (protocol == RAW)
+        p->literals[length++] = '\n';
+    p->literal_offset[p->arguments] = start;
+    p->literal_length[p->arguments] = length - start;
+
+    luaL_newmetatable(L, PREPARED_METATABLE);
+    lua_setmetatable(L, -2);
+
+    return 1;
+
+error_length:
+    error_printf("Template too long\n");
+    lua_pushnil(L);
+    return 1;
+}
+
+// lua: response = prepared(...)
+static int prepared_call(lua_State *L)
+{
+    struct prepared_t *p = luaL_checkudata(L, 1, PREPARED_METATABLE);
+    struct session_t *s;
+    const char *string;
+    size_t string_length;
+    int i, n, length = 0, timeout;
+
+    // Build command from literals and arguments in place
+    for (i = 0; i <= p->arguments; i++)
+    {
+        n = p->literal_length[i];
+        if (length + n > PREPARED_LENGTH_MAX)
+            goto error_length;
+        memcpy(&p->command[length], &p->literals[p->literal_offset[i]], n);
+        length += n;
+
+        if (i == p->arguments)
+            break;
+
+        switch (p->type[i])
+        {
+            case 'g':
+                n = format_number(&p->command[length], PREPARED_LENGTH_MAX - length, luaL_checknumber(L, i + 2));
+                break;
+
+            case 'd':
+                n = format_integer(&p->command[length], PREPARED_LENGTH_MAX - length, luaL_checkinteger(L, i + 2));
+                break;
+
+            default:
+                string = luaL_checklstring(L, i + 2, &string_length);
+                n = string_length;
+                if (length + n <= PREPARED_LENGTH_MAX)
+                    memcpy(&p->command[length], string, n);
+                else
+                    n = -1;
+                break;
+        }
+        if (n < 0)
+            goto error_length;
+        length += n;
+    }
+
+    // Response buffer is allocated on first query and reused
+    if (p->response_expected && (p->response == NULL))
+    {
+        p->response = malloc(RESPONSE_LENGTH_MAX);
+        if (p->response == NULL)
+        {
+            lua_pushnumber(L, LXI_ERROR);
+            return 1;
+        }
+    }
+
+    // Arguments are checked, no Lua error can skip putting back session
+    s = session_get(p->device);
+    if (s == NULL)
+    {
+        lua_pushnumber(L, LXI_ERROR);
+        return 1;
+    }
+
+    // Handle may have been disconnected and reused for another instrument
+    if (s->generation != p->generation)
+    {
+        session_put(s);
+        error_printf("Device of prepared command is disconnected\n");
+        lua_pushnumber(L, LXI_ERROR);
+        return 1;
+    }
+
+    timeout = p->timeout ? p->timeout : s->timeout;
+
+    length = session_request(s, owner_get(L), p->command, length, p->response_expected,
+                             p->response, RESPONSE_LENGTH_MAX, timeout);
+    session_put(s);
+    if (length < 0)
+    {
+        lua_pushnumber(L, length);
+        return 1;
+    }
+
+    // Strip newline and carriage return
+    if ((length > 0) && (p->response[length-1] == '\n'))
+        length--;
+    if ((length > 0) && (p->response[length-1] == '\r'))
+        length--;
+
+    lua_pushlstring(L, p->response, length);
+    return 1;
+
+error_length:
+    error_printf("Prepared command too long\n");
+    lua_pushnumber(L, LXI_ERROR);
+    return 1;
+}
+
+static int prepared_gc(lua_State *L)
+{
+    struct prepared_t *p = luaL_checkudata(L, 1, PREPARED_METATABLE);
+
+    free(p->response);
+    p->response = NULL;
+
+    return 0;
+}
+
+// lua: stats = session_stats(device)
+static int session_stats(lua_State *L)
+{
+    int device = lua_tointeger(L, 1);
+    struct session_t *s = session_get(device);
+    struct vxi11_stats_t rpc_stats;
+
+    if (s == NULL)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    // Return table of per-device request latency statistics (seconds)
+    lua_newtable(L);
+    lua_pushinteger(L, s->requests);
+    lua_setfield(L, -2, "requests");
+    lua_pushnumber(L, s->latency_last);
+    lua_setfield(L, -2, "latency_last");
+    lua_pushnumber(L, s->latency_min);
+    lua_setfield(L, -2, "latency_min");
+    lua_pushnumber(L, s->latency_max);
+    lua_setfield(L, -2, "latency_max");
+    lua_pushnumber(L, s->requests ? s->latency_total / s->requests : 0);
+    lua_setfield(L, -2, "latency_avg");
+    lua_pushstring(L, s->address);
+    lua_setfield(L, -2, "address");
+    lua_pushstring(L, s->name);
+    lua_setfield(L, -2, "name");
+    if (s->cache != NULL)
+    {
+        lua_pushinteger(L, s->cache->hits);
+        lua_setfield(L, -2, "cache_hits");
+    }
+
+    // Per RPC timing of native VXI-11 client
+    if (s->native && (vxi11_stats(s->device, &rpc_stats) == 0))
+    {
+        lua_pushinteger(L, rpc_stats.rpcs);
+        lua_setfield(L, -2, "rpcs");
+        lua_pushnumber(L, rpc_stats.write_last);
+        lua_setfield(L, -2, "rpc_write_last");
+        lua_pushnumber(L, rpc_stats.read_last);
+        lua_setfield(L, -2, "rpc_read_last");
+        lua_pushnumber(L, rpc_stats.rpcs ? rpc_stats.rpc_total / rpc_stats.rpcs : 0);
+        lua_setfield(L, -2, "rpc_avg");
+        lua_pushinteger(L, rpc_stats.syscalls);
+        lua_setfield(L, -2, "syscalls");
+    }
+
+    session_put(s);
+    return 1;
+}
+
+// lua: session_cache(device, enable)
+static int session_cache(lua_State *L)
+{
+    int device = lua_tointeger(L, 1);
+    bool enable = lua_toboolean(L, 2);
+    struct session_t *s = session_get(device);
+    int status = 0;
+
+    if (s == NULL)
+    {
+        lua_pushnumber(L, LXI_ERROR);
+        return 1;
+    }
+
+    gateway_acquire(s->gateway);
+    if (enable && (s->cache == NULL))
+    {
+        s->cache = calloc(1, sizeof(struct setcache_t));
+        if (s->cache == NULL)
+            status = LXI_ERROR;
+    }
+    else if (!enable)
+    {
+        free(s->cache);
+        s->cache = NULL;
+    }
+    gateway_release(s->gateway);
+    session_put(s);
+
+    lua_pushnumber(L, status);
+    return 1;
+}
+
+// lua: session_flush(device)
+static int session_flush(lua_State *L)
+{
+    int device = lua_tointeger(L, 1);
+    struct session_t *s = session_get(device);
+
+    if (s == NULL)
+    {
+        lua_pushnumber(L, LXI_ERROR);
+        return 1;
+    }
+
+    gateway_acquire(s->gateway);
+    if (s->cache != NULL)
+        setcache_flush(s->cache);
+    gateway_release(s->gateway);
+    session_put(s);
+
+    lua_pushnumber(L, 0);
+    return 1;
+}
+
+// lua: status = lock(device, timeout)
+static int lock(lua_State *L)
+{
+    int device = lua_tointeger(L, 1);
+    int timeout = lua_tointeger(L, 2);
+    struct owner_t *owner = owner_get(L);
+    struct session_t *s = session_get(device);
+    struct ratelimit_lock_t lock;
+    double deadline, remaining;
+    int status = 0;
+    bool held;
+
+    if ((s == NULL) || (owner == NULL))
+    {
+        session_put(s);
+        lua_pushnumber(L, LXI_ERROR);
+        return 1;
+    }
+
+    // Lock is held per script, other scripts sharing the link wait in line below
+    pthread_mutex_lock(&session_mutex);
+    held = (s->lock_owner == owner);
+    pthread_mutex_unlock(&session_mutex);
+    if (held)
+    {
+        session_put(s);
+        lua_pushnumber(L, 0);
+        return 1;
+    }
+
+    // Use session timeout if no timeout provided
+    if (timeout == 0)
+        timeout = s->timeout;
+    deadline = time_now() + timeout / 1000.0;
+
+    // Wait in line behind other lxi-tools clients of instrument
+    if (ratelimit_lock(s->address, timeout, &lock) != 0)
+    {
+        session_put(s);
+        lua_pushnumber(L, LXI_ERROR);
+        return 1;
+    }
+
+    // Also lock out other VXI-11 clients of instrument
+    if (s->native)
+    {
+        remaining = deadline - time_now();
+        gateway_acquire(s->gateway);
+        status = vxi11_lock(s->device, remaining > 0 ? remaining * 1000 : 0);
+        gateway_release(s->gateway);
+        if (status != 0)
+        {
+            error_printf("Failed to lock %s\n", s->address);
+            ratelimit_unlock(&lock);
+            session_put(s);
+            lua_pushnumber(L, LXI_ERROR);
+            return 1;
+        }
+    }
+
+    pthread_mutex_lock(&session_mutex);
+    s->lock = lock;
+    s->lock_owner = owner;
+    pthread_mutex_unlock(&session_mutex);
+    session_put(s);
+
+    lua_pushnumber(L, 0);
+    return 1;
+}
+
+// lua: status = unlock(device)
+static int unlock(lua_State *L)
+{
+    int device = lua_tointeger(L, 1);
+    struct owner_t *owner = owner_get(L);
+    struct session_t *s = session_get(device);
+    int status;
+
+    if ((s == NULL) || (owner == NULL))
+    {
+        session_put(s);
+        lua_pushnumber(L, LXI_ERROR);
+        return 1;
+    }
+
+    // Only lock held by this script is released
+    status = session_unlock(s, owner);
+    session_put(s);
+    if (status != 0)
+    {
+        lua_pushnumber(L, LXI_ERROR);
+        return 1;
+    }
+
+    lua_pushnumber(L, 0);
+    return 1;
+}
+
+// lua: stats_iteration()
+static int stats_iteration(lua_State *L)
+{
+    double now = time_now();
+
+    UNUSED(L);
+
+    pthread_mutex_lock(&iterations_mutex);
+    if (iterations.count > 0)
+    {
+        if (iterations.interval == 0)
+            iterations.interval = now - iterations.last;
+        else
+            iterations.interval = 0.9 * iterations.interval + 0.1 * (now - iterations.last);
+    }
+    iterations.last = now;
+    iterations.count++;
+    pthread_mutex_unlock(&iterations_mutex);
+
+    return 0;
+}
+
+void lua_iterations_get(struct lua_iteration_info_t *info)
+{
+    pthread_mutex_lock(&iterations_mutex);
+    *info = iterations;
+    pthread_mutex_unlock(&iterations_mutex);
+}
+
+// lua: sleep(seconds)
+static int sleep_(lua_State *L)
+{
+    long seconds = lua_tointeger(L, 1);
+
+    sleep(seconds);
+
+    return 0;
+}
+
+// lua: msleep(miliseconds)
+static int msleep(lua_State *L)
+{
+    long mseconds = lua_tointeger(L, 1);
+    long useconds = mseconds * 1000;
 
     usleep(useconds);
 
@@ -328,17 +1449,454 @@ static int clock_free(lua_State *L)
     return 0;
 }
 
+// Only results databases opened by this script can be used
+static struct owner_t *results_owner(lua_State *L, int handle)
+{
+    struct owner_t *owner = owner_get(L);
+
+    if ((owner == NULL) || (handle < 0) || (handle >= RESULTS_HANDLES_MAX) || !owner->results[handle])
+    {
+        error_printf("Invalid results handle\n");
+        return NULL;
+    }
+
+    return owner;
+}
+
+// lua: handle = results_open(filename)
+static int lua_results_open(lua_State *L)
+{
+    const char *filename = lua_tostring(L, 1);
+    struct owner_t *owner = owner_get(L);
+    int handle;
+
+    if (filename == NULL)
+    {
+        error_printf("Missing filename\n");
+        lua_pushinteger(L, -1);
+        return 1;
+    }
+
+    // Handle must be tracked so it is closed with the script
+    if (owner == NULL)
+    {
+        lua_pushinteger(L, -1);
+        return 1;
+    }
+
+    handle = results_open(filename);
+    if (handle >= 0)
+        owner->results[handle] = true;
+
+    lua_pushinteger(L, handle);
+    return 1;
+}
+
+// lua: results_columns(handle, table, name1, name2, ...)
+static int lua_results_columns(lua_State *L)
+{
+    const char *names[RESULTS_COLUMNS_MAX];
+    int handle = lua_tointeger(L, 1);
+    const char *table = lua_tostring(L, 2);
+    int count = lua_gettop(L) - 2;
+    int i;
+
+    if ((table == NULL) || (count > RESULTS_COLUMNS_MAX) || (results_owner(L, handle) == NULL))
+    {
+        lua_pushinteger(L, 1);
+        return 1;
+    }
+
+    for (i=0; i<count; i++)
+    {
+        names[i] = lua_tostring(L, i+3);
+        if (names[i] == NULL)
+        {
+            error_printf("Column name must be a string\n");
+            lua_pushinteger(L, 1);
+            return 1;
+        }
+    }
+
+    lua_pushinteger(L, results_columns(handle, table, names, count));
+    return 1;
+}
+
+// lua: results_add(handle, table, value1, value2, ...)
+static int lua_results_add(lua_State *L)
+{
+    struct results_value_t values[RESULTS_COLUMNS_MAX];
+    int handle = lua_tointeger(L, 1);
+    const char *table = lua_tostring(L, 2);
+    int count = lua_gettop(L) - 2;
+    int i;
+
+    if ((table == NULL) || (count > RESULTS_COLUMNS_MAX) || (results_owner(L, handle) == NULL))
+    {
+        lua_pushinteger(L, 1);
+        return 1;
+    }
+
+    // Convert Lua values to results values
+    for (i=0; i<count; i++)
+    {
+        switch (lua_type(L, i+3))
+        {
+            case LUA_TNUMBER:
+                if (lua_isinteger(L, i+3))
+                {
+                    values[i].type = RESULTS_INTEGER;
+                    values[i].integer = lua_tointeger(L, i+3);
+                }
+                else
+                {
+                    values[i].type = RESULTS_REAL;
+                    values[i].real = lua_tonumber(L, i+3);
+                }
+                break;
+            case LUA_TBOOLEAN:
+                values[i].type = RESULTS_INTEGER;
+                values[i].integer = lua_toboolean(L, i+3);
+                break;
+            case LUA_TSTRING:
+                values[i].type = RESULTS_TEXT;
+                values[i].text = (char *) lua_tostring(L, i+3);
+                break;
+            default:
+                values[i].type = RESULTS_NULL;
+                break;
+        }
+    }
+
+    lua_pushinteger(L, results_add(handle, table, values, count));
+    return 1;
+}
+
+// lua: results_close(handle)
+static int lua_results_close(lua_State *L)
+{
+    int handle = lua_tointeger(L, 1);
+    struct owner_t *owner = results_owner(L, handle);
+
+    if (owner == NULL)
+    {
+        lua_pushinteger(L, 1);
+        return 1;
+    }
+
+    // Cleared first so owner_gc() never closes a slot reused by another script
+    owner->results[handle] = false;
+
+    lua_pushinteger(L, results_close(handle));
+    return 1;
+}
+
+// Native C module API
+
+// Owner of script running on this thread, modules are called from its thread
+static __thread const struct owner_t *module_owner = NULL;
+
+static int module_session(int device, struct lxi_module_session_t *info)
+{
+    struct session_t *s = session_get(device);
+
+    if ((s == NULL) || (info == NULL))
+    {
+        session_put(s);
+        return LXI_ERROR;
+    }
+
+    // Strings stay valid until device is disconnected
+    info->address = s->address;
+    info->name = s->name;
+    info->port = s->port;
+    info->timeout = s->timeout;
+    info->protocol = s->protocol;
+
+    session_put(s);
+    return 0;
+}
+
+static int module_send(int device, const char *data, int length, int timeout)
+{
+    struct session_t *s = session_get(device);
+
+    if ((s == NULL) || (data == NULL))
+    {
+        session_put(s);
+        return LXI_ERROR;
+    }
+
+    length = session_request(s, module_owner, data, length, false, NULL, 0, timeout ? timeout : s->timeout);
+    session_put(s);
+
+    return length;
+}
+
+static int module_receive(int device, char *buffer, int length, int timeout)
+{
+    struct session_t *s = session_get(device);
+
+    if ((s == NULL) || (buffer == NULL))
+    {
+        session_put(s);
+        return LXI_ERROR;
+    }
+
+    gateway_acquire(s->gateway);
+    if (s->native)
+        length = vxi11_receive(s->device, buffer, length, timeout ? timeout : s->timeout);
+    else
+        length = lxi_receive(s->device, buffer, length, timeout ? timeout : s->timeout);
+    gateway_release(s->gateway);
+    session_put(s);
+
+    if (length < 0)
+        error_printf("Failed to receive message\n");
+
+    return length;
+}
+
+static int module_request(int device, const char *command, int command_length,
+                          char *response, int response_length, int timeout)
+{
+    struct session_t *s = session_get(device);
+    int length;
+
+    if ((s == NULL) || (command == NULL))
+    {
+        session_put(s);
+        return LXI_ERROR;
+    }
+
+    length = session_request(s, module_owner, command, command_length, response != NULL,
+                             response, response_length, timeout ? timeout : s->timeout);
+    session_put(s);
+
+    return length;
+}
+
+static char *module_buffer(int device, int *size)
+{
+    struct session_t *s = session_get(device);
+    char *buffer;
+
+    if (s == NULL)
+        return NULL;
+
+    // Allocate once per link so hot loops avoid per request allocations
+    pthread_mutex_lock(&session_mutex);
+    if (s->buffer == NULL)
+        s->buffer = malloc(RESPONSE_LENGTH_MAX);
+    buffer = s->buffer;
+    pthread_mutex_unlock(&session_mutex);
+    session_put(s);
+
+    if ((buffer != NULL) && (size != NULL))
+        *size = RESPONSE_LENGTH_MAX;
+
+    return buffer;
+}
+
+static const struct lxi_module_api_t module_api =
+{
+    .abi_version = LXI_MODULE_ABI_VERSION,
+    .size = sizeof(struct lxi_module_api_t),
+    .session = module_session,
+    .send = module_send,
+    .receive = module_receive,
+    .request = module_request,
+    .buffer = module_buffer,
+};
+
+// Report latency of every session request (used by script benchmark)
+void lua_set_request_callback(void (*callback)(const char *command, int length, double latency))
+{
+    request_callback = callback;
+}
+
+// Report state of open script sessions
+void lua_sessions_foreach(void (*callback)(const struct lua_session_info_t *info, void *data), void *data)
+{
+    unsigned long latency_histogram[LUA_LATENCY_BUCKETS];
+    char address[ADDRESS_LENGTH_MAX];
+    char name[NAME_LENGTH_MAX];
+    struct lua_session_info_t info;
+    int handle;
+
+    info.address = address;
+    info.name = name;
+    info.latency_histogram = latency_histogram;
+
+    // Copy one session at a time so callback never runs with session lock held
+    for (handle = 0; handle < SESSIONS_MAX; handle++)
+    {
+        struct session_t *s = &session[handle];
+
+        pthread_mutex_lock(&session_mutex);
+        if (s->state != SESSION_READY)
+        {
+            pthread_mutex_unlock(&session_mutex);
+            continue;
+        }
+
+        memcpy(address, s->address, sizeof(address));
+        memcpy(name, s->name, sizeof(name));
+        memcpy(latency_histogram, s->latency_histogram, sizeof(latency_histogram));
+        info.links = s->links;
+        info.requests = s->requests;
+        info.latency_last = s->latency_last;
+        info.latency_avg = s->requests ? s->latency_total / s->requests : 0;
+        info.latency_max = s->latency_max;
+        info.errors = s->errors;
+        info.bytes_sent = s->bytes_sent;
+        info.bytes_received = s->bytes_received;
+        pthread_mutex_unlock(&session_mutex);
+
+        callback(&info, data);
+    }
+}
+
+// Prepend search path pattern (eg. "/some/dir/?.so") to package.cpath
+void lua_add_module_path(lua_State *L, const char *path)
+{
+    lua_getglobal(L, "package");
+    if (!lua_istable(L, -1))
+    {
+        lua_pop(L, 1);
+        return;
+    }
+
+    lua_getfield(L, -1, "cpath");
+    lua_pushfstring(L, "%s;%s", path, lua_isstring(L, -1) ? lua_tostring(L, -1) : "");
+    lua_setfield(L, -3, "cpath");
+    lua_pop(L, 2);
+}
+
+static __thread uint64_t trace_lua_start[TRACE_LUA_DEPTH_MAX];
+static __thread int trace_lua_depth = 0;
+
+// Number of active function frames below hooked function
+static int trace_lua_level(lua_State *L)
+{
+    lua_Debug ar;
+    int low = 0, high = 1, middle;
+
+    while (lua_getstack(L, high, &ar))
+    {
+        low = high;
+        high *= 2;
+    }
+
+    while (high - low > 1)
+    {
+        middle = (low + high) / 2;
+        if (lua_getstack(L, middle, &ar))
+            low = middle;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+// Record span of each Lua function call while tracing. Spans are indexed by
+// stack level, since frames unwound by an error never report their return.
+void lua_trace_hook(lua_State *L, lua_Debug *ar)
+{
+    int level;
+
+    if ((ar->event != LUA_HOOKCALL) && (ar->event != LUA_HOOKRET))
+        return;
+
+    level = trace_lua_level(L);
+    if (level >= TRACE_LUA_DEPTH_MAX)
+        return;
+
+    if (ar->event == LUA_HOOKCALL)
+    {
+        // Levels called before hook was installed have no span, deeper spans
+        // left by an error are dropped
+        while (trace_lua_depth < level)
+            trace_lua_start[trace_lua_depth++] = 0;
+        trace_lua_start[level] = trace_time();
+        trace_lua_depth = level + 1;
+    }
+    else if (level < trace_lua_depth)
+    {
+        if (trace_lua_start[level] != 0)
+        {
+            lua_getinfo(L, "nS", ar);
+            trace_end("lua", "lua", trace_lua_start[level],
+                      ar->name != NULL ? ar->name : ar->short_src);
+        }
+        trace_lua_depth = level;
+    }
+}
+
 int lua_register_lxi(lua_State *L)
 {
+    const char *home = getenv("HOME");
+    char path[1024];
+
+    // Trace Lua calls unless another hook (which then forwards) is installed
+    if (trace_enabled && (lua_gethook(L) == NULL))
+        lua_sethook(L, lua_trace_hook, LUA_MASKCALL | LUA_MASKRET, 0);
+
+    // Links opened by this state are released when it is closed
+    struct owner_t *owner = lua_newuserdata(L, sizeof(struct owner_t));
+    memset(owner, 0, sizeof(struct owner_t));
+    lua_newtable(L);
+    lua_pushcfunction(L, owner_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, OWNER_KEY);
+    module_owner = owner;
+
+    // Make module API available to native C modules loaded via require()
+    lua_pushlightuserdata(L, (void *) &module_api);
+    lua_setfield(L, LUA_REGISTRYINDEX, LXI_MODULE_API_KEY);
+
+    // Search system and user module directories
+    lua_add_module_path(L, LIBDIR "/lxi-tools/lua/?.so");
+    if (home != NULL)
+    {
+        snprintf(path, sizeof(path), "%s/.local/lib/lxi-tools/lua/?.so", home);
+        lua_add_module_path(L, path);
+    }
+
+    // Prepared commands are called like functions
+    luaL_newmetatable(L, PREPARED_METATABLE);
+    lua_pushcfunction(L, prepared_call);
+    lua_setfield(L, -2, "__call");
+    lua_pushcfunction(L, prepared_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
     lua_register(L, "connect", connect);
     lua_register(L, "disconnect", disconnect);
+    lua_register(L, "resolve", lua_resolve);
     lua_register(L, "scpi", scpi);
     lua_register(L, "scpi_raw", scpi_raw);
+    lua_register(L, "session_stats", session_stats);
+    lua_register(L, "session_cache", session_cache);
+    lua_register(L, "session_flush", session_flush);
+    lua_register(L, "lock", lock);
+    lua_register(L, "unlock", unlock);
+    lua_register(L, "stats_iteration", stats_iteration);
+    lua_register(L, "scpi_prepare", scpi_prepare);
+    lua_register(L, "sweep", lua_sweep);
+    lua_register(L, "waveform_fetch", lua_waveform_fetch);
+    lua_register(L, "waveform_download", lua_waveform_download);
     lua_register(L, "sleep", sleep_);
     lua_register(L, "msleep", msleep);
     lua_register(L, "clock_new", clock_new);
     lua_register(L, "clock_read", clock_read);
     lua_register(L, "clock_reset", clock_reset);
     lua_register(L, "clock_free", clock_free);
+    lua_register(L, "results_open", lua_results_open);
+    lua_register(L, "results_columns", lua_results_columns);
+    lua_register(L, "results_add", lua_results_add);
+    lua_register(L, "results_close", lua_results_close);
     return 0;
 }
@@ -35,3 +35,36 @@
 #include <lualib.h>
 
 int lua_register_lxi(lua_State *L);
+void lua_add_module_path(lua_State *L, const char *path);
+void lua_trace_hook(lua_State *L, lua_Debug *ar);
+void lua_set_request_callback(void (*callback)(const char *command, int length, double latency));
+
+// Request latency histogram, bucket i counts latencies up to 2^((i+1)/4) us
+#define LUA_LATENCY_BUCKETS 96
+
+struct lua_session_info_t
+{
+    const char *address;
+    const char *name;
+    int links;
+    unsigned long requests;
+    unsigned long errors;
+    unsigned long long bytes_sent;
+    unsigned long long bytes_received;
+    double latency_last;
+    double latency_avg;
+    double latency_max;
+    const unsigned long *latency_histogram;
+};
+
+// Script loop iterations marked by stats_iteration()
+struct lua_iteration_info_t
+{
+    unsigned long count;
+    double last;     // time of last iteration (CLOCK_MONOTONIC)
+    double interval; // smoothed interval between iterations
+};
+
+void lua_sessions_foreach(void (*callback)(const struct lua_session_info_t *info, void *data), void *data);
+double lua_latency_percentile(const unsigned long *histogram, double percentile);
+void lua_iterations_get(struct lua_iteration_info_t *info);
@@ -44,6 +44,9 @@
 #include "screenshot.h"
 #include "benchmark.h"
 #include "run.h"
+#include "serve.h"
+#include "stats.h"
+#include "trace.h"
 #include <lxi.h>
 
 int main(int argc, char* argv[])
@@ -57,6 +60,9 @@ int main(int argc, char* argv[])
     // Initialize LXI library
     lxi_init();
 
+    // Enable event tracing if requested via LXI_TRACE
+    trace_init();
+
     switch (option.command)
     {
         case DISCOVER:
@@ -78,14 +84,53 @@ int main(int argc, char* argv[])
                 screenshot_list_plugins();
                 return EXIT_SUCCESS;
             }
+            if ((option.trigger != NULL) || (option.match != NULL) || option.above_set ||
+                option.below_set || option.srq)
+            {
+                struct screenshot_trigger_t trigger =
+                {
+                    .query = option.trigger,
+                    .match = option.match,
+                    .above_set = option.above_set,
+                    .above = option.above,
+                    .below_set = option.below_set,
+                    .below = option.below,
+                    .srq = option.srq,
+                    .interval = option.interval,
+                    .count = option.count,
+                };
+                status = screenshot_trigger(option.ip, option.plugin_name, option.screenshot_filename, option.timeout, &trigger);
+                break;
+            }
             status = screenshot(option.ip, option.plugin_name, option.screenshot_filename, option.timeout, true, NULL, NULL, NULL, NULL);
             break;
         case BENCHMARK:
-            status = benchmark(option.ip, option.port, option.timeout, option.protocol, option.count, true, &result, NULL);
+            if (strlen(option.lua_script_filename) > 0)
+            {
+                status = run_benchmark(option.lua_script_filename, option.count, option.warmup,
+                                       option.repetitions, option.duration);
+                break;
+            }
+            if (option.discover)
+            {
+                status = benchmark_discover(option.port, option.timeout, option.protocol, option.native,
+                                            option.count, option.warmup, option.repetitions, option.duration,
+                                            option.jobs, option.sort, option.json_filename);
+                break;
+            }
+            status = benchmark(option.ip, option.port, option.timeout, option.protocol, option.native, option.count,
+                               option.warmup, option.repetitions, option.duration, true, &result, NULL, NULL);
             break;
          case RUN:
             status = run(option.lua_script_filename, option.timeout);
             break;
+        case SERVE:
+            status = serve(option.ip, option.port, option.timeout, option.protocol, option.queries,
+                           option.query_count, option.listen_port, option.interval, option.replay);
+            break;
+        case STATS:
+            status = stats(option.pid, option.json, option.interval);
+            break;
    }
 
     return status;
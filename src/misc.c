@@ -34,6 +34,15 @@
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "resolve.h"
 
 void hex_print(void *data, int length)
 {
@@ -84,3 +93,93 @@ int question(const char *string)
     return false;
 }
 
+// Print string as quoted and escaped JSON string
+void json_string(FILE *f, const char *string, int length)
+{
+    int i;
+
+    fputc('"', f);
+    for (i = 0; i < length; i++)
+    {
+        unsigned char c = string[i];
+
+        if ((c == '"') || (c == '\\'))
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+// Connect TCP socket with timeout (ms), returns socket or -1 on failure
+int socket_connect(const char *address, int port, int timeout)
+{
+    struct addrinfo hints, *result, *rp;
+    struct timeval tv;
+    char service[16], numeric[RESOLVE_ADDRESS_LENGTH_MAX];
+    int fd = -1, flags, error, one = 1;
+    socklen_t length;
+    struct pollfd pfd;
+
+    // Host names via resolver cache
+    if (resolve(address, numeric, sizeof(numeric), timeout) != 0)
+        return -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+
+    if (getaddrinfo(numeric, service, &hints, &result) != 0)
+        return -1;
+
+    for (rp = result; rp != NULL; rp = rp->ai_next)
+    {
+        fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        // Connect with timeout
+        flags = fcntl(fd, F_GETFL, 0);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        if (connect(fd, rp->ai_addr, rp->ai_addrlen) < 0)
+        {
+            if (errno != EINPROGRESS)
+                goto next;
+
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            if (poll(&pfd, 1, timeout) <= 0)
+                goto next;
+
+            length = sizeof(error);
+            if ((getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0) || (error != 0))
+                goto next;
+        }
+        fcntl(fd, F_SETFL, flags);
+        break;
+next:
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(result);
+
+    if (fd < 0)
+    {
+        // Look up again next time in case instrument moved
+        resolve_invalidate(address);
+        return -1;
+    }
+
+    // Small requests must not wait for Nagle
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    return fd;
+}
@@ -30,8 +30,12 @@
 
 #pragma once
 
+#include <stdio.h>
+
 #define UNUSED(expr) do { (void)(expr); } while (0)
 
 void hex_print(void *data, int length);
 void strip_trailing_space(char *line);
 int question(const char *string);
+int socket_connect(const char *address, int port, int timeout);
+void json_string(FILE *f, const char *string, int length);
@@ -58,14 +58,33 @@ struct option_t option =
     .scpi_command = "",        // Default SCPI command
     .hex = false,              // Default no hexadecimal print
     .interactive = false,      // Default no interactive mode
+    .cache = false,            // Default send all commands
     .lua_script_filename = "", // Default lua script filename
     .plugin_name = "",         // Default screenshot plugin name
     .list = false,             // Default no list
     .screenshot_filename = "", // Default screenshot filename
     .protocol = VXI11,         // Default protocol
+    .native = false,           // Default use liblxi VXI-11 client
     .port = 0,                 // Default port (set later)
     .mdns = false,             // Default no mDNS discover
     .count = 100,              // Default number of requests in benchmark
+    .warmup = 10,              // Default number of warm-up requests in benchmark
+    .repetitions = 5,          // Default number of benchmark repetitions
+    .duration = 0,             // Default no minimum benchmark runtime
+    .discover = false,         // Default benchmark single instrument
+    .jobs = 4,                 // Default number of parallel benchmarks
+    .sort = "throughput",      // Default survey table sort field
+    .json_filename = NULL,     // Default no survey JSON file
+    .queries = NULL,           // Default no serve queries
+    .query_count = 0,          // Default no serve queries
+    .listen_port = 8080,       // Default serve port
+    .interval = 1,             // Default serve poll interval in seconds
+    .replay = 100,             // Default number of events kept for replay
+    .trigger = NULL,           // Default no screenshot trigger query
+    .match = NULL,             // Default no trigger response match
+    .above_set = false,        // Default no trigger lower threshold
+    .below_set = false,        // Default no trigger upper threshold
+    .srq = false,              // Default no trigger on service request
 };
 
 void print_help(char *argv[])
@@ -81,6 +100,8 @@ void print_help(char *argv[])
     printf("  screenshot [<options>] [<filename>]  Capture screenshot\n");
     printf("  benchmark [<options>]                Benchmark\n");
     printf("  run <filename>                       Run Lua script\n");
+    printf("  serve [<options>] <scpi-query>...    Serve live query results\n");
+    printf("  stats [<options>] <pid>              Show live statistics of running script\n");
     printf("\n");
     printf("Discover options:\n");
     printf("  -t, --timeout <seconds>              Timeout (default: Normal: %d, mDNS: %d)\n", TIMEOUT_DISCOVER, TIMEOUT_DISCOVER_MDNS);
@@ -92,6 +113,8 @@ void print_help(char *argv[])
     printf("  -t, --timeout <seconds>              Timeout (default: %d)\n", option.timeout);
     printf("  -x, --hex                            Print response in hexadecimal\n");
     printf("  -i, --interactive                    Enter interactive mode\n");
+    printf("  -C, --cache                          Skip set commands not changing state (interactive)\n");
+    printf("  -L, --lock <seconds>                 Lock instrument, waiting in line up to seconds\n");
     printf("  -r, --raw                            Use raw/TCP\n");
     printf("\n");
     printf("Screenshot options:\n");
@@ -99,13 +122,42 @@ void print_help(char *argv[])
     printf("  -t, --timeout <seconds>              Timeout (default: %d)\n", TIMEOUT_SCREENSHOT);
     printf("  -p, --plugin <name>                  Use screenshot plugin by name\n");
     printf("  -l, --list                           List available screenshot plugins\n");
+    printf("  -q, --trigger <scpi-query>           Capture when query response meets condition\n");
+    printf("  -m, --match <regex>                  Trigger when response matches regular expression\n");
+    printf("  -A, --above <value>                  Trigger when response is above value\n");
+    printf("  -B, --below <value>                  Trigger when response is below value\n");
+    printf("  -s, --srq                            Trigger on service request\n");
+    printf("  -i, --interval <seconds>             Trigger poll interval (default: 0.1)\n");
+    printf("  -n, --count <count>                  Number of triggered captures, 0 = unlimited (default: 1)\n");
     printf("\n");
     printf("Benchmark options:\n");
     printf("  -a, --address <ip>                   Device IP address\n");
     printf("  -p, --port <port>                    Use port (default: VXI11: %d, RAW: %d)\n", PORT_VXI11, PORT_RAW);
     printf("  -t, --timeout <seconds>              Timeout (default: %d)\n", option.timeout);
-    printf("  -c, --count <count>                  Number of requests (default: %d)\n", option.count);
+    printf("  -c, --count <count>                  Number of measured requests (default: %d)\n", option.count);
+    printf("  -w, --warmup <count>                 Number of warm-up requests (default: %d)\n", option.warmup);
+    printf("  -n, --repetitions <count>            Number of repetitions (default: %d)\n", option.repetitions);
+    printf("  -d, --duration <seconds>             Minimum runtime (adapts number of requests)\n");
     printf("  -r, --raw                            Use raw/TCP\n");
+    printf("  -N, --native                         Use native VXI-11 client\n");
+    printf("  -D, --discover                       Benchmark all discovered instruments\n");
+    printf("  -j, --jobs <count>                   Number of parallel benchmarks (default: %d)\n", option.jobs);
+    printf("  -s, --sort <field>                   Sort survey by throughput, latency or address\n");
+    printf("  -J, --json <filename>                Save survey results as JSON\n");
+    printf("  -S, --script <filename>              Benchmark function returned by Lua script\n");
+    printf("\n");
+    printf("Serve options:\n");
+    printf("  -a, --address <ip>                   Device IP address\n");
+    printf("  -p, --port <port>                    Use port (default: VXI11: %d, RAW: %d)\n", PORT_VXI11, PORT_RAW);
+    printf("  -t, --timeout <seconds>              Timeout (default: %d)\n", option.timeout);
+    printf("  -l, --listen <port>                  Serve events on local port (default: %d)\n", option.listen_port);
+    printf("  -i, --interval <seconds>             Poll interval (default: %g)\n", option.interval);
+    printf("  -b, --replay <count>                 Number of events replayed to new subscribers (default: %d)\n", option.replay);
+    printf("  -r, --raw                            Use raw/TCP\n");
+    printf("\n");
+    printf("Stats options:\n");
+    printf("  -J, --json                           Print statistics as JSON\n");
+    printf("  -i, --interval <seconds>             Refresh interval, 0 = print once (default: 0)\n");
     printf("\n");
 }
 
@@ -184,6 +236,8 @@ void parse_options(int argc, char *argv[])
             {"timeout",        required_argument, 0, 't'},
             {"hex",            no_argument,       0, 'x'},
             {"interactive",    no_argument,       0, 'i'},
+            {"cache",          no_argument,       0, 'C'},
+            {"lock",           required_argument, 0, 'L'},
             {"raw",            no_argument,       0, 'r'},
             {0,                0,                 0,  0 }
         };
@@ -191,7 +245,7 @@ void parse_options(int argc, char *argv[])
         do
         {
             /* Parse scpi options */
-            c = getopt_long(argc, argv, "a:p:t:xir", long_options, &option_index);
+            c = getopt_long(argc, argv, "a:p:t:xiCL:r", long_options, &option_index);
 
             switch (c)
             {
@@ -215,6 +269,14 @@ void parse_options(int argc, char *argv[])
                     option.interactive = true;
                     break;
 
+                case 'C':
+                    option.cache = true;
+                    break;
+
+                case 'L':
+                    option.lock = atof(optarg);
+                    break;
+
                 case 'r':
                     option.protocol = RAW;
                     break;
@@ -236,13 +298,24 @@ void parse_options(int argc, char *argv[])
             {"timeout",        required_argument, 0, 't'},
             {"plugin",         required_argument, 0, 'p'},
             {"list",           no_argument,       0, 'l'},
+            {"trigger",        required_argument, 0, 'q'},
+            {"match",          required_argument, 0, 'm'},
+            {"above",          required_argument, 0, 'A'},
+            {"below",          required_argument, 0, 'B'},
+            {"srq",            no_argument,       0, 's'},
+            {"interval",       required_argument, 0, 'i'},
+            {"count",          required_argument, 0, 'n'},
             {0,                0,                 0,  0 }
         };
 
+        // Set defaults for triggered capture
+        option.interval = 0.1;
+        option.count = 1;
+
         do
         {
             /* Parse screenshot options */
-            c = getopt_long(argc, argv, "a:t:p:l", long_options, &option_index);
+            c = getopt_long(argc, argv, "a:t:p:lq:m:A:B:si:n:", long_options, &option_index);
 
             switch (c)
             {
@@ -262,6 +335,36 @@ void parse_options(int argc, char *argv[])
                     option.list = true;
                     break;
 
+                case 'q':
+                    option.trigger = optarg;
+                    break;
+
+                case 'm':
+                    option.match = optarg;
+                    break;
+
+                case 'A':
+                    option.above = atof(optarg);
+                    option.above_set = true;
+                    break;
+
+                case 'B':
+                    option.below = atof(optarg);
+                    option.below_set = true;
+                    break;
+
+                case 's':
+                    option.srq = true;
+                    break;
+
+                case 'i':
+                    option.interval = atof(optarg);
+                    break;
+
+                case 'n':
+                    option.count = atoi(optarg);
+                    break;
+
                 case '?':
                     exit(EXIT_FAILURE);
             }
@@ -276,14 +379,23 @@ void parse_options(int argc, char *argv[])
             {"port",           required_argument, 0, 'p'},
             {"timeout",        required_argument, 0, 't'},
             {"count",          required_argument, 0, 'c'},
+            {"warmup",         required_argument, 0, 'w'},
+            {"repetitions",    required_argument, 0, 'n'},
+            {"duration",       required_argument, 0, 'd'},
             {"raw",            no_argument,       0, 'r'},
+            {"native",         no_argument,       0, 'N'},
+            {"discover",       no_argument,       0, 'D'},
+            {"jobs",           required_argument, 0, 'j'},
+            {"sort",           required_argument, 0, 's'},
+            {"json",           required_argument, 0, 'J'},
+            {"script",         required_argument, 0, 'S'},
             {0,                0,                 0,  0 }
         };
 
         do
         {
             /* Parse benchmark options */
-            c = getopt_long(argc, argv, "a:p:t:rc:", long_options, &option_index);
+            c = getopt_long(argc, argv, "a:p:t:rNc:w:n:d:Dj:s:J:S:", long_options, &option_index);
 
             switch (c)
             {
@@ -303,10 +415,132 @@ void parse_options(int argc, char *argv[])
                     option.count = atoi(optarg);
                     break;
 
+                case 'w':
+                    option.warmup = atoi(optarg);
+                    break;
+
+                case 'n':
+                    option.repetitions = atoi(optarg);
+                    break;
+
+                case 'd':
+                    option.duration = atof(optarg);
+                    break;
+
                 case 'r':
                     option.protocol = RAW;
                     break;
 
+                case 'N':
+                    option.native = true;
+                    break;
+
+                case 'D':
+                    option.discover = true;
+                    break;
+
+                case 'j':
+                    option.jobs = atoi(optarg);
+                    break;
+
+                case 's':
+                    option.sort = optarg;
+                    break;
+
+                case 'J':
+                    option.json_filename = optarg;
+                    break;
+
+                case 'S':
+                    strncpy(option.lua_script_filename, optarg, 999);
+                    break;
+
+                case '?':
+                    exit(EXIT_FAILURE);
+            }
+        } while (c != -1);
+    } else if (strcmp(argv[1], "serve") == 0)
+    {
+        option.command = SERVE;
+
+        static struct option long_options[] =
+        {
+            {"address",        required_argument, 0, 'a'},
+            {"port",           required_argument, 0, 'p'},
+            {"timeout",        required_argument, 0, 't'},
+            {"listen",         required_argument, 0, 'l'},
+            {"interval",       required_argument, 0, 'i'},
+            {"replay",         required_argument, 0, 'b'},
+            {"raw",            no_argument,       0, 'r'},
+            {0,                0,                 0,  0 }
+        };
+
+        do
+        {
+            /* Parse serve options */
+            c = getopt_long(argc, argv, "a:p:t:l:i:b:r", long_options, &option_index);
+
+            switch (c)
+            {
+                case 'a':
+                    strncpy(option.ip, optarg, 499);
+                    break;
+
+                case 'p':
+                    option.port = atoi(optarg);
+                    break;
+
+                case 't':
+                    option.timeout = atoi(optarg);
+                    break;
+
+                case 'l':
+                    option.listen_port = atoi(optarg);
+                    break;
+
+                case 'i':
+                    option.interval = atof(optarg);
+                    break;
+
+                case 'b':
+                    option.replay = atoi(optarg);
+                    break;
+
+                case 'r':
+                    option.protocol = RAW;
+                    break;
+
+                case '?':
+                    exit(EXIT_FAILURE);
+            }
+        } while (c != -1);
+    } else if (strcmp(argv[1], "stats") == 0)
+    {
+        option.command = STATS;
+        option.interval = 0;
+
+        static struct option long_options[] =
+        {
+            {"json",           no_argument,       0, 'J'},
+            {"interval",       required_argument, 0, 'i'},
+            {0,                0,                 0,  0 }
+        };
+
+        do
+        {
+            /* Parse stats options */
+            c = getopt_long(argc, argv, "Ji:", long_options, &option_index);
+
+            switch (c)
+            {
+                case 'J':
+                    option.json = true;
+                    break;
+
+                case 'i':
+                    option.interval = atof(optarg);
+                    break;
+
                 case '?':
                     exit(EXIT_FAILURE);
             }
@@ -403,6 +637,25 @@ void parse_options(int argc, char *argv[])
         strncpy(option.lua_script_filename, argv[optind++], 999);
     }
 
+    if ((option.command == STATS) && (optind != argc))
+    {
+        option.pid = atoi(argv[optind++]);
+    }
+
+    if (option.command == SERVE)
+    {
+        // Remaining arguments are the SCPI queries to poll
+        option.queries = &argv[optind];
+        option.query_count = argc - optind;
+        optind = argc;
+
+        if (strlen(option.ip) == 0)
+        {
+            error_printf("No IP address specified\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     /* Print any unknown arguments */
     if (optind < argc)
     {
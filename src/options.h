@@ -43,14 +43,38 @@ struct option_t
     char scpi_command[500];
     bool hex;
     bool interactive;
+    bool cache;
+    double lock;
     char lua_script_filename[1000];
     char *plugin_name;
     bool list;
     char screenshot_filename[1000];
     lxi_protocol_t protocol;
+    bool native;
     int port;
     bool mdns;
     int count;
+    int warmup;
+    int repetitions;
+    double duration;
+    bool discover;
+    int jobs;
+    char *sort;
+    char *json_filename;
+    char **queries;
+    int query_count;
+    int listen_port;
+    double interval;
+    int replay;
+    char *trigger;
+    char *match;
+    bool above_set;
+    double above;
+    bool below_set;
+    double below;
+    bool srq;
+    int pid;
+    bool json;
 };
 
 enum command_t
@@ -60,6 +84,8 @@ enum command_t
     SCREENSHOT,
     BENCHMARK,
     RUN,
+    SERVE,
+    STATS,
     NO_COMMAND
 };
 
@@ -37,6 +37,7 @@
 #include <lxi.h>
 #include "error.h"
 #include "screenshot.h"
+#include "connection.h"
 
 #define IMAGE_SIZE_MAX 0x400000 // 4 MB
 
@@ -50,7 +51,7 @@ int rigol_dg_screenshot(char *address, char *id, int timeout)
     UNUSED(id);
 
     // Connect to LXI instrument
-    device = lxi_connect(address, 0, NULL, timeout, VXI11);
+    device = connection_open(address, 0, NULL, timeout, VXI11);
     if (device == LXI_ERROR)
     {
         error_printf("Failed to connect\n");
@@ -83,7 +84,7 @@ int rigol_dg_screenshot(char *address, char *id, int timeout)
     free(response);
     
     // Disconnect
-    lxi_disconnect(device);
+    connection_close(device);
 
     return 0;
 
@@ -37,6 +37,7 @@
 #include <lxi.h>
 #include "error.h"
 #include "screenshot.h"
+#include "connection.h"
 
 #define IMAGE_SIZE_MAX 308278 // 302KB
 #define PARAM_STR_SIZE 10
@@ -61,7 +62,7 @@ int tektronix_screenshot_3000(char *address, char *id, int timeout)
     UNUSED(id);
 
     // Connect to LXI instrument
-    device = lxi_connect(address, 0, NULL, timeout, VXI11);
+    device = connection_open(address, 0, NULL, timeout, VXI11);
     if (device == LXI_ERROR)
     {
         error_printf("Failed to connect\n");
@@ -127,7 +128,7 @@ int tektronix_screenshot_3000(char *address, char *id, int timeout)
     free(response);
     
     // Disconnect
-    lxi_disconnect(device);
+    connection_close(device);
 
     return 0;
 
@@ -152,5 +153,6 @@ struct screenshot_plugin tektronix_3000 =
     .name = "tektronix-3000",
     .description = "Tektronix TDS 3000 series e*Scope oscilloscope (experimental)",
     .regex = "TEKTRONIX TDS3... ",
-    .screenshot = tektronix_screenshot_3000
+    .screenshot = tektronix_screenshot_3000,
+    .http_url = "http://%s/image.png"
 };
@@ -0,0 +1,935 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Shared memory rate limiter
+ *
+ * A POSIX shared memory table holds one entry per instrument address with
+ * its token bucket and concurrency slots, protected by a process shared
+ * robust mutex so a crashed process can not leave it locked. Entries are
+ * keyed by resolved numeric address, so host name and address of an
+ * instrument share one entry, and entries which have been unused for a
+ * while without holders or lock are reclaimed for other instruments. Slots record
+ * the pid of the holder and slots of processes which no longer exist are
+ * reclaimed. The *IDN? response used to match model rules is cached in the
+ * entry so each instrument is only asked once. It is only requested when a
+ * rule may match it, using the protocol and port of the caller.
+ *
+ * Each entry also holds a FIFO queue of clients waiting for the exclusive
+ * instrument lock, the head of the queue holds the lock. Waiters sleep on a
+ * futex in the entry which is bumped whenever a lock or concurrency slot is
+ * released, so the next client proceeds immediately instead of polling.
+ * Waiters still wake up periodically to reclaim the lock or slots held by
+ * processes which have exited. While the lock is held, requests of all other
+ * clients wait in ratelimit_acquire(), whether they called lock or not.
+ *
+ * Limits themselves are resolved by each process from its configuration
+ * file and cached per process.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <regex.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+#include "error.h"
+#include "ratelimit.h"
+#include "resolve.h"
+#include <lxi.h>
+
+#define RATELIMIT_MAGIC 0x4c584932 // "LXI2"
+#define RULES_MAX 64
+#define ADDRESS_LENGTH_MAX 256
+#define ID_LENGTH_MAX 256
+#define LINE_LENGTH_MAX 1024
+#define POLL_INTERVAL 0.001 // s
+#define HOLDER_CHECK_INTERVAL 0.1 // s
+#define ENTRY_IDLE_TIMEOUT 600 // s
+
+#define RULE_ADDRESS 0x1
+#define RULE_ID 0x2
+
+struct ratelimit_rule_t
+{
+    regex_t regex;
+    int match; // RULE_ADDRESS and/or RULE_ID
+    double rate;
+    double burst;
+    int concurrency;
+};
+
+struct ratelimit_waiter_t
+{
+    pid_t pid;
+    uint32_t id;
+};
+
+struct ratelimit_entry_t
+{
+    char address[ADDRESS_LENGTH_MAX];
+    uint32_t generation;
+    uint64_t used; // ms
+    char id[ID_LENGTH_MAX];
+    bool id_resolved;
+    bool bucket_initialized;
+    double tokens;
+    double refill;
+    pid_t holder[RATELIMIT_CONCURRENCY_MAX];
+    uint32_t wakeup;
+    int lock_count;
+    struct ratelimit_waiter_t lock_queue[RATELIMIT_LOCK_QUEUE_MAX];
+};
+
+struct ratelimit_shm_t
+{
+    uint32_t magic;
+    uint32_t size;
+    pthread_mutex_t mutex;
+    int entry_count;
+    struct ratelimit_entry_t entry[RATELIMIT_ENTRIES_MAX];
+};
+
+// Limits resolved by this process
+struct ratelimit_limit_t
+{
+    char address[ADDRESS_LENGTH_MAX];
+    int entry;
+    uint32_t generation;
+    double rate;
+    double burst;
+    int concurrency;
+};
+
+static struct ratelimit_rule_t rule[RULES_MAX];
+static int rule_count = 0;
+static int rule_id_count = 0;
+static struct ratelimit_shm_t *shm = NULL;
+static struct ratelimit_limit_t limit_cache[RATELIMIT_ENTRIES_MAX];
+static int limit_count = 0;
+static int limit_next = 0;
+static pthread_mutex_t limit_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_once_t shm_once = PTHREAD_ONCE_INIT;
+static uint32_t lock_id = 0;
+
+static double time_now(void)
+{
+    struct timespec time_spec;
+
+    // Monotonic clock is shared by all processes
+    clock_gettime(CLOCK_MONOTONIC, &time_spec);
+
+    return time_spec.tv_sec + time_spec.tv_nsec * 0.000000001;
+}
+
+static void sleep_seconds(double seconds)
+{
+    struct timespec ts;
+
+    ts.tv_sec = (time_t) seconds;
+    ts.tv_nsec = (seconds - ts.tv_sec) * 1000000000;
+    nanosleep(&ts, NULL);
+}
+
+// Sleep until futex word changes from value or timeout expires
+static void futex_wait(uint32_t *word, uint32_t value, double timeout)
+{
+    struct timespec ts;
+
+    ts.tv_sec = (time_t) timeout;
+    ts.tv_nsec = (timeout - ts.tv_sec) * 1000000000;
+    syscall(SYS_futex, word, FUTEX_WAIT, value, &ts, NULL, 0);
+}
+
+// Wake all waiters of entry, called with table locked
+static void entry_wakeup(struct ratelimit_entry_t *e)
+{
+    __atomic_add_fetch(&e->wakeup, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &e->wakeup, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static FILE *config_open(void)
+{
+    char filename[1000];
+    const char *env;
+
+    env = getenv("LXI_RATELIMIT");
+    if (env != NULL)
+        return fopen(env, "r");
+
+    env = getenv("XDG_CONFIG_HOME");
+    if ((env != NULL) && (strlen(env) > 0))
+        snprintf(filename, sizeof(filename), "%s/lxi-tools/ratelimit.conf", env);
+    else if ((env = getenv("HOME")) != NULL)
+        snprintf(filename, sizeof(filename), "%s/.config/lxi-tools/ratelimit.conf", env);
+    else
+        return NULL;
+
+    return fopen(filename, "r");
+}
+
+// Parse "<requests/s> <burst> <concurrency> [address|id] <regex>" lines
+static void config_load(void)
+{
+    char line[LINE_LENGTH_MAX];
+    struct ratelimit_rule_t *r;
+    int line_number = 0, offset, length;
+    char *pattern;
+    FILE *f;
+
+    f = config_open();
+    if (f == NULL)
+        return;
+
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        line_number++;
+        line[strcspn(line, "\r\n")] = 0;
+
+        pattern = line;
+        while (isspace((unsigned char) *pattern))
+            pattern++;
+        if ((*pattern == 0) || (*pattern == '#'))
+            continue;
+
+        if (rule_count >= RULES_MAX)
+        {
+            error_printf("Too many rate limit rules\n");
+            break;
+        }
+
+        r = &rule[rule_count];
+        if ((sscanf(line, "%lf %lf %d %n", &r->rate, &r->burst, &r->concurrency, &offset) != 3) ||
+            (r->rate < 0) || (r->concurrency < 0) || (line[offset] == 0))
+        {
+            error_printf("Invalid rate limit rule on line %d\n", line_number);
+            continue;
+        }
+        if (r->concurrency > RATELIMIT_CONCURRENCY_MAX)
+            r->concurrency = RATELIMIT_CONCURRENCY_MAX;
+        if (r->burst < 1)
+            r->burst = 1;
+
+        // Optional keyword restricts what the pattern is matched against
+        r->match = RULE_ADDRESS | RULE_ID;
+        length = strcspn(&line[offset], " \t");
+        if ((line[offset + length] != 0) && (length == 7) && (strncmp(&line[offset], "address", 7) == 0))
+            r->match = RULE_ADDRESS;
+        else if ((line[offset + length] != 0) && (length == 2) && (strncmp(&line[offset], "id", 2) == 0))
+            r->match = RULE_ID;
+        if (r->match != (RULE_ADDRESS | RULE_ID))
+            offset += length + strspn(&line[offset + length], " \t");
+
+        if (regcomp(&r->regex, &line[offset], REG_EXTENDED | REG_NOSUB) != 0)
+        {
+            error_printf("Invalid rate limit pattern on line %d\n", line_number);
+            continue;
+        }
+        if (r->match & RULE_ID)
+            rule_id_count++;
+        rule_count++;
+    }
+
+    fclose(f);
+}
+
+static void shm_lock(void)
+{
+    if (pthread_mutex_lock(&shm->mutex) == EOWNERDEAD)
+        pthread_mutex_consistent(&shm->mutex);
+}
+
+static void shm_unlock(void)
+{
+    pthread_mutex_unlock(&shm->mutex);
+}
+
+static struct ratelimit_shm_t *shm_attach(void)
+{
+    struct ratelimit_shm_t *s;
+    pthread_mutexattr_t attr;
+    struct stat st;
+    char name[64];
+    bool creator = false;
+    int fd, i;
+
+    // One table per user
+    snprintf(name, sizeof(name), "/lxi-tools-ratelimit-%u", (unsigned) getuid());
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0)
+    {
+        creator = true;
+        if (ftruncate(fd, sizeof(struct ratelimit_shm_t)) < 0)
+            goto error;
+    }
+    else
+    {
+        fd = shm_open(name, O_RDWR, 0600);
+        if (fd < 0)
+            return NULL;
+
+        // Wait for creator to size table
+        for (i = 0; i < 1000; i++)
+        {
+            if ((fstat(fd, &st) == 0) && (st.st_size >= (off_t) sizeof(struct ratelimit_shm_t)))
+                break;
+            sleep_seconds(POLL_INTERVAL);
+        }
+        if (i == 1000)
+            goto error;
+    }
+
+    s = mmap(NULL, sizeof(struct ratelimit_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED)
+        return NULL;
+
+    if (creator)
+    {
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&s->mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+        s->size = sizeof(struct ratelimit_shm_t);
+        __atomic_store_n(&s->magic, RATELIMIT_MAGIC, __ATOMIC_RELEASE);
+        return s;
+    }
+
+    // Wait for creator to initialize table
+    for (i = 0; i < 1000; i++)
+    {
+        if (__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) == RATELIMIT_MAGIC)
+            break;
+        sleep_seconds(POLL_INTERVAL);
+    }
+    if ((i == 1000) || (s->size != sizeof(struct ratelimit_shm_t)))
+    {
+        error_printf("Incompatible rate limit table %s, rate limits disabled\n", name);
+        munmap(s, sizeof(struct ratelimit_shm_t));
+        return NULL;
+    }
+
+    return s;
+
+error:
+    close(fd);
+    return NULL;
+}
+
+static void shm_init(void)
+{
+    shm = shm_attach();
+}
+
+static void ratelimit_init(void)
+{
+    config_load();
+
+    // Table is needed for instrument locks even without limits
+    pthread_once(&shm_once, shm_init);
+    if ((shm == NULL) && (rule_count > 0))
+    {
+        error_printf("Failed to open shared rate limit table, rate limits disabled\n");
+        rule_count = 0;
+    }
+}
+
+static int get_device_id(const char *address, int port, lxi_protocol_t protocol, char *id, int timeout)
+{
+    const char *command = protocol == RAW ? "*IDN?\n" : "*IDN?";
+    int device, length;
+
+    device = resolve_connect(address, port, NULL, timeout, protocol);
+    if (device == LXI_ERROR)
+        return 1;
+
+    length = -1;
+    if (lxi_send(device, command, strlen(command), timeout) >= 0)
+        length = lxi_receive(device, id, ID_LENGTH_MAX - 1, timeout);
+    lxi_disconnect(device);
+
+    if (length < 0)
+        return 1;
+
+    id[length] = 0;
+    id[strcspn(id, "\r\n")] = 0;
+
+    return 0;
+}
+
+static bool holder_alive(pid_t pid)
+{
+    return (pid != 0) && ((kill(pid, 0) == 0) || (errno != ESRCH));
+}
+
+static void lock_queue_reclaim(struct ratelimit_entry_t *e);
+
+static uint64_t time_ms(void)
+{
+    return (uint64_t) (time_now() * 1000);
+}
+
+// Check if entry can be reused for another instrument, called with table locked
+static bool entry_idle(struct ratelimit_entry_t *e, uint64_t now)
+{
+    int i;
+
+    if (now - __atomic_load_n(&e->used, __ATOMIC_RELAXED) < ENTRY_IDLE_TIMEOUT * 1000)
+        return false;
+
+    for (i = 0; i < RATELIMIT_CONCURRENCY_MAX; i++)
+    {
+        if (holder_alive(e->holder[i]))
+            return false;
+    }
+
+    lock_queue_reclaim(e);
+
+    return e->lock_count == 0;
+}
+
+// Entry of instrument by resolved address, reclaiming an idle entry when full
+static int entry_get(const char *address, int timeout, uint32_t *generation)
+{
+    char key[RESOLVE_ADDRESS_LENGTH_MAX];
+    struct ratelimit_entry_t *e;
+    uint64_t now = time_ms();
+    uint32_t next;
+    int i, idle = -1;
+
+    // Address is kept as is if it can not be resolved
+    if (resolve(address, key, sizeof(key), timeout) != 0)
+        snprintf(key, sizeof(key), "%s", address);
+
+    shm_lock();
+    for (i = 0; i < shm->entry_count; i++)
+    {
+        e = &shm->entry[i];
+        if (strcmp(e->address, key) == 0)
+            goto found;
+        if ((idle < 0) && entry_idle(e, now))
+            idle = i;
+    }
+
+    if (shm->entry_count < RATELIMIT_ENTRIES_MAX)
+        i = shm->entry_count++;
+    else if (idle >= 0)
+        i = idle;
+    else
+    {
+        shm_unlock();
+        return -1;
+    }
+
+    // New generation tells processes caching index that entry changed
+    e = &shm->entry[i];
+    next = e->generation + 1;
+    memset(e, 0, sizeof(struct ratelimit_entry_t));
+    strncpy(e->address, key, ADDRESS_LENGTH_MAX - 1);
+    __atomic_store_n(&e->generation, next, __ATOMIC_RELEASE);
+
+found:
+    __atomic_store_n(&e->used, now, __ATOMIC_RELAXED);
+    *generation = e->generation;
+    shm_unlock();
+
+    return i;
+}
+
+static struct ratelimit_rule_t *rule_match(const char *string, int match)
+{
+    int i;
+
+    for (i = 0; i < rule_count; i++)
+    {
+        if ((rule[i].match & match) && (regexec(&rule[i].regex, string, 0, NULL, 0) == 0))
+            return &rule[i];
+    }
+
+    return NULL;
+}
+
+// Cached limits of address, called with limit_mutex locked
+static struct ratelimit_limit_t *limit_find(const char *address)
+{
+    int i;
+
+    for (i = 0; i < limit_count; i++)
+    {
+        if (strcmp(limit_cache[i].address, address) == 0)
+            return &limit_cache[i];
+    }
+
+    return NULL;
+}
+
+// Check that cached entry still belongs to instrument and mark it used
+static bool limit_valid(struct ratelimit_limit_t *limit)
+{
+    struct ratelimit_entry_t *e;
+
+    if (limit->entry < 0)
+        return true;
+
+    e = &shm->entry[limit->entry];
+    if (__atomic_load_n(&e->generation, __ATOMIC_ACQUIRE) != limit->generation)
+        return false;
+    __atomic_store_n(&e->used, time_ms(), __ATOMIC_RELAXED);
+
+    return true;
+}
+
+// Resolve limits of instrument, first rule matching address or ID wins. The
+// instrument is probed for its ID without holding limit_mutex.
+static int limit_get(const char *address, int port, lxi_protocol_t protocol, int timeout,
+                     struct ratelimit_limit_t *limit)
+{
+    struct ratelimit_limit_t *cached;
+    struct ratelimit_entry_t *e;
+    struct ratelimit_rule_t *r;
+    char id[ID_LENGTH_MAX];
+    bool id_resolved;
+
+    pthread_mutex_lock(&limit_mutex);
+    cached = limit_find(address);
+    if ((cached != NULL) && limit_valid(cached))
+    {
+        *limit = *cached;
+        pthread_mutex_unlock(&limit_mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&limit_mutex);
+
+    if (strlen(address) >= ADDRESS_LENGTH_MAX)
+        return 1;
+
+    memset(limit, 0, sizeof(struct ratelimit_limit_t));
+    strcpy(limit->address, address);
+
+    limit->entry = entry_get(address, timeout, &limit->generation);
+    if (limit->entry < 0)
+    {
+        error_printf("Rate limit table full, %s is not rate limited\n", address);
+        goto done;
+    }
+
+    r = rule_match(address, RULE_ADDRESS);
+    if ((r == NULL) && (rule_id_count > 0))
+    {
+        e = &shm->entry[limit->entry];
+
+        shm_lock();
+        id_resolved = e->id_resolved && (e->generation == limit->generation);
+        if (id_resolved)
+            strcpy(id, e->id);
+        shm_unlock();
+
+        if (!id_resolved)
+        {
+            if (get_device_id(address, port, protocol, id, timeout) != 0)
+                id[0] = 0;
+
+            shm_lock();
+            if (e->generation == limit->generation)
+            {
+                strcpy(e->id, id);
+                e->id_resolved = true;
+            }
+            shm_unlock();
+        }
+
+        if (strlen(id) > 0)
+            r = rule_match(id, RULE_ID);
+    }
+
+    if (r != NULL)
+    {
+        limit->rate = r->rate;
+        limit->burst = r->burst;
+        limit->concurrency = r->concurrency;
+    }
+
+done:
+    // Replace stale or oldest cached limits when cache is full
+    pthread_mutex_lock(&limit_mutex);
+    cached = limit_find(address);
+    if (cached == NULL)
+    {
+        if (limit_count < RATELIMIT_ENTRIES_MAX)
+            cached = &limit_cache[limit_count++];
+        else
+        {
+            cached = &limit_cache[limit_next];
+            limit_next = (limit_next + 1) % RATELIMIT_ENTRIES_MAX;
+        }
+    }
+    *cached = *limit;
+    pthread_mutex_unlock(&limit_mutex);
+
+    return 0;
+}
+
+
+// Check if instrument is locked by other client than lock, called with table locked
+static bool lock_blocked(struct ratelimit_entry_t *e, int entry, const struct ratelimit_lock_t *lock)
+{
+    if (e->lock_count == 0)
+        return false;
+
+    lock_queue_reclaim(e);
+    if (e->lock_count == 0)
+        return false;
+
+    return (lock == NULL) || (lock->entry != entry) ||
+           (e->lock_queue[0].pid != getpid()) || (e->lock_queue[0].id != lock->id);
+}
+
+// Wait until lock is released or held by lock, called with table locked
+static int lock_wait(struct ratelimit_entry_t *e, int entry, const struct ratelimit_lock_t *lock,
+                     double deadline)
+{
+    uint32_t wakeup;
+    double now;
+
+    while (lock_blocked(e, entry, lock))
+    {
+        now = time_now();
+        if (now >= deadline)
+            return 1;
+
+        wakeup = e->wakeup;
+        shm_unlock();
+        futex_wait(&e->wakeup, wakeup, MIN(deadline - now, HOLDER_CHECK_INTERVAL));
+        shm_lock();
+    }
+
+    return 0;
+}
+
+int ratelimit_lock_wait(const char *address, int port, lxi_protocol_t protocol, int timeout,
+                        const struct ratelimit_lock_t *lock)
+{
+    struct ratelimit_limit_t l;
+    struct ratelimit_entry_t *e;
+    int status;
+
+    pthread_once(&init_once, ratelimit_init);
+    if (shm == NULL)
+        return 0;
+
+    if ((limit_get(address, port, protocol, timeout, &l) != 0) || (l.entry < 0))
+        return 0;
+
+    e = &shm->entry[l.entry];
+    if (__atomic_load_n(&e->lock_count, __ATOMIC_ACQUIRE) == 0)
+        return 0;
+
+    shm_lock();
+    status = (e->generation == l.generation) ?
+             lock_wait(e, l.entry, lock, time_now() + timeout / 1000.0) : 0;
+    shm_unlock();
+
+    if (status != 0)
+        error_printf("Timeout waiting for lock of %s held by other client\n", address);
+
+    return status;
+}
+
+int ratelimit_acquire(const char *address, int port, lxi_protocol_t protocol, int timeout,
+                      const struct ratelimit_lock_t *lock, struct ratelimit_t *limit)
+{
+    struct ratelimit_limit_t resolved, *l = &resolved;
+    struct ratelimit_entry_t *e;
+    double now, deadline, wait;
+    uint32_t wakeup;
+    int slot, i;
+
+    limit->entry = -1;
+    limit->slot = -1;
+
+    pthread_once(&init_once, ratelimit_init);
+    if (shm == NULL)
+        return 0;
+
+    if ((limit_get(address, port, protocol, timeout, l) != 0) || (l->entry < 0))
+        return 0;
+
+    // Fast path for unlimited instrument nobody has locked
+    e = &shm->entry[l->entry];
+    if ((l->rate == 0) && (l->concurrency == 0) &&
+        (__atomic_load_n(&e->lock_count, __ATOMIC_ACQUIRE) == 0))
+        return 0;
+
+    deadline = time_now() + timeout / 1000.0;
+
+    for (;;)
+    {
+        shm_lock();
+
+        // Entry reclaimed while idle since limits were cached
+        if (e->generation != l->generation)
+        {
+            shm_unlock();
+            if ((limit_get(address, port, protocol, timeout, l) != 0) || (l->entry < 0))
+                return 0;
+            e = &shm->entry[l->entry];
+            continue;
+        }
+
+        // Instrument locked by other client
+        if (lock_wait(e, l->entry, lock, deadline) != 0)
+        {
+            shm_unlock();
+            error_printf("Timeout waiting for lock of %s held by other client\n", address);
+            return 1;
+        }
+        if ((l->rate == 0) && (l->concurrency == 0))
+        {
+            shm_unlock();
+            return 0;
+        }
+
+        // Refill token bucket
+        now = time_now();
+        if (!e->bucket_initialized)
+        {
+            e->tokens = l->burst;
+            e->bucket_initialized = true;
+        }
+        else if (l->rate > 0)
+            e->tokens = MIN(l->burst, e->tokens + (now - e->refill) * l->rate);
+        e->refill = now;
+
+        // Free concurrency slot, reclaiming those of exited processes
+        slot = -1;
+        for (i = 0; i < l->concurrency; i++)
+        {
+            if (!holder_alive(e->holder[i]))
+            {
+                slot = i;
+                break;
+            }
+        }
+
+        if (((l->concurrency == 0) || (slot >= 0)) && ((l->rate == 0) || (e->tokens >= 1)))
+        {
+            if (l->rate > 0)
+                e->tokens -= 1;
+            if (slot >= 0)
+                e->holder[slot] = getpid();
+            shm_unlock();
+
+            limit->entry = l->entry;
+            limit->slot = slot;
+            return 0;
+        }
+
+        if ((l->rate > 0) && (e->tokens < 1))
+        {
+            wait = (1 - e->tokens) / l->rate;
+            shm_unlock();
+
+            if (now + wait > deadline)
+                goto timeout;
+
+            sleep_seconds(wait);
+            continue;
+        }
+
+        // Sleep until a slot is released
+        wakeup = e->wakeup;
+        shm_unlock();
+
+        if (now >= deadline)
+            goto timeout;
+
+        futex_wait(&e->wakeup, wakeup, MIN(deadline - now, HOLDER_CHECK_INTERVAL));
+    }
+
+timeout:
+    error_printf("Timeout waiting for rate limit of %s\n", address);
+    return 1;
+}
+
+void ratelimit_release(struct ratelimit_t *limit)
+{
+    if ((limit->entry < 0) || (limit->slot < 0))
+        return;
+
+    shm_lock();
+    shm->entry[limit->entry].holder[limit->slot] = 0;
+    entry_wakeup(&shm->entry[limit->entry]);
+    shm_unlock();
+
+    limit->entry = -1;
+    limit->slot = -1;
+}
+
+// Remove waiter from lock queue, called with table locked
+static void lock_queue_remove(struct ratelimit_entry_t *e, int index)
+{
+    memmove(&e->lock_queue[index], &e->lock_queue[index + 1],
+            (e->lock_count - index - 1) * sizeof(struct ratelimit_waiter_t));
+    e->lock_count--;
+    entry_wakeup(e);
+}
+
+// Drop waiters and lock holder of processes which no longer exist
+static void lock_queue_reclaim(struct ratelimit_entry_t *e)
+{
+    int i = 0;
+
+    while (i < e->lock_count)
+    {
+        if (!holder_alive(e->lock_queue[i].pid))
+            lock_queue_remove(e, i);
+        else
+            i++;
+    }
+}
+
+static int lock_queue_find(struct ratelimit_entry_t *e, uint32_t id)
+{
+    pid_t pid = getpid();
+    int i;
+
+    for (i = 0; i < e->lock_count; i++)
+    {
+        if ((e->lock_queue[i].pid == pid) && (e->lock_queue[i].id == id))
+            return i;
+    }
+
+    return -1;
+}
+
+int ratelimit_lock(const char *address, int timeout, struct ratelimit_lock_t *lock)
+{
+    struct ratelimit_entry_t *e;
+    double now, deadline;
+    uint32_t wakeup, generation;
+    int index;
+
+    lock->entry = -1;
+
+    pthread_once(&shm_once, shm_init);
+    if (shm == NULL)
+    {
+        error_printf("Failed to open shared instrument table, unable to lock %s\n", address);
+        return 1;
+    }
+
+    if (strlen(address) >= ADDRESS_LENGTH_MAX)
+        return 1;
+
+    index = entry_get(address, timeout, &generation);
+    if (index < 0)
+    {
+        error_printf("Instrument table full, unable to lock %s\n", address);
+        return 1;
+    }
+
+    e = &shm->entry[index];
+    lock->id = __atomic_add_fetch(&lock_id, 1, __ATOMIC_RELAXED);
+    deadline = time_now() + timeout / 1000.0;
+
+    // Join end of queue
+    shm_lock();
+    lock_queue_reclaim(e);
+    if (e->lock_count >= RATELIMIT_LOCK_QUEUE_MAX)
+    {
+        shm_unlock();
+        error_printf("Too many clients waiting for lock of %s\n", address);
+        return 1;
+    }
+    e->lock_queue[e->lock_count].pid = getpid();
+    e->lock_queue[e->lock_count].id = lock->id;
+    e->lock_count++;
+
+    for (;;)
+    {
+        // Lock is granted when reaching head of queue
+        lock_queue_reclaim(e);
+        if (lock_queue_find(e, lock->id) == 0)
+            break;
+
+        now = time_now();
+        if (now >= deadline)
+        {
+            lock_queue_remove(e, lock_queue_find(e, lock->id));
+            shm_unlock();
+            error_printf("Timeout waiting for lock of %s\n", address);
+            return 1;
+        }
+
+        wakeup = e->wakeup;
+        shm_unlock();
+        futex_wait(&e->wakeup, wakeup, MIN(deadline - now, HOLDER_CHECK_INTERVAL));
+        shm_lock();
+    }
+    shm_unlock();
+
+    lock->entry = index;
+    return 0;
+}
+
+void ratelimit_unlock(struct ratelimit_lock_t *lock)
+{
+    struct ratelimit_entry_t *e;
+    int index;
+
+    if (lock->entry < 0)
+        return;
+
+    e = &shm->entry[lock->entry];
+
+    shm_lock();
+    index = lock_queue_find(e, lock->id);
+    if (index >= 0)
+        lock_queue_remove(e, index);
+    shm_unlock();
+
+    lock->entry = -1;
+}
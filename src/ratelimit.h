@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <lxi.h>
+
+#define RATELIMIT_ENTRIES_MAX 256
+#define RATELIMIT_CONCURRENCY_MAX 16
+#define RATELIMIT_LOCK_QUEUE_MAX 32
+
+/*
+ * Per instrument request rate limiting and concurrency caps shared by all
+ * lxi-tools processes of a user.
+ *
+ * Limits are configured in ratelimit.conf (see lxi(1)) by matching the
+ * instrument address or *IDN? response. The *IDN? response is requested
+ * using the protocol and port passed by the caller, and only if a rule may
+ * match it. Each request is wrapped in
+ * ratelimit_acquire()/ratelimit_release(), which waits until the token
+ * bucket of the instrument has a token and one of its concurrency slots is
+ * free.
+ *
+ * Independent of configuration, ratelimit_lock()/ratelimit_unlock() give a
+ * client exclusive use of an instrument across processes. Clients waiting
+ * for the lock are queued and granted it in order of arrival. While locked,
+ * ratelimit_acquire() also waits unless passed the lock held by the caller
+ * (or NULL if none). ratelimit_lock_wait() only waits for the lock, eg.
+ * before taking other resources the lock holder may need.
+ */
+struct ratelimit_t
+{
+    int entry;
+    int slot;
+};
+
+struct ratelimit_lock_t
+{
+    int entry;
+    unsigned int id;
+};
+
+int ratelimit_acquire(const char *address, int port, lxi_protocol_t protocol, int timeout,
+                      const struct ratelimit_lock_t *lock, struct ratelimit_t *limit);
+int ratelimit_lock_wait(const char *address, int port, lxi_protocol_t protocol, int timeout,
+                        const struct ratelimit_lock_t *lock);
+void ratelimit_release(struct ratelimit_t *limit);
+int ratelimit_lock(const char *address, int timeout, struct ratelimit_lock_t *lock);
+void ratelimit_unlock(struct ratelimit_lock_t *lock);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,479 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host name resolver cache
+ *
+ * liblxi and getaddrinfo() resolve host names synchronously on every
+ * connect, which on networks with a slow DNS server adds up to hundreds of
+ * milliseconds per connection. Here each name is looked up by a detached
+ * thread and the result kept in a table:
+ *
+ *  - fresh entries (RESOLVE_TTL for addresses, RESOLVE_NEGATIVE_TTL for
+ *    names which do not resolve) are answered from the table
+ *  - entries in use are looked up again in the background during the last
+ *    RESOLVE_REFRESH_AHEAD seconds of their TTL so they rarely expire
+ *  - an expired address is not used before a lookup confirms it, as the
+ *    address may have been handed to another device (DHCP). Only if DNS is
+ *    unavailable (EAI_AGAIN) the last known address is used, for at most
+ *    RESOLVE_STALE_MAX seconds since it was last resolved
+ *  - resolve_connect() retries with a fresh lookup if a cached address does
+ *    not connect
+ *  - a caller which has to wait for a lookup waits at most its timeout, the
+ *    lookup completes in the background regardless
+ *
+ * getaddrinfo() does not expose record TTLs (names may as well come from
+ * /etc/hosts or mDNS) so fixed TTLs are used. The table is saved to
+ * $XDG_CACHE_HOME/lxi-tools/resolve.cache (or ~/.cache) after each lookup
+ * and loaded on first use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include "error.h"
+#include "resolve.h"
+#include <lxi.h>
+
+#define ENTRIES_MAX 256
+#define HOST_LENGTH_MAX 256
+#define FILENAME_LENGTH_MAX 1000
+#define RESOLVE_TTL 300 // s
+#define RESOLVE_NEGATIVE_TTL 30 // s
+#define RESOLVE_REFRESH_AHEAD 60 // s
+#define RESOLVE_STALE_MAX 900 // s
+
+struct resolve_entry_t
+{
+    bool used;
+    bool valid;
+    bool pending;
+    bool negative;
+    char host[HOST_LENGTH_MAX];
+    char address[RESOLVE_ADDRESS_LENGTH_MAX];
+    time_t expires; // Wall clock so entries stay meaningful across runs
+    time_t resolved; // Time of last successful lookup
+};
+
+static struct resolve_entry_t entry[ENTRIES_MAX];
+static pthread_mutex_t resolve_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolve_cond;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static double time_now(void)
+{
+    struct timespec time_spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &time_spec);
+
+    return time_spec.tv_sec + time_spec.tv_nsec * 0.000000001;
+}
+
+static bool numeric_address(const char *host)
+{
+    unsigned char buffer[sizeof(struct in6_addr)];
+
+    return (inet_pton(AF_INET, host, buffer) == 1) || (inet_pton(AF_INET6, host, buffer) == 1);
+}
+
+static int cache_filename(char *filename, size_t size, bool create)
+{
+    char directory[FILENAME_LENGTH_MAX];
+    const char *env;
+
+    env = getenv("XDG_CACHE_HOME");
+    if ((env != NULL) && (strlen(env) > 0))
+        snprintf(directory, sizeof(directory), "%s", env);
+    else if ((env = getenv("HOME")) != NULL)
+        snprintf(directory, sizeof(directory), "%s/.cache", env);
+    else
+        return -1;
+
+    if (create)
+        mkdir(directory, 0700);
+    strncat(directory, "/lxi-tools", sizeof(directory) - strlen(directory) - 1);
+    if (create)
+        mkdir(directory, 0700);
+
+    snprintf(filename, size, "%s/resolve.cache", directory);
+
+    return 0;
+}
+
+// Lines of "<host> <address or -> <expiry time> <resolve time>"
+static void cache_load(void)
+{
+    char filename[FILENAME_LENGTH_MAX], line[512];
+    char host[HOST_LENGTH_MAX], address[RESOLVE_ADDRESS_LENGTH_MAX];
+    long long expires, resolved;
+    int count = 0;
+    FILE *f;
+
+    if (cache_filename(filename, sizeof(filename), false) != 0)
+        return;
+
+    f = fopen(filename, "r");
+    if (f == NULL)
+        return;
+
+    while ((count < ENTRIES_MAX) && (fgets(line, sizeof(line), f) != NULL))
+    {
+        struct resolve_entry_t *e;
+
+        // Files written before resolve time was recorded lack it
+        resolved = 0;
+        if (sscanf(line, "%255s %63s %lld %lld", host, address, &expires, &resolved) < 3)
+            continue;
+
+        e = &entry[count++];
+
+        strcpy(e->host, host);
+        e->negative = (strcmp(address, "-") == 0);
+        if (!e->negative)
+            strcpy(e->address, address);
+        e->expires = expires;
+        e->resolved = resolved;
+        e->used = true;
+        e->valid = true;
+    }
+
+    fclose(f);
+}
+
+// Replace cache file, called with table locked
+static void cache_save(void)
+{
+    char filename[FILENAME_LENGTH_MAX], temporary[FILENAME_LENGTH_MAX + 16];
+    FILE *f;
+    int i;
+
+    if (cache_filename(filename, sizeof(filename), true) != 0)
+        return;
+
+    snprintf(temporary, sizeof(temporary), "%s.%d", filename, getpid());
+    f = fopen(temporary, "w");
+    if (f == NULL)
+        return;
+
+    for (i = 0; i < ENTRIES_MAX; i++)
+    {
+        if (entry[i].used && entry[i].valid)
+            fprintf(f, "%s %s %lld %lld\n", entry[i].host, entry[i].negative ? "-" : entry[i].address,
+                    (long long) entry[i].expires, (long long) entry[i].resolved);
+    }
+
+    if (fclose(f) == 0)
+        rename(temporary, filename);
+    else
+        unlink(temporary);
+}
+
+static void resolve_init(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&resolve_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    cache_load();
+}
+
+static struct resolve_entry_t *entry_find(const char *host)
+{
+    int i;
+
+    for (i = 0; i < ENTRIES_MAX; i++)
+    {
+        if (entry[i].used && (strcmp(entry[i].host, host) == 0))
+            return &entry[i];
+    }
+
+    return NULL;
+}
+
+// Find or add entry of host, evicting the entry expiring first if full
+static struct resolve_entry_t *entry_get(const char *host)
+{
+    struct resolve_entry_t *e = entry_find(host), *victim = NULL;
+    int i;
+
+    if (e != NULL)
+        return e;
+
+    for (i = 0; i < ENTRIES_MAX; i++)
+    {
+        if (!entry[i].used)
+        {
+            victim = &entry[i];
+            break;
+        }
+        if (!entry[i].pending && ((victim == NULL) || (entry[i].expires < victim->expires)))
+            victim = &entry[i];
+    }
+
+    if (victim == NULL)
+        return NULL;
+
+    memset(victim, 0, sizeof(struct resolve_entry_t));
+    strcpy(victim->host, host);
+    victim->used = true;
+
+    return victim;
+}
+
+static void *lookup_thread(void *data)
+{
+    struct resolve_entry_t *e = data;
+    char host[HOST_LENGTH_MAX], address[RESOLVE_ADDRESS_LENGTH_MAX];
+    struct addrinfo hints, *result;
+    int status;
+
+    pthread_mutex_lock(&resolve_mutex);
+    strcpy(host, e->host);
+    pthread_mutex_unlock(&resolve_mutex);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    status = getaddrinfo(host, NULL, &hints, &result);
+    if (status == 0)
+    {
+        status = getnameinfo(result->ai_addr, result->ai_addrlen, address, sizeof(address),
+                             NULL, 0, NI_NUMERICHOST);
+        freeaddrinfo(result);
+    }
+
+    pthread_mutex_lock(&resolve_mutex);
+    if (status == 0)
+    {
+        strcpy(e->address, address);
+        e->negative = false;
+        e->resolved = time(NULL);
+        e->expires = e->resolved + RESOLVE_TTL;
+    }
+    else if ((status == EAI_AGAIN) && e->valid && !e->negative &&
+             (time(NULL) - e->resolved < RESOLVE_STALE_MAX))
+    {
+        // Keep serving last known address for a while when DNS is unavailable
+        e->expires = time(NULL) + RESOLVE_NEGATIVE_TTL;
+    }
+    else
+    {
+        e->negative = true;
+        e->expires = time(NULL) + RESOLVE_NEGATIVE_TTL;
+    }
+    e->valid = true;
+    e->pending = false;
+    cache_save();
+    pthread_cond_broadcast(&resolve_cond);
+    pthread_mutex_unlock(&resolve_mutex);
+
+    return NULL;
+}
+
+// Start lookup of entry unless one is already running, called with table locked
+static int lookup_start(struct resolve_entry_t *e)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    int status;
+
+    if (e->pending)
+        return 0;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    status = pthread_create(&thread, &attr, lookup_thread, e);
+    pthread_attr_destroy(&attr);
+    if (status != 0)
+        return -1;
+
+    e->pending = true;
+
+    return 0;
+}
+
+static bool entry_fresh(const struct resolve_entry_t *e)
+{
+    return e->valid && (time(NULL) < e->expires);
+}
+
+// Resolve host, cached is set if answer came from table without a lookup
+static int resolve_entry(const char *host, char *address, int size, int timeout, bool *cached)
+{
+    struct resolve_entry_t *e;
+    struct timespec ts;
+    double deadline;
+
+    *cached = false;
+
+    if (numeric_address(host) || (strlen(host) >= HOST_LENGTH_MAX))
+    {
+        snprintf(address, size, "%s", host);
+        return 0;
+    }
+
+    pthread_once(&init_once, resolve_init);
+    deadline = time_now() + timeout / 1000.0;
+
+    pthread_mutex_lock(&resolve_mutex);
+
+    for (;;)
+    {
+        e = entry_get(host);
+        if (e == NULL)
+        {
+            // All entries busy, leave lookup to caller
+            pthread_mutex_unlock(&resolve_mutex);
+            snprintf(address, size, "%s", host);
+            return 0;
+        }
+
+        if (entry_fresh(e))
+        {
+            // Refresh address in use before it expires
+            if (!e->negative && (e->expires - time(NULL) < RESOLVE_REFRESH_AHEAD))
+                lookup_start(e);
+            *cached = true;
+            break;
+        }
+
+        // Expired address may belong to another device by now, wait for lookup
+
+        if (lookup_start(e) != 0)
+        {
+            pthread_mutex_unlock(&resolve_mutex);
+            snprintf(address, size, "%s", host);
+            return 0;
+        }
+
+        if (time_now() >= deadline)
+        {
+            pthread_mutex_unlock(&resolve_mutex);
+            error_printf("Timeout resolving %s\n", host);
+            return 1;
+        }
+
+        ts.tv_sec = (time_t) deadline;
+        ts.tv_nsec = (deadline - ts.tv_sec) * 1000000000;
+        pthread_cond_timedwait(&resolve_cond, &resolve_mutex, &ts);
+
+        // Entry may have been reused for other host while waiting, look up again
+        e = entry_find(host);
+        if ((e != NULL) && !e->pending && e->valid)
+            break;
+    }
+
+    if (e->negative)
+    {
+        pthread_mutex_unlock(&resolve_mutex);
+        error_printf("Unable to resolve %s\n", host);
+        return 1;
+    }
+
+    snprintf(address, size, "%s", e->address);
+    pthread_mutex_unlock(&resolve_mutex);
+
+    return 0;
+}
+
+int resolve(const char *host, char *address, int size, int timeout)
+{
+    bool cached;
+
+    return resolve_entry(host, address, size, timeout, &cached);
+}
+
+void resolve_prefetch(const char **hosts, int count)
+{
+    struct resolve_entry_t *e;
+    int i;
+
+    pthread_once(&init_once, resolve_init);
+
+    pthread_mutex_lock(&resolve_mutex);
+    for (i = 0; i < count; i++)
+    {
+        if ((hosts[i] == NULL) || numeric_address(hosts[i]) || (strlen(hosts[i]) >= HOST_LENGTH_MAX))
+            continue;
+
+        e = entry_get(hosts[i]);
+        if ((e != NULL) && !entry_fresh(e))
+            lookup_start(e);
+    }
+    pthread_mutex_unlock(&resolve_mutex);
+}
+
+// Force next resolve() of host to wait for fresh lookup
+void resolve_invalidate(const char *host)
+{
+    struct resolve_entry_t *e;
+
+    pthread_once(&init_once, resolve_init);
+
+    pthread_mutex_lock(&resolve_mutex);
+    e = entry_find(host);
+    if ((e != NULL) && !e->pending)
+        e->valid = false;
+    pthread_mutex_unlock(&resolve_mutex);
+}
+
+int resolve_connect(const char *host, int port, const char *name, int timeout, lxi_protocol_t protocol)
+{
+    char address[RESOLVE_ADDRESS_LENGTH_MAX], fresh[RESOLVE_ADDRESS_LENGTH_MAX];
+    bool cached;
+    int device;
+
+    if (resolve_entry(host, address, sizeof(address), timeout, &cached) != 0)
+        return LXI_ERROR;
+
+    device = lxi_connect(address, port, name, timeout, protocol);
+    if ((device == LXI_ERROR) && cached)
+    {
+        // Instrument may have moved, retry if a fresh lookup tells so
+        resolve_invalidate(host);
+        if ((resolve_entry(host, fresh, sizeof(fresh), timeout, &cached) == 0) &&
+            (strcmp(fresh, address) != 0))
+            device = lxi_connect(fresh, port, name, timeout, protocol);
+    }
+
+    return device;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <lxi.h>
+
+#define RESOLVE_ADDRESS_LENGTH_MAX 64
+
+/*
+ * Instrument host name resolution with a positive/negative cache shared by
+ * all threads of a process and persisted across runs, so connecting by host
+ * name does not wait for DNS once a name has been seen.
+ *
+ * resolve() turns a host name into a numeric address (numeric addresses are
+ * returned as is). resolve_prefetch() starts lookups of several names in
+ * parallel and returns immediately, later resolve() calls pick up their
+ * results. resolve_connect() is lxi_connect() by host name which retries
+ * with a fresh lookup if a cached address no longer works.
+ */
+int resolve(const char *host, char *address, int size, int timeout);
+void resolve_prefetch(const char **hosts, int count);
+void resolve_invalidate(const char *host);
+int resolve_connect(const char *host, int port, const char *name, int timeout, lxi_protocol_t protocol);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,567 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include "error.h"
+#include "results.h"
+
+#define RESULTS_TABLES_MAX 64
+#define RESULTS_QUEUE_SIZE 65536
+#define RESULTS_BATCH_SIZE 4096
+#define RESULTS_BUSY_TIMEOUT 5000 // ms
+
+struct results_row_t
+{
+    int table;
+    int count;
+    double timestamp;
+    struct results_value_t *values;
+};
+
+struct results_table_t
+{
+    char *name;
+    int columns;
+    char *column_names[RESULTS_COLUMNS_MAX];
+    bool created;
+    sqlite3_stmt *insert;
+};
+
+struct results_t
+{
+    bool allocated;
+    sqlite3 *db;
+    pthread_t writer;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct results_row_t *queue;
+    struct results_row_t *batch;
+    int head;
+    int tail;
+    int count;
+    bool closing;
+    struct results_table_t table[RESULTS_TABLES_MAX];
+    int table_count;
+    unsigned long rows_failed;
+};
+
+static struct results_t results[RESULTS_HANDLES_MAX];
+static pthread_mutex_t results_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void row_free(struct results_row_t *row)
+{
+    int i;
+
+    for (i=0; i<row->count; i++)
+    {
+        if (row->values[i].type == RESULTS_TEXT)
+            free(row->values[i].text);
+    }
+    free(row->values);
+}
+
+static int table_prepare(struct results_t *r, struct results_table_t *t)
+{
+    sqlite3_str *sql;
+    char *statement;
+    char *error = NULL;
+    int i, status;
+
+    // Create table matching schema of first row added
+    sql = sqlite3_str_new(r->db);
+    sqlite3_str_appendf(sql, "CREATE TABLE IF NOT EXISTS \"%w\" (timestamp REAL", t->name);
+    for (i=0; i<t->columns; i++)
+    {
+        if (t->column_names[i] != NULL)
+            sqlite3_str_appendf(sql, ", \"%w\"", t->column_names[i]);
+        else
+            sqlite3_str_appendf(sql, ", value%d", i+1);
+    }
+    sqlite3_str_appendall(sql, ")");
+    statement = sqlite3_str_finish(sql);
+
+    status = sqlite3_exec(r->db, statement, NULL, NULL, &error);
+    sqlite3_free(statement);
+    if (status != SQLITE_OK)
+    {
+        error_printf("Failed to create table %s (%s)\n", t->name, error);
+        sqlite3_free(error);
+        return 1;
+    }
+
+    // Prepare insert statement once per table
+    sql = sqlite3_str_new(r->db);
+    sqlite3_str_appendf(sql, "INSERT INTO \"%w\" (timestamp", t->name);
+    for (i=0; i<t->columns; i++)
+    {
+        if (t->column_names[i] != NULL)
+            sqlite3_str_appendf(sql, ", \"%w\"", t->column_names[i]);
+        else
+            sqlite3_str_appendf(sql, ", value%d", i+1);
+    }
+    sqlite3_str_appendall(sql, ") VALUES (?");
+    for (i=0; i<t->columns; i++)
+        sqlite3_str_appendall(sql, ", ?");
+    sqlite3_str_appendall(sql, ")");
+    statement = sqlite3_str_finish(sql);
+
+    status = sqlite3_prepare_v2(r->db, statement, -1, &t->insert, NULL);
+    sqlite3_free(statement);
+    if (status != SQLITE_OK)
+    {
+        error_printf("Failed to prepare insert into %s (%s)\n", t->name, sqlite3_errmsg(r->db));
+        return 1;
+    }
+
+    t->created = true;
+
+    return 0;
+}
+
+static int row_insert(struct results_t *r, struct results_row_t *row)
+{
+    struct results_table_t *t = &r->table[row->table];
+    struct results_value_t *value;
+    int i, status;
+
+    if (!t->created)
+    {
+        if (table_prepare(r, t) != 0)
+            return 1;
+    }
+
+    sqlite3_bind_double(t->insert, 1, row->timestamp);
+    for (i=0; i<row->count; i++)
+    {
+        value = &row->values[i];
+        switch (value->type)
+        {
+            case RESULTS_INTEGER:
+                sqlite3_bind_int64(t->insert, i+2, value->integer);
+                break;
+            case RESULTS_REAL:
+                sqlite3_bind_double(t->insert, i+2, value->real);
+                break;
+            case RESULTS_TEXT:
+                sqlite3_bind_text(t->insert, i+2, value->text, -1, SQLITE_STATIC);
+                break;
+            default:
+                sqlite3_bind_null(t->insert, i+2);
+                break;
+        }
+    }
+
+    status = sqlite3_step(t->insert);
+    sqlite3_reset(t->insert);
+    sqlite3_clear_bindings(t->insert);
+
+    if (status != SQLITE_DONE)
+    {
+        error_printf("Failed to insert into %s (%s)\n", t->name, sqlite3_errmsg(r->db));
+        return 1;
+    }
+
+    return 0;
+}
+
+static void batch_write(struct results_t *r, struct results_row_t *batch, int count)
+{
+    int i, inserted = 0;
+
+    // Write whole batch in one transaction
+    if (sqlite3_exec(r->db, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK)
+    {
+        error_printf("Failed to begin transaction (%s)\n", sqlite3_errmsg(r->db));
+        r->rows_failed += count;
+        return;
+    }
+
+    for (i=0; i<count; i++)
+    {
+        if (row_insert(r, &batch[i]) != 0)
+            r->rows_failed++;
+        else
+            inserted++;
+    }
+
+    // Rows which failed on their own are already counted
+    if (sqlite3_exec(r->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+    {
+        error_printf("Failed to commit transaction (%s)\n", sqlite3_errmsg(r->db));
+        sqlite3_exec(r->db, "ROLLBACK", NULL, NULL, NULL);
+        r->rows_failed += inserted;
+    }
+}
+
+static void *writer_thread(void *data)
+{
+    struct results_t *r = data;
+    struct results_row_t *batch = r->batch;
+    int count, i;
+
+    while (true)
+    {
+        pthread_mutex_lock(&r->mutex);
+
+        while ((r->count == 0) && (!r->closing))
+            pthread_cond_wait(&r->not_empty, &r->mutex);
+
+        if ((r->count == 0) && (r->closing))
+        {
+            pthread_mutex_unlock(&r->mutex);
+            break;
+        }
+
+        // Take everything queued so far (up to batch size)
+        count = 0;
+        while ((r->count > 0) && (count < RESULTS_BATCH_SIZE))
+        {
+            batch[count++] = r->queue[r->tail];
+            r->tail = (r->tail + 1) % RESULTS_QUEUE_SIZE;
+            r->count--;
+        }
+
+        pthread_cond_broadcast(&r->not_full);
+        pthread_mutex_unlock(&r->mutex);
+
+        batch_write(r, batch, count);
+
+        for (i=0; i<count; i++)
+            row_free(&batch[i]);
+    }
+
+    return NULL;
+}
+
+static struct results_t *results_get(int handle)
+{
+    if ((handle < 0) || (handle >= RESULTS_HANDLES_MAX) || (results[handle].allocated == false))
+    {
+        error_printf("Invalid results handle\n");
+        return NULL;
+    }
+
+    return &results[handle];
+}
+
+static struct results_table_t *table_get(struct results_t *r, const char *name)
+{
+    int i;
+
+    for (i=0; i<r->table_count; i++)
+    {
+        if (strcmp(r->table[i].name, name) == 0)
+            return &r->table[i];
+    }
+
+    if (r->table_count >= RESULTS_TABLES_MAX)
+    {
+        error_printf("Too many results tables\n");
+        return NULL;
+    }
+
+    r->table[r->table_count].name = strdup(name);
+    if (r->table[r->table_count].name == NULL)
+    {
+        error_printf("Failure allocating memory for results table\n");
+        return NULL;
+    }
+
+    return &r->table[r->table_count++];
+}
+
+int results_open(const char *filename)
+{
+    struct results_t *r = NULL;
+    int handle;
+
+    // Find free results handle
+    pthread_mutex_lock(&results_mutex);
+    for (handle=0; handle<RESULTS_HANDLES_MAX; handle++)
+    {
+        if (results[handle].allocated == false)
+        {
+            r = &results[handle];
+            memset(r, 0, sizeof(struct results_t));
+            r->allocated = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&results_mutex);
+
+    if (r == NULL)
+    {
+        error_printf("Too many open results databases\n");
+        return -1;
+    }
+
+    if (sqlite3_open(filename, &r->db) != SQLITE_OK)
+    {
+        error_printf("Failed to open %s (%s)\n", filename, sqlite3_errmsg(r->db));
+        goto error_open;
+    }
+
+    // WAL lets several scripts write the same file concurrently
+    sqlite3_busy_timeout(r->db, RESULTS_BUSY_TIMEOUT);
+    sqlite3_exec(r->db, "PRAGMA journal_mode=WAL", NULL, NULL, NULL);
+    sqlite3_exec(r->db, "PRAGMA synchronous=NORMAL", NULL, NULL, NULL);
+
+    // Allocated here so writer can not fail after producers start queueing
+    r->queue = malloc(sizeof(struct results_row_t) * RESULTS_QUEUE_SIZE);
+    r->batch = malloc(sizeof(struct results_row_t) * RESULTS_BATCH_SIZE);
+    if ((r->queue == NULL) || (r->batch == NULL))
+    {
+        error_printf("Failure allocating memory for results queue\n");
+        goto error_queue;
+    }
+
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init(&r->not_empty, NULL);
+    pthread_cond_init(&r->not_full, NULL);
+
+    if (pthread_create(&r->writer, NULL, writer_thread, r) != 0)
+    {
+        error_printf("Failed to start results writer\n");
+        goto error_thread;
+    }
+
+    return handle;
+
+error_thread:
+    pthread_cond_destroy(&r->not_full);
+    pthread_cond_destroy(&r->not_empty);
+    pthread_mutex_destroy(&r->mutex);
+error_queue:
+    free(r->batch);
+    free(r->queue);
+error_open:
+    sqlite3_close(r->db);
+    r->allocated = false;
+    return -1;
+}
+
+int results_columns(int handle, const char *table, const char **names, int count)
+{
+    struct results_t *r = results_get(handle);
+    struct results_table_t *t;
+    int i;
+
+    if (r == NULL)
+        return 1;
+
+    if (count > RESULTS_COLUMNS_MAX)
+    {
+        error_printf("Too many results columns\n");
+        return 1;
+    }
+
+    pthread_mutex_lock(&r->mutex);
+
+    t = table_get(r, table);
+    if (t == NULL)
+    {
+        pthread_mutex_unlock(&r->mutex);
+        return 1;
+    }
+
+    // Schema already defined by results_add() has no column names
+    if ((t->columns != 0) && (t->column_names[0] == NULL))
+    {
+        pthread_mutex_unlock(&r->mutex);
+        error_printf("Columns of table %s must be defined before adding values\n", table);
+        return 1;
+    }
+
+    // Defining same columns again is fine, eg. for repeated runs into table
+    if (t->columns != 0)
+    {
+        for (i=0; (i<count) && (count == t->columns); i++)
+        {
+            if (strcmp(t->column_names[i], names[i]) != 0)
+                break;
+        }
+        pthread_mutex_unlock(&r->mutex);
+        if ((count == t->columns) && (i == count))
+            return 0;
+        error_printf("Columns of table %s already defined differently\n", table);
+        return 1;
+    }
+
+    for (i=0; i<count; i++)
+    {
+        t->column_names[i] = strdup(names[i]);
+        if (t->column_names[i] == NULL)
+        {
+            while (i-- > 0)
+            {
+                free(t->column_names[i]);
+                t->column_names[i] = NULL;
+            }
+            pthread_mutex_unlock(&r->mutex);
+            error_printf("Failure allocating memory for results columns\n");
+            return 1;
+        }
+    }
+    t->columns = count;
+
+    pthread_mutex_unlock(&r->mutex);
+
+    return 0;
+}
+
+int results_add(int handle, const char *table, struct results_value_t *values, int count)
+{
+    struct results_t *r = results_get(handle);
+    struct results_table_t *t;
+    struct results_row_t row;
+    struct timespec now;
+    int i;
+
+    if (r == NULL)
+        return 1;
+
+    if ((count == 0) || (count > RESULTS_COLUMNS_MAX))
+    {
+        error_printf("Invalid number of results values\n");
+        return 1;
+    }
+
+    // Copy values so the caller can release its own right away
+    clock_gettime(CLOCK_REALTIME, &now);
+    row.timestamp = now.tv_sec + now.tv_nsec * 0.000000001;
+    row.count = count;
+    row.values = malloc(sizeof(struct results_value_t) * count);
+    if (row.values == NULL)
+    {
+        error_printf("Failure allocating memory for results row\n");
+        return 1;
+    }
+    memcpy(row.values, values, sizeof(struct results_value_t) * count);
+    for (i=0; i<count; i++)
+    {
+        if (row.values[i].type != RESULTS_TEXT)
+            continue;
+
+        row.values[i].text = strdup(values[i].text);
+        if (row.values[i].text == NULL)
+        {
+            // Only values copied so far are owned by row
+            row.count = i;
+            row_free(&row);
+            error_printf("Failure allocating memory for results row\n");
+            return 1;
+        }
+    }
+
+    pthread_mutex_lock(&r->mutex);
+
+    t = table_get(r, table);
+    if (t == NULL)
+        goto error;
+
+    // First row defines the table schema
+    if (t->columns == 0)
+        t->columns = count;
+
+    if (t->columns != count)
+    {
+        error_printf("Table %s expects %d values\n", table, t->columns);
+        goto error;
+    }
+    row.table = t - r->table;
+
+    // Bounded queue - wait for writer to catch up
+    while (r->count == RESULTS_QUEUE_SIZE)
+        pthread_cond_wait(&r->not_full, &r->mutex);
+
+    r->queue[r->head] = row;
+    r->head = (r->head + 1) % RESULTS_QUEUE_SIZE;
+    r->count++;
+
+    pthread_cond_signal(&r->not_empty);
+    pthread_mutex_unlock(&r->mutex);
+
+    return 0;
+
+error:
+    pthread_mutex_unlock(&r->mutex);
+    row_free(&row);
+    return 1;
+}
+
+int results_close(int handle)
+{
+    struct results_t *r = results_get(handle);
+    struct results_table_t *t;
+    int i, j, status;
+
+    if (r == NULL)
+        return 1;
+
+    // Let writer drain queue and exit
+    pthread_mutex_lock(&r->mutex);
+    r->closing = true;
+    pthread_cond_signal(&r->not_empty);
+    pthread_mutex_unlock(&r->mutex);
+    pthread_join(r->writer, NULL);
+
+    for (i=0; i<r->table_count; i++)
+    {
+        t = &r->table[i];
+        sqlite3_finalize(t->insert);
+        free(t->name);
+        for (j=0; j<RESULTS_COLUMNS_MAX; j++)
+            free(t->column_names[j]);
+    }
+
+    sqlite3_close(r->db);
+    free(r->batch);
+    free(r->queue);
+    pthread_cond_destroy(&r->not_full);
+    pthread_cond_destroy(&r->not_empty);
+    pthread_mutex_destroy(&r->mutex);
+
+    if (r->rows_failed > 0)
+        error_printf("Failed to write %lu results rows\n", r->rows_failed);
+    status = (r->rows_failed > 0);
+
+    pthread_mutex_lock(&results_mutex);
+    r->allocated = false;
+    pthread_mutex_unlock(&results_mutex);
+
+    return status;
+}
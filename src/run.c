@@ -34,41 +34,296 @@
 #include <stdbool.h>
 #include <string.h>
 #include <time.h>
+#include <libgen.h>
+#include <ctype.h>
+#include <math.h>
+#include <sys/param.h>
 #include "options.h"
+#include "benchmark.h"
 #include "error.h"
 #include "lxilua.h"
 #include "misc.h"
+#include "stats.h"
+#include "trace.h"
 #include <lxi.h>
 #include <lauxlib.h>
 #include <lua.h>
 #include <lualib.h>
 
-int run(char *filename, int timeout)
+#define COMMANDS_MAX 32
+#define COMMAND_NAME_MAX 64
+#define CALIBRATION_COUNT 10
+
+// Latencies of scpi() calls in script benchmark, grouped by command header
+struct command_stats_t
 {
-    lua_State *L;
+    char name[COMMAND_NAME_MAX];
+    double *latency;
+    int count;
+    int capacity;
+    int count_repetition[BENCHMARK_REPETITIONS_MAX];
+};
 
-    UNUSED(timeout);
+static struct command_stats_t command_stats[COMMANDS_MAX];
+static int command_count = 0;
+static int command_repetition = 0;
+static bool command_recording = false;
+
+static double time_now(void)
+{
+    struct timespec time_spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &time_spec);
+
+    return time_spec.tv_sec + time_spec.tv_nsec * 0.000000001;
+}
+
+static lua_State *script_open(char *filename)
+{
+    lua_State *L;
+    char path[1024];
+    char *filename_copy;
 
     if (strlen(filename) == 0)
     {
         error_printf("Missing filename\n");
-        return 1;
+        return NULL;
     }
 
-    L = luaL_newstate();
+    // Counting allocator so lxi stats can report Lua heap usage
+    L = stats_lua_newstate();
     luaL_openlibs(L);
 
     // Add lxi functions
     lua_register_lxi(L);
 
+    // Allow require() of native C modules located next to script
+    filename_copy = strdup(filename);
+    if (filename_copy != NULL)
+    {
+        snprintf(path, sizeof(path), "%s/?.so", dirname(filename_copy));
+        lua_add_module_path(L, path);
+        free(filename_copy);
+    }
+
+    return L;
+}
+
+int run(char *filename, int timeout)
+{
+    lua_State *L;
+
+    UNUSED(timeout);
+
+    L = script_open(filename);
+    if (L == NULL)
+        return 1;
+
+    // Expose live statistics to "lxi stats <pid>" (non-fatal if unavailable)
+    stats_server_start(filename);
+
+    uint64_t trace_start = trace_begin();
     if (luaL_dofile(L, filename))
     {
+        trace_end("script", "lua", trace_start, filename);
         error_printf("%s\n", lua_tostring(L, -1));
         lua_close(L);
         return 0;
     }
+    trace_end("script", "lua", trace_start, filename);
 
+    // Closing state also flushes results databases left open by script
     lua_close(L);
 
     return 0;
 }
+
+static void command_record(const char *command, int length, double latency)
+{
+    struct command_stats_t *c;
+    double *latency_new;
+    char name[COMMAND_NAME_MAX];
+    int i;
+
+    if (!command_recording)
+        return;
+
+    // Group by command header so arguments do not split statistics
+    for (i = 0; (i < length) && (i < COMMAND_NAME_MAX - 1) && !isspace((unsigned char) command[i]); i++)
+        name[i] = command[i];
+    name[i] = 0;
+
+    for (i = 0; i < command_count; i++)
+    {
+        if (strcmp(command_stats[i].name, name) == 0)
+            break;
+    }
+    if (i == command_count)
+    {
+        if (command_count == COMMANDS_MAX)
+            return;
+        memset(&command_stats[i], 0, sizeof(struct command_stats_t));
+        strcpy(command_stats[i].name, name);
+        command_count++;
+    }
+    c = &command_stats[i];
+
+    if (c->count == c->capacity)
+    {
+        latency_new = realloc(c->latency, sizeof(double) * (c->capacity + 1024));
+        if (latency_new == NULL)
+            return;
+        c->latency = latency_new;
+        c->capacity += 1024;
+    }
+
+    c->latency[c->count++] = latency;
+    c->count_repetition[command_repetition]++;
+}
+
+static int script_iteration(lua_State *L, int function)
+{
+    lua_rawgeti(L, LUA_REGISTRYINDEX, function);
+    if (lua_pcall(L, 0, 0, 0) != 0)
+    {
+        error_printf("%s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Benchmark function returned by script, see 'lxi benchmark --script'
+int run_benchmark(char *filename, int count, int warmup, int repetitions, double duration)
+{
+    struct benchmark_stats_t stats;
+    double throughput[BENCHMARK_REPETITIONS_MAX];
+    double time_repetition[BENCHMARK_REPETITIONS_MAX];
+    double command_throughput[BENCHMARK_REPETITIONS_MAX];
+    double *latency = NULL;
+    double time_start, time_iteration, latency_mean;
+    int function, i, j, index = 0;
+    int status = 1;
+    lua_State *L;
+
+    if ((count < 1) || (repetitions < 1) || (repetitions > BENCHMARK_REPETITIONS_MAX))
+    {
+        error_printf("Invalid number of requests or repetitions\n");
+        return 1;
+    }
+
+    L = script_open(filename);
+    if (L == NULL)
+        return 1;
+
+    // Script sets up instruments and returns function to benchmark
+    if (luaL_loadfile(L, filename) || lua_pcall(L, 0, 1, 0))
+    {
+        error_printf("%s\n", lua_tostring(L, -1));
+        goto out;
+    }
+    if (!lua_isfunction(L, -1))
+    {
+        error_printf("Benchmark script must return a function\n");
+        goto out;
+    }
+    function = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    // Warm up (not measured)
+    time_start = time_now();
+    for (i=0; i<warmup; i++)
+    {
+        if (script_iteration(L, function) != 0)
+            goto out;
+    }
+
+    // Minimum runtime mode - adapt iteration count to measured duration
+    if (duration > 0)
+    {
+        if (warmup < CALIBRATION_COUNT)
+        {
+            time_start = time_now();
+            for (i=0; i<CALIBRATION_COUNT; i++)
+            {
+                if (script_iteration(L, function) != 0)
+                    goto out;
+            }
+            latency_mean = (time_now() - time_start) / CALIBRATION_COUNT;
+        }
+        else
+            latency_mean = (time_now() - time_start) / warmup;
+
+        if ((latency_mean > 0) && (duration / latency_mean > count))
+            count = (int) ceil(duration / latency_mean);
+    }
+
+    // Count is the total number of measured iterations, split evenly into repetitions
+    count = MAX(count / repetitions, 1);
+
+    latency = malloc(sizeof(double) * count * repetitions);
+    if (latency == NULL)
+    {
+        error_printf("Failure allocating memory for latency samples\n");
+        goto out;
+    }
+
+    printf("Benchmarking by running %d iterations of %s (%d warm-up, %d repetition%s). Please wait...\n",
+           count * repetitions, filename, warmup, repetitions, repetitions > 1 ? "s" : "");
+
+    lua_set_request_callback(command_record);
+    command_recording = true;
+
+    for (j=0; j<repetitions; j++)
+    {
+        command_repetition = j;
+        time_start = time_now();
+
+        for (i=0; i<count; i++)
+        {
+            time_iteration = time_now();
+            if (script_iteration(L, function) != 0)
+                goto out;
+            latency[index++] = time_now() - time_iteration;
+
+            // Print progress
+            printf("\r%d", index);
+            fflush(stdout);
+        }
+
+        time_repetition[j] = time_now() - time_start;
+        throughput[j] = count / time_repetition[j];
+    }
+
+    command_recording = false;
+    printf("\r");
+
+    if (benchmark_stats_compute(&stats, throughput, repetitions, latency, index) != 0)
+        goto out;
+    benchmark_stats_print(&stats, "iterations");
+
+    // Same statistics for each SCPI command issued by the iterations
+    for (i=0; i<command_count; i++)
+    {
+        printf("\nCommand %s (%d calls):\n", command_stats[i].name, command_stats[i].count);
+        for (j=0; j<repetitions; j++)
+            command_throughput[j] = command_stats[i].count_repetition[j] / time_repetition[j];
+        if (benchmark_stats_compute(&stats, command_throughput, repetitions,
+                                    command_stats[i].latency, command_stats[i].count) != 0)
+            goto out;
+        benchmark_stats_print(&stats, "calls");
+    }
+
+    status = 0;
+
+out:
+    command_recording = false;
+    lua_set_request_callback(NULL);
+    for (i=0; i<command_count; i++)
+        free(command_stats[i].latency);
+    command_count = 0;
+    free(latency);
+    lua_close(L);
+
+    return status;
+}
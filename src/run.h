@@ -45,6 +45,7 @@ extern "C" {
 #include <lxi.h>
 
 int run(char *filename, int timeout);
+int run_benchmark(char *filename, int count, int warmup, int repetitions, double duration);
 
 #ifdef __cplusplus
 }
@@ -40,6 +40,9 @@
 #include "options.h"
 #include "error.h"
 #include "misc.h"
+#include "ratelimit.h"
+#include "resolve.h"
+#include "setcache.h"
 #include <lxi.h>
 
 #define RESPONSE_LENGTH_MAX 0x500000
@@ -49,6 +52,8 @@ int scpi(char *ip, int port, int timeout, lxi_protocol_t protocol, char *command
 {
     char* response = malloc(RESPONSE_LENGTH_MAX);
     char command_buffer[1000];
+    struct ratelimit_t limit = { -1, -1 };
+    struct ratelimit_lock_t lock = { -1, 0 };
     int device, length;;
 
     strip_trailing_space(command);
@@ -63,13 +68,19 @@ int scpi(char *ip, int port, int timeout, lxi_protocol_t protocol, char *command
     }
 
     // Connect
-    device = lxi_connect(ip, port, NULL, timeout, protocol);
+    device = resolve_connect(ip, port, NULL, timeout, protocol);
     if (device != LXI_OK)
     {
         error_printf("Unable to connect to LXI device\n");
         goto error_connect;
     }
 
+    if ((option.lock > 0) && (ratelimit_lock(ip, option.lock * 1000, &lock) != 0))
+        goto error_send;
+
+    if (ratelimit_acquire(ip, port, protocol, timeout, &lock, &limit) != 0)
+        goto error_send;
+
     // Send SCPI command
     length = lxi_send(device, command, strlen(command), timeout);
     if (length < 0)
@@ -103,6 +114,9 @@ int scpi(char *ip, int port, int timeout, lxi_protocol_t protocol, char *command
             }
     }
 
+    ratelimit_release(&limit);
+    ratelimit_unlock(&lock);
+
     // Disconnect
     lxi_disconnect(device);
     free(response);
@@ -110,6 +124,8 @@ int scpi(char *ip, int port, int timeout, lxi_protocol_t protocol, char *command
 
 error_send:
 error_receive:
+    ratelimit_release(&limit);
+    ratelimit_unlock(&lock);
 
     // Disconnect
     lxi_disconnect(device);
@@ -122,17 +138,30 @@ error_connect:
 int enter_interactive_mode(char *ip, int port, int timeout, lxi_protocol_t protocol)
 {
     char* response = malloc(RESPONSE_LENGTH_MAX);
+    struct setcache_t *cache = NULL;
+    struct ratelimit_t limit;
+    struct ratelimit_lock_t lock = { -1, 0 };
     int device, length;
     char *input = "";
 
+    if (option.cache)
+        cache = calloc(1, sizeof(struct setcache_t));
+
     // Connect
-    device = lxi_connect(ip, port, NULL, timeout, protocol);
+    device = resolve_connect(ip, port, NULL, timeout, protocol);
     if (device != LXI_OK)
     {
         error_printf("Unable to connect to LXI device\n");
         goto error_connect;
     }
 
+    // Hold lock for whole session
+    if ((option.lock > 0) && (ratelimit_lock(ip, option.lock * 1000, &lock) != 0))
+    {
+        lxi_disconnect(device);
+        goto error_connect;
+    }
+
     printf("Connected to %s\n", ip);
     printf("Entering interactive mode (ctrl-d to quit)\n\n");
 
@@ -151,11 +180,26 @@ int enter_interactive_mode(char *ip, int port, int timeout, lxi_protocol_t proto
         if (strlen(input) == 0)
             continue;
 
+        // Skip set command which would not change instrument state
+        if ((cache != NULL) && setcache_redundant(cache, input, strlen(input)))
+            continue;
+
+        if (ratelimit_acquire(ip, port, protocol, timeout, &lock, &limit) != 0)
+            continue;
+
         // Send entered input as SCPI command
         length = lxi_send(device, input, strlen(input), timeout);
         if (length < 0)
             error_printf("Failed to send message\n");
 
+        if (cache != NULL)
+        {
+            if (length < 0)
+                setcache_flush(cache);
+            else
+                setcache_update(cache, input, strlen(input));
+        }
+
         // Only expect response in case we are firing a question command
         if (question(input))
         {
@@ -172,17 +216,23 @@ int enter_interactive_mode(char *ip, int port, int timeout, lxi_protocol_t proto
                 printf("%s", response);
             }
         }
+
+        ratelimit_release(&limit);
     }
 
     printf("\n");
 
+    ratelimit_unlock(&lock);
+
     // Disconnect
     lxi_disconnect(device);
     free(response);
+    free(cache);
 
     return 0;
 
 error_connect:
     free(response);
+    free(cache);
     return 1;
 }
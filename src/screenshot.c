@@ -39,12 +39,20 @@
 #include <unistd.h>
 #include <time.h>
 #include <regex.h>
+#include <pthread.h>
 #include "screenshot.h"
 #include "error.h"
+#include "connection.h"
+#include "http.h"
+#include "ratelimit.h"
+#include "resolve.h"
 #include <lxi.h>
 
 #define PLUGIN_LIST_SIZE_MAX 50
 #define ID_LENGTH_MAX 65536
+#define HTTP_IMAGE_SIZE_MAX 0x1000000 // 16 MB
+#define URL_LENGTH_MAX 1024
+#define TRIGGER_FAILURES_MAX 3
 
 extern struct screenshot_plugin keysight_dmm;
 extern struct screenshot_plugin keysight_ivx;
@@ -72,6 +80,9 @@ static void *screenshot_image_buffer;
 static int *screenshot_image_size;
 static char *screenshot_image_format;
 static char *screenshot_image_filename;
+static int screenshot_sequence = 0;
+static char *http_image = NULL;
+static pthread_mutex_t http_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static int get_device_id(char *address, char *id, int timeout)
 {
@@ -79,7 +90,7 @@ static int get_device_id(char *address, char *id, int timeout)
     char *command;
 
     // Connect to LXI instrument
-    device = lxi_connect(address, 0, NULL, timeout, VXI11);
+    device = connection_open(address, 0, NULL, timeout, VXI11);
     if (device == LXI_ERROR)
     {
         error_printf("Failed to connect\n");
@@ -101,7 +112,7 @@ static int get_device_id(char *address, char *id, int timeout)
     }
 
     // Disconnect
-    lxi_disconnect(device);
+    connection_close(device);
 
     // Remove trailing newline
     if (id[bytes_received-1] == '\n')
@@ -111,7 +122,7 @@ static int get_device_id(char *address, char *id, int timeout)
 
 error_receive:
 error_send:
-    lxi_disconnect(device);
+    connection_close(device);
 error_connect:
     return 1;
 }
@@ -159,7 +170,16 @@ void screenshot_file_dump(void *data, int length, char *format)
     if (strlen(screenshot_filename) == 0)
     {
         // Automatically resolve screenshot filename if no filename is provided
-        sprintf(automatic_filename, "screenshot_%s_%s.%s", screenshot_address, date_time(), format);
+        if (screenshot_sequence > 0)
+            sprintf(automatic_filename, "screenshot_%s_%s_%d.%s", screenshot_address, date_time(), screenshot_sequence, format);
+        else
+            sprintf(automatic_filename, "screenshot_%s_%s.%s", screenshot_address, date_time(), format);
+        filename = automatic_filename;
+    }
+    else if ((screenshot_sequence > 0) && (strcmp(screenshot_filename, "-") != 0))
+    {
+        // Triggered captures use specified filename as prefix
+        snprintf(automatic_filename, sizeof(automatic_filename), "%s_%d.%s", screenshot_filename, screenshot_sequence, format);
         filename = automatic_filename;
     }
     else
@@ -202,6 +222,88 @@ void screenshot_file_dump(void *data, int length, char *format)
     }
 }
 
+// Resolve image format from file signature
+static const char *image_format(const unsigned char *data, int length)
+{
+    if ((length >= 8) && (memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0))
+        return "png";
+    if ((length >= 3) && (memcmp(data, "\xff\xd8\xff", 3) == 0))
+        return "jpg";
+    if ((length >= 6) && ((memcmp(data, "GIF87a", 6) == 0) || (memcmp(data, "GIF89a", 6) == 0)))
+        return "gif";
+    if ((length >= 2) && (memcmp(data, "BM", 2) == 0))
+        return "bmp";
+    if ((length >= 4) && ((memcmp(data, "II*\0", 4) == 0) || (memcmp(data, "MM\0*", 4) == 0)))
+        return "tiff";
+
+    return NULL;
+}
+
+// Capture display image served by instrument web server, called with
+// http_mutex held
+static int screenshot_http_alloc(void)
+{
+    // Buffer is reused by later captures
+    if (http_image == NULL)
+    {
+        http_image = malloc(HTTP_IMAGE_SIZE_MAX);
+        if (http_image == NULL)
+            return 1;
+    }
+
+    return 0;
+}
+
+// Allocate image buffer ahead of captures
+static int screenshot_http_prepare(void)
+{
+    int status;
+
+    pthread_mutex_lock(&http_mutex);
+    status = screenshot_http_alloc();
+    pthread_mutex_unlock(&http_mutex);
+
+    return status;
+}
+
+static int screenshot_http(char *address, const char *http_url, int timeout)
+{
+    char url[URL_LENGTH_MAX], host[URL_LENGTH_MAX];
+    const char *format;
+    int length, status = 1;
+
+    // IPv6 literal address must be enclosed in brackets in URL
+    if (strchr(address, ':') != NULL)
+        snprintf(host, sizeof(host), "[%s]", address);
+    else
+        snprintf(host, sizeof(host), "%s", address);
+    snprintf(url, sizeof(url), http_url, host);
+
+    // Reused image buffer is held until image is dumped
+    pthread_mutex_lock(&http_mutex);
+
+    if (screenshot_http_alloc() != 0)
+        goto out;
+
+    length = http_get(url, http_image, HTTP_IMAGE_SIZE_MAX, timeout);
+    if (length < 0)
+        goto out;
+
+    format = image_format((unsigned char *) http_image, length);
+    if (format == NULL)
+    {
+        error_printf("Unknown image format received from %s\n", url);
+        goto out;
+    }
+
+    screenshot_file_dump(http_image, length, (char *) format);
+    status = 0;
+
+out:
+    pthread_mutex_unlock(&http_mutex);
+    return status;
+}
+
 void screenshot_plugin_register(struct screenshot_plugin *plugin)
 {
     int i = 0;
@@ -271,11 +373,9 @@ void screenshot_register_plugins(void)
     screenshot_plugin_register(&tektronix_3000);
 }
 
-int screenshot(char *address, char *plugin_name, char *filename,
-               int timeout, bool no_gui, void *image_buffer,
-               int *image_size, char *image_format, char *image_filename)
+// Find plugin by name, or autodetect it from instrument ID
+static int plugin_select(char *address, char *plugin_name, int timeout, char *id)
 {
-    static char id[ID_LENGTH_MAX];
     bool no_match = true;
     bool token_found = true;
     char *token = NULL;
@@ -285,29 +385,13 @@ int screenshot(char *address, char *plugin_name, char *filename,
     char *regex_buffer;
     int i = 0;
 
-    // Check parameters
-    if (strlen(address) == 0)
-    {
-        error_printf("Missing address\n");
-        return 1;
-    }
-
-    // Save variables
-    screenshot_address = address;
-    screenshot_filename = filename;
-    screenshot_no_gui = no_gui;
-    screenshot_image_buffer = image_buffer;
-    screenshot_image_size = image_size;
-    screenshot_image_format = image_format;
-    screenshot_image_filename = image_filename;
-
     if (strlen(plugin_name) == 0)
     {
         // Get instrument ID
         if (get_device_id(address, id, timeout) != 0)
         {
             error_printf("Unable to retrieve instrument ID\n");
-            return 1;
+            return -1;
         }
 
         // Find relevant screenshot plugin (match instrument ID to plugin)
@@ -356,7 +440,7 @@ int screenshot(char *address, char *plugin_name, char *filename,
         if (plugin_winner == -1)
         {
             error_printf("Could not autodetect which screenshot plugin to use\n");
-            return 1;
+            return -1;
         }
 
         if (isatty(fileno(stdout)) && screenshot_no_gui)
@@ -382,9 +466,301 @@ int screenshot(char *address, char *plugin_name, char *filename,
     if (no_match)
     {
         error_printf("Unknown plugin name\n");
-        return 1;
+        return -1;
     }
 
+    return i;
+}
+
+static int screenshot_capture(int plugin, char *address, char *id, int timeout)
+{
+    struct ratelimit_t limit;
+    int status;
+
+    // Prefer web server capture which leaves SCPI connection to instrument free
+    if (plugin_list[plugin]->http_url != NULL)
+    {
+        if (screenshot_http(address, plugin_list[plugin]->http_url, timeout) == 0)
+            return 0;
+        if (plugin_list[plugin]->screenshot == NULL)
+            return 1;
+        error_printf("Falling back to SCPI screenshot\n");
+    }
+
+    // Capture counts as one request against instrument rate limit
+    if (ratelimit_acquire(address, 0, VXI11, timeout, NULL, &limit) != 0)
+        return 1;
+
     // Call capture screenshot function
-    return plugin_list[i]->screenshot(address, id, timeout);
+    status = plugin_list[plugin]->screenshot(address, id, timeout);
+
+    ratelimit_release(&limit);
+
+    return status;
+}
+
+int screenshot(char *address, char *plugin_name, char *filename,
+               int timeout, bool no_gui, void *image_buffer,
+               int *image_size, char *image_format, char *image_filename)
+{
+    static char id[ID_LENGTH_MAX];
+    int plugin;
+
+    // Check parameters
+    if (strlen(address) == 0)
+    {
+        error_printf("Missing address\n");
+        return 1;
+    }
+
+    // Save variables
+    screenshot_address = address;
+    screenshot_filename = filename;
+    screenshot_no_gui = no_gui;
+    screenshot_image_buffer = image_buffer;
+    screenshot_image_size = image_size;
+    screenshot_image_format = image_format;
+    screenshot_image_filename = image_filename;
+    screenshot_sequence = 0;
+
+    plugin = plugin_select(address, plugin_name, timeout, id);
+    if (plugin < 0)
+        return 1;
+
+    return screenshot_capture(plugin, address, id, timeout);
+}
+
+/*
+ * Triggered capture
+ *
+ * A single VXI-11 session is opened up front and kept for the whole run. The
+ * trigger condition is polled on that session and, while armed, any
+ * connection the screenshot plugin opens to the same address borrows it, so
+ * capture starts right after the condition is seen instead of after a new
+ * RPC portmapper lookup and link setup. The web server image buffer is
+ * allocated before arming, SCPI plugins still allocate their response buffer
+ * per capture.
+ *
+ * Capture happens when the condition becomes true (or is true at start) and
+ * is then disarmed until the condition clears again, so a condition which
+ * stays true (eg. a stopped scope in single mode) yields one image only.
+ *
+ * A failed poll or capture is reported and retried on the next poll, the run
+ * is only given up after several failures in a row.
+ */
+
+static int trigger_device = LXI_ERROR;
+static char *trigger_address = NULL;
+
+static int trigger_connection_open(const char *address, int port, const char *name, int timeout, lxi_protocol_t protocol)
+{
+    if ((trigger_device != LXI_ERROR) && (protocol == VXI11) && (port == 0) &&
+        (strcmp(address, trigger_address) == 0))
+        return trigger_device;
+
+    return resolve_connect(address, port, name, timeout, protocol);
+}
+
+static int trigger_connection_close(int device)
+{
+    if (device == trigger_device)
+        return 0;
+
+    return lxi_disconnect(device);
+}
+
+static const struct connection_provider_t trigger_connection_provider =
+{
+    .open = trigger_connection_open,
+    .close = trigger_connection_close,
+};
+
+static double time_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int trigger_query(char *address, const char *command, char *response, int length, int timeout)
+{
+    struct ratelimit_t limit;
+    int received;
+
+    if (ratelimit_acquire(address, 0, VXI11, timeout, NULL, &limit) != 0)
+        return -1;
+
+    if (lxi_send(trigger_device, command, strlen(command), timeout) < 0)
+    {
+        ratelimit_release(&limit);
+        error_printf("Failed to send message\n");
+        return -1;
+    }
+
+    received = lxi_receive(trigger_device, response, length - 1, timeout);
+    ratelimit_release(&limit);
+    if (received < 0)
+    {
+        error_printf("Failed to receive message\n");
+        return -1;
+    }
+
+    // Strip trailing whitespace
+    while ((received > 0) && ((response[received-1] == '\n') || (response[received-1] == '\r') ||
+                              (response[received-1] == ' ')))
+        received--;
+    response[received] = 0;
+
+    return received;
+}
+
+// Returns 1 if trigger condition holds, 0 if not, -1 on error
+static int trigger_condition(char *address, struct screenshot_trigger_t *trigger, int timeout)
+{
+    char response[ID_LENGTH_MAX];
+    char *end;
+    double value;
+
+    if (trigger->srq)
+    {
+        // Request service (RQS/MSS) bit of status byte
+        if (trigger_query(address, "*STB?", response, sizeof(response), timeout) < 0)
+            return -1;
+        if ((atoi(response) & 0x40) == 0)
+            return 0;
+    }
+
+    if (trigger->query == NULL)
+        return 1;
+
+    if (trigger_query(address, trigger->query, response, sizeof(response), timeout) < 0)
+        return -1;
+
+    if ((trigger->match != NULL) && !regex_match(response, trigger->match))
+        return 0;
+
+    if (trigger->above_set || trigger->below_set)
+    {
+        value = strtod(response, &end);
+        if (end == response)
+            return 0; // Not a number
+        if (trigger->above_set && !(value > trigger->above))
+            return 0;
+        if (trigger->below_set && !(value < trigger->below))
+            return 0;
+    }
+
+    return 1;
+}
+
+int screenshot_trigger(char *address, char *plugin_name, char *filename,
+                       int timeout, struct screenshot_trigger_t *trigger)
+{
+    static char id[ID_LENGTH_MAX];
+    bool armed = true;
+    int captured = 0, failures = 0;
+    double next, now;
+    int plugin, status = 1, condition;
+
+    // Check parameters
+    if (strlen(address) == 0)
+    {
+        error_printf("Missing address\n");
+        return 1;
+    }
+
+    if ((trigger->query == NULL) && !trigger->srq)
+    {
+        error_printf("Missing trigger query\n");
+        return 1;
+    }
+
+    if ((trigger->query != NULL) && (trigger->match == NULL) &&
+        !trigger->above_set && !trigger->below_set)
+    {
+        error_printf("Missing trigger condition (match, above or below)\n");
+        return 1;
+    }
+
+    // Save variables
+    screenshot_address = address;
+    screenshot_filename = filename;
+    screenshot_no_gui = true;
+    screenshot_sequence = 0;
+
+    if (screenshot_http_prepare() != 0)
+    {
+        error_printf("Failed to allocate image buffer\n");
+        return 1;
+    }
+
+    // Open session kept for polling and capture
+    trigger_device = resolve_connect(address, 0, NULL, timeout, VXI11);
+    if (trigger_device == LXI_ERROR)
+    {
+        error_printf("Failed to connect\n");
+        return 1;
+    }
+    trigger_address = address;
+    connection_set_provider(&trigger_connection_provider);
+
+    plugin = plugin_select(address, plugin_name, timeout, id);
+    if (plugin < 0)
+        goto error;
+
+    if (isatty(fileno(stdout)))
+        printf("Waiting for trigger condition\n");
+
+    next = time_now();
+    while ((trigger->count == 0) || (captured < trigger->count))
+    {
+        condition = trigger_condition(address, trigger, timeout);
+        if (condition < 0)
+        {
+            if (++failures >= TRIGGER_FAILURES_MAX)
+                goto error;
+        }
+        else if (condition && armed)
+        {
+            screenshot_sequence = captured + 1;
+            if (screenshot_capture(plugin, address, id, timeout) != 0)
+            {
+                // Stay armed to retry while condition holds
+                error_printf("Failed to capture screenshot %d\n", screenshot_sequence);
+                if (++failures >= TRIGGER_FAILURES_MAX)
+                    goto error;
+            }
+            else
+            {
+                failures = 0;
+                captured++;
+                armed = false;
+            }
+        }
+        else
+        {
+            failures = 0;
+
+            // Rearm once condition clears
+            armed = !condition;
+        }
+
+        next += trigger->interval;
+        now = time_now();
+        if (next > now)
+            usleep((next - now) * 1000000);
+        else
+            next = now;
+    }
+
+    status = 0;
+
+error:
+    connection_set_provider(NULL);
+    lxi_disconnect(trigger_device);
+    trigger_device = LXI_ERROR;
+
+    return status;
 }
@@ -43,6 +43,23 @@ int screenshot(char *address, char *plugin_name, char *filename,
                int timeout, bool no_gui, void *image_buffer,
                int *image_size, char *image_format, char *image_filename);
 
+// Capture screenshot each time trigger condition becomes true
+struct screenshot_trigger_t
+{
+    const char *query;  // SCPI query polled for trigger condition
+    const char *match;  // Regular expression response must match
+    bool above_set;
+    double above;       // Numeric response must be above this value
+    bool below_set;
+    double below;       // Numeric response must be below this value
+    bool srq;           // Require service request bit set in status byte
+    double interval;    // Poll interval in seconds
+    int count;          // Number of captures (0 = unlimited)
+};
+
+int screenshot_trigger(char *address, char *plugin_name, char *filename,
+                       int timeout, struct screenshot_trigger_t *trigger);
+
 // Screenshot helper function used by plugins to dump image file
 void screenshot_file_dump(void *data, int length, char *format);
 
@@ -52,6 +69,10 @@ struct screenshot_plugin
    const char *description;
    const char *regex;
    int (*screenshot)(char *address, char *id, int timeout);
+   // Optional URL of display image on instrument web server, "%s" is
+   // replaced by instrument address (eg. "http://%s/image.png"). If set it
+   // is tried before the SCPI based .screenshot function.
+   const char *http_url;
 };
 
 #ifdef __cplusplus
@@ -0,0 +1,535 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Live data server
+ *
+ * Polls a set of SCPI queries on one instrument and publishes each round of
+ * responses as a Server-Sent Events (SSE) stream to any number of local
+ * subscribers, so instrument load is independent of the number of viewers.
+ *
+ * One thread polls the instrument and appends events to a ring buffer of the
+ * most recent events. The main thread serves subscribers with non-blocking
+ * sockets straight from that ring buffer:
+ *
+ *  - new subscribers are replayed the buffered events (or those after their
+ *    Last-Event-ID when an EventSource reconnects)
+ *  - a slow subscriber only falls behind in the ring buffer, it never stalls
+ *    polling or other subscribers and costs no extra memory
+ *  - a subscriber whose position is overwritten skips ahead to the oldest
+ *    buffered event (event ids reveal the gap), or is disconnected if it was
+ *    in the middle of sending that event
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "error.h"
+#include "misc.h"
+#include "ratelimit.h"
+#include "resolve.h"
+#include "serve.h"
+#include <lxi.h>
+
+#define RESPONSE_LENGTH_MAX 65536
+#define REQUEST_LENGTH_MAX 4096
+#define COMMAND_LENGTH_MAX 1000
+
+struct serve_event_t
+{
+    unsigned long id;
+    char *data;
+    size_t length;
+};
+
+struct serve_client_t
+{
+    bool used;
+    bool streaming;
+    int socket;
+    char request[REQUEST_LENGTH_MAX];
+    int request_length;
+    unsigned long next_id;
+    size_t offset;
+};
+
+static struct serve_event_t *ring;
+static int ring_size;
+static unsigned long ring_newest = 0;
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct serve_client_t client[SERVE_CLIENTS_MAX];
+static int wake_pipe[2];
+
+struct serve_poll_t
+{
+    const char *ip;
+    int device;
+    int port;
+    int timeout;
+    lxi_protocol_t protocol;
+    char **queries;
+    int query_count;
+    double interval;
+};
+
+static double time_now(void)
+{
+    struct timespec time_spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &time_spec);
+
+    return time_spec.tv_sec + time_spec.tv_nsec * 0.000000001;
+}
+
+static void ring_publish(char *data, size_t length)
+{
+    struct serve_event_t *event;
+    char byte = 0;
+
+    pthread_mutex_lock(&ring_mutex);
+    ring_newest++;
+    event = &ring[ring_newest % ring_size];
+    free(event->data);
+    event->id = ring_newest;
+    event->data = data;
+    event->length = length;
+    pthread_mutex_unlock(&ring_mutex);
+
+    // Wake up server loop
+    if (write(wake_pipe[1], &byte, 1) < 0)
+        return;
+}
+
+static unsigned long ring_oldest(void)
+{
+    if (ring_newest < (unsigned long) ring_size)
+        return 1;
+
+    return ring_newest - ring_size + 1;
+}
+
+static void *poll_worker(void *data)
+{
+    struct serve_poll_t *p = data;
+    struct ratelimit_t limit;
+    static char response[RESPONSE_LENGTH_MAX];
+    char command[COMMAND_LENGTH_MAX];
+    double time_next = time_now(), delay;
+    struct timeval tv;
+    struct timespec ts;
+    char *event_data;
+    size_t event_length;
+    unsigned long id;
+    int i, length;
+    FILE *f;
+
+    for (;;)
+    {
+        gettimeofday(&tv, NULL);
+
+        pthread_mutex_lock(&ring_mutex);
+        id = ring_newest + 1;
+        pthread_mutex_unlock(&ring_mutex);
+
+        f = open_memstream(&event_data, &event_length);
+        if (f == NULL)
+            return NULL;
+        fprintf(f, "id: %lu\ndata: {\"time\":%.6f,\"values\":{", id, tv.tv_sec + tv.tv_usec * 0.000001);
+
+        for (i = 0; i < p->query_count; i++)
+        {
+            // RAW devices need newline terminated commands
+            snprintf(command, sizeof(command), p->protocol == RAW ? "%s\n" : "%s", p->queries[i]);
+
+            json_string(f, p->queries[i], strlen(p->queries[i]));
+            fputc(':', f);
+
+            length = -1;
+            if (ratelimit_acquire(p->ip, p->port, p->protocol, p->timeout, NULL, &limit) == 0)
+            {
+                if (lxi_send(p->device, command, strlen(command), p->timeout) >= 0)
+                    length = lxi_receive(p->device, response, RESPONSE_LENGTH_MAX, p->timeout);
+                ratelimit_release(&limit);
+            }
+
+            if (length < 0)
+                fputs("null", f);
+            else
+            {
+                while ((length > 0) && isspace((unsigned char) response[length - 1]))
+                    length--;
+                json_string(f, response, length);
+            }
+            if (i < p->query_count - 1)
+                fputc(',', f);
+        }
+
+        fputs("}}\n\n", f);
+        fclose(f);
+
+        ring_publish(event_data, event_length);
+
+        // Keep fixed poll rate
+        time_next += p->interval;
+        delay = time_next - time_now();
+        if (delay < 0)
+        {
+            time_next = time_now();
+            continue;
+        }
+        ts.tv_sec = (time_t) delay;
+        ts.tv_nsec = (delay - ts.tv_sec) * 1000000000;
+        nanosleep(&ts, NULL);
+    }
+
+    return NULL;
+}
+
+static void client_close(struct serve_client_t *c)
+{
+    close(c->socket);
+    c->used = false;
+}
+
+static int client_send(struct serve_client_t *c, const char *data, size_t length)
+{
+    ssize_t n;
+
+    do
+    {
+        n = send(c->socket, data, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while ((n < 0) && (errno == EINTR));
+
+    if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+        return 0;
+
+    return n;
+}
+
+// Handle HTTP request and start event stream
+static void client_request(struct serve_client_t *c)
+{
+    static const char *header =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Connection: keep-alive\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "\r\n";
+    static const char *not_found =
+        "HTTP/1.1 404 Not Found\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+    unsigned long last_id = 0;
+    char path[256] = "";
+    char *line;
+    ssize_t n;
+
+    n = recv(c->socket, c->request + c->request_length,
+             REQUEST_LENGTH_MAX - 1 - c->request_length, MSG_DONTWAIT);
+    if (n <= 0)
+    {
+        if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+            return;
+        client_close(c);
+        return;
+    }
+    c->request_length += n;
+    c->request[c->request_length] = 0;
+
+    if (strstr(c->request, "\r\n\r\n") == NULL)
+    {
+        if (c->request_length == REQUEST_LENGTH_MAX - 1)
+            client_close(c);
+        return;
+    }
+
+    sscanf(c->request, "GET %255s", path);
+    if ((strcmp(path, "/") != 0) && (strcmp(path, "/events") != 0))
+    {
+        client_send(c, not_found, strlen(not_found));
+        client_close(c);
+        return;
+    }
+
+    // Resume after last received event when EventSource reconnects
+    for (line = strstr(c->request, "\r\n"); line != NULL; line = strstr(line, "\r\n"))
+    {
+        line += 2;
+        if (strncasecmp(line, "Last-Event-ID:", 14) == 0)
+            last_id = strtoul(line + 14, NULL, 10);
+    }
+
+    if ((size_t) client_send(c, header, strlen(header)) != strlen(header))
+    {
+        client_close(c);
+        return;
+    }
+
+    c->streaming = true;
+    c->next_id = last_id + 1;
+}
+
+// Send pending events, stops when socket buffer is full
+static void client_flush(struct serve_client_t *c)
+{
+    struct serve_event_t *event;
+    int n;
+
+    // Last-Event-ID from before a server restart
+    if (c->next_id > ring_newest + 1)
+        c->next_id = ring_oldest();
+
+    while (c->next_id <= ring_newest)
+    {
+        if (c->next_id < ring_oldest())
+        {
+            // Event partially sent to subscriber was overwritten
+            if (c->offset > 0)
+            {
+                client_close(c);
+                return;
+            }
+            c->next_id = ring_oldest();
+        }
+
+        event = &ring[c->next_id % ring_size];
+        n = client_send(c, event->data + c->offset, event->length - c->offset);
+        if (n < 0)
+        {
+            client_close(c);
+            return;
+        }
+
+        c->offset += n;
+        if (c->offset < event->length)
+            return;
+
+        c->offset = 0;
+        c->next_id++;
+    }
+}
+
+static int listen_socket(int port)
+{
+    struct sockaddr_in address;
+    int fd, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    // Only serve local subscribers
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    if ((bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0) ||
+        (listen(fd, SERVE_CLIENTS_MAX) < 0))
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int serve(char *ip, int port, int timeout, lxi_protocol_t protocol,
+          char **queries, int query_count, int listen_port,
+          double interval, int replay)
+{
+    struct pollfd pfd[SERVE_CLIENTS_MAX + 2];
+    int index[SERVE_CLIENTS_MAX + 2];
+    struct serve_poll_t poll_config;
+    struct serve_client_t *c;
+    pthread_t thread;
+    int device, fd, server, count, i, j;
+    char drain[256];
+
+    if (query_count == 0)
+    {
+        error_printf("No SCPI queries specified\n");
+        return 1;
+    }
+
+    if (replay < 1)
+        replay = 1;
+
+    ring_size = replay;
+    ring = calloc(ring_size, sizeof(struct serve_event_t));
+    if (ring == NULL)
+        return 1;
+
+    server = listen_socket(listen_port);
+    if (server < 0)
+    {
+        error_printf("Unable to listen on port %d (%s)\n", listen_port, strerror(errno));
+        goto error_listen;
+    }
+
+    if (pipe(wake_pipe) < 0)
+        goto error_pipe;
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+
+    device = resolve_connect(ip, port, NULL, timeout, protocol);
+    if (device == LXI_ERROR)
+    {
+        error_printf("Unable to connect to LXI device\n");
+        goto error_connect;
+    }
+
+    poll_config.ip = ip;
+    poll_config.device = device;
+    poll_config.port = port;
+    poll_config.timeout = timeout;
+    poll_config.protocol = protocol;
+    poll_config.queries = queries;
+    poll_config.query_count = query_count;
+    poll_config.interval = interval;
+
+    if (pthread_create(&thread, NULL, poll_worker, &poll_config) != 0)
+    {
+        error_printf("Unable to start poll thread\n");
+        goto error_thread;
+    }
+
+    printf("Serving %s events on http://localhost:%d/events\n", ip, listen_port);
+    fflush(stdout);
+
+    for (;;)
+    {
+        pfd[0].fd = server;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = wake_pipe[0];
+        pfd[1].events = POLLIN;
+        count = 2;
+
+        pthread_mutex_lock(&ring_mutex);
+        for (i = 0; i < SERVE_CLIENTS_MAX; i++)
+        {
+            if (!client[i].used)
+                continue;
+            pfd[count].fd = client[i].socket;
+            pfd[count].events = POLLIN;
+            if (client[i].streaming && (client[i].next_id <= ring_newest))
+                pfd[count].events |= POLLOUT;
+            index[count++] = i;
+        }
+        pthread_mutex_unlock(&ring_mutex);
+
+        if (poll(pfd, count, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            error_printf("Poll failed (%s)\n", strerror(errno));
+            break;
+        }
+
+        if (pfd[1].revents & POLLIN)
+        {
+            while (read(wake_pipe[0], drain, sizeof(drain)) > 0)
+                ;
+        }
+
+        if (pfd[0].revents & POLLIN)
+        {
+            fd = accept(server, NULL, NULL);
+            if (fd >= 0)
+            {
+                for (i = 0; (i < SERVE_CLIENTS_MAX) && client[i].used; i++)
+                    ;
+                if (i == SERVE_CLIENTS_MAX)
+                    close(fd);
+                else
+                {
+                    memset(&client[i], 0, sizeof(struct serve_client_t));
+                    client[i].used = true;
+                    client[i].socket = fd;
+                }
+            }
+        }
+
+        for (j = 2; j < count; j++)
+        {
+            c = &client[index[j]];
+            if (pfd[j].revents & (POLLERR | POLLHUP | POLLNVAL))
+            {
+                client_close(c);
+                continue;
+            }
+            if (!(pfd[j].revents & POLLIN))
+                continue;
+
+            if (!c->streaming)
+                client_request(c);
+            else if ((recv(c->socket, drain, sizeof(drain), MSG_DONTWAIT) == 0))
+                client_close(c); // Subscriber went away
+        }
+
+        // Deliver new events to all subscribers
+        pthread_mutex_lock(&ring_mutex);
+        for (i = 0; i < SERVE_CLIENTS_MAX; i++)
+        {
+            if (client[i].used && client[i].streaming)
+                client_flush(&client[i]);
+        }
+        pthread_mutex_unlock(&ring_mutex);
+    }
+
+    return 1;
+
+error_thread:
+    lxi_disconnect(device);
+error_connect:
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+error_pipe:
+    close(server);
+error_listen:
+    free(ring);
+    return 1;
+}
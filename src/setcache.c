@@ -0,0 +1,372 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Write-through cache of instrument settings
+ *
+ * Remembers the last value sent with each set command of a session so a
+ * command which would not change instrument state can be skipped. Headers
+ * are normalized to SCPI short form in upper case (VOLTage -> VOLT, POWer ->
+ * POW) with leading colon and numeric suffix 1 dropped (CHANnel1 -> CHAN),
+ * and values are compared in upper case without whitespace, or numerically.
+ *
+ * The cache is conservative: common commands and queries other than *RST
+ * and *RCL leave it as is, while *RST, *RCL, commands without value (events
+ * such as INIT or SYST:PRES) and anything not understood (eg. compound
+ * commands) flush it. As optional SCPI nodes can not be known, setting a
+ * header also invalidates all cached headers whose nodes are a subsequence
+ * of it, or which it is a subsequence of (VOLT vs. SOUR:VOLT:LEV).
+ *
+ * Relative values (VOLT UP, FREQ DOWN, INC, DEC) step the setting from its
+ * current value, so they are never redundant. They invalidate the header
+ * like any other set command but are not cached.
+ *
+ * Queries can have side effects (MEAS:VOLT:DC? reconfigures the instrument,
+ * READ? starts a measurement), which can not be told apart from plain
+ * setting queries without knowing the instrument. Only a query without
+ * parameters of a header which is cached (VOLT? after VOLT 5) leaves the
+ * cache as is, any other query flushes it. Scripts polling other queries
+ * (eg. SYST:ERR?) between set commands therefore get few cache hits.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "setcache.h"
+
+#define NODES_MAX 16
+
+enum command_type_t
+{
+    COMMAND_IGNORE, // Does not change cached state
+    COMMAND_FLUSH,  // May change any state
+    COMMAND_SET,    // Sets value of header
+    COMMAND_STEP,   // Changes value of header relative to current value
+    COMMAND_QUERY   // Queries value of header, no side effects if header is a setting
+};
+
+static bool vowel(char c)
+{
+    return (c == 'A') || (c == 'E') || (c == 'I') || (c == 'O') || (c == 'U');
+}
+
+// Normalize header to short form nodes, returns false if not understood
+static bool header_normalize(const char *header, int length, char *normalized, int size)
+{
+    char letters[SETCACHE_HEADER_LENGTH_MAX];
+    int i = 0, n = 0, out = 0, count, suffix;
+
+    // Leading colon is optional
+    if ((length > 0) && (header[0] == ':'))
+        i++;
+
+    while (i < length)
+    {
+        // Keyword letters
+        count = 0;
+        while ((i < length) && isalpha((unsigned char) header[i]))
+        {
+            if (count < (int) sizeof(letters) - 1)
+                letters[count++] = toupper((unsigned char) header[i]);
+            i++;
+        }
+        if (count == 0)
+            return false;
+
+        // Short form is four characters, three if the fourth is a vowel
+        if (count > 4)
+            count = vowel(letters[3]) ? 3 : 4;
+
+        // Numeric suffix (1 is the default)
+        suffix = 1;
+        if ((i < length) && isdigit((unsigned char) header[i]))
+        {
+            suffix = 0;
+            while ((i < length) && isdigit((unsigned char) header[i]))
+                suffix = suffix * 10 + (header[i++] - '0');
+        }
+
+        if ((i < length) && (header[i] != ':'))
+            return false;
+        i++;
+
+        if (++n > NODES_MAX)
+            return false;
+
+        if (out + count + 12 >= size)
+            return false;
+        if (out > 0)
+            normalized[out++] = ':';
+        memcpy(&normalized[out], letters, count);
+        out += count;
+        if (suffix != 1)
+            out += sprintf(&normalized[out], "%d", suffix);
+    }
+
+    normalized[out] = 0;
+
+    return out > 0;
+}
+
+// Upper case value with whitespace removed, except inside quotes
+static bool value_normalize(const char *value, int length, char *normalized, int size)
+{
+    char quote = 0;
+    int i, out = 0;
+
+    for (i = 0; i < length; i++)
+    {
+        char c = value[i];
+
+        if (quote)
+        {
+            if (c == quote)
+                quote = 0;
+        }
+        else if ((c == '"') || (c == '\''))
+            quote = c;
+        else if (isspace((unsigned char) c))
+            continue;
+        else
+            c = toupper((unsigned char) c);
+
+        if (out >= size - 1)
+            return false;
+        normalized[out++] = c;
+    }
+
+    normalized[out] = 0;
+
+    return true;
+}
+
+// Step value relative to current setting (eg. VOLT UP)
+static bool value_relative(const char *value)
+{
+    static const char *relative[] = { "UP", "DOWN", "INC", "INCR", "INCREMENT", "DEC", "DECR", "DECREMENT" };
+    unsigned int i;
+
+    for (i = 0; i < sizeof(relative) / sizeof(relative[0]); i++)
+    {
+        if (strcmp(value, relative[i]) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+static enum command_type_t command_parse(const char *command, int length,
+                                         char *header, char *value)
+{
+    int i, header_start, header_end;
+
+    // Skip surrounding whitespace and terminators
+    while ((length > 0) && isspace((unsigned char) command[length-1]))
+        length--;
+    for (i = 0; (i < length) && isspace((unsigned char) command[i]); i++);
+    if (i == length)
+        return COMMAND_IGNORE;
+
+    if (memchr(command, ';', length) != NULL)
+        return COMMAND_FLUSH;
+
+    header_start = i;
+    while ((i < length) && !isspace((unsigned char) command[i]))
+        i++;
+    header_end = i;
+
+    if (command[header_start] == '*')
+    {
+        if ((header_end - header_start == 4) &&
+            ((strncasecmp(&command[header_start], "*RST", 4) == 0) ||
+             (strncasecmp(&command[header_start], "*RCL", 4) == 0)))
+            return COMMAND_FLUSH;
+        return COMMAND_IGNORE;
+    }
+
+    if (memchr(&command[header_start], '?', header_end - header_start) != NULL)
+    {
+        // Setting query is header with trailing '?' and no parameters
+        if ((command[header_end - 1] != '?') || (header_end != length) ||
+            (memchr(&command[header_start], '?', header_end - header_start - 1) != NULL))
+            return COMMAND_FLUSH;
+
+        if (!header_normalize(&command[header_start], header_end - header_start - 1,
+                              header, SETCACHE_HEADER_LENGTH_MAX))
+            return COMMAND_FLUSH;
+
+        return COMMAND_QUERY;
+    }
+
+    // Events without value may change any state
+    if (header_end == length)
+        return COMMAND_FLUSH;
+
+    if (!header_normalize(&command[header_start], header_end - header_start,
+                          header, SETCACHE_HEADER_LENGTH_MAX))
+        return COMMAND_FLUSH;
+
+    if (!value_normalize(&command[header_end], length - header_end,
+                         value, SETCACHE_VALUE_LENGTH_MAX))
+        return COMMAND_FLUSH;
+
+    if (value_relative(value))
+        return COMMAND_STEP;
+
+    return COMMAND_SET;
+}
+
+static bool value_equal(const char *a, const char *b)
+{
+    char *end_a, *end_b;
+    double number_a, number_b;
+
+    if (strcmp(a, b) == 0)
+        return true;
+
+    // Compare numbers by value (5 vs. 5.0 vs. 5E0)
+    number_a = strtod(a, &end_a);
+    number_b = strtod(b, &end_b);
+    if ((end_a != a) && (*end_a == 0) && (end_b != b) && (*end_b == 0))
+        return number_a == number_b;
+
+    return false;
+}
+
+// Check if nodes of header a appear in order in header b
+static bool header_subsequence(const char *a, const char *b)
+{
+    char nodes_a[SETCACHE_HEADER_LENGTH_MAX], nodes_b[SETCACHE_HEADER_LENGTH_MAX];
+    char *save_a, *save_b, *node_a, *node_b;
+
+    strcpy(nodes_a, a);
+    strcpy(nodes_b, b);
+
+    node_a = strtok_r(nodes_a, ":", &save_a);
+    node_b = strtok_r(nodes_b, ":", &save_b);
+    while ((node_a != NULL) && (node_b != NULL))
+    {
+        if (strcmp(node_a, node_b) == 0)
+            node_a = strtok_r(NULL, ":", &save_a);
+        node_b = strtok_r(NULL, ":", &save_b);
+    }
+
+    return node_a == NULL;
+}
+
+void setcache_flush(struct setcache_t *cache)
+{
+    cache->count = 0;
+}
+
+// Check if command would not change cached instrument state
+bool setcache_redundant(struct setcache_t *cache, const char *command, int length)
+{
+    char header[SETCACHE_HEADER_LENGTH_MAX];
+    char value[SETCACHE_VALUE_LENGTH_MAX];
+    int i;
+
+    if (command_parse(command, length, header, value) != COMMAND_SET)
+        return false;
+
+    for (i = 0; i < cache->count; i++)
+    {
+        if ((strcmp(cache->entry[i].header, header) == 0) &&
+            value_equal(cache->entry[i].value, value))
+        {
+            cache->hits++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Record command which has been sent to instrument
+void setcache_update(struct setcache_t *cache, const char *command, int length)
+{
+    char header[SETCACHE_HEADER_LENGTH_MAX];
+    char value[SETCACHE_VALUE_LENGTH_MAX];
+    enum command_type_t type;
+    int i, j;
+
+    type = command_parse(command, length, header, value);
+    switch (type)
+    {
+        case COMMAND_IGNORE:
+            return;
+
+        case COMMAND_FLUSH:
+            setcache_flush(cache);
+            return;
+
+        case COMMAND_QUERY:
+            // Query of cached setting, anything else may have side effects
+            for (i = 0; i < cache->count; i++)
+                if (strcmp(cache->entry[i].header, header) == 0)
+                    return;
+            setcache_flush(cache);
+            return;
+
+        case COMMAND_SET:
+        case COMMAND_STEP:
+            break;
+    }
+
+    // Invalidate entries which may refer to same setting
+    for (i = 0, j = 0; i < cache->count; i++)
+    {
+        if (header_subsequence(cache->entry[i].header, header) ||
+            header_subsequence(header, cache->entry[i].header))
+            continue;
+        if (i != j)
+            cache->entry[j] = cache->entry[i];
+        j++;
+    }
+    cache->count = j;
+
+    // New value depends on previous one, which is not known
+    if (type == COMMAND_STEP)
+        return;
+
+    // Drop oldest entry when full
+    if (cache->count == SETCACHE_ENTRIES_MAX)
+    {
+        memmove(&cache->entry[0], &cache->entry[1], sizeof(struct setcache_entry_t) * (SETCACHE_ENTRIES_MAX - 1));
+        cache->count--;
+    }
+
+    strcpy(cache->entry[cache->count].header, header);
+    strcpy(cache->entry[cache->count].value, value);
+    cache->count++;
+}
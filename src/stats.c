@@ -0,0 +1,374 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Live statistics of running 'lxi run' scripts
+ *
+ * The script process listens on a Unix socket named after its pid in
+ * $XDG_RUNTIME_DIR (or /tmp). A client connects, sends "text" or "json" and
+ * receives one snapshot of the counters before the connection is closed:
+ * Lua memory (tracked by the allocator of the Lua state), loop iterations
+ * marked by stats_iteration() and per session request, error, byte and
+ * latency percentile counters kept by the Lua bindings.
+ *
+ * 'lxi stats <pid>' is the client.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <lua.h>
+#include "error.h"
+#include "misc.h"
+#include "lxilua.h"
+#include "stats.h"
+
+#define REQUEST_LENGTH_MAX 16
+#define REQUEST_TIMEOUT 1000 // ms
+
+static size_t lua_memory = 0;
+static double time_start;
+static const char *stats_script;
+static char socket_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+static int server_socket = -1;
+
+static double time_now(void)
+{
+    struct timespec time_spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &time_spec);
+
+    return time_spec.tv_sec + time_spec.tv_nsec * 0.000000001;
+}
+
+static int stats_socket_path(int pid, char *path, size_t size)
+{
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    int length;
+
+    if ((dir == NULL) || (strlen(dir) == 0))
+        dir = "/tmp";
+
+    length = snprintf(path, size, "%s/lxi-stats-%d.sock", dir, pid);
+    if ((length < 0) || ((size_t) length >= size))
+        return -1;
+
+    return 0;
+}
+
+// Lua allocator which keeps track of memory used by the Lua state
+static void *stats_lua_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    void *ptr_new;
+
+    UNUSED(ud);
+
+    // For new blocks osize encodes object type, not size
+    if (ptr == NULL)
+        osize = 0;
+
+    if (nsize == 0)
+    {
+        free(ptr);
+        __atomic_sub_fetch(&lua_memory, osize, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    ptr_new = realloc(ptr, nsize);
+    if (ptr_new != NULL)
+    {
+        __atomic_add_fetch(&lua_memory, nsize, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&lua_memory, osize, __ATOMIC_RELAXED);
+    }
+
+    return ptr_new;
+}
+
+static int stats_lua_panic(lua_State *L)
+{
+    error_printf("PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+    return 0;
+}
+
+// Same as luaL_newstate() but with memory accounting
+lua_State *stats_lua_newstate(void)
+{
+    lua_State *L = lua_newstate(stats_lua_alloc, NULL);
+
+    if (L != NULL)
+        lua_atpanic(L, stats_lua_panic);
+
+    return L;
+}
+
+struct snapshot_t
+{
+    FILE *f;
+    bool json;
+    int count;
+};
+
+static void snapshot_session(const struct lua_session_info_t *info, void *data)
+{
+    struct snapshot_t *snapshot = data;
+    FILE *f = snapshot->f;
+    double p50 = lua_latency_percentile(info->latency_histogram, 50);
+    double p90 = lua_latency_percentile(info->latency_histogram, 90);
+    double p99 = lua_latency_percentile(info->latency_histogram, 99);
+
+    if (snapshot->json)
+    {
+        fprintf(f, "%s{\"address\":", snapshot->count > 0 ? "," : "");
+        json_string(f, info->address, strlen(info->address));
+        fprintf(f, ",\"name\":");
+        json_string(f, info->name, strlen(info->name));
+        fprintf(f, ",\"requests\":%lu,\"errors\":%lu,\"bytes_sent\":%llu,\"bytes_received\":%llu,"
+                   "\"latency_p50\":%g,\"latency_p90\":%g,\"latency_p99\":%g,\"latency_max\":%g}",
+                info->requests, info->errors, info->bytes_sent, info->bytes_received,
+                p50, p90, p99, info->latency_max);
+    }
+    else
+    {
+        fprintf(f, "%-20s %-10s %10lu %8lu %12llu %12llu %9.3f %9.3f %9.3f %9.3f\n",
+                info->address, info->name, info->requests, info->errors,
+                info->bytes_sent, info->bytes_received,
+                p50 * 1000, p90 * 1000, p99 * 1000, info->latency_max * 1000);
+    }
+
+    snapshot->count++;
+}
+
+static void snapshot_write(FILE *f, bool json)
+{
+    struct snapshot_t snapshot = { f, json, 0 };
+    struct lua_iteration_info_t iterations;
+    double now = time_now();
+    double uptime = now - time_start;
+    double rate, age;
+    size_t memory = __atomic_load_n(&lua_memory, __ATOMIC_RELAXED);
+
+    lua_iterations_get(&iterations);
+    rate = (iterations.interval > 0) ? 1 / iterations.interval : 0;
+    age = (iterations.count > 0) ? now - iterations.last : uptime;
+
+    if (json)
+    {
+        fprintf(f, "{\"pid\":%d,\"script\":", getpid());
+        json_string(f, stats_script, strlen(stats_script));
+        fprintf(f, ",\"uptime\":%.3f,\"lua_memory\":%zu,\"iterations\":%lu,"
+                   "\"iteration_rate\":%g,\"iteration_age\":%.3f,\"instruments\":[",
+                uptime, memory, iterations.count, rate, age);
+        lua_sessions_foreach(snapshot_session, &snapshot);
+        fprintf(f, "]}\n");
+        return;
+    }
+
+    fprintf(f, "Script:      %s (pid %d)\n", stats_script, getpid());
+    fprintf(f, "Uptime:      %.1f s\n", uptime);
+    fprintf(f, "Lua memory:  %zu bytes\n", memory);
+    if (iterations.count > 0)
+        fprintf(f, "Iterations:  %lu (%.3f/s, last %.3f s ago)\n", iterations.count, rate, age);
+    else
+        fprintf(f, "Iterations:  0 (mark loop iterations with stats_iteration())\n");
+    fprintf(f, "\n%-20s %-10s %10s %8s %12s %12s %9s %9s %9s %9s\n",
+            "Address", "Name", "Requests", "Errors", "Sent", "Received",
+            "p50 [ms]", "p90 [ms]", "p99 [ms]", "max [ms]");
+    lua_sessions_foreach(snapshot_session, &snapshot);
+}
+
+static void client_serve(int client)
+{
+    char request[REQUEST_LENGTH_MAX] = {};
+    struct pollfd pfd = { client, POLLIN, 0 };
+    char *buffer = NULL;
+    size_t length = 0, offset = 0;
+    ssize_t n;
+    FILE *f;
+
+    // Request is "json" or "text" (default)
+    if (poll(&pfd, 1, REQUEST_TIMEOUT) > 0)
+    {
+        n = read(client, request, sizeof(request) - 1);
+        if (n < 0)
+            return;
+    }
+
+    f = open_memstream(&buffer, &length);
+    if (f == NULL)
+        return;
+    snapshot_write(f, strncmp(request, "json", 4) == 0);
+    fclose(f);
+
+    while (offset < length)
+    {
+        n = write(client, buffer + offset, length - offset);
+        if (n <= 0)
+            break;
+        offset += n;
+    }
+
+    free(buffer);
+}
+
+static void *server_thread(void *data)
+{
+    int client;
+
+    UNUSED(data);
+
+    while (true)
+    {
+        client = accept(server_socket, NULL, NULL);
+        if (client < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        client_serve(client);
+        close(client);
+    }
+
+    return NULL;
+}
+
+static void server_cleanup(void)
+{
+    unlink(socket_path);
+}
+
+int stats_server_start(const char *script)
+{
+    struct sockaddr_un address = {};
+    pthread_t thread;
+
+    time_start = time_now();
+    stats_script = script;
+
+    if (stats_socket_path(getpid(), socket_path, sizeof(socket_path)) != 0)
+        return -1;
+
+    server_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server_socket < 0)
+        return -1;
+
+    // Remove stale socket left by earlier process with same pid
+    unlink(socket_path);
+
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+    if ((bind(server_socket, (struct sockaddr *) &address, sizeof(address)) != 0) ||
+        (chmod(socket_path, S_IRUSR | S_IWUSR) != 0) ||
+        (listen(server_socket, 8) != 0))
+        goto error;
+
+    atexit(server_cleanup);
+
+    if (pthread_create(&thread, NULL, server_thread, NULL) != 0)
+        goto error;
+    pthread_detach(thread);
+
+    return 0;
+
+error:
+    error_printf("Failed to set up stats socket %s (%s)\n", socket_path, strerror(errno));
+    close(server_socket);
+    server_socket = -1;
+    return -1;
+}
+
+static int stats_fetch(int pid, bool json)
+{
+    struct sockaddr_un address = {};
+    char buffer[4096];
+    const char *request = json ? "json\n" : "text\n";
+    ssize_t n;
+    int s;
+
+    address.sun_family = AF_UNIX;
+    if (stats_socket_path(pid, address.sun_path, sizeof(address.sun_path)) != 0)
+        return 1;
+
+    s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s < 0)
+        return 1;
+
+    if (connect(s, (struct sockaddr *) &address, sizeof(address)) != 0)
+    {
+        error_printf("No running lxi script with pid %d (%s)\n", pid, strerror(errno));
+        close(s);
+        return 1;
+    }
+
+    if (write(s, request, strlen(request)) < 0)
+    {
+        close(s);
+        return 1;
+    }
+
+    while ((n = read(s, buffer, sizeof(buffer))) > 0)
+        fwrite(buffer, 1, n, stdout);
+    fflush(stdout);
+
+    close(s);
+
+    return 0;
+}
+
+int stats(int pid, bool json, double interval)
+{
+    if (pid <= 0)
+    {
+        error_printf("Missing pid\n");
+        return 1;
+    }
+
+    if (interval <= 0)
+        return stats_fetch(pid, json);
+
+    // Keep polling until script exits
+    while (stats_fetch(pid, json) == 0)
+    {
+        if (!json)
+            printf("\n");
+        usleep(interval * 1000000);
+    }
+
+    return 0;
+}
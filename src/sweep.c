@@ -0,0 +1,675 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lxi.h>
+#include "error.h"
+#include "misc.h"
+#include "results.h"
+#include "lxi_module.h"
+#include "sweep.h"
+
+#define SWEEP_SET_MAX 16
+#define SWEEP_MEASURE_MAX 64
+#define SWEEP_VALUES_MAX 1000000
+#define COMMAND_LENGTH_MAX 1000
+#define NAME_LENGTH_MAX 256
+#define RESPONSE_LENGTH_MAX 4096
+
+// Settle defaults
+#define SETTLE_COUNT 3
+#define SETTLE_TIMEOUT 10000 // ms
+
+struct sweep_command_t
+{
+    int device;
+    char command[COMMAND_LENGTH_MAX];
+    char name[NAME_LENGTH_MAX];
+    double value;
+    int status;
+};
+
+struct sweep_group_t
+{
+    pthread_t thread;
+    const struct lxi_module_api_t *api;
+    int device;
+    struct sweep_command_t *command[SWEEP_MEASURE_MAX];
+    int count;
+    double setpoint;
+    bool query;
+    bool pipeline;
+    bool threaded;
+};
+
+struct sweep_t
+{
+    double *values;
+    int values_count;
+    struct sweep_command_t set[SWEEP_SET_MAX];
+    int set_count;
+    struct sweep_command_t measure[SWEEP_MEASURE_MAX];
+    int measure_count;
+    bool settle;
+    struct sweep_command_t settle_query;
+    double settle_tolerance;
+    int settle_count;
+    int settle_interval;
+    int settle_timeout;
+    int delay;
+    bool pipeline;
+    int results;
+    char table[NAME_LENGTH_MAX];
+};
+
+static double time_now(void)
+{
+    struct timespec time_spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &time_spec);
+
+    return time_spec.tv_sec + time_spec.tv_nsec * 0.000000001;
+}
+
+static void sleep_ms(int ms)
+{
+    struct timespec time_spec;
+
+    time_spec.tv_sec = ms / 1000;
+    time_spec.tv_nsec = (ms % 1000) * 1000000L;
+    nanosleep(&time_spec, NULL);
+}
+
+// Only accept set command formats with one floating point conversion
+static bool format_valid(const char *format)
+{
+    const char *p = format;
+    int conversions = 0;
+
+    while ((p = strchr(p, '%')) != NULL)
+    {
+        p++;
+        if (*p == '%')
+        {
+            p++;
+            continue;
+        }
+
+        while ((*p != 0) && (strchr("-+ 0#", *p) != NULL))
+            p++;
+        while (isdigit((unsigned char) *p))
+            p++;
+        if (*p == '.')
+        {
+            p++;
+            while (isdigit((unsigned char) *p))
+                p++;
+        }
+        if ((*p == 0) || (strchr("eEfFgG", *p) == NULL))
+            return false;
+        conversions++;
+    }
+
+    return conversions <= 1;
+}
+
+// Send command and, if query, parse numeric response
+static int sweep_request(const struct lxi_module_api_t *api, struct sweep_command_t *c,
+                         const char *command, bool query)
+{
+    struct lxi_module_session_t info;
+    char buffer[COMMAND_LENGTH_MAX + 2];
+    char response[RESPONSE_LENGTH_MAX];
+    char *end;
+    int length;
+
+    if (api->session(c->device, &info) != 0)
+        return LXI_ERROR;
+
+    // RAW devices need newline terminated commands
+    length = snprintf(buffer, sizeof(buffer), info.protocol == RAW ? "%s\n" : "%s", command);
+
+    length = api->request(c->device, buffer, length, query ? response : NULL,
+                          sizeof(response) - 1, 0);
+    if (length < 0)
+        return LXI_ERROR;
+
+    if (query)
+    {
+        response[length] = 0;
+        c->value = strtod(response, &end);
+        if (end == response)
+            c->value = NAN;
+    }
+
+    return 0;
+}
+
+// Send all commands of device as one compound program message, eg.
+// "VOLT 1.000;:CURR 0.100" or "MEAS:VOLT?;:MEAS:CURR?" with ';' separated
+// responses, so the device is only waited for once
+static int sweep_group_pipelined(struct sweep_group_t *g)
+{
+    struct lxi_module_session_t info;
+    struct sweep_command_t *c;
+    size_t size = g->count * (COMMAND_LENGTH_MAX + 2) + 2, length = 0;
+    int response_size = g->count * RESPONSE_LENGTH_MAX;
+    char *message, *response = NULL, *p, *end;
+    int i, received, status = LXI_ERROR;
+
+    if (g->api->session(g->device, &info) != 0)
+        return LXI_ERROR;
+
+    message = malloc(size);
+    if (g->query)
+        response = malloc(response_size);
+    if ((message == NULL) || (g->query && (response == NULL)))
+    {
+        error_printf("Failure allocating memory for sweep commands\n");
+        goto out;
+    }
+
+    for (i = 0; i < g->count; i++)
+    {
+        c = g->command[i];
+
+        // Continue from root of command tree unless command is common or absolute
+        if (i > 0)
+            length += snprintf(message + length, size - length, "%s",
+                               ((c->command[0] == '*') || (c->command[0] == ':')) ? ";" : ";:");
+        if (length < size)
+        {
+            if (g->query)
+                length += snprintf(message + length, size - length, "%s", c->command);
+            else
+                length += snprintf(message + length, size - length, c->command, g->setpoint);
+        }
+        if (length >= size - 1)
+        {
+            error_printf("Sweep commands too long\n");
+            goto out;
+        }
+    }
+
+    // RAW devices need newline terminated commands
+    if (info.protocol == RAW)
+        message[length++] = '\n';
+
+    received = g->api->request(g->device, message, length, response, response_size - 1, 0);
+    if (received < 0)
+        goto out;
+
+    if (g->query)
+    {
+        response[received] = 0;
+        p = response;
+        for (i = 0; i < g->count; i++)
+        {
+            if (p == NULL)
+            {
+                error_printf("Sweep expected %d responses to %s\n", g->count, message);
+                goto out;
+            }
+
+            c = g->command[i];
+            c->value = strtod(p, &end);
+            if (end == p)
+                c->value = NAN;
+
+            p = strchr(p, ';');
+            if (p != NULL)
+                p++;
+        }
+    }
+
+    status = 0;
+
+out:
+    free(message);
+    free(response);
+    return status;
+}
+
+static void *sweep_group_run(void *arg)
+{
+    struct sweep_group_t *g = arg;
+    char command[COMMAND_LENGTH_MAX];
+    int i, status;
+
+    if (g->pipeline && (g->count > 1))
+    {
+        status = sweep_group_pipelined(g);
+        for (i = 0; i < g->count; i++)
+            g->command[i]->status = status;
+        return NULL;
+    }
+
+    for (i = 0; i < g->count; i++)
+    {
+        struct sweep_command_t *c = g->command[i];
+
+        if (g->query)
+            c->status = sweep_request(g->api, c, c->command, true);
+        else
+        {
+            snprintf(command, sizeof(command), c->command, g->setpoint);
+            c->status = sweep_request(g->api, c, command, false);
+        }
+    }
+
+    return NULL;
+}
+
+// Run commands, in parallel across devices and in order per device
+static int sweep_run(const struct lxi_module_api_t *api, struct sweep_command_t *commands,
+                     int count, bool query, bool pipeline, double setpoint)
+{
+    struct sweep_group_t group[SWEEP_MEASURE_MAX];
+    int groups = 0, i, j;
+
+    for (i = 0; i < count; i++)
+    {
+        for (j = 0; j < groups; j++)
+            if (group[j].device == commands[i].device)
+                break;
+
+        if (j == groups)
+        {
+            group[j].api = api;
+            group[j].device = commands[i].device;
+            group[j].count = 0;
+            group[j].setpoint = setpoint;
+            group[j].query = query;
+            group[j].pipeline = pipeline;
+            group[j].threaded = false;
+            groups++;
+        }
+        group[j].command[group[j].count++] = &commands[i];
+    }
+
+    if (groups == 1)
+        sweep_group_run(&group[0]);
+    else
+    {
+        for (i = 0; i < groups; i++)
+        {
+            if (pthread_create(&group[i].thread, NULL, sweep_group_run, &group[i]) == 0)
+                group[i].threaded = true;
+            else
+                sweep_group_run(&group[i]);
+        }
+        for (i = 0; i < groups; i++)
+            if (group[i].threaded)
+                pthread_join(group[i].thread, NULL);
+    }
+
+    for (i = 0; i < count; i++)
+        if (commands[i].status != 0)
+            return LXI_ERROR;
+
+    return 0;
+}
+
+// Poll until settle query readings stay within tolerance
+static int sweep_settle(const struct lxi_module_api_t *api, struct sweep_t *sw)
+{
+    double time_start = time_now(), previous = NAN;
+    int stable = 0;
+
+    while (stable < sw->settle_count)
+    {
+        if (sweep_request(api, &sw->settle_query, sw->settle_query.command, true) != 0)
+            return LXI_ERROR;
+
+        if (fabs(sw->settle_query.value - previous) <= sw->settle_tolerance)
+            stable++;
+        else
+            stable = 1;
+        previous = sw->settle_query.value;
+
+        if ((stable < sw->settle_count) && ((time_now() - time_start) * 1000 > sw->settle_timeout))
+        {
+            error_printf("Sweep settle timeout\n");
+            return LXI_ERROR;
+        }
+
+        if ((stable < sw->settle_count) && (sw->settle_interval > 0))
+            sleep_ms(sw->settle_interval);
+    }
+
+    return 0;
+}
+
+static double field_number(lua_State *L, int index, const char *name, double value)
+{
+    lua_getfield(L, index, name);
+    if (lua_isnumber(L, -1))
+        value = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    return value;
+}
+
+static int field_command(lua_State *L, int index, const char *key, struct sweep_command_t *c)
+{
+    const char *string;
+
+    lua_getfield(L, index, "device");
+    c->device = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : -1;
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, key);
+    string = lua_tostring(L, -1);
+    if ((string == NULL) || (strlen(string) >= COMMAND_LENGTH_MAX))
+    {
+        lua_pop(L, 1);
+        error_printf("Sweep entry requires device and %s\n", key);
+        return LXI_ERROR;
+    }
+    strcpy(c->command, string);
+    strip_trailing_space(c->command);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "name");
+    string = lua_tostring(L, -1);
+    if (string != NULL)
+        strncpy(c->name, string, NAME_LENGTH_MAX - 1);
+    lua_pop(L, 1);
+
+    return 0;
+}
+
+// Parse list of commands, accepting a single entry or an array of entries
+static int field_commands(lua_State *L, int index, const char *name, const char *key,
+                          struct sweep_command_t *commands, int max)
+{
+    int count = 0, i;
+
+    lua_getfield(L, index, name);
+    if (!lua_istable(L, -1))
+    {
+        lua_pop(L, 1);
+        return 0;
+    }
+
+    lua_rawgeti(L, -1, 1);
+    if (!lua_istable(L, -1))
+    {
+        lua_pop(L, 1);
+        count = field_command(L, lua_gettop(L), key, &commands[0]) == 0 ? 1 : LXI_ERROR;
+        lua_pop(L, 1);
+        return count;
+    }
+    lua_pop(L, 1);
+
+    for (i = 1; ; i++)
+    {
+        lua_rawgeti(L, -1, i);
+        if (!lua_istable(L, -1))
+        {
+            lua_pop(L, 1);
+            break;
+        }
+        if ((count == max) || (field_command(L, lua_gettop(L), key, &commands[count]) != 0))
+        {
+            lua_pop(L, 2);
+            return LXI_ERROR;
+        }
+        count++;
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 1);
+    return count;
+}
+
+static int sweep_parse(lua_State *L, struct sweep_t *sw)
+{
+    double start, stop, step;
+    const char *string;
+    int i;
+
+    // Set points as list or as start, stop and step
+    lua_getfield(L, 1, "values");
+    if (lua_istable(L, -1))
+    {
+        for (sw->values_count = 0; ; sw->values_count++)
+        {
+            lua_rawgeti(L, -1, sw->values_count + 1);
+            if (lua_isnil(L, -1))
+            {
+                lua_pop(L, 1);
+                break;
+            }
+            lua_pop(L, 1);
+        }
+        sw->values = malloc(sizeof(double) * (sw->values_count + 1));
+        if (sw->values == NULL)
+        {
+            lua_pop(L, 1);
+            error_printf("Failure allocating memory for sweep values\n");
+            return LXI_ERROR;
+        }
+        for (i = 0; i < sw->values_count; i++)
+        {
+            lua_rawgeti(L, -1, i + 1);
+            sw->values[i] = lua_tonumber(L, -1);
+            lua_pop(L, 1);
+        }
+    }
+    else
+    {
+        start = field_number(L, 1, "start", 0);
+        stop = field_number(L, 1, "stop", 0);
+        step = field_number(L, 1, "step", 0);
+        if ((step == 0) || ((stop - start) / step < 0) || ((stop - start) / step >= SWEEP_VALUES_MAX))
+        {
+            lua_pop(L, 1);
+            error_printf("Sweep requires values or valid start, stop and step\n");
+            return LXI_ERROR;
+        }
+        sw->values_count = floor((stop - start) / step + 1e-9) + 1;
+        sw->values = malloc(sizeof(double) * sw->values_count);
+        if (sw->values == NULL)
+        {
+            lua_pop(L, 1);
+            error_printf("Failure allocating memory for sweep values\n");
+            return LXI_ERROR;
+        }
+        for (i = 0; i < sw->values_count; i++)
+            sw->values[i] = start + i * step;
+    }
+    lua_pop(L, 1);
+
+    sw->set_count = field_commands(L, 1, "set", "command", sw->set, SWEEP_SET_MAX);
+    sw->measure_count = field_commands(L, 1, "measure", "query", sw->measure, SWEEP_MEASURE_MAX);
+    if ((sw->set_count < 0) || (sw->measure_count < 0))
+        return LXI_ERROR;
+
+    for (i = 0; i < sw->set_count; i++)
+    {
+        if (!format_valid(sw->set[i].command))
+        {
+            error_printf("Invalid sweep set command format: %s\n", sw->set[i].command);
+            return LXI_ERROR;
+        }
+    }
+
+    // Optional settle detection
+    lua_getfield(L, 1, "settle");
+    if (lua_istable(L, -1))
+    {
+        int index = lua_gettop(L);
+
+        if (field_command(L, index, "query", &sw->settle_query) != 0)
+        {
+            lua_pop(L, 1);
+            return LXI_ERROR;
+        }
+        sw->settle = true;
+        sw->settle_tolerance = field_number(L, index, "tolerance", 0);
+        sw->settle_count = field_number(L, index, "count", SETTLE_COUNT);
+        sw->settle_interval = field_number(L, index, "interval", 0);
+        sw->settle_timeout = field_number(L, index, "timeout", SETTLE_TIMEOUT);
+    }
+    lua_pop(L, 1);
+
+    sw->delay = field_number(L, 1, "delay", 0);
+
+    // Commands to same device are combined into one message unless disabled
+    lua_getfield(L, 1, "pipeline");
+    sw->pipeline = lua_isnil(L, -1) || lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    // Optional results sink
+    sw->results = -1;
+    lua_getfield(L, 1, "results");
+    if (lua_isnumber(L, -1))
+        sw->results = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, 1, "table");
+    string = lua_tostring(L, -1);
+    strncpy(sw->table, string != NULL ? string : "sweep", NAME_LENGTH_MAX - 1);
+    lua_pop(L, 1);
+
+    return 0;
+}
+
+static int sweep_results_columns(struct sweep_t *sw)
+{
+    const char *names[RESULTS_COLUMNS_MAX];
+    char generated[SWEEP_MEASURE_MAX][NAME_LENGTH_MAX];
+    int i;
+
+    names[0] = "setpoint";
+    for (i = 0; (i < sw->measure_count) && (i + 1 < RESULTS_COLUMNS_MAX); i++)
+    {
+        if (sw->measure[i].name[0] != 0)
+            names[i + 1] = sw->measure[i].name;
+        else
+        {
+            snprintf(generated[i], NAME_LENGTH_MAX, "measure%d", i + 1);
+            names[i + 1] = generated[i];
+        }
+    }
+
+    return results_columns(sw->results, sw->table, names, i + 1);
+}
+
+// lua: rows = sweep{values, set, settle, delay, measure, results, table}
+int lua_sweep(lua_State *L)
+{
+    const struct lxi_module_api_t *api = lxi_module_api(L);
+    struct results_value_t values[RESULTS_COLUMNS_MAX];
+    struct sweep_t *sw;
+    int i, j, row;
+
+    if ((api == NULL) || !lua_istable(L, 1))
+    {
+        error_printf("sweep requires a table argument\n");
+        lua_pushnil(L);
+        return 1;
+    }
+
+    sw = calloc(1, sizeof(struct sweep_t));
+    if (sw == NULL)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (sweep_parse(L, sw) != 0)
+        goto error;
+
+    if ((sw->results >= 0) && (sweep_results_columns(sw) != 0))
+        goto error;
+
+    // Rows of {setpoint, measurement1, measurement2, ...}
+    lua_createtable(L, sw->values_count, 0);
+
+    for (row = 0; row < sw->values_count; row++)
+    {
+        if (sweep_run(api, sw->set, sw->set_count, false, sw->pipeline, sw->values[row]) != 0)
+            goto error_run;
+
+        if (sw->delay > 0)
+            sleep_ms(sw->delay);
+
+        if (sw->settle && (sweep_settle(api, sw) != 0))
+            goto error_run;
+
+        if (sweep_run(api, sw->measure, sw->measure_count, true, sw->pipeline, 0) != 0)
+            goto error_run;
+
+        lua_createtable(L, sw->measure_count + 1, 0);
+        lua_pushnumber(L, sw->values[row]);
+        lua_rawseti(L, -2, 1);
+        for (i = 0; i < sw->measure_count; i++)
+        {
+            lua_pushnumber(L, sw->measure[i].value);
+            lua_rawseti(L, -2, i + 2);
+        }
+        lua_rawseti(L, -2, row + 1);
+
+        if (sw->results >= 0)
+        {
+            values[0].type = RESULTS_REAL;
+            values[0].real = sw->values[row];
+            for (j = 0; (j < sw->measure_count) && (j + 1 < RESULTS_COLUMNS_MAX); j++)
+            {
+                values[j + 1].type = RESULTS_REAL;
+                values[j + 1].real = sw->measure[j].value;
+            }
+            results_add(sw->results, sw->table, values, j + 1);
+        }
+    }
+
+    free(sw->values);
+    free(sw);
+    return 1;
+
+error_run:
+    error_printf("Sweep failed at set point %g\n", sw->values[row]);
+    lua_pop(L, 1);
+error:
+    free(sw->values);
+    free(sw);
+    lua_pushnil(L);
+    return 1;
+}
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+#include "error.h"
+#include "misc.h"
+#include "trace.h"
+
+#define TRACE_EVENTS_MAX 262144 // Per buffer
+#define TRACE_CHUNK_EVENTS 1024
+#define TRACE_CHUNKS_MAX (TRACE_EVENTS_MAX / TRACE_CHUNK_EVENTS)
+#define TRACE_DETAIL_LENGTH 48
+
+struct trace_event_t
+{
+    const char *name;
+    const char *category; // NULL for thread name metadata
+    long tid;
+    uint64_t start;
+    uint64_t duration;
+    char detail[TRACE_DETAIL_LENGTH];
+};
+
+// Each thread records into its own buffer, so recording takes no locks. Events
+// are allocated in chunks as they are recorded and the buffer is handed on to
+// a new thread when its thread exits.
+struct trace_buffer_t
+{
+    struct trace_buffer_t *next;
+    bool idle;
+    unsigned long count;
+    unsigned long dropped;
+    struct trace_event_t *chunk[TRACE_CHUNKS_MAX];
+};
+
+bool trace_enabled = false;
+
+static const char *trace_filename;
+static uint64_t trace_time_start;
+static pthread_key_t trace_key;
+static struct trace_buffer_t *trace_buffers = NULL;
+static __thread struct trace_buffer_t *trace_buffer = NULL;
+static __thread long trace_tid = 0;
+
+uint64_t trace_time(void)
+{
+    struct timespec time_spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &time_spec);
+
+    return (uint64_t) time_spec.tv_sec * 1000000000 + time_spec.tv_nsec;
+}
+
+// Release buffer of exiting thread for reuse, its events are kept for export
+static void trace_thread_exit(void *data)
+{
+    struct trace_buffer_t *buffer = data;
+
+    __atomic_store_n(&buffer->idle, true, __ATOMIC_RELEASE);
+}
+
+static struct trace_buffer_t *trace_buffer_get(void)
+{
+    struct trace_buffer_t *buffer = trace_buffer;
+    bool idle = true;
+
+    if (buffer != NULL)
+        return buffer;
+
+    trace_tid = syscall(SYS_gettid);
+
+    // Reuse buffer of an exited thread (eg. GUI worker threads)
+    for (buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer->next)
+    {
+        if (__atomic_compare_exchange_n(&buffer->idle, &idle, false, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        idle = true;
+    }
+
+    if (buffer == NULL)
+    {
+        buffer = calloc(1, sizeof(struct trace_buffer_t));
+        if (buffer == NULL)
+            return NULL;
+
+        // Lock-free push to list of thread buffers
+        buffer->next = __atomic_load_n(&trace_buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&trace_buffers, &buffer->next, buffer, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    pthread_setspecific(trace_key, buffer);
+    trace_buffer = buffer;
+
+    return buffer;
+}
+
+static struct trace_event_t *trace_event_new(struct trace_buffer_t *buffer, unsigned long count)
+{
+    struct trace_event_t **chunk;
+
+    if (count == TRACE_EVENTS_MAX)
+        return NULL;
+
+    chunk = &buffer->chunk[count / TRACE_CHUNK_EVENTS];
+
+    if (*chunk == NULL)
+        *chunk = malloc(sizeof(struct trace_event_t) * TRACE_CHUNK_EVENTS);
+    if (*chunk == NULL)
+        return NULL;
+
+    return &(*chunk)[count % TRACE_CHUNK_EVENTS];
+}
+
+static void trace_record(const char *name, const char *category, uint64_t start,
+                         const char *detail, int length)
+{
+    struct trace_buffer_t *buffer = trace_buffer_get();
+    struct trace_event_t *event;
+    unsigned long count;
+
+    if (buffer == NULL)
+        return;
+
+    count = buffer->count;
+    event = trace_event_new(buffer, count);
+    if (event == NULL)
+    {
+        buffer->dropped++;
+        return;
+    }
+
+    event->name = name;
+    event->category = category;
+    event->tid = trace_tid;
+    event->start = start;
+    event->duration = (category != NULL) ? trace_time() - start : 0;
+    // Detail need not be terminated, eg. raw command buffer
+    if (detail == NULL)
+        length = 0;
+    else if (length < 0)
+        length = strnlen(detail, TRACE_DETAIL_LENGTH - 1);
+    length = MIN(length, TRACE_DETAIL_LENGTH - 1);
+    if (length > 0)
+        memcpy(event->detail, detail, length);
+    event->detail[length] = 0;
+
+    // Publish event to exporter
+    __atomic_store_n(&buffer->count, count + 1, __ATOMIC_RELEASE);
+}
+
+void trace_thread_name(const char *name)
+{
+    if (trace_enabled)
+        trace_record(name, NULL, 0, NULL, 0);
+}
+
+void trace_event(const char *name, const char *category, uint64_t start, const char *detail, int length)
+{
+    trace_record(name, category, start, detail, length);
+}
+
+static void trace_write(void)
+{
+    struct trace_buffer_t *buffer;
+    unsigned long i, count;
+    bool first = true;
+    long pid = getpid();
+    FILE *file;
+
+    trace_enabled = false;
+
+    file = fopen(trace_filename, "w");
+    if (file == NULL)
+    {
+        error_printf("Could not open trace file %s\n", trace_filename);
+        return;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    for (buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer->next)
+    {
+        count = __atomic_load_n(&buffer->count, __ATOMIC_ACQUIRE);
+        for (i = 0; i < count; i++)
+        {
+            struct trace_event_t *event = &buffer->chunk[i / TRACE_CHUNK_EVENTS][i % TRACE_CHUNK_EVENTS];
+
+            // Thread name metadata
+            if (event->category == NULL)
+            {
+                fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%ld,\"args\":{\"name\":",
+                        first ? "" : ",\n", pid, event->tid);
+                json_string(file, event->name, strlen(event->name));
+                fprintf(file, "}}");
+                first = false;
+                continue;
+            }
+
+            // Complete events with microsecond timestamps
+            fprintf(file, "%s{\"name\":", first ? "" : ",\n");
+            json_string(file, event->name, strlen(event->name));
+            fprintf(file, ",\"cat\":");
+            json_string(file, event->category, strlen(event->category));
+            fprintf(file, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":%ld",
+                    (event->start - trace_time_start) / 1000.0, event->duration / 1000.0,
+                    pid, event->tid);
+            if (event->detail[0] != 0)
+            {
+                fprintf(file, ",\"args\":{\"detail\":");
+                json_string(file, event->detail, strlen(event->detail));
+                fprintf(file, "}");
+            }
+            fprintf(file, "}");
+            first = false;
+        }
+
+        if (buffer->dropped > 0)
+            error_printf("Trace buffer full, dropped %lu events\n", buffer->dropped);
+    }
+
+    fprintf(file, "\n]}\n");
+    fclose(file);
+}
+
+void trace_init(void)
+{
+    trace_filename = getenv("LXI_TRACE");
+    if ((trace_filename == NULL) || (trace_filename[0] == 0))
+        return;
+
+    if (pthread_key_create(&trace_key, trace_thread_exit) != 0)
+        return;
+
+    trace_time_start = trace_time();
+    trace_enabled = true;
+    trace_thread_name("main");
+
+    atexit(trace_write);
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Event tracer
+ *
+ * Enabled by setting the LXI_TRACE environment variable to the name of the
+ * trace file to write at exit. The file is in Chrome trace event JSON format
+ * and can be opened in chrome://tracing or https://ui.perfetto.dev
+ *
+ * Usage:
+ *   uint64_t start = trace_begin();
+ *   ...
+ *   trace_end("send", "io", start, command);
+ *
+ * Name, category and thread name must be string literals (pointers are
+ * recorded). Detail is copied and may be NULL, trace_end_length() takes a
+ * detail which is not NUL terminated (eg. command buffer).
+ */
+
+extern bool trace_enabled;
+
+void trace_init(void);
+void trace_thread_name(const char *name);
+uint64_t trace_time(void);
+void trace_event(const char *name, const char *category, uint64_t start, const char *detail, int length);
+
+static inline uint64_t trace_begin(void)
+{
+    return trace_enabled ? trace_time() : 0;
+}
+
+static inline void trace_end(const char *name, const char *category, uint64_t start, const char *detail)
+{
+    if (trace_enabled)
+        trace_event(name, category, start, detail, -1);
+}
+
+static inline void trace_end_length(const char *name, const char *category, uint64_t start,
+                                    const char *detail, int length)
+{
+    if (trace_enabled)
+        trace_event(name, category, start, detail, length);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,1014 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Native VXI-11 core channel client
+ *
+ * Implements the subset of ONC RPC (RFC 5531) and VXI-11 core channel needed
+ * for SCPI communication directly on top of TCP sockets. Compared to a
+ * generic RPC library this avoids per call XDR (de)serialization and
+ * allocations:
+ *
+ *  - device_write and device_read calls are pre-encoded once per link and
+ *    only the xid, timeout, flags and length fields are patched per request
+ *  - transmit and receive buffers are owned by the channel and reused
+ *  - a query sends its device_write and device_read calls back to back in a
+ *    single writev() and the replies are typically returned by one recv()
+ *  - links to logical devices on the same host (eg. "gpib0,5" and "gpib0,7"
+ *    behind one LAN/GPIB gateway) share one TCP connection
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "error.h"
+#include "misc.h"
+#include "vxi11.h"
+
+#define VXI11_CHANNELS_MAX 64
+#define ADDRESS_LENGTH_MAX 256
+#define NAME_LENGTH_MAX 256
+#define RX_BUFFER_SIZE 0x10000
+#define RECORD_LENGTH_MAX 0x4000000
+#define TIMEOUT_MARGIN 1000 // ms
+#define READ_TIMEOUT -2
+
+// ONC RPC
+#define RPC_CALL 0
+#define RPC_REPLY 1
+#define RPC_VERSION 2
+#define RPC_MSG_ACCEPTED 0
+#define RPC_SUCCESS 0
+#define RECORD_LAST 0x80000000
+
+// Portmapper
+#define PORTMAP_PORT 111
+#define PORTMAP_PROGRAM 100000
+#define PORTMAP_VERSION 2
+#define PORTMAP_GETPORT 3
+#define PORTMAP_TCP 6
+
+// VXI-11 core channel
+#define DEVICE_CORE 0x0607AF
+#define DEVICE_CORE_VERSION 1
+#define CREATE_LINK 10
+#define DEVICE_WRITE 11
+#define DEVICE_READ 12
+#define DEVICE_LOCK 18
+#define DEVICE_UNLOCK 19
+#define DESTROY_LINK 23
+#define FLAG_WAITLOCK 0x01
+#define FLAG_END 0x08
+#define REASON_END 0x04
+
+// Encoded call lengths including record mark
+#define CALL_HEADER_LENGTH 44
+#define WRITE_CALL_LENGTH (CALL_HEADER_LENGTH + 20)
+#define READ_CALL_LENGTH (CALL_HEADER_LENGTH + 24)
+
+struct vxi11_channel_t
+{
+    bool allocated;
+    bool failed; // Not connected, (re)connected on next use
+    char address[ADDRESS_LENGTH_MAX];
+    int socket;
+    int users;
+    unsigned int generation; // Incremented for every connection
+    uint32_t xid;
+    pthread_mutex_t mutex;
+
+    // Reused receive stream buffer and reassembled record buffer
+    unsigned char *rx;
+    size_t rx_start;
+    size_t rx_end;
+    unsigned char *record;
+    size_t record_size;
+};
+
+struct vxi11_link_t
+{
+    bool allocated;
+    int channel;
+    unsigned int generation; // Channel connection the link was created on
+    char name[NAME_LENGTH_MAX + 1];
+    uint32_t lid;
+    uint32_t max_recv_size;
+    unsigned char write_call[WRITE_CALL_LENGTH];
+    unsigned char read_call[READ_CALL_LENGTH];
+    struct vxi11_stats_t stats;
+};
+
+static struct vxi11_channel_t channels[VXI11_CHANNELS_MAX];
+static struct vxi11_link_t links[VXI11_LINKS_MAX];
+static pthread_mutex_t vxi11_mutex = PTHREAD_MUTEX_INITIALIZER;
+static const unsigned char padding[4];
+
+static double time_now(void)
+{
+    struct timespec time_spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &time_spec);
+
+    return time_spec.tv_sec + time_spec.tv_nsec * 0.000000001;
+}
+
+static inline void put32(unsigned char *p, uint32_t value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static inline uint32_t get32(const unsigned char *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static inline size_t pad4(size_t length)
+{
+    return (4 - (length & 3)) & 3;
+}
+
+// Encode record mark and call header with null credentials
+static void call_header(unsigned char *p, uint32_t program, uint32_t version,
+                        uint32_t procedure, size_t length)
+{
+    memset(p, 0, CALL_HEADER_LENGTH);
+    put32(p, RECORD_LAST | (length - 4));
+    put32(p + 8, RPC_CALL);
+    put32(p + 12, RPC_VERSION);
+    put32(p + 16, program);
+    put32(p + 20, version);
+    put32(p + 24, procedure);
+}
+
+static void stats_update(struct vxi11_stats_t *stats, double time)
+{
+    if (stats == NULL)
+        return;
+
+    if ((stats->rpcs == 0) || (time < stats->rpc_min))
+        stats->rpc_min = time;
+    if (time > stats->rpc_max)
+        stats->rpc_max = time;
+    stats->rpc_total += time;
+    stats->rpcs++;
+}
+
+static int channel_send(struct vxi11_channel_t *ch, struct iovec *iov, int iovcnt,
+                        struct vxi11_stats_t *stats)
+{
+    ssize_t n;
+
+    while (iovcnt > 0)
+    {
+        n = writev(ch->socket, iov, iovcnt);
+        if (stats != NULL)
+            stats->syscalls++;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ch->failed = true;
+            return -1;
+        }
+
+        // Skip fully sent vectors and adjust partially sent one
+        while ((iovcnt > 0) && ((size_t) n >= iov->iov_len))
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+static int channel_wait(struct vxi11_channel_t *ch, double deadline, struct vxi11_stats_t *stats)
+{
+    struct pollfd pfd;
+    int remaining, status;
+
+    pfd.fd = ch->socket;
+    pfd.events = POLLIN;
+
+    do
+    {
+        remaining = (deadline - time_now()) * 1000;
+        if (remaining < 0)
+            remaining = 0;
+        status = poll(&pfd, 1, remaining);
+        if (stats != NULL)
+            stats->syscalls++;
+    } while ((status < 0) && (errno == EINTR));
+
+    return status > 0 ? 0 : -1;
+}
+
+// Read exactly length bytes from stream, returns READ_TIMEOUT if deadline
+// passed before any byte was consumed
+static int channel_read(struct vxi11_channel_t *ch, unsigned char *data, size_t length,
+                        double deadline, struct vxi11_stats_t *stats)
+{
+    size_t available, requested = length;
+    ssize_t n;
+
+    while (length > 0)
+    {
+        available = ch->rx_end - ch->rx_start;
+        if (available > 0)
+        {
+            if (available > length)
+                available = length;
+            memcpy(data, ch->rx + ch->rx_start, available);
+            ch->rx_start += available;
+            data += available;
+            length -= available;
+            continue;
+        }
+
+        // Try without blocking first, most replies are already waiting
+        ch->rx_start = ch->rx_end = 0;
+        for (;;)
+        {
+            if (length >= RX_BUFFER_SIZE)
+                n = recv(ch->socket, data, length, MSG_DONTWAIT);
+            else
+                n = recv(ch->socket, ch->rx, RX_BUFFER_SIZE, MSG_DONTWAIT);
+            if (stats != NULL)
+                stats->syscalls++;
+
+            if (n > 0)
+                break;
+            if ((n == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)))
+                return -1;
+            if (channel_wait(ch, deadline, stats) != 0)
+                return length == requested ? READ_TIMEOUT : -1;
+        }
+
+        // Large payloads are received directly into destination
+        if (length >= RX_BUFFER_SIZE)
+        {
+            data += n;
+            length -= n;
+        }
+        else
+            ch->rx_end = n;
+    }
+
+    return 0;
+}
+
+// Receive one complete (possibly fragmented) record into record buffer
+static int channel_record(struct vxi11_channel_t *ch, size_t *length,
+                          double deadline, struct vxi11_stats_t *stats)
+{
+    unsigned char mark[4];
+    uint32_t fragment;
+    bool last, boundary = true;
+    int status;
+
+    *length = 0;
+
+    do
+    {
+        status = channel_read(ch, mark, 4, deadline, stats);
+
+        // Nothing consumed, stream is still at a record boundary
+        if ((status == READ_TIMEOUT) && boundary)
+            return -1;
+        if (status != 0)
+            goto error;
+        boundary = false;
+
+        fragment = get32(mark) & ~RECORD_LAST;
+        last = get32(mark) & RECORD_LAST;
+
+        if (*length + fragment > RECORD_LENGTH_MAX)
+            goto error;
+
+        if (*length + fragment > ch->record_size)
+        {
+            unsigned char *record = realloc(ch->record, *length + fragment);
+            if (record == NULL)
+                goto error;
+            ch->record = record;
+            ch->record_size = *length + fragment;
+        }
+
+        if (channel_read(ch, ch->record + *length, fragment, deadline, stats) != 0)
+            goto error;
+
+        *length += fragment;
+    } while (!last);
+
+    return 0;
+
+error:
+    // Stream position is unknown after partial record, reconnect on next use
+    ch->failed = true;
+    return -1;
+}
+
+// Receive accepted reply to call xid, returns pointer to results
+static const unsigned char *channel_reply(struct vxi11_channel_t *ch, uint32_t xid,
+                                          size_t *length, double deadline,
+                                          struct vxi11_stats_t *stats)
+{
+    const unsigned char *p;
+    size_t record_length, offset;
+
+    for (;;)
+    {
+        if (channel_record(ch, &record_length, deadline, stats) != 0)
+            return NULL;
+
+        p = ch->record;
+        if (record_length < 24)
+            return NULL;
+
+        // Skip late replies to calls which have already timed out
+        if (get32(p) != xid)
+            continue;
+
+        if ((get32(p + 4) != RPC_REPLY) || (get32(p + 8) != RPC_MSG_ACCEPTED))
+            return NULL;
+
+        offset = 20 + get32(p + 16) + pad4(get32(p + 16));
+        if ((offset + 4 > record_length) || (get32(p + offset) != RPC_SUCCESS))
+            return NULL;
+
+        offset += 4;
+        *length = record_length - offset;
+        return p + offset;
+    }
+}
+
+// Send single call and wait for its reply
+static const unsigned char *channel_call(struct vxi11_channel_t *ch, unsigned char *call,
+                                         size_t call_length, size_t *reply_length,
+                                         int timeout, struct vxi11_stats_t *stats)
+{
+    const unsigned char *reply;
+    struct iovec iov = { call, call_length };
+    uint32_t xid = ++ch->xid;
+    double time_start = time_now();
+
+    put32(call + 4, xid);
+
+    if (channel_send(ch, &iov, 1, stats) != 0)
+        return NULL;
+
+    reply = channel_reply(ch, xid, reply_length, time_start + (timeout + TIMEOUT_MARGIN) / 1000.0, stats);
+    if (reply != NULL)
+        stats_update(stats, time_now() - time_start);
+
+    return reply;
+}
+
+static int portmap_getport(const char *address, int timeout)
+{
+    struct vxi11_channel_t ch;
+    unsigned char call[CALL_HEADER_LENGTH + 16];
+    const unsigned char *reply;
+    size_t length;
+    int port = -1;
+
+    memset(&ch, 0, sizeof(ch));
+    ch.socket = socket_connect(address, PORTMAP_PORT, timeout);
+    if (ch.socket < 0)
+        return -1;
+    ch.rx = malloc(RX_BUFFER_SIZE);
+    if (ch.rx == NULL)
+        goto out;
+
+    call_header(call, PORTMAP_PROGRAM, PORTMAP_VERSION, PORTMAP_GETPORT, sizeof(call));
+    put32(call + CALL_HEADER_LENGTH, DEVICE_CORE);
+    put32(call + CALL_HEADER_LENGTH + 4, DEVICE_CORE_VERSION);
+    put32(call + CALL_HEADER_LENGTH + 8, PORTMAP_TCP);
+    put32(call + CALL_HEADER_LENGTH + 12, 0);
+
+    reply = channel_call(&ch, call, sizeof(call), &length, timeout, NULL);
+    if ((reply != NULL) && (length >= 4) && (get32(reply) != 0))
+        port = get32(reply);
+
+out:
+    close(ch.socket);
+    free(ch.rx);
+    free(ch.record);
+    return port;
+}
+
+// Release channel reference, caller holds vxi11_mutex
+static void channel_put(int index)
+{
+    struct vxi11_channel_t *ch = &channels[index];
+
+    if (--ch->users > 0)
+        return;
+
+    if (ch->socket >= 0)
+        close(ch->socket);
+    free(ch->rx);
+    free(ch->record);
+    pthread_mutex_destroy(&ch->mutex);
+    memset(ch, 0, sizeof(*ch));
+}
+
+// Get core channel to address, shared by all links to same address. Caller
+// holds vxi11_mutex, a new channel is connected on first use (channel_connect)
+static int channel_get(const char *address)
+{
+    int i, free_index = -1;
+    struct vxi11_channel_t *ch;
+
+    for (i = 0; i < VXI11_CHANNELS_MAX; i++)
+    {
+        if (channels[i].allocated && (strcmp(channels[i].address, address) == 0))
+        {
+            channels[i].users++;
+            return i;
+        }
+        if (!channels[i].allocated && (free_index < 0))
+            free_index = i;
+    }
+
+    if (free_index < 0)
+    {
+        error_printf("Too many VXI-11 connections\n");
+        return -1;
+    }
+
+    ch = &channels[free_index];
+    memset(ch, 0, sizeof(*ch));
+    ch->rx = malloc(RX_BUFFER_SIZE);
+    if (ch->rx == NULL)
+        return -1;
+
+    strncpy(ch->address, address, ADDRESS_LENGTH_MAX - 1);
+    pthread_mutex_init(&ch->mutex, NULL);
+    ch->socket = -1;
+    ch->failed = true;
+    ch->users = 1;
+    ch->allocated = true;
+
+    return free_index;
+}
+
+// (Re)connect failed or new core channel, caller holds channel mutex
+static int channel_connect(struct vxi11_channel_t *ch, int timeout)
+{
+    int port;
+
+    if (!ch->failed)
+        return 0;
+
+    if (ch->socket >= 0)
+    {
+        close(ch->socket);
+        ch->socket = -1;
+    }
+    ch->rx_start = ch->rx_end = 0;
+
+    port = portmap_getport(ch->address, timeout);
+    if (port < 0)
+    {
+        error_printf("Failed to look up VXI-11 core channel port of %s\n", ch->address);
+        return -1;
+    }
+
+    ch->socket = socket_connect(ch->address, port, timeout);
+    if (ch->socket < 0)
+    {
+        error_printf("Failed to connect VXI-11 core channel of %s\n", ch->address);
+        return -1;
+    }
+
+    // Links created on previous connection are gone on device side
+    ch->generation++;
+    ch->failed = false;
+
+    return 0;
+}
+
+// Create link on current channel connection, caller holds channel mutex
+static int link_create(struct vxi11_channel_t *ch, struct vxi11_link_t *l, int timeout)
+{
+    unsigned char call[CALL_HEADER_LENGTH + 16 + NAME_LENGTH_MAX + 4];
+    const unsigned char *reply;
+    size_t length, name_length = strlen(l->name);
+
+    // create_link(clientId, lockDevice, lock_timeout, device)
+    length = CALL_HEADER_LENGTH + 16 + name_length + pad4(name_length);
+    call_header(call, DEVICE_CORE, DEVICE_CORE_VERSION, CREATE_LINK, length);
+    put32(call + CALL_HEADER_LENGTH, l - links);
+    put32(call + CALL_HEADER_LENGTH + 4, 0);
+    put32(call + CALL_HEADER_LENGTH + 8, 0);
+    put32(call + CALL_HEADER_LENGTH + 12, name_length);
+    memcpy(call + CALL_HEADER_LENGTH + 16, l->name, name_length);
+    memset(call + CALL_HEADER_LENGTH + 16 + name_length, 0, pad4(name_length));
+
+    reply = channel_call(ch, call, length, &length, timeout, &l->stats);
+    if ((reply == NULL) || (length < 16) || (get32(reply) != 0))
+    {
+        error_printf("Failed to create VXI-11 link to %s (%s)\n", ch->address, l->name);
+        return -1;
+    }
+
+    l->lid = get32(reply + 4);
+    l->max_recv_size = get32(reply + 12);
+    if (l->max_recv_size == 0)
+        l->max_recv_size = 1024;
+
+    // Pre-encode device_write(lid, io_timeout, lock_timeout, flags, data)
+    call_header(l->write_call, DEVICE_CORE, DEVICE_CORE_VERSION, DEVICE_WRITE, WRITE_CALL_LENGTH);
+    put32(l->write_call + CALL_HEADER_LENGTH, l->lid);
+
+    // Pre-encode device_read(lid, requestSize, io_timeout, lock_timeout, flags, termChar)
+    call_header(l->read_call, DEVICE_CORE, DEVICE_CORE_VERSION, DEVICE_READ, READ_CALL_LENGTH);
+    put32(l->read_call + CALL_HEADER_LENGTH, l->lid);
+
+    l->generation = ch->generation;
+
+    return 0;
+}
+
+// Make sure channel is connected and link exists on that connection,
+// caller holds channel mutex
+static int link_ready(struct vxi11_channel_t *ch, struct vxi11_link_t *l, int timeout)
+{
+    if (channel_connect(ch, timeout) != 0)
+        return -1;
+
+    if (l->generation != ch->generation)
+        return link_create(ch, l, timeout);
+
+    return 0;
+}
+
+int vxi11_connect(const char *address, const char *name, int timeout)
+{
+    struct vxi11_link_t *l = NULL;
+    struct vxi11_channel_t *ch;
+    int handle, index, status;
+
+    if (name == NULL)
+        name = "inst0";
+
+    if (strlen(name) > NAME_LENGTH_MAX)
+        return -1;
+
+    // Reserve link and channel, network traffic happens outside vxi11_mutex
+    pthread_mutex_lock(&vxi11_mutex);
+
+    for (handle = 0; handle < VXI11_LINKS_MAX; handle++)
+    {
+        if (!links[handle].allocated)
+        {
+            l = &links[handle];
+            break;
+        }
+    }
+
+    if (l == NULL)
+    {
+        error_printf("Too many VXI-11 links\n");
+        pthread_mutex_unlock(&vxi11_mutex);
+        return -1;
+    }
+
+    index = channel_get(address);
+    if (index < 0)
+    {
+        pthread_mutex_unlock(&vxi11_mutex);
+        return -1;
+    }
+
+    memset(l, 0, sizeof(*l));
+    strcpy(l->name, name);
+    l->channel = index;
+    l->allocated = true;
+
+    pthread_mutex_unlock(&vxi11_mutex);
+
+    ch = &channels[index];
+    pthread_mutex_lock(&ch->mutex);
+    status = link_ready(ch, l, timeout);
+    pthread_mutex_unlock(&ch->mutex);
+
+    if (status != 0)
+    {
+        pthread_mutex_lock(&vxi11_mutex);
+        channel_put(index);
+        l->allocated = false;
+        pthread_mutex_unlock(&vxi11_mutex);
+        return -1;
+    }
+
+    return handle;
+}
+
+static struct vxi11_link_t *link_get(int handle)
+{
+    if ((handle < 0) || (handle >= VXI11_LINKS_MAX) || !links[handle].allocated)
+        return NULL;
+
+    return &links[handle];
+}
+
+// Patch device_write template, returns number of iovecs used
+static int write_call_prepare(struct vxi11_link_t *l, struct iovec *iov, uint32_t xid,
+                              const char *data, size_t length, bool end, int timeout)
+{
+    unsigned char *p = l->write_call;
+
+    put32(p, RECORD_LAST | (WRITE_CALL_LENGTH - 4 + length + pad4(length)));
+    put32(p + 4, xid);
+    put32(p + CALL_HEADER_LENGTH + 4, timeout);
+    put32(p + CALL_HEADER_LENGTH + 12, end ? FLAG_END : 0);
+    put32(p + CALL_HEADER_LENGTH + 16, length);
+
+    iov[0].iov_base = p;
+    iov[0].iov_len = WRITE_CALL_LENGTH;
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len = length;
+    iov[2].iov_base = (void *) padding;
+    iov[2].iov_len = pad4(length);
+
+    return 3;
+}
+
+static void read_call_prepare(struct vxi11_link_t *l, struct iovec *iov, uint32_t xid,
+                              size_t request_size, int timeout)
+{
+    unsigned char *p = l->read_call;
+
+    put32(p + 4, xid);
+    put32(p + CALL_HEADER_LENGTH + 4, request_size);
+    put32(p + CALL_HEADER_LENGTH + 8, timeout);
+
+    iov->iov_base = p;
+    iov->iov_len = READ_CALL_LENGTH;
+}
+
+// Handle device_write reply, returns bytes written or -1
+static int write_reply(struct vxi11_channel_t *ch, struct vxi11_link_t *l, uint32_t xid,
+                       double time_start, double deadline)
+{
+    const unsigned char *reply;
+    size_t length;
+
+    reply = channel_reply(ch, xid, &length, deadline, &l->stats);
+    if ((reply == NULL) || (length < 8) || (get32(reply) != 0))
+        return -1;
+
+    l->stats.write_last = time_now() - time_start;
+    stats_update(&l->stats, l->stats.write_last);
+
+    return get32(reply + 4);
+}
+
+// Handle device_read reply, returns bytes received or -1
+static int read_reply(struct vxi11_channel_t *ch, struct vxi11_link_t *l, uint32_t xid,
+                      char *data, size_t size, bool *end, double time_start, double deadline)
+{
+    const unsigned char *reply;
+    size_t length, count;
+
+    reply = channel_reply(ch, xid, &length, deadline, &l->stats);
+    if ((reply == NULL) || (length < 12) || (get32(reply) != 0))
+        return -1;
+
+    count = get32(reply + 8);
+    if (count > length - 12)
+        return -1;
+    if (count > size)
+        count = size;
+    memcpy(data, reply + 12, count);
+
+    *end = get32(reply + 4) & REASON_END;
+
+    l->stats.read_last = time_now() - time_start;
+    stats_update(&l->stats, l->stats.read_last);
+
+    return count;
+}
+
+static int link_send(struct vxi11_channel_t *ch, struct vxi11_link_t *l,
+                     const char *data, int length, int timeout)
+{
+    struct iovec iov[3];
+    size_t chunk;
+    double time_start;
+    int sent = 0, n;
+    uint32_t xid;
+
+    do
+    {
+        // Split writes larger than what the device accepts
+        chunk = length - sent;
+        if (chunk > l->max_recv_size)
+            chunk = l->max_recv_size;
+
+        xid = ++ch->xid;
+        write_call_prepare(l, iov, xid, data + sent, chunk, sent + chunk == (size_t) length, timeout);
+
+        time_start = time_now();
+        if (channel_send(ch, iov, 3, &l->stats) != 0)
+            return -1;
+
+        n = write_reply(ch, l, xid, time_start, time_start + (timeout + TIMEOUT_MARGIN) / 1000.0);
+        if (n < 0)
+            return -1;
+        sent += n;
+    } while (sent < length);
+
+    return sent;
+}
+
+static int link_receive(struct vxi11_channel_t *ch, struct vxi11_link_t *l,
+                        char *data, int length, int received, bool end, int timeout)
+{
+    struct iovec iov;
+    double time_start;
+    uint32_t xid;
+    int n;
+
+    while (!end && (received < length))
+    {
+        xid = ++ch->xid;
+        read_call_prepare(l, &iov, xid, length - received, timeout);
+
+        time_start = time_now();
+        if (channel_send(ch, &iov, 1, &l->stats) != 0)
+            return -1;
+
+        n = read_reply(ch, l, xid, data + received, length - received, &end,
+                       time_start, time_start + (timeout + TIMEOUT_MARGIN) / 1000.0);
+        if (n < 0)
+            return -1;
+        received += n;
+    }
+
+    return received;
+}
+
+int vxi11_send(int handle, const char *data, int length, int timeout)
+{
+    struct vxi11_link_t *l = link_get(handle);
+    struct vxi11_channel_t *ch;
+    int status;
+
+    if ((l == NULL) || (length < 0))
+        return -1;
+    ch = &channels[l->channel];
+
+    pthread_mutex_lock(&ch->mutex);
+    status = link_ready(ch, l, timeout) != 0 ? -1 : link_send(ch, l, data, length, timeout);
+    pthread_mutex_unlock(&ch->mutex);
+
+    return status;
+}
+
+int vxi11_receive(int handle, char *data, int length, int timeout)
+{
+    struct vxi11_link_t *l = link_get(handle);
+    struct vxi11_channel_t *ch;
+    int status;
+
+    if ((l == NULL) || (length < 0))
+        return -1;
+    ch = &channels[l->channel];
+
+    pthread_mutex_lock(&ch->mutex);
+    status = link_ready(ch, l, timeout) != 0 ? -1 : link_receive(ch, l, data, length, 0, false, timeout);
+    pthread_mutex_unlock(&ch->mutex);
+
+    return status;
+}
+
+// Send command and receive response with pipelined device_write/device_read
+int vxi11_request(int handle, const char *command, int command_length,
+                  char *response, int response_length, int timeout)
+{
+    struct vxi11_link_t *l = link_get(handle);
+    struct vxi11_channel_t *ch;
+    struct iovec iov[4];
+    double time_start, deadline;
+    uint32_t xid_write, xid_read;
+    int status = -1, received;
+    bool end = false;
+
+    if ((l == NULL) || (command_length < 0))
+        return -1;
+
+    if (response == NULL)
+        return vxi11_send(handle, command, command_length, timeout);
+
+    ch = &channels[l->channel];
+
+    pthread_mutex_lock(&ch->mutex);
+
+    if (link_ready(ch, l, timeout) != 0)
+        goto out;
+
+    // Commands not fitting one device_write are sent without pipelining
+    if ((uint32_t) command_length > l->max_recv_size)
+    {
+        if (link_send(ch, l, command, command_length, timeout) < 0)
+            goto out;
+        status = link_receive(ch, l, response, response_length, 0, false, timeout);
+        goto out;
+    }
+
+    xid_write = ++ch->xid;
+    xid_read = ++ch->xid;
+    write_call_prepare(l, iov, xid_write, command, command_length, true, timeout);
+    read_call_prepare(l, &iov[3], xid_read, response_length, timeout);
+
+    // Both calls in one syscall, device processes them in order
+    time_start = time_now();
+    deadline = time_start + (2 * timeout + TIMEOUT_MARGIN) / 1000.0;
+    if (channel_send(ch, iov, 4, &l->stats) != 0)
+        goto out;
+
+    if (write_reply(ch, l, xid_write, time_start, deadline) < 0)
+        goto out;
+
+#ifdef TCP_QUICKACK
+    // Acknowledge at once so a device using Nagle does not hold back the
+    // pipelined device_read reply until delayed ACK
+    if (ch->rx_start == ch->rx_end)
+    {
+        int one = 1;
+        setsockopt(ch->socket, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+        l->stats.syscalls++;
+    }
+#endif
+
+    received = read_reply(ch, l, xid_read, response, response_length, &end, time_start, deadline);
+    if (received < 0)
+        goto out;
+
+    // Continue reading if response did not fit one device_read
+    status = link_receive(ch, l, response, response_length, received, end, timeout);
+
+out:
+    pthread_mutex_unlock(&ch->mutex);
+    return status;
+}
+
+// Lock device against other links, waiting up to timeout for other holder
+int vxi11_lock(int handle, int timeout)
+{
+    struct vxi11_link_t *l = link_get(handle);
+    struct vxi11_channel_t *ch;
+    unsigned char call[CALL_HEADER_LENGTH + 12];
+    const unsigned char *reply;
+    size_t length;
+    int status = -1;
+
+    if (l == NULL)
+        return -1;
+    ch = &channels[l->channel];
+
+    // device_lock(lid, flags, lock_timeout)
+    call_header(call, DEVICE_CORE, DEVICE_CORE_VERSION, DEVICE_LOCK, sizeof(call));
+    put32(call + CALL_HEADER_LENGTH + 4, FLAG_WAITLOCK);
+    put32(call + CALL_HEADER_LENGTH + 8, timeout);
+
+    pthread_mutex_lock(&ch->mutex);
+    if (link_ready(ch, l, timeout) == 0)
+    {
+        put32(call + CALL_HEADER_LENGTH, l->lid);
+        reply = channel_call(ch, call, sizeof(call), &length, timeout, &l->stats);
+        if ((reply != NULL) && (length >= 4) && (get32(reply) == 0))
+            status = 0;
+    }
+    pthread_mutex_unlock(&ch->mutex);
+
+    return status;
+}
+
+int vxi11_unlock(int handle)
+{
+    struct vxi11_link_t *l = link_get(handle);
+    struct vxi11_channel_t *ch;
+    unsigned char call[CALL_HEADER_LENGTH + 4];
+    const unsigned char *reply;
+    size_t length;
+    int status = -1;
+
+    if (l == NULL)
+        return -1;
+    ch = &channels[l->channel];
+
+    // device_unlock(lid)
+    call_header(call, DEVICE_CORE, DEVICE_CORE_VERSION, DEVICE_UNLOCK, sizeof(call));
+
+    // Lock went away with the link if channel was reconnected meanwhile
+    pthread_mutex_lock(&ch->mutex);
+    if (!ch->failed && (l->generation == ch->generation))
+    {
+        put32(call + CALL_HEADER_LENGTH, l->lid);
+        reply = channel_call(ch, call, sizeof(call), &length, 1000, &l->stats);
+        if ((reply != NULL) && (length >= 4) && (get32(reply) == 0))
+            status = 0;
+    }
+    pthread_mutex_unlock(&ch->mutex);
+
+    return status;
+}
+
+int vxi11_disconnect(int handle)
+{
+    struct vxi11_link_t *l;
+    struct vxi11_channel_t *ch;
+    unsigned char call[CALL_HEADER_LENGTH + 4];
+    const unsigned char *reply;
+    size_t length;
+    int status = 0;
+
+    l = link_get(handle);
+    if (l == NULL)
+        return -1;
+    ch = &channels[l->channel];
+
+    // destroy_link(lid)
+    call_header(call, DEVICE_CORE, DEVICE_CORE_VERSION, DESTROY_LINK, sizeof(call));
+
+    // Link is gone on device side if channel was reconnected meanwhile
+    pthread_mutex_lock(&ch->mutex);
+    if (!ch->failed && (l->generation == ch->generation))
+    {
+        put32(call + CALL_HEADER_LENGTH, l->lid);
+        reply = channel_call(ch, call, sizeof(call), &length, 1000, &l->stats);
+        if ((reply == NULL) || (length < 4) || (get32(reply) != 0))
+            status = -1;
+    }
+    pthread_mutex_unlock(&ch->mutex);
+
+    pthread_mutex_lock(&vxi11_mutex);
+    channel_put(l->channel);
+    l->allocated = false;
+    pthread_mutex_unlock(&vxi11_mutex);
+
+    return status;
+}
+
+int vxi11_stats(int handle, struct vxi11_stats_t *stats)
+{
+    struct vxi11_link_t *l = link_get(handle);
+
+    if ((l == NULL) || (stats == NULL))
+        return -1;
+
+    *stats = l->stats;
+
+    return 0;
+}
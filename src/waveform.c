@@ -0,0 +1,583 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Display resolution waveform fetch
+ *
+ * Instead of transferring the full acquisition record and decimating it on
+ * the host, the instrument is asked for its display record (:WAV:MODE NORM)
+ * in byte format with the number of points needed (:WAV:POIN), which on most
+ * oscilloscopes is decimated by the instrument in a peak preserving way. The
+ * configuration is only sent again if source or number of points change.
+ *
+ * Instruments which ignore the point count return more points than asked
+ * for, which are then reduced on the host by min/max decimation so narrow
+ * peaks remain visible.
+ *
+ * Deep memory records are downloaded in ranges (:WAV:STAR/:WAV:STOP) of the
+ * raw record. Each range is written to its place in the output file as soon
+ * as it arrives and only a failed range is requested again, so a hiccup on a
+ * slow link costs one range instead of the whole record. A download which
+ * was interrupted can be resumed from the ranges already in the file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lxi.h>
+#include "error.h"
+#include "lxi_module.h"
+#include "waveform.h"
+
+#define WAVEFORM_CONFIGS_MAX 64
+#define WAVEFORM_POINTS_DEFAULT 1000
+#define ADDRESS_LENGTH_MAX 256
+#define SOURCE_LENGTH_MAX 64
+#define COMMAND_LENGTH_MAX 128
+#define DOWNLOAD_CHUNK_DEFAULT 250000 // points
+#define DOWNLOAD_RETRIES_DEFAULT 3
+
+struct waveform_config_t
+{
+    bool used;
+    int device;
+    char address[ADDRESS_LENGTH_MAX];
+    char source[SOURCE_LENGTH_MAX];
+    int points;
+    unsigned long sequence;
+};
+
+static struct waveform_config_t waveform_config[WAVEFORM_CONFIGS_MAX];
+static unsigned long waveform_config_sequence;
+static pthread_mutex_t waveform_config_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static double time_now(void)
+{
+    struct timespec time_spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &time_spec);
+
+    return time_spec.tv_sec + time_spec.tv_nsec * 0.000000001;
+}
+
+static int waveform_command(const struct lxi_module_api_t *api, int device, int protocol,
+                            const char *command)
+{
+    char buffer[COMMAND_LENGTH_MAX];
+    int length;
+
+    // RAW devices need newline terminated commands
+    length = snprintf(buffer, sizeof(buffer), protocol == RAW ? "%s\n" : "%s", command);
+
+    return api->request(device, buffer, length, NULL, 0, 0);
+}
+
+// Check if device is already configured for source and points, and record it
+static bool waveform_configured(int device, const char *address, const char *source, int points)
+{
+    struct waveform_config_t *free_config = NULL;
+    struct waveform_config_t *oldest_config = &waveform_config[0];
+    struct waveform_config_t *c;
+    bool configured = false;
+    int i;
+
+    pthread_mutex_lock(&waveform_config_mutex);
+
+    for (i = 0; i < WAVEFORM_CONFIGS_MAX; i++)
+    {
+        c = &waveform_config[i];
+        if (c->sequence < oldest_config->sequence)
+            oldest_config = c;
+        if (!c->used)
+        {
+            if (free_config == NULL)
+                free_config = c;
+            continue;
+        }
+        if ((c->device == device) && (strcmp(c->address, address) == 0))
+        {
+            configured = (strcmp(c->source, source) == 0) && (c->points == points);
+            free_config = c;
+            break;
+        }
+    }
+
+    // Least recently used entry is reused when table is full
+    if (free_config == NULL)
+        free_config = oldest_config;
+
+    free_config->used = true;
+    free_config->sequence = ++waveform_config_sequence;
+    free_config->device = device;
+    snprintf(free_config->address, sizeof(free_config->address), "%s", address);
+    snprintf(free_config->source, sizeof(free_config->source), "%s", source);
+    free_config->points = points;
+
+    pthread_mutex_unlock(&waveform_config_mutex);
+
+    return configured;
+}
+
+static void waveform_forget(int device)
+{
+    int i;
+
+    pthread_mutex_lock(&waveform_config_mutex);
+    for (i = 0; i < WAVEFORM_CONFIGS_MAX; i++)
+    {
+        if (waveform_config[i].used && (waveform_config[i].device == device))
+            waveform_config[i].used = false;
+    }
+    pthread_mutex_unlock(&waveform_config_mutex);
+}
+
+// Reduce samples to at most points values, keeping min and max of each bucket
+static int waveform_decimate(double *samples, int count, int points)
+{
+    int buckets = points / 2;
+    int bucket, start, end, i, i_min, i_max, out = 0;
+
+    if ((count <= points) || (buckets < 1))
+        return count;
+
+    for (bucket = 0; bucket < buckets; bucket++)
+    {
+        start = (long) bucket * count / buckets;
+        end = (long) (bucket + 1) * count / buckets;
+
+        i_min = start;
+        i_max = start;
+        for (i = start + 1; i < end; i++)
+        {
+            if (samples[i] < samples[i_min])
+                i_min = i;
+            if (samples[i] > samples[i_max])
+                i_max = i;
+        }
+
+        // Keep order of occurrence so slopes are drawn in right direction
+        if (i_min <= i_max)
+        {
+            samples[out++] = samples[i_min];
+            samples[out++] = samples[i_max];
+        }
+        else
+        {
+            samples[out++] = samples[i_max];
+            samples[out++] = samples[i_min];
+        }
+    }
+
+    return out;
+}
+
+static bool waveform_separator(char c)
+{
+    return (c == ',') || (c == ' ') || (c == '\n') || (c == '\r');
+}
+
+// Parse IEEE 488.2 definite length block of unsigned bytes or ASCII values
+double *waveform_parse(const char *data, size_t length, int *count)
+{
+    const unsigned char *block;
+    const char *p = data;
+    const char *data_end = data + length;
+    double *samples;
+    char header[10] = {};
+    char number[64];
+    size_t i, size, n = 0, digits;
+
+    *count = 0;
+
+    if ((length > 2) && (data[0] == '#') && (data[1] > '0') && (data[1] <= '9'))
+    {
+        digits = data[1] - '0';
+        if (length < 2 + digits)
+            return NULL;
+
+        memcpy(header, &data[2], digits);
+        n = strtoul(header, NULL, 10);
+        if (n > length - 2 - digits)
+            n = length - 2 - digits;
+
+        samples = malloc(sizeof(double) * (n > 0 ? n : 1));
+        if (samples == NULL)
+            return NULL;
+
+        block = (const unsigned char *) &data[2 + digits];
+        for (i = 0; i < n; i++)
+            samples[i] = block[i];
+
+        *count = n;
+        return samples;
+    }
+
+    // ASCII values, there can never be more values than separators plus one
+    size = 1;
+    for (i = 0; i < length; i++)
+        if (waveform_separator(data[i]))
+            size++;
+
+    samples = malloc(sizeof(double) * size);
+    if (samples == NULL)
+        return NULL;
+
+    while (n < size)
+    {
+        char *end;
+
+        while ((p < data_end) && waveform_separator(*p))
+            p++;
+        if (p >= data_end)
+            break;
+
+        // Data is not necessarily zero terminated, parse a bounded copy
+        for (i = 0; (p + i < data_end) && (i < sizeof(number) - 1) && !waveform_separator(p[i]); i++)
+            number[i] = p[i];
+        number[i] = 0;
+
+        samples[n] = strtod(number, &end);
+        if (end == number)
+            break;
+        n++;
+        p += i;
+    }
+
+    *count = n;
+    return samples;
+}
+
+// lua: samples = waveform_fetch(device, source, points)
+int lua_waveform_fetch(lua_State *L)
+{
+    const struct lxi_module_api_t *api = lxi_module_api(L);
+    struct lxi_module_session_t info;
+    int device = lua_tointeger(L, 1);
+    const char *source = lua_tostring(L, 2);
+    int points = lua_tointeger(L, 3);
+    char command[COMMAND_LENGTH_MAX];
+    double *samples;
+    char *response;
+    int size, length, count, i;
+
+    if ((api == NULL) || (api->session(device, &info) != 0))
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (source == NULL)
+        source = "";
+
+    if (points <= 0)
+        points = WAVEFORM_POINTS_DEFAULT;
+
+    // Ask instrument for display record at needed resolution
+    if (!waveform_configured(device, info.address, source, points))
+    {
+        if (strlen(source) > 0)
+        {
+            snprintf(command, sizeof(command), ":WAV:SOUR %s", source);
+            if (waveform_command(api, device, info.protocol, command) < 0)
+                goto error;
+        }
+
+        snprintf(command, sizeof(command), ":WAV:POIN %d", points);
+        if ((waveform_command(api, device, info.protocol, ":WAV:MODE NORM") < 0) ||
+            (waveform_command(api, device, info.protocol, ":WAV:FORM BYTE") < 0) ||
+            (waveform_command(api, device, info.protocol, command) < 0))
+            goto error;
+    }
+
+    response = api->buffer(device, &size);
+    if (response == NULL)
+        goto error;
+
+    length = api->request(device, info.protocol == RAW ? ":WAV:DATA?\n" : ":WAV:DATA?",
+                          info.protocol == RAW ? 11 : 10, response, size, 0);
+    if (length < 0)
+        goto error;
+
+    samples = waveform_parse(response, length, &count);
+    if (samples == NULL)
+        goto error;
+
+    // Host side fallback for instruments ignoring requested number of points
+    count = waveform_decimate(samples, count, points);
+
+    lua_createtable(L, count, 0);
+    for (i = 0; i < count; i++)
+    {
+        lua_pushnumber(L, samples[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    free(samples);
+    return 1;
+
+error:
+    // Configure again on next fetch
+    waveform_forget(device);
+    error_printf("Failed to fetch waveform\n");
+    lua_pushnil(L);
+    return 1;
+}
+
+static int waveform_query(const struct lxi_module_api_t *api, int device, int protocol,
+                          const char *command, char *response, int length)
+{
+    char buffer[COMMAND_LENGTH_MAX];
+    int n;
+
+    n = snprintf(buffer, sizeof(buffer), protocol == RAW ? "%s\n" : "%s", command);
+
+    return api->request(device, buffer, n, response, length, 0);
+}
+
+// Fetch one range of raw record, returns 0 if complete range was received
+static int download_chunk(const struct lxi_module_api_t *api, int device, int protocol,
+                          long start, long stop, FILE *file)
+{
+    char command[COMMAND_LENGTH_MAX];
+    char header[10] = {};
+    char *response;
+    int size, length, digits, count;
+
+    response = api->buffer(device, &size);
+    if (response == NULL)
+        return LXI_ERROR;
+
+    snprintf(command, sizeof(command), ":WAV:STAR %ld", start);
+    if (waveform_command(api, device, protocol, command) < 0)
+        return LXI_ERROR;
+    snprintf(command, sizeof(command), ":WAV:STOP %ld", stop);
+    if (waveform_command(api, device, protocol, command) < 0)
+        return LXI_ERROR;
+
+    length = waveform_query(api, device, protocol, ":WAV:DATA?", response, size);
+    if ((length < 2) || (response[0] != '#') || (response[1] <= '0') || (response[1] > '9'))
+        return LXI_ERROR;
+
+    // Only accept a complete block of the requested range
+    digits = response[1] - '0';
+    if (length < 2 + digits)
+        return LXI_ERROR;
+    memcpy(header, &response[2], digits);
+    count = atoi(header);
+    if ((count != stop - start + 1) || (count > length - 2 - digits))
+        return LXI_ERROR;
+
+    if ((fseek(file, start - 1, SEEK_SET) != 0) ||
+        (fwrite(&response[2 + digits], 1, count, file) != (size_t) count))
+    {
+        error_printf("Failed to write waveform file (%s)\n", strerror(errno));
+        return LXI_ERROR;
+    }
+
+    return 0;
+}
+
+// lua: stats = waveform_download{device, source, filename, chunk, retries, resume, progress}
+int lua_waveform_download(lua_State *L)
+{
+    const struct lxi_module_api_t *api = lxi_module_api(L);
+    struct lxi_module_session_t info;
+    char command[COMMAND_LENGTH_MAX];
+    char preamble[512];
+    const char *source, *filename;
+    int device, length, retries, retries_max, retries_total = 0;
+    int progress = 0;
+    long points, chunk, start, stop, resumed = 0;
+    double time_start, seconds;
+    bool resume;
+    FILE *file = NULL;
+    char *p;
+    int i;
+
+    if ((api == NULL) || !lua_istable(L, 1))
+    {
+        error_printf("waveform_download requires a table argument\n");
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_getfield(L, 1, "device");
+    device = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : -1;
+    lua_getfield(L, 1, "source");
+    source = lua_tostring(L, -1);
+    lua_getfield(L, 1, "filename");
+    filename = lua_tostring(L, -1);
+    lua_getfield(L, 1, "chunk");
+    chunk = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : DOWNLOAD_CHUNK_DEFAULT;
+    lua_getfield(L, 1, "retries");
+    retries_max = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : DOWNLOAD_RETRIES_DEFAULT;
+    lua_getfield(L, 1, "resume");
+    resume = lua_toboolean(L, -1);
+    lua_getfield(L, 1, "progress");
+    if (lua_isfunction(L, -1))
+        progress = lua_gettop(L);
+
+    if ((filename == NULL) || (chunk <= 0) || (api->session(device, &info) != 0))
+    {
+        error_printf("waveform_download requires device and filename\n");
+        lua_pushnil(L);
+        return 1;
+    }
+
+    // Display record configuration of waveform_fetch() is replaced
+    waveform_forget(device);
+
+    // Ranges of raw record in byte format
+    if ((source != NULL) && (strlen(source) > 0))
+    {
+        snprintf(command, sizeof(command), ":WAV:SOUR %s", source);
+        if (waveform_command(api, device, info.protocol, command) < 0)
+            goto error;
+    }
+    if ((waveform_command(api, device, info.protocol, ":WAV:MODE RAW") < 0) ||
+        (waveform_command(api, device, info.protocol, ":WAV:FORM BYTE") < 0))
+        goto error;
+
+    // Number of points is third field of preamble
+    length = waveform_query(api, device, info.protocol, ":WAV:PRE?", preamble, sizeof(preamble) - 1);
+    if (length < 0)
+        goto error;
+    preamble[length] = 0;
+    p = preamble;
+    for (i = 0; (i < 2) && (p != NULL); i++)
+    {
+        p = strchr(p, ',');
+        if (p != NULL)
+            p++;
+    }
+    points = (p != NULL) ? strtol(p, NULL, 10) : 0;
+    if (points <= 0)
+    {
+        error_printf("Unable to read number of waveform points\n");
+        goto error;
+    }
+
+    // Chunk and block header must fit in response buffer
+    if (api->buffer(device, &length) == NULL)
+        goto error;
+    if (chunk > length - 16)
+        chunk = length - 16;
+
+    // Continue after last complete range already in file
+    if (resume)
+    {
+        file = fopen(filename, "r+");
+        if (file != NULL)
+        {
+            fseek(file, 0, SEEK_END);
+            resumed = (ftell(file) / chunk) * chunk;
+
+            // File does not belong to this record
+            if (ftell(file) > points)
+            {
+                fclose(file);
+                file = NULL;
+                resumed = 0;
+            }
+        }
+    }
+    if (file == NULL)
+        file = fopen(filename, "w");
+    if (file == NULL)
+    {
+        error_printf("Could not open waveform file (%s)\n", strerror(errno));
+        goto error;
+    }
+
+    time_start = time_now();
+
+    for (start = resumed + 1; start <= points; start += chunk)
+    {
+        stop = start + chunk - 1;
+        if (stop > points)
+            stop = points;
+
+        // Only the failed range is requested again
+        for (retries = 0; download_chunk(api, device, info.protocol, start, stop, file) != 0; retries++)
+        {
+            if (retries == retries_max)
+            {
+                error_printf("Failed to download waveform points %ld-%ld\n", start, stop);
+                goto error;
+            }
+            retries_total++;
+        }
+
+        if (progress)
+        {
+            seconds = time_now() - time_start;
+            lua_pushvalue(L, progress);
+            lua_pushinteger(L, stop);
+            lua_pushinteger(L, points);
+            lua_pushnumber(L, seconds > 0 ? (stop - resumed) / seconds : 0);
+
+            // Close file before passing on error raised by callback
+            if (lua_pcall(L, 3, 0, 0) != 0)
+            {
+                fclose(file);
+                return lua_error(L);
+            }
+        }
+    }
+
+    fclose(file);
+    seconds = time_now() - time_start;
+
+    // Return download statistics
+    lua_newtable(L);
+    lua_pushinteger(L, points);
+    lua_setfield(L, -2, "points");
+    lua_pushinteger(L, points - resumed);
+    lua_setfield(L, -2, "transferred");
+    lua_pushnumber(L, seconds);
+    lua_setfield(L, -2, "seconds");
+    lua_pushnumber(L, seconds > 0 ? (points - resumed) / seconds : 0);
+    lua_setfield(L, -2, "throughput");
+    lua_pushinteger(L, retries_total);
+    lua_setfield(L, -2, "retries");
+    return 1;
+
+error:
+    if (file != NULL)
+        fclose(file);
+    lua_pushnil(L);
+    return 1;
+}